@@ -15,6 +15,9 @@ extern "C" {
 /* NOTE: can be cast to `uv_link_t` */
 typedef struct uv_ssl_s uv_ssl_t;
 
+/* A handshake suspended by the certificate callback (returning -1) goes on
+ * on the thread pool, where the callback is called again and must return 1.
+ * Signing the key exchange then doesn't block the loop. */
 UV_EXTERN uv_ssl_t* uv_ssl_create(uv_loop_t* loop, SSL* ssl, int* err);
 
 int uv_ssl_setup_recommended_secure_context(SSL_CTX* ctx);
@@ -22,6 +25,15 @@ int uv_ssl_setup_recommended_secure_context(SSL_CTX* ctx);
 /* This function can be only used in SNI callback */
 void uv_ssl_cancel(uv_ssl_t* ssl);
 
+size_t uv_ssl_get_write_queue_size(uv_ssl_t* ssl);
+
+/* Nothing is buffered and no record is half read or written */
+bool uv_ssl_is_idle(uv_ssl_t* ssl);
+
+/* Chains parent and child to each other and destroys the link, which must
+ * be idle. SSL is left to the user, who must not read or write with it. */
+void uv_ssl_detach(uv_ssl_t* ssl);
+
 #ifdef __cplusplus
 }
 #endif  /* __cplusplus */
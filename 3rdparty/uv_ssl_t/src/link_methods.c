@@ -58,8 +58,9 @@ int uv_ssl_link_read_start(uv_link_t* link) {
   internal = ssl->state == kSSLStateHandshake;
   ssl->state = kSSLStateData;
 
-  /* Already state, skip calling parent */
-  if (internal)
+  /* Already state, skip calling parent. Reads of the parent restart once
+   * an offloaded handshake is back. */
+  if (internal || ssl->offload)
     return 0;
 
   return uv_link_read_start(link->parent);
@@ -184,8 +185,6 @@ void uv_ssl_read_cb_override(uv_link_t* link,
   else if (nread < 0)
     return uv_ssl_error(ssl, nread);
 
-
-  SSL_CTX_set_tlsext_servername_arg(SSL_get_SSL_CTX(ssl->ssl), ssl->data);
   r = uv_ssl_cycle(ssl);
 
   if (r != 0)
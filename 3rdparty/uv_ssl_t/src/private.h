@@ -50,6 +50,17 @@ struct uv_ssl_s {
   } encrypted;
   uv_buf_t initial_buf;
   bool cancel;
+
+  /* Handshake continued on the thread pool, nothing else touches SSL or the
+   * ringbuffers until it is back */
+  uv_work_t offload_req;
+  int offload_err;
+  unsigned int offload:1;
+
+  /* Shutdown requested during the offload, runs once it is back */
+  uv_link_t* shutdown_source;
+  uv_link_shutdown_cb shutdown_cb;
+  void* shutdown_arg;
 };
 
 struct uv_ssl_write_req_s {
@@ -14,6 +14,10 @@ static int uv_ssl_cycle_output(uv_ssl_t* s);
 static int uv_ssl_cycle_pending(uv_ssl_t* s);
 static int uv_ssl_handshake_read_start(uv_ssl_t* s);
 static int uv_ssl_handshake_read_stop(uv_ssl_t* s);
+static int uv_ssl_offload_start(uv_ssl_t* s);
+static void uv_ssl_offload_work_cb(uv_work_t* req);
+static void uv_ssl_offload_after_cb(uv_work_t* req, int status);
+static void uv_ssl_offload_shutdown(uv_ssl_t* s, int err);
 static void uv_ssl_write_cb(uv_link_t* link, int status, void* arg);
 static int uv_ssl_queue_write_cb(uv_ssl_t* ssl, uv_link_t* source,
                                  uv_link_write_cb cb, void* arg);
@@ -141,6 +145,10 @@ void uv_ssl_destroy(uv_ssl_t* s, uv_link_t* source, uv_link_close_cb cb) {
   s->ssl = NULL;
   s->close_source = source;
   s->close_cb = cb;
+
+  /* Closed once the handshake is back from the thread pool */
+  if (s->offload)
+    return;
   uv_close((uv_handle_t*) &s->write_cb_idle, uv_ssl_idle_close_cb);
 }
 
@@ -152,15 +160,15 @@ int uv_ssl_cycle(uv_ssl_t* s) {
   if (err != 0)
     return err;
 
-  if (s->cycle != 0)
+  if (s->cycle != 0 || s->offload)
     return 0;
 
   s->cycle = 1;
 
   err = uv_ssl_cycle_input(s);
-  if (err == 0 && !s->cancel)
+  if (err == 0 && !s->cancel && !s->offload)
     err = uv_ssl_cycle_pending(s);
-  if (err == 0 && !s->cancel)
+  if (err == 0 && !s->cancel && !s->offload)
     err = uv_ssl_cycle_output(s);
   if(s->cancel)
   {
@@ -243,6 +251,10 @@ int uv_ssl_cycle_input(uv_ssl_t* s) {
       err = 0;
   }
 
+  /* Certificate callback suspended the handshake, continue it off the loop */
+  if (err == SSL_ERROR_WANT_X509_LOOKUP && !s->cancel)
+    return uv_ssl_offload_start(s);
+
   /* Start state if asked during handshake */
   if (err == SSL_ERROR_WANT_READ &&
       s->state == kSSLStateNone &&
@@ -267,6 +279,107 @@ int uv_ssl_cycle_input(uv_ssl_t* s) {
 }
 
 
+int uv_ssl_offload_start(uv_ssl_t* s) {
+  int err;
+
+  /* Reads would append to the input ringbuffer under OpenSSL's feet */
+  err = uv_link_read_stop(s->parent);
+  if (err != 0)
+    return err;
+
+  s->offload = 1;
+  s->offload_req.data = s->ssl;
+  err = uv_queue_work(s->write_cb_idle.loop, &s->offload_req,
+                      uv_ssl_offload_work_cb, uv_ssl_offload_after_cb);
+  if (err != 0)
+    s->offload = 0;
+  return err;
+}
+
+
+void uv_ssl_offload_work_cb(uv_work_t* req) {
+  uv_ssl_t* s;
+  SSL* ssl;
+  int err;
+
+  s = container_of(req, uv_ssl_t, offload_req);
+  ssl = req->data;
+
+  /* Certificate callback lets it through this time, signing the key
+   * exchange is the expensive part */
+  err = SSL_do_handshake(ssl);
+  if (err <= 0)
+    err = SSL_get_error(ssl, err);
+  else
+    err = 0;
+  s->offload_err = err;
+
+  /* Error queue is per thread */
+  ERR_clear_error();
+}
+
+
+void uv_ssl_offload_after_cb(uv_work_t* req, int status) {
+  uv_ssl_t* s;
+  int err;
+
+  s = container_of(req, uv_ssl_t, offload_req);
+  s->offload = 0;
+
+  /* Link was closed meanwhile */
+  if (s->ssl == NULL) {
+    uv_close((uv_handle_t*) &s->write_cb_idle, uv_ssl_idle_close_cb);
+    return;
+  }
+
+  err = s->offload_err;
+  if (status != 0) {
+    err = status;
+  } else if (err == SSL_ERROR_WANT_READ ||
+             err == SSL_ERROR_WANT_WRITE ||
+             err == SSL_ERROR_WANT_X509_LOOKUP) {
+    err = 0;
+  } else if (err != 0) {
+    err = kUVSSLErrCycleInput;
+  }
+  if (s->shutdown_cb != NULL)
+    return uv_ssl_offload_shutdown(s, err);
+  if (err != 0)
+    return uv_ssl_error(s, err);
+
+  if (s->state == kSSLStateHandshake || s->state == kSSLStateData) {
+    err = uv_link_read_start(s->parent);
+    if (err != 0)
+      return uv_ssl_error(s, err);
+  }
+
+  /* Send the flight and go on with what arrived after it */
+  err = uv_ssl_cycle(s);
+  if (err != 0)
+    uv_ssl_error(s, err);
+}
+
+
+void uv_ssl_offload_shutdown(uv_ssl_t* s, int err) {
+  uv_link_t* source;
+  uv_link_shutdown_cb cb;
+  void* arg;
+
+  source = s->shutdown_source;
+  cb = s->shutdown_cb;
+  arg = s->shutdown_arg;
+  s->shutdown_source = NULL;
+  s->shutdown_cb = NULL;
+  s->shutdown_arg = NULL;
+
+  /* No more reads, the flight goes out before the close_notify */
+  if (err == 0)
+    err = uv_ssl_shutdown(s, source, cb, arg);
+  if (err != 0)
+    cb(source, err, arg);
+}
+
+
 int uv_ssl_cycle_pending(uv_ssl_t* s) {
   QUEUE write_queue;
   QUEUE* q;
@@ -472,8 +585,9 @@ int uv_ssl_write(uv_ssl_t* ssl, uv_link_t* source, const uv_buf_t bufs[],
   if (err != 0)
     return err;
 
+  /* Queued while the handshake is on the thread pool */
   bytes = 0;
-  for (i = 0; i < nbufs; i++) {
+  for (i = 0; i < nbufs && !ssl->offload; i++) {
     bytes = SSL_write(ssl->ssl, bufs[i].base, bufs[i].len);
     if (bytes == -1)
       break;
@@ -483,10 +597,10 @@ int uv_ssl_write(uv_ssl_t* ssl, uv_link_t* source, const uv_buf_t bufs[],
   }
 
   /* All written immediately */
-  if (i == nbufs)
+  if (i == nbufs && !ssl->offload)
     return uv_ssl_queue_write_cb(ssl, source, cb, arg);
 
-  err = nbufs != 0 ? SSL_get_error(ssl->ssl, bytes) : 0;
+  err = nbufs != 0 && !ssl->offload ? SSL_get_error(ssl->ssl, bytes) : 0;
   if (err == SSL_ERROR_WANT_READ ||
       err == SSL_ERROR_WANT_WRITE ||
       err == SSL_ERROR_WANT_X509_LOOKUP) {
@@ -497,15 +611,18 @@ int uv_ssl_write(uv_ssl_t* ssl, uv_link_t* source, const uv_buf_t bufs[],
 
   /* Only buffers before `i` were written, queue rest */
   extra_size = 0;
-  for (j = 0; j <= i; j++)
-    extra_size += bufs[i].len;
+  for (j = i; j < nbufs; j++)
+    extra_size += bufs[j].len;
 
   req = malloc(sizeof(*req) + extra_size);
   if (req == NULL)
     return UV_ENOMEM;
 
-  for (j = 0, p = uv_ssl_get_write_data(req); j <= i; j++, p += bufs[i].len)
-    memcpy(p, bufs[i].base, bufs[i].len);
+  p = uv_ssl_get_write_data(req);
+  for (j = i; j < nbufs; j++) {
+    memcpy(p, bufs[j].base, bufs[j].len);
+    p += bufs[j].len;
+  }
 
   req->source = source;
   req->size = extra_size;
@@ -529,6 +646,9 @@ int uv_ssl_sync_write(uv_ssl_t* ssl, const uv_buf_t bufs[],
   if (err != 0)
     return err;
 
+  if (ssl->offload)
+    return UV_EAGAIN;
+
   total = 0;
   for (i = 0; i < nbufs; i++) {
     bytes = SSL_write(ssl->ssl, bufs[i].base, bufs[i].len);
@@ -565,6 +685,16 @@ int uv_ssl_shutdown(uv_ssl_t* ssl, uv_link_t* source, uv_link_shutdown_cb cb,
   if (err != 0)
     return err;
 
+  /* Deferred until the handshake is back from the thread pool */
+  if (ssl->offload) {
+    if (ssl->shutdown_cb != NULL)
+      return UV_EBUSY;
+    ssl->shutdown_source = source;
+    ssl->shutdown_cb = cb;
+    ssl->shutdown_arg = arg;
+    return 0;
+  }
+
   if (SSL_shutdown(ssl->ssl) == 0)
     SSL_shutdown(ssl->ssl);
 
@@ -624,6 +754,49 @@ void uv_ssl_cancel(uv_ssl_t* ssl)
 }
 
 
+/* Encrypted bytes not handed to the parent link yet */
+size_t uv_ssl_get_write_queue_size(uv_ssl_t* ssl)
+{
+  if (ssl->offload)
+    return 0;
+  return ringbuffer_size(&ssl->encrypted.output);
+}
+
+
+bool uv_ssl_is_idle(uv_ssl_t* ssl)
+{
+  SSL* s;
+
+  s = ssl->ssl;
+  if (ssl->state != kSSLStateData || ssl->cycle || ssl->offload ||
+      ssl->cancel ||
+      !SSL_is_init_finished(s) || ssl->pending_write != 0 ||
+      !QUEUE_EMPTY(&ssl->write_queue) || !QUEUE_EMPTY(&ssl->write_cb_queue) ||
+      ringbuffer_size(&ssl->encrypted.input) != 0 ||
+      ringbuffer_size(&ssl->encrypted.output) != 0) {
+    return false;
+  }
+
+  /* Records OpenSSL took from the ringbuffers but didn't finish */
+  return s->rstate == SSL_ST_READ_HEADER && s->s3->rbuf.left == 0 &&
+         s->s3->rrec.length == 0 && s->s3->wbuf.left == 0 &&
+         s->s3->handshake_fragment_len == 0 && !s->s3->alert_dispatch;
+}
+
+
+void uv_ssl_detach(uv_ssl_t* ssl)
+{
+  uv_link_t* child = ssl->child;
+  uv_link_t* parent = ssl->parent;
+
+  CHECK(uv_ssl_is_idle(ssl), "uv_ssl_detach() of a busy link");
+  uv_link_unchain((uv_link_t*)ssl, child);
+  uv_link_unchain(parent, (uv_link_t*)ssl);
+  CHECK_EQ(uv_link_chain(parent, child), 0, "uv_link_chain() failed");
+  uv_ssl_destroy(ssl, (uv_link_t*)ssl, do_nothing_close_cb);
+}
+
+
 /* Just a convenience method */
 
 
@@ -0,0 +1,167 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+
+// Reports the memory a keep-alive connection holds for HTTP state: the
+// link context plus header storage, while a request/response pair is in
+// flight and once the connection is idle again. The baseline is the layout
+// before headers moved to an arena, which held them in fixed arrays.
+//
+// Usage: out/Release/bproxy-bench-conn-memory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_link.h"
+
+#define CONNECTIONS 10000
+
+// Baseline limits of 20 headers of up to 500 bytes
+#define BASELINE_MAX_HEADERS 20
+#define BASELINE_MAX_ELEMENT_SIZE 500
+#define BASELINE_HEADER_SIZE \
+  (BASELINE_MAX_HEADERS * 2 * (BASELINE_MAX_ELEMENT_SIZE + 2) + 256)
+
+typedef struct baseline_request_s {
+  ssize_t raw_len;
+  enum http_method method;
+  char host[256];
+  char *url;
+  char *body;
+  char hostname[256];
+  uint8_t http_major;
+  uint8_t http_minor;
+  uint8_t keepalive;
+  uint8_t upgrade;
+  enum header_element last_header_element;
+  int num_headers;
+  char headers[BASELINE_MAX_HEADERS][2][BASELINE_MAX_ELEMENT_SIZE];
+  char http_header[BASELINE_HEADER_SIZE];
+  int http_header_len;
+  boolean enable_compression;
+  http_parser parser;
+  int content_length;
+  bool complete;
+  char *status_line;
+} baseline_request_t;
+
+typedef struct baseline_response_s {
+  http_parser parser;
+  enum header_element last_header_element;
+  int num_headers;
+  char headers[BASELINE_MAX_HEADERS][2][BASELINE_MAX_ELEMENT_SIZE];
+  char http_header[BASELINE_HEADER_SIZE];
+  int http_header_len;
+  char status_line[256];
+  boolean enable_compression;
+  boolean headers_received;
+  boolean headers_send;
+  boolean complete;
+  boolean keepalive;
+  gzip_state_t *gzip_state;
+  gzip_job_t *gzip_job;
+  uv_buf_t *gzip_frames;
+  unsigned int num_gzip_frames;
+  unsigned int max_gzip_frames;
+} baseline_response_t;
+
+// Same for requests in flight and idle connections, nothing was allocated
+// for headers
+static const size_t baseline_memory =
+    sizeof(http_link_context_t) - sizeof(http_request_t) -
+    sizeof(http_response_t) + sizeof(baseline_request_t) +
+    sizeof(baseline_response_t);
+
+static const char request[] =
+    "GET /static/js/app.3f9c2e.js?v=1 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:62.0) Gecko/20100101 "
+    "Firefox/62.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Cookie: session=4f7c1a9d2b8e6f30; theme=dark; _ga=GA1.2.1234567890\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/javascript\r\n"
+    "Content-Length: 0\r\n"
+    "Date: Thu, 18 Oct 2018 10:00:00 GMT\r\n"
+    "ETag: \"5bc85a1c-3a2f1\"\r\n"
+    "Last-Modified: Thu, 18 Oct 2018 09:00:00 GMT\r\n"
+    "Cache-Control: public, max-age=31536000\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static size_t headers_memory(const http_headers_t *headers) {
+  return headers->arena.size + headers->max * sizeof(http_header_t);
+}
+
+static size_t connection_memory(const http_link_context_t *context) {
+  return sizeof(*context) + headers_memory(&context->request.headers) +
+         headers_memory(&context->response.headers);
+}
+
+int main() {
+  config_t config;
+  memset(&config, 0, sizeof(config));
+  uv_link_t *links = calloc(CONNECTIONS, sizeof(uv_link_t));
+  http_link_context_t *contexts =
+      calloc(CONNECTIONS, sizeof(http_link_context_t));
+
+  size_t busy = 0;
+  for (int i = 0; i < CONNECTIONS; i++) {
+    http_link_context_t *context = &contexts[i];
+    http_link_init(&links[i], context, &config, NULL);
+    strcpy(context->peer_ip, "192.168.1.10");
+
+    // Parser resets the headers and builds the request line itself
+    http_request_t *req = &context->request;
+    http_parser_execute(&req->parser, &parser_settings, request,
+                        sizeof(request) - 1);
+    http_init_request_headers(context);
+
+    http_response_t *resp = &context->response;
+    http_headers_reset(&resp->headers);
+    resp->status_line =
+        http_slice(&resp->headers, response, strcspn(response, "\r"));
+    http_parser_execute(&resp->parser, &resp_parser_settings, response,
+                        sizeof(response) - 1);
+    http_init_response_headers(resp, false);
+    busy += connection_memory(context);
+  }
+
+  size_t idle = 0;
+  for (int i = 0; i < CONNECTIONS; i++) {
+    http_headers_reset(&contexts[i].request.headers);
+    http_headers_reset(&contexts[i].response.headers);
+    idle += connection_memory(&contexts[i]);
+  }
+
+  printf("http_link_context_t: %zu bytes (baseline %zu bytes)\n",
+         sizeof(http_link_context_t), baseline_memory);
+  printf("per connection, request in flight: %zu bytes (baseline %zu bytes)\n",
+         busy / CONNECTIONS, baseline_memory);
+  printf("per connection, idle keep-alive:   %zu bytes (baseline %zu bytes)\n",
+         idle / CONNECTIONS, baseline_memory);
+  printf("%d connections: %.1f MB (baseline %.1f MB)\n", CONNECTIONS,
+         busy / (1024.0 * 1024.0),
+         CONNECTIONS * baseline_memory / (1024.0 * 1024.0));
+
+  for (int i = 0; i < CONNECTIONS; i++) {
+    http_headers_free(&contexts[i].request.headers);
+    http_headers_free(&contexts[i].response.headers);
+  }
+  free(contexts);
+  free(links);
+  return 0;
+}
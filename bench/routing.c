@@ -0,0 +1,115 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+
+// Compares host routing through router_t against the linear scan over all
+// configured hosts it replaced, for 10, 1k and 100k hosts.
+//
+// Usage: out/Release/bproxy-bench-routing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "router.h"
+
+#define LOOKUPS 200000
+
+static int linear_lookup(char **hosts, int num_hosts, const char *hostname) {
+  for (int j = 0; j < num_hosts; j++) {
+    const char *conf_host = hosts[j];
+    int wildcard = conf_host[0] == '*';
+    if (wildcard) {
+      conf_host++;
+    }
+
+    ssize_t conf_i = strlen(conf_host) - 1;
+    ssize_t i = strlen(hostname) - 1;
+
+    while ((i >= 0 && conf_i >= 0) && hostname[i] == conf_host[conf_i]) {
+      --i;
+      --conf_i;
+    }
+    if (conf_i < 0 && (wildcard || i < 0)) {
+      return j;
+    }
+  }
+  return -1;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(int num_hosts) {
+  char **hosts = malloc(num_hosts * sizeof(char *));
+  char **requests = malloc(LOOKUPS * sizeof(char *));
+  router_t *router = router_new();
+
+  // Every fourth host is a wildcard, as with "*.example.com" style configs
+  for (int i = 0; i < num_hosts; i++) {
+    hosts[i] = malloc(64);
+    if (i % 4 == 0) {
+      snprintf(hosts[i], 64, "*.example%d.net", i);
+    } else {
+      snprintf(hosts[i], 64, "app%d.example%d.com", i, i);
+    }
+    router_add(router, hosts[i], i);
+  }
+
+  srand(1);
+  for (int i = 0; i < LOOKUPS; i++) {
+    int n = rand() % num_hosts;
+    requests[i] = malloc(64);
+    if (i % 10 == 0) {
+      snprintf(requests[i], 64, "unknown%d.org", n);
+    } else if (n % 4 == 0) {
+      snprintf(requests[i], 64, "www.example%d.net", n);
+    } else {
+      snprintf(requests[i], 64, "app%d.example%d.com", n, n);
+    }
+  }
+
+  int lookups = num_hosts > 1000 ? LOOKUPS / 100 : LOOKUPS;
+  long checksum = 0;
+
+  double start = now_ns();
+  for (int i = 0; i < lookups; i++) {
+    checksum += linear_lookup(hosts, num_hosts, requests[i]);
+  }
+  double linear = (now_ns() - start) / lookups;
+
+  start = now_ns();
+  for (int i = 0; i < lookups; i++) {
+    checksum -= router_lookup(router, requests[i]);
+  }
+  double routed = (now_ns() - start) / lookups;
+
+  printf("%7d hosts: linear %10.1f ns/lookup, router %6.1f ns/lookup%s\n",
+         num_hosts, linear, routed, checksum ? " (MISMATCH)" : "");
+
+  for (int i = 0; i < num_hosts; i++) {
+    free(hosts[i]);
+  }
+  for (int i = 0; i < LOOKUPS; i++) {
+    free(requests[i]);
+  }
+  free(hosts);
+  free(requests);
+  router_free(router);
+}
+
+int main() {
+  bench(10);
+  bench(1000);
+  bench(100000);
+  return 0;
+}
@@ -0,0 +1,99 @@
+#!/bin/bash
+#
+# Measures full TLS handshakes/sec with SNI spread over HOSTS distinct
+# certificates (default 1000).
+#
+# Usage: bench/sni.sh [path/to/bproxy]
+#
+# Requires openssl and node in PATH. One certificate is generated for every
+# host-N.test, bproxy is started on ports 8080 and 8443 with one proxy per
+# host, and node opens CONNECTIONS handshakes at a time (default 64) for
+# DURATION seconds (default 10), each with the SNI of the next host.
+# Handshakes which got a certificate of another host are counted as wrong.
+
+BPROXY="${1:-out/Release/bproxy}"
+HOSTS="${HOSTS:-1000}"
+DURATION="${DURATION:-10}"
+CONNECTIONS="${CONNECTIONS:-64}"
+WORKERS="${WORKERS:-1}"
+
+TMPDIR="$(mktemp -d)"
+trap 'kill $BPROXY_PID 2>/dev/null; rm -rf "$TMPDIR"' EXIT
+
+openssl ecparam -name prime256v1 -genkey -noout -out "$TMPDIR/key.pem"
+proxies=""
+for i in $(seq "$HOSTS"); do
+  openssl req -x509 -new -key "$TMPDIR/key.pem" -days 1 \
+    -subj "/CN=host-$i.test" -out "$TMPDIR/host-$i.pem"
+  proxies="$proxies${proxies:+,}
+    {
+      \"hosts\": [\"host-$i.test\"],
+      \"ip\": \"127.0.0.1\",
+      \"port\": 4000,
+      \"certificate_path\": \"$TMPDIR/host-$i.pem\",
+      \"key_path\": \"$TMPDIR/key.pem\"
+    }"
+done
+
+cat > "$TMPDIR/bproxy.json" <<JSON
+{
+  "port": 8080,
+  "secure_port": 8443,
+  "workers": $WORKERS,
+  "gzip_mime_types": [],
+  "ssl_sessions": {
+    "cache_size": 0,
+    "tickets": false
+  },
+  "proxies": [$proxies
+  ]
+}
+JSON
+
+"$BPROXY" -c "$TMPDIR/bproxy.json" >/dev/null 2>&1 &
+BPROXY_PID=$!
+until curl -sk -o /dev/null https://127.0.0.1:8443/; do
+  if ! kill -0 $BPROXY_PID 2>/dev/null; then
+    echo "bproxy exited, see $BPROXY -c $TMPDIR/bproxy.json" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+node -e "
+const tls = require('tls');
+const hosts = $HOSTS, duration = $DURATION * 1000;
+let next = 0, done = 0, wrong = 0, failed = 0, running = true;
+const start = Date.now();
+function handshake() {
+  if (!running) {
+    return;
+  }
+  const host = 'host-' + (next++ % hosts + 1) + '.test';
+  const socket = tls.connect({
+    host: '127.0.0.1', port: 8443, servername: host,
+    rejectUnauthorized: false
+  }, () => {
+    if (socket.getPeerCertificate().subject.CN !== host) {
+      wrong++;
+    }
+    done++;
+    socket.destroy();
+    handshake();
+  });
+  socket.on('error', () => {
+    failed++;
+    handshake();
+  });
+}
+for (let i = 0; i < $CONNECTIONS; i++) {
+  handshake();
+}
+setTimeout(() => {
+  running = false;
+  const secs = (Date.now() - start) / 1000;
+  console.log('hosts: ' + hosts + '\thandshakes/sec: ' +
+              Math.round(done / secs) + '\twrong: ' + wrong +
+              '\tfailed: ' + failed);
+}, duration);
+"
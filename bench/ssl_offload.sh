@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# Measures full TLS handshakes/sec and the latency of requests on an already
+# established connection during a handshake storm, with ssl_offload off and
+# on.
+#
+# Usage: bench/ssl_offload.sh [path/to/bproxy]
+#
+# Requires openssl and node in PATH. A node upstream is started on port 4000
+# and bproxy on ports 8080 and 8443 with WORKERS workers (default 1) and an
+# RSA 2048 certificate. For DURATION seconds (default 10) node keeps
+# CONNECTIONS handshakes open at a time (default 64) while one keep-alive
+# connection sends requests one after another. The thread pool size is set
+# with UV_THREADPOOL_SIZE as usual.
+
+BPROXY="${1:-out/Release/bproxy}"
+DURATION="${DURATION:-10}"
+CONNECTIONS="${CONNECTIONS:-64}"
+WORKERS="${WORKERS:-1}"
+
+TMPDIR="$(mktemp -d)"
+trap 'kill $UPSTREAM_PID $BPROXY_PID $STORM_PID 2>/dev/null; rm -rf "$TMPDIR"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=bench.test" \
+  -keyout "$TMPDIR/key.pem" -out "$TMPDIR/cert.pem" 2>/dev/null
+
+node -e "require('http').createServer((req, res) => res.end('ok'))
+  .listen(4000);" &
+UPSTREAM_PID=$!
+sleep 1
+
+for offload in false true; do
+  cat > "$TMPDIR/bproxy.json" <<JSON
+{
+  "port": 8080,
+  "secure_port": 8443,
+  "workers": $WORKERS,
+  "ssl_offload": $offload,
+  "gzip_mime_types": [],
+  "proxies": [
+    {
+      "hosts": ["bench.test"],
+      "ip": "127.0.0.1",
+      "port": 4000,
+      "certificate_path": "$TMPDIR/cert.pem",
+      "key_path": "$TMPDIR/key.pem"
+    }
+  ]
+}
+JSON
+
+  "$BPROXY" -c "$TMPDIR/bproxy.json" >/dev/null 2>&1 &
+  BPROXY_PID=$!
+  sleep 1
+
+  # Handshakes and requests come from two processes, so the latency of
+  # requests doesn't include the client side of the handshakes
+  node -e "
+const tls = require('tls');
+let handshakes = 0, running = true;
+const start = Date.now();
+function handshake() {
+  if (!running) {
+    return;
+  }
+  const socket = tls.connect({
+    host: '127.0.0.1', port: 8443, servername: 'bench.test',
+    rejectUnauthorized: false
+  }, () => {
+    handshakes++;
+    socket.destroy();
+    handshake();
+  });
+  socket.on('error', handshake);
+}
+for (let i = 0; i < $CONNECTIONS; i++) {
+  handshake();
+}
+setTimeout(() => {
+  running = false;
+  const secs = (Date.now() - start) / 1000;
+  console.log('ssl_offload: $offload\thandshakes/sec: ' +
+              Math.round(handshakes / secs));
+}, $DURATION * 1000);
+" > "$TMPDIR/handshakes.out" &
+  STORM_PID=$!
+
+  node -e "
+const tls = require('tls');
+const latencies = [];
+let sent, response = '', running = true;
+const client = tls.connect({
+  host: '127.0.0.1', port: 8443, servername: 'bench.test',
+  rejectUnauthorized: false
+}, request);
+function request() {
+  if (!running) {
+    return client.destroy();
+  }
+  sent = process.hrtime.bigint();
+  client.write('GET / HTTP/1.1\r\nHost: bench.test\r\n\r\n');
+}
+client.on('data', (data) => {
+  response += data;
+  if (response.endsWith('\r\n\r\nok')) {
+    latencies.push(Number(process.hrtime.bigint() - sent) / 1e6);
+    response = '';
+    request();
+  }
+});
+setTimeout(() => {
+  running = false;
+  latencies.sort((a, b) => a - b);
+  const at = (q) => latencies[Math.floor(q * (latencies.length - 1))];
+  console.log('requests: ' + latencies.length +
+              '\tp50: ' + at(0.5).toFixed(2) + ' ms' +
+              '\tp99: ' + at(0.99).toFixed(2) + ' ms');
+}, $DURATION * 1000);
+" > "$TMPDIR/requests.out"
+  wait $STORM_PID
+  echo "$(cat "$TMPDIR/handshakes.out")	$(cat "$TMPDIR/requests.out")"
+
+  kill $BPROXY_PID
+  wait $BPROXY_PID 2>/dev/null
+done
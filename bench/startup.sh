@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# Measures the time from starting bproxy until it completes a TLS handshake
+# on its secure port, which includes generating the fallback certificate.
+#
+# Usage: bench/startup.sh [path/to/bproxy]
+#
+# Requires curl in PATH. bproxy is started RUNS times (default 10) on ports
+# 8080 and 8443 with WORKERS workers (default 1) and no proxies, so the
+# handshake is made with the fallback certificate.
+
+BPROXY="${1:-out/Release/bproxy}"
+RUNS="${RUNS:-10}"
+WORKERS="${WORKERS:-1}"
+
+TMPDIR="$(mktemp -d)"
+trap 'kill $BPROXY_PID 2>/dev/null; rm -rf "$TMPDIR"' EXIT
+
+cat > "$TMPDIR/bproxy.json" <<JSON
+{
+  "port": 8080,
+  "secure_port": 8443,
+  "workers": $WORKERS,
+  "gzip_mime_types": [],
+  "proxies": []
+}
+JSON
+
+total=0
+min=
+max=0
+for run in $(seq "$RUNS"); do
+  start=$(date +%s%N)
+  "$BPROXY" -c "$TMPDIR/bproxy.json" >/dev/null 2>&1 &
+  BPROXY_PID=$!
+  until curl -sk -o /dev/null https://127.0.0.1:8443/; do
+    if ! kill -0 $BPROXY_PID 2>/dev/null; then
+      echo "bproxy exited, see $BPROXY -c $TMPDIR/bproxy.json" >&2
+      exit 1
+    fi
+    sleep 0.005
+  done
+  ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+  kill $BPROXY_PID
+  wait $BPROXY_PID 2>/dev/null
+  total=$((total + ms))
+  if [ -z "$min" ] || [ "$ms" -lt "$min" ]; then
+    min=$ms
+  fi
+  if [ "$ms" -gt "$max" ]; then
+    max=$ms
+  fi
+done
+
+printf "runs: %d\tmin: %d ms\tavg: %d ms\tmax: %d ms\n" \
+  "$RUNS" "$min" $((total / RUNS)) "$max"
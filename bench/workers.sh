@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Measures proxied requests/sec for 1, 2, 4 and 8 workers using wrk.
+#
+# Usage: bench/workers.sh [path/to/bproxy]
+#
+# Requires wrk and node in PATH. A node upstream (one process per core) is
+# started on port 4000 and bproxy is started on port 8080 for every worker
+# count.
+
+BPROXY="${1:-out/Release/bproxy}"
+DURATION="${DURATION:-10s}"
+CONNECTIONS="${CONNECTIONS:-512}"
+THREADS="${THREADS:-8}"
+
+TMPDIR="$(mktemp -d)"
+trap 'pkill -P $UPSTREAM_PID; kill $UPSTREAM_PID $BPROXY_PID 2>/dev/null; rm -rf "$TMPDIR"' EXIT
+
+node -e "
+const cluster = require('cluster');
+if (cluster.isMaster) {
+  require('os').cpus().forEach(() => cluster.fork());
+} else {
+  require('http').createServer((req, res) => res.end('ok')).listen(4000);
+}" &
+UPSTREAM_PID=$!
+sleep 1
+
+for workers in 1 2 4 8; do
+  cat > "$TMPDIR/bproxy.json" <<JSON
+{
+  "port": 8080,
+  "workers": $workers,
+  "gzip_mime_types": [],
+  "proxies": [{ "hosts": ["localhost"], "ip": "127.0.0.1", "port": 4000 }]
+}
+JSON
+  "$BPROXY" -c "$TMPDIR/bproxy.json" >/dev/null 2>&1 &
+  BPROXY_PID=$!
+  sleep 1
+
+  rps=$(wrk -t"$THREADS" -c"$CONNECTIONS" -d"$DURATION" http://localhost:8080/ |
+        awk '/Requests\/sec/ { print $2 }')
+  printf "workers: %d\trequests/sec: %s\n" "$workers" "$rps"
+
+  kill $BPROXY_PID
+  wait $BPROXY_PID 2>/dev/null
+done
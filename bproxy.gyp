@@ -22,13 +22,61 @@
     ],
     "sources": [
       "src/log.c",
+      "src/arena.c",
       "src/config.c",
       "src/gzip.c",
+      "src/gzip_job.c",
       "src/http_parser.c",
       "src/http.c",
       "src/cJSON.c",
       "src/http_link.c",
+      "src/upstream.c",
+      "src/balancer.c",
+      "src/health.c",
+      "src/timer_wheel.c",
+      "src/router.c",
+      "src/buf_pool.c",
+      "src/cache.c",
+      "src/tunnel.c",
+      "src/ssl_sessions.c",
+      "src/metrics.c",
+      "src/upgrade.c",
+      "src/hpack.c",
+      "src/http2.c",
+      "src/ktls.c",
       "src/bproxy.c"
     ]
+  }, {
+    "target_name": "bproxy-bench-routing",
+    "type": "executable",
+    "include_dirs": [
+      "include"
+    ],
+    "sources": [
+      "src/router.c",
+      "bench/routing.c"
+    ]
+  }, {
+    "target_name": "bproxy-bench-conn-memory",
+    "type": "executable",
+    "dependencies": [
+      "<!@(gypkg deps <(gypkg_deps))",
+    ],
+    "include_dirs": [
+      "include"
+    ],
+    "sources": [
+      "src/log.c",
+      "src/arena.c",
+      "src/gzip.c",
+      "src/gzip_job.c",
+      "src/http_parser.c",
+      "src/http.c",
+      "src/http_link.c",
+      "src/buf_pool.c",
+      "src/cache.c",
+      "src/metrics.c",
+      "bench/conn_memory.c"
+    ]
   }]
 }
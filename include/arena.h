@@ -0,0 +1,34 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_ARENA_H_
+#define _BPROXY_ARENA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// First allocation of an arena, arenas which grew past ARENA_KEEP_SIZE are
+// released on reset so idle connections hold little memory
+#define ARENA_INITIAL_SIZE 1024
+#define ARENA_KEEP_SIZE 4096
+
+// Growable buffer for data that lives as long as one message. Growing may
+// move the buffer, so allocations are referred to by offset.
+typedef struct arena_s {
+  char *base;
+  size_t len;
+  size_t size;
+} arena_t;
+
+uint32_t arena_alloc(arena_t *arena, size_t len);
+uint32_t arena_strndup(arena_t *arena, const char *data, size_t len);
+void arena_strncat(arena_t *arena, const char *data, size_t len);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif  // _BPROXY_ARENA_H_
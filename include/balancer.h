@@ -0,0 +1,87 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_BALANCER_H_
+#define _BPROXY_BALANCER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "uv.h"
+
+// Points on the hash ring per unit of weight
+#define BALANCER_POINTS_PER_WEIGHT 100
+#define BALANCER_MAX_WEIGHT 100
+
+enum balancer_policy {
+  BALANCE_ROUND_ROBIN,
+  BALANCE_LEAST_OUTSTANDING,
+  BALANCE_P2C,
+  BALANCE_HASH
+};
+
+// Backend address of a proxy, with its own upstream keep-alive pool
+typedef struct upstream_target_s {
+  struct sockaddr_storage addr;
+  // ip:port, for logging
+  char name[64];
+  int weight;
+  // Smooth weighted round robin state
+  int current_weight;
+  QUEUE idle_upstreams;
+  int num_idle_upstreams;
+
+  // Consecutive failed requests, ejections since the last success
+  int fails;
+  int ejections;
+  uint64_t ejected_until;
+  // Last active probe failed
+  bool probe_failed;
+  bool probing;
+  uint64_t next_probe;
+} upstream_target_t;
+
+typedef struct balancer_point_s {
+  uint32_t hash;
+  int target;
+} balancer_point_t;
+
+// Picks the target of a proxy for every upstream connection. Each worker has
+// its own copy, so counters are plain integers.
+typedef struct balancer_s {
+  enum balancer_policy policy;
+  upstream_target_t *targets;
+  int num_targets;
+  int total_weight;
+  // Requests in flight per target, kept apart from the targets so picks
+  // scan a few cache lines only
+  uint32_t *outstanding;
+  // Targets are not picked before then (uv_now() milliseconds)
+  uint64_t *down_until;
+  // Prefix sums of weights for weighted random picks
+  int *cumulative;
+  // Sorted by hash
+  balancer_point_t *ring;
+  int num_points;
+  // Request header hashed by BALANCE_HASH, the client IP when NULL
+  char *hash_header;
+  uint32_t random;
+  int next;
+} balancer_t;
+
+int balancer_policy(const char *name);
+int balancer_add(balancer_t *balancer, const char *ip, unsigned short port,
+                 int weight);
+void balancer_build(balancer_t *balancer);
+int balancer_pick(balancer_t *balancer, const char *key, uint64_t now);
+void balancer_update(balancer_t *balancer, int index);
+void balancer_free(balancer_t *balancer);
+
+#endif  // _BPROXY_BALANCER_H_
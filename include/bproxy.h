@@ -14,11 +14,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "buf_pool.h"
 #include "config.h"
+#include "health.h"
+#include "http2.h"
 #include "http_link.h"
+#include "ktls.h"
+#include "metrics.h"
+#include "ssl_sessions.h"
+#include "timer_wheel.h"
+#include "tunnel.h"
+#include "upgrade.h"
+#include "upstream.h"
 #include "version.h"
 
 #include "openssl/bio.h"
+#include "openssl/ec.h"
 #include "openssl/err.h"
 #include "openssl/evp.h"
 #include "openssl/pem.h"
@@ -28,48 +39,182 @@
 
 typedef struct {
   uv_write_t req;
-  uv_buf_t buf;
+  unsigned int nbufs;
+  uv_buf_t bufs[];
 } write_req_t;
 
-typedef struct server_t {
+// Each worker owns an event loop, its own SO_REUSEPORT listeners and a
+// private copy of the configuration (including SSL contexts), so nothing
+// on the connection path is shared between threads.
+typedef struct worker_s {
+  int id;
   uv_loop_t *loop;
+  uv_thread_t thread;
   uv_tcp_t tcp;
   uv_tcp_t secure_tcp;
-  struct sockaddr_in address;
   config_t *config;
-  int num_configs;
+  SSL_CTX *default_ctx;
+  uv_timer_t keepalive_timer;
+  // Timeouts of the worker's connections
+  timer_wheel_t timeouts;
+  buf_pool_t buffers;
+  // Counters by host, unrouted counts connections not routed to any proxy
+  metrics_host_t *metrics;
+  metrics_t *unrouted;
+  // Parsed by the main thread on reload, installed by the worker
+  config_t *pending_config;
+  uv_async_t reload_async;
+  // Stops accepting once a new process took over the listening sockets
+  uv_async_t drain_async;
+  bool draining;
+  // Set by the worker thread when its loop ended
+  bool drained;
+  // Completed TLS handshakes, read by the main thread for logging
+  uint64_t ssl_full_handshakes;
+  uint64_t ssl_resumed_handshakes;
+  // Connections done with their handshake, switched to kernel TLS once
+  // uv_ssl_t holds nothing of theirs
+  QUEUE ktls_conns;
+  uv_check_t ktls_check;
+} worker_t;
+
+typedef struct server_t {
+  uv_loop_t *loop;
+  config_t *config;
   char *config_file;
+  char *config_json;
+  worker_t *workers;
+  int num_workers;
+  EVP_PKEY *default_pkey;
+  X509 *default_x509;
+  cache_t *cache;
+  uv_timer_t cache_timer;
+  cache_stats_t cache_stats;
+  ssl_sessions_t *ssl_sessions;
+  uv_timer_t ssl_timer;
+  uint64_t ssl_full_handshakes;
+  uint64_t ssl_resumed_handshakes;
+  metrics_server_t metrics_server;
+  uv_signal_t log_signal;
+  uv_signal_t reload_signal;
+  char **argv;
+  uv_signal_t upgrade_signal;
+  upgrade_t upgrade;
+  uv_timer_t drain_timer;
+  uint64_t drain_deadline;
+  // Kernel TLS works, probed at start
+  bool ktls;
 } server_t;
 
+// What a connection waits for, each has its own timeout
+enum conn_wait {
+  WAIT_CLIENT_HEADER,
+  WAIT_CLIENT_IDLE,
+  WAIT_UPSTREAM_CONNECT,
+  WAIT_UPSTREAM_HEADER,
+  WAIT_UPSTREAM_IDLE,
+  // Tunnels (websockets, ssl passthrough) have no timeout
+  WAIT_NONE
+};
+
 typedef struct conn_s {
+  worker_t *worker;
   proxy_config_t *config;
+  // Configuration the connection was accepted with, referenced until it is
+  // freed
+  config_t *server_config;
   uv_stream_t *handle;
   bool handle_flushed;
+  // Chain of a stream closes synchronously, inside conn_close()
+  bool handle_closing;
   uv_tcp_t *proxy_handle;
+  // Upstream connection finished its last response and takes the next
+  // request if it goes to the same proxy
+  bool proxy_idle;
+  // Target of config proxy_handle is connected to, counted as outstanding
+  // until the upstream connection is released
+  int target;
+  // Outcome of the request was reported to the target's health
+  bool target_reported;
+  // Copy of a request sent over a reused upstream connection, sent once
+  // more on a new connection when the server closes the reused one before
+  // answering
+  uv_buf_t retry_buf;
+  bool retried;
   http_link_context_t http_link_context;
   QUEUE raw_requests;
 
+  // Reads stopped while worker's buffer pool is over its memory limit
+  buf_waiter_t buffers_waiter;
+  bool client_paused;
+  bool proxy_paused;
+  // Reads stopped until offloaded compression catches up
+  buf_waiter_t gzip_waiter;
+  bool gzip_closing;
+  // Reads of one side stopped while the other side's write queue is over
+  // the high-water mark: upstream reads for the client and the other way
+  // round
+  bool client_congested;
+  bool proxy_congested;
+  buf_waiter_t write_waiter;
+  // Set once ssl passthrough is detected until ClientHello is replayed
+  bool passthrough_pending;
+  bool splice_failed;
+
   uv_link_source_t source;
   uv_link_t http_link;
   uv_link_t observer;
 
   SSL *ssl;
+  // Proxy of the SNI hostname, resolved once for the whole handshake
+  proxy_config_t *sni_config;
+  // Full handshake was suspended once to go on on the thread pool
+  bool handshake_offloaded;
+  // ALPN picked h2, the session starts once the handshake is done
+  bool http2_selected;
+  // NULL once the kernel took over the TLS records
   uv_ssl_t *ssl_link;
+  bool ktls;
+  bool ktls_pending;
+  QUEUE ktls_member;
+
+  // HTTP/2 connection at the end of the TLS chain instead of the HTTP/1.1
+  // links, each of its streams is served by a conn of its own
+  http2_session_t *http2;
+  // Stream served by the conn, and the conn of its connection until that
+  // one is closed
+  http2_stream_t *stream;
+  struct conn_s *session;
+
+  enum conn_wait wait;
+  timer_wheel_entry_t timeout;
+  // Ends a request taking longer than request_timeout in total
+  timer_wheel_entry_t request_timeout;
+
+  // uv_hrtime() when the upstream connect and the TLS handshake started
+  uint64_t connect_start;
+  uint64_t handshake_start;
 } conn_t;
 
 server_t *server;
-static SSL_CTX *default_ctx;
 
-static void conn_init(uv_stream_t *handle);
+static void conn_init(worker_t *worker, uv_stream_t *handle);
 static void conn_close(conn_t *conn);
+static void conn_splice(conn_t *conn);
+static void conn_wait(conn_t *conn, enum conn_wait wait);
+static void conn_written(conn_t *conn);
+static void conn_http2_start(conn_t *conn);
 
 static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
-static void write_buf(uv_stream_t *handle, char *data, int len);
+static void write_raw_requests(conn_t *conn);
 
 void proxy_close_cb(uv_handle_t *peer);
 void proxy_read_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
 void proxy_connect_cb(uv_connect_t *req, int status);
-void proxy_http_request(char *ip, unsigned short port, conn_t *conn);
+void proxy_http_request(conn_t *conn);
+static bool proxy_finished(conn_t *conn);
+static bool proxy_reusable(conn_t *conn);
+static void proxy_release(conn_t *conn, bool reuse);
 
 static void write_cb(uv_write_t *req, int status);
 void link_close_cb(uv_link_t *source);
@@ -80,9 +225,16 @@ uv_link_methods_t proxy_methods;
 EVP_PKEY *generatePrivateKey();
 X509 *generateCertificate(EVP_PKEY *pkey);
 
-static proxy_config_t *find_proxy_config(const char *hostname);
+static proxy_config_t *find_proxy_config(config_t *config,
+                                         const char *hostname);
 static int server_init();
-static int server_listen(unsigned short port, uv_tcp_t *tcp);
+static void server_reload();
+static void server_upgrade();
+static void server_drain_wait();
+static int worker_init(worker_t *worker);
+static void worker_run(void *arg);
+static int server_listen(worker_t *worker, unsigned short port,
+                         uv_tcp_t *tcp);
 void parse_args(int argc, char **argv);
 void usage();
 
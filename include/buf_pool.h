@@ -0,0 +1,89 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_BUF_POOL_H_
+#define _BPROXY_BUF_POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "uv.h"
+
+// Block sizes are 256 B, 1 KB, 4 KB, 16 KB and 64 KB
+#define BUF_POOL_NUM_CLASSES 5
+#define BUF_POOL_MIN_SHIFT 8
+#define BUF_POOL_CLASS_SHIFT 2
+#define BUF_POOL_SLAB_SIZE (2 * 1024 * 1024)
+
+struct buf_pool_s;
+
+// Starts every slab. Slabs are aligned to BUF_POOL_SLAB_SIZE, so the slab
+// (and from it the block) of any pointer into a buffer can be found by
+// masking, which lets slices of a buffer be released like the buffer itself.
+typedef struct buf_slab_s {
+  struct buf_pool_s *pool;
+  size_t size;
+  size_t stride;
+  int size_class;  // -1 for a slab holding one large block
+} __attribute__((aligned(64))) buf_slab_t;
+
+// Precedes every block handed out by the pool.
+typedef struct buf_header_s {
+  struct buf_header_s *next;
+  // Released together with this block
+  struct buf_header_s *attached;
+  unsigned int refs;
+} __attribute__((aligned(16))) buf_header_t;
+
+struct buf_waiter_s;
+typedef void (*buf_waiter_cb)(struct buf_waiter_s *waiter);
+
+// Stream which stopped reading because the pool is over its memory limit.
+typedef struct buf_waiter_s {
+  QUEUE member;
+  bool waiting;
+  buf_waiter_cb cb;
+  void *data;
+} buf_waiter_t;
+
+// Size-classed free lists carved from 2 MB slabs. Blocks are reference
+// counted, so one read buffer can be handed to several writes without
+// copying. A pool belongs to one event loop and must only be used from that
+// loop's thread.
+typedef struct buf_pool_s {
+  uv_loop_t *loop;
+  buf_header_t *free_lists[BUF_POOL_NUM_CLASSES];
+  int num_slabs;
+  bool hugepages;
+
+  // Bytes handed out and not yet released
+  size_t in_use;
+  // Readers are paused above max_memory (0 means no limit) and resumed
+  // once usage drops under 3/4 of it
+  size_t max_memory;
+  QUEUE waiters;
+  uv_idle_t resume_handle;
+} buf_pool_t;
+
+void buf_pool_init(buf_pool_t *pool, uv_loop_t *loop, size_t max_memory,
+                   bool hugepages);
+void *buf_pool_alloc(buf_pool_t *pool, size_t size);
+// These accept any pointer into a buffer, not just its start. The last
+// buf_free() returns the buffer to its pool. buf_attach() hands the caller's
+// reference to other over to ptr, it is dropped when ptr is released.
+void buf_ref(void *ptr);
+void buf_free(void *ptr);
+void buf_attach(void *ptr, void *other);
+bool buf_pool_full(buf_pool_t *pool);
+void buf_pool_wait(buf_pool_t *pool, buf_waiter_t *waiter);
+void buf_pool_cancel_wait(buf_waiter_t *waiter);
+
+#endif  // _BPROXY_BUF_POOL_H_
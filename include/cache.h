@@ -0,0 +1,83 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_CACHE_H_
+#define _BPROXY_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "uv.h"
+
+struct cache_s;
+
+// Compressed response, immutable once inserted. Readers hold a reference
+// while writing it, so an evicted entry lives until the last write is done.
+typedef struct cache_entry_s {
+  struct cache_s *cache;
+  struct cache_entry_s *next;
+  QUEUE lru;
+  uint32_t hash;
+  char *key;
+  // Upstream validators, NULL when missing
+  char *etag;
+  char *last_modified;
+  // Rewritten headers and chunked gzip body, written as they are
+  char *headers;
+  size_t headers_len;
+  char *body;
+  size_t body_len;
+  size_t body_size;
+  // Served without asking upstream until then (uv_hrtime() milliseconds)
+  uint64_t expires;
+  int refs;
+} cache_entry_t;
+
+typedef struct cache_stats_s {
+  uint64_t hits;
+  uint64_t revalidated;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t evictions;
+  size_t memory;
+  size_t entries;
+} cache_stats_t;
+
+enum cache_result { CACHE_HIT, CACHE_REVALIDATED, CACHE_MISS };
+
+// LRU cache of compressed responses shared by all workers, bounded by the
+// memory held by entries.
+typedef struct cache_s {
+  uv_mutex_t lock;
+  cache_entry_t **buckets;
+  size_t num_buckets;
+  QUEUE lru;
+  size_t max_memory;
+  size_t max_entry_size;
+  cache_stats_t stats;
+} cache_t;
+
+cache_t *cache_new(size_t max_memory, size_t max_entry_size);
+cache_entry_t *cache_entry_new(cache_t *cache, const char *key,
+                               const char *etag, const char *last_modified,
+                               uint64_t expires);
+bool cache_entry_append(cache_entry_t *entry, const char *data, size_t len);
+void cache_entry_set_headers(cache_entry_t *entry, const char *headers,
+                             size_t len);
+void cache_insert(cache_entry_t *entry);
+cache_entry_t *cache_lookup(cache_t *cache, const char *key);
+bool cache_fresh(cache_entry_t *entry);
+void cache_refresh(cache_entry_t *entry, uint64_t expires);
+void cache_release(cache_entry_t *entry);
+void cache_count(cache_t *cache, enum cache_result result);
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
+uint64_t cache_now();
+
+#endif  // _BPROXY_CACHE_H_
@@ -9,53 +9,140 @@
 #define _BPROXY_CONFIG_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "balancer.h"
 #include "cJSON.h"
 #include "log.h"
+#include "queue.h"
+#include "router.h"
 #include "version.h"
 
 #include "openssl/err.h"
 #include "openssl/ssl.h"
 #include "uv_ssl_t.h"
 
-#define CONFIG_MAX_HOSTS 10
 #define CONFIG_MAX_GZIP_MIME_TYPES 20
-#define CONFIG_MAX_PROXIES 100
+#define CONFIG_DEFAULT_KEEPALIVE_IDLE_TIMEOUT 60000
+#define CONFIG_DEFAULT_KEEPALIVE_MAX_REQUESTS 1000
+#define CONFIG_DEFAULT_HEALTH_TIMEOUT 2000
+#define CONFIG_DEFAULT_EJECT_TIME 10000
+#define CONFIG_DEFAULT_MAX_EJECT_TIME 300000
+
+struct metrics_s;
 
 typedef struct proxy_config_t {
-  char *hosts[CONFIG_MAX_HOSTS];
-  char *ip;
-  unsigned short port;
+  char **hosts;
   int num_hosts;
+  balancer_t balancer;
   SSL_CTX *ssl_context;
+  // Session id context of the proxy's TLS sessions, set with ssl_context
+  unsigned char ssl_sid_ctx[SSL_MAX_SID_CTX_LENGTH];
   bool ssl_passthrough;
   bool force_ssl;
+  // Offer h2 in ALPN, needs ssl_context
+  bool http2;
+
+  // Upstream keep-alive pools of the targets, disabled when
+  // keepalive_max_idle is 0
+  int keepalive_max_idle;
+  uint64_t keepalive_idle_timeout;
+  unsigned int keepalive_max_requests;
+
+  // Active health checks probe every target each health_interval
+  // milliseconds, disabled when 0. Probes only connect when health_path is
+  // NULL, else they expect health_status for a GET of the path.
+  uint64_t health_interval;
+  uint64_t health_timeout;
+  char *health_path;
+  int health_status;
+  // Targets failing max_fails requests in a row are ejected for eject_time,
+  // doubled on every ejection without a success in between up to
+  // max_eject_time. Disabled when max_fails is 0.
+  int max_fails;
+  uint64_t eject_time;
+  uint64_t max_eject_time;
+
+  // Counters of the worker using this copy, set when it is installed
+  struct metrics_s *metrics;
 } proxy_config_t;
 
 typedef struct templates_t {
   char *status_400_template;
   char *status_404_template;
   char *status_502_template;
+  char *status_504_template;
 } templates_t;
 
 typedef struct config_t {
   unsigned short port;
   unsigned short secure_port;
+  int workers;
+  // Per worker buffer memory limit in bytes, 0 means no limit
+  size_t buffers_max_memory;
+  bool buffers_hugepages;
+  // Reads from a peer stop while the other side has more than high_water
+  // bytes waiting to be sent, and start again below low_water
+  size_t write_high_water;
+  size_t write_low_water;
+  // Forward ssl passthrough and websocket connections with splice()
+  bool splice;
+  // Hand TLS 1.2 AES-GCM records to the kernel after the handshake
+  bool ktls;
+  char *log_file;
   char *gzip_mime_types[CONFIG_MAX_GZIP_MIME_TYPES];
   int num_gzip_mime_types;
+  // Compress on the thread pool bodies of at least gzip_offload_min_size
+  // bytes or of unknown length
+  bool gzip_offload;
+  size_t gzip_offload_min_size;
+  // Continue full TLS handshakes on the thread pool once the certificate is
+  // picked, so signing the key exchange doesn't block the loop
+  bool ssl_offload;
+  // Compressed response cache shared by workers, disabled when 0
+  size_t cache_max_memory;
+  size_t cache_max_entry_size;
+  // TLS sessions shared by workers, cache size 0 disables session ids
+  size_t ssl_session_cache_size;
+  long ssl_session_timeout;
+  bool ssl_session_tickets;
+  char *ssl_ticket_key_file;
+  // Admin listener serving metrics, disabled when the port is 0
+  unsigned short metrics_port;
+  char *metrics_address;
+  // Seconds the old process keeps serving open connections after an upgrade
+  long drain_timeout;
+  // Milliseconds a connection may wait on a peer, 0 disables a timeout.
+  // Headers of a new connection include its TLS handshake, idle is the time
+  // between requests. Request is the total time from the request to the end
+  // of its response.
+  uint64_t client_header_timeout;
+  uint64_t client_idle_timeout;
+  uint64_t upstream_connect_timeout;
+  uint64_t upstream_header_timeout;
+  uint64_t upstream_idle_timeout;
+  uint64_t request_timeout;
   templates_t *templates;
-  proxy_config_t *proxies[CONFIG_MAX_PROXIES];
+  proxy_config_t **proxies;
   int num_proxies;
+  router_t *router;
+  // Held by the worker using the configuration and its connections, so a
+  // reload frees the old one after the last connection using it closes
+  int refs;
 } config_t;
 
 char *read_file(char *path);
-void parse_config(const char *json_string, config_t *config);
+int parse_config(const char *json_string, config_t *config, bool quiet);
+void config_check_reload(const config_t *running, const config_t *config);
+void config_free(config_t *config);
+void config_release(config_t *config);
 
 void http_400_response(char *resp);
 void http_404_response(char *resp);
 void http_502_response(char *resp);
+void http_504_response(char *resp);
 
 #endif  // _BPROXY_CONFIG_H_
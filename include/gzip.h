@@ -7,22 +7,22 @@
 
 #include "zlib.h"
 
+// Compressed output is emitted as chunked transfer encoding frames of at most
+// GZIP_FRAME_SIZE bytes, room is left for the chunk size line before the data
+// and for CRLF plus the last chunk after it.
+#define GZIP_FRAME_SIZE 16384
+#define GZIP_FRAME_HEAD 6
+#define GZIP_FRAME_TAIL 7
+
 typedef struct gzip_state_t {
   z_stream strm;
-  int current_size_in;
-  int current_size_out;
-  int current_size_buf_out;
-  bool first_chunk;
-  bool last_chunk;
-  char *http_header;
-  unsigned char *raw_body;
-  unsigned char *gzip_body;
-  char *chunk_body;
+  // More output is waiting for the next frame
+  bool pending;
 } gzip_state_t;
 
-int gzip_init_state(gzip_state_t *state, char *http_header);
+int gzip_init_state(gzip_state_t *state);
 void gzip_free_state(gzip_state_t *state);
-int gzip_compress(gzip_state_t *state);
-void gzip_chunk_compress(gzip_state_t *state);
+void gzip_input(gzip_state_t *state, const char *data, size_t len);
+size_t gzip_frame(gzip_state_t *state, char *out, bool finish, char **frame);
 
 #endif
@@ -0,0 +1,72 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_GZIP_JOB_H_
+#define _BPROXY_GZIP_JOB_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "buf_pool.h"
+#include "gzip.h"
+#include "queue.h"
+#include "uv.h"
+
+// Output frames reserved for one round on the thread pool, compression
+// continues in another round when they are used up
+#define GZIP_JOB_MAX_FRAMES 8
+
+struct gzip_job_s;
+// Takes over frames compressed in one round, called on the loop thread
+typedef void (*gzip_job_cb)(struct gzip_job_s *job, uv_buf_t *frames,
+                            unsigned int nframes);
+
+// Body data waiting to be compressed, holds a reference to its buffer
+typedef struct gzip_input_s {
+  QUEUE member;
+  const char *data;
+  size_t len;
+  bool finish;
+} gzip_input_t;
+
+// Compresses one response stream on the libuv thread pool. At most one round
+// runs at a time, so frames come back in the order data was pushed.
+typedef struct gzip_job_s {
+  uv_work_t req;
+  buf_pool_t *buffers;
+  gzip_state_t *state;
+  gzip_job_cb cb;
+  void *data;
+
+  // Pushed since the current round started
+  QUEUE inputs;
+  // Owned by the thread pool while busy
+  QUEUE running;
+  QUEUE done;
+  // Head of running was handed to the compressor already
+  bool started;
+  char *out[GZIP_JOB_MAX_FRAMES];
+  uv_buf_t frames[GZIP_JOB_MAX_FRAMES];
+  unsigned int num_out;
+  unsigned int num_frames;
+  // Nanoseconds the last round took
+  uint64_t work_time;
+
+  bool busy;
+  // Freed when the running round completes
+  bool closed;
+} gzip_job_t;
+
+gzip_job_t *gzip_job_new(buf_pool_t *buffers, gzip_state_t *state,
+                         gzip_job_cb cb, void *data);
+void gzip_job_push(gzip_job_t *job, const char *data, size_t len,
+                   bool finish);
+void gzip_job_submit(gzip_job_t *job);
+bool gzip_job_idle(gzip_job_t *job);
+void gzip_job_free(gzip_job_t *job);
+
+#endif  // _BPROXY_GZIP_JOB_H_
@@ -0,0 +1,44 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_HEALTH_H_
+#define _BPROXY_HEALTH_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+#include "uv.h"
+
+// Room for the request line, Host header and path of a probe
+#define HEALTH_MAX_REQUEST 1024
+
+// Active probe of one target, holds a reference to its configuration so a
+// reload can't free the target while the probe runs
+typedef struct health_probe_s {
+  uv_tcp_t tcp;
+  uv_timer_t timer;
+  uv_connect_t connect;
+  uv_write_t write;
+  config_t *config;
+  proxy_config_t *proxy_config;
+  int target;
+  char request[HEALTH_MAX_REQUEST];
+  // "HTTP/1.1 200"
+  char status_line[12];
+  size_t len;
+  int handles;
+  bool done;
+} health_probe_t;
+
+void health_report(proxy_config_t *proxy_config, int target, bool ok,
+                   uint64_t now);
+void health_check(config_t *config, uv_loop_t *loop, uint64_t now);
+
+#endif  // _BPROXY_HEALTH_H_
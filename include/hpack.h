@@ -0,0 +1,67 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_HPACK_H_
+#define _BPROXY_HPACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Dynamic table size of the decoder, the HTTP/2 default which bproxy never
+// raises
+#define HPACK_TABLE_SIZE 4096
+// Size counted for every entry on top of its strings (RFC 7541 4.1)
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+// Upper bound of hpack_encode_header() output
+#define HPACK_ENCODED_MAX(name_len, value_len) ((name_len) + (value_len) + 16)
+
+enum hpack_error { HPACK_OK = 0, HPACK_ERROR = -1 };
+
+// Entry of the dynamic table, name and value are stored in one block and are
+// both NUL terminated
+typedef struct hpack_entry_s {
+  char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} hpack_entry_t;
+
+// Header block decoder of one connection. Entries are kept in a ring, the
+// newest one is at first.
+typedef struct hpack_decoder_s {
+  hpack_entry_t entries[HPACK_MAX_ENTRIES];
+  int first;
+  int num;
+  size_t size;
+  size_t max_size;
+  // Strings of the block being decoded
+  arena_t strings;
+} hpack_decoder_t;
+
+// Called for each header field in block order with NUL terminated strings,
+// which are only valid during the call. Decoding stops when it returns
+// nonzero.
+typedef int (*hpack_header_cb)(void *data, const char *name, size_t name_len,
+                               const char *value, size_t value_len);
+
+void hpack_decoder_init(hpack_decoder_t *decoder);
+int hpack_decode(hpack_decoder_t *decoder, const uint8_t *data, size_t len,
+                 hpack_header_cb cb, void *arg);
+void hpack_decoder_free(hpack_decoder_t *decoder);
+
+// The encoder never adds to the peer's dynamic table, so it has no state
+size_t hpack_encode_status(char *out, int status);
+size_t hpack_encode_header(char *out, const char *name, size_t name_len,
+                           const char *value, size_t value_len);
+
+#endif  // _BPROXY_HPACK_H_
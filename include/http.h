@@ -17,17 +17,43 @@
 #include "config.h"
 #include "http_parser.h"
 #include "uv.h"
+#include "uv_link_t.h"
 #include "version.h"
 
+#include "arena.h"
 #include "gzip.h"
+#include "gzip_job.h"
+#include "metrics.h"
+#include "buf_pool.h"
+#include "cache.h"
 #include "queue.h"
 
-#define MAX_HEADERS 20
-#define MAX_ELEMENT_SIZE 500
+// Header lists which grew past this are released on reset
+#define HTTP_KEEP_HEADERS 64
 
 typedef bool boolean;
 
-enum header_element { NONE = 0, FIELD, VALUE };
+enum header_element { NONE = 0, URL, FIELD, VALUE };
+
+// String stored in the arena of a message
+typedef struct http_slice_s {
+  uint32_t offset;
+  uint32_t len;
+} http_slice_t;
+
+typedef struct http_header_s {
+  http_slice_t name;
+  http_slice_t value;
+} http_header_t;
+
+// Strings of one message, the arena is reset when the next one starts
+typedef struct http_headers_s {
+  arena_t arena;
+  http_header_t *list;
+  int num;
+  int max;
+  enum header_element last;
+} http_headers_t;
 
 typedef struct buf_queue_s {
   uv_buf_t buf;
@@ -37,54 +63,81 @@ typedef struct buf_queue_s {
 typedef struct http_request_s {
   ssize_t raw_len;
   enum http_method method;
+  // Longer Host headers are refused, hostname also holds the SNI name
   char host[256];
-  char *url;
-  char *body;
+  http_slice_t url;
   char hostname[256];
   uint8_t http_major;
   uint8_t http_minor;
   uint8_t keepalive;
   uint8_t upgrade;
-  enum header_element last_header_element;
-  int num_headers;
-  char headers[MAX_HEADERS][2][MAX_ELEMENT_SIZE];
-  char http_header[MAX_HEADERS * 2 * (MAX_ELEMENT_SIZE + 2) + 256];
-  int http_header_len;
+  http_headers_t headers;
+  // Rewritten headers forwarded upstream
+  http_slice_t http_header;
   boolean enable_compression;
   http_parser parser;
   int content_length;
   bool complete;
-  char *status_line;
+  bool headers_received;
+  // Rewritten headers were passed on, the observer routes the request when
+  // it gets them
+  bool headers_sent;
+  http_slice_t status_line;
 } http_request_t;
 
 typedef struct http_response_s {
   http_parser parser;
-  char *raw_body;
-  size_t body_size;
-
-  int expected_data_len;
-  int processed_data_len;
-
-  enum header_element last_header_element;
-  int num_headers;
-  char headers[MAX_HEADERS][2][MAX_ELEMENT_SIZE];
-  char http_header[MAX_HEADERS * 2 * (MAX_ELEMENT_SIZE + 2) + 256];
-  int http_header_len;
-  char status_line[256];
+  http_headers_t headers;
+  // Rewritten headers sent to the client
+  http_slice_t http_header;
+  http_slice_t status_line;
   boolean enable_compression;
   boolean headers_received;
   boolean headers_send;
+  boolean complete;
+  boolean keepalive;
   gzip_state_t *gzip_state;
+  // Set instead of gzip_state when compression runs on the thread pool
+  gzip_job_t *gzip_job;
+  // Compressed frames waiting to be written to the client
+  uv_buf_t *gzip_frames;
+  unsigned int num_gzip_frames;
+  unsigned int max_gzip_frames;
 } http_response_t;
 
 typedef struct http_link_context_s {
+  uv_link_t *link;
   http_request_t request;
   http_response_t response;
+  buf_pool_t *buffers;
+  // Notified when offloaded compression has caught up with the response
+  buf_waiter_t *gzip_waiter;
+  // Notified when a write of offloaded frames or a cached response completed
+  buf_waiter_t *write_waiter;
+  // Shared response cache, NULL when disabled
+  cache_t *cache;
+  // Set for requests whose response may come from or go to the cache
+  char *cache_key;
+  // Fresh entry to serve (cache_hit) or stale one being revalidated
+  cache_entry_t *cache_entry;
+  bool cache_hit;
+  // Response being stored, filled as its frames are written
+  cache_entry_t *cache_pending;
+  // Counters of the proxy serving the connection
+  metrics_t *metrics;
   config_t *server_config;  // TODO: Move this out, and use only part of
                             // configuration needed
   bool https;
   enum { TYPE_REQUEST, TYPE_WEBSOCKET } type;
   bool initial_reply;
+  // Requests forwarded upstream which have not been fully answered yet
+  unsigned int pending_responses;
+  // Data of pipelined requests read before the previous response ended
+  QUEUE held;
+  // Reads the observer asked for, stopped while requests are held
+  bool reading;
+  bool framing;
+  bool closing;
   char peer_ip[45];
 
   // Data for logging
@@ -104,6 +157,8 @@ int response_message_begin_cb(http_parser *p);
 int response_headers_complete_cb(http_parser *p);
 int response_headers_field_cb(http_parser *p, const char *buf, size_t length);
 int response_headers_value_cb(http_parser *p, const char *buf, size_t length);
+int response_body_cb(http_parser *p, const char *buf, size_t length);
+int response_message_complete_cb(http_parser *p);
 
 void parse_requested_host(http_request_t *request);
 int insert_header(char *src, char *resp);
@@ -112,7 +167,26 @@ char *substring(char *string, int position, int length);
 void http_301_response(char *resp, const http_request_t *request,
                        unsigned short port);
 
+void http_headers_reset(http_headers_t *headers);
+void http_headers_free(http_headers_t *headers);
+void http_headers_add(http_headers_t *headers, const char *name,
+                      const char *value);
+void http_headers_field(http_headers_t *headers, const char *buf,
+                        size_t len);
+void http_headers_value(http_headers_t *headers, const char *buf,
+                        size_t len);
+char *http_str(const http_headers_t *headers, http_slice_t slice);
+const char *http_header_find(const http_headers_t *headers, const char *name);
+http_slice_t http_slice(http_headers_t *headers, const char *data, size_t len);
+
 void http_init_response_headers(http_response_t *response, bool compressed);
+void http_response_add_frame(http_response_t *response, uv_buf_t frame);
+void http_gzip_job_cb(gzip_job_t *job, uv_buf_t *frames, unsigned int nframes);
+bool http_gzip_idle(http_link_context_t *context);
+void http_cache_request(http_link_context_t *context);
+void http_cache_response(http_link_context_t *context);
+void http_cache_reset(http_link_context_t *context);
+int http_cache_write(http_link_context_t *context, cache_entry_t *entry);
 void http_init_request_headers(http_link_context_t *context);
 
 // clang-format off
@@ -132,6 +206,8 @@ static http_parser_settings resp_parser_settings =
   .on_header_field = response_headers_field_cb,
   .on_header_value = response_headers_value_cb,
   .on_headers_complete = response_headers_complete_cb,
+  .on_body = response_body_cb,
+  .on_message_complete = response_message_complete_cb
 };
 // clang-format on
 
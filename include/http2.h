@@ -0,0 +1,213 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_HTTP2_H_
+#define _BPROXY_HTTP2_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+#include "hpack.h"
+#include "http.h"
+#include "queue.h"
+#include "uv.h"
+#include "uv_link_t.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+#define HTTP2_FRAME_HEADER_LEN 9
+// Frames are never sent or accepted larger than the protocol's default
+#define HTTP2_MAX_FRAME_SIZE 16384
+#define HTTP2_MAX_CONCURRENT_STREAMS 128
+// Request body a client may send ahead per stream and per connection
+#define HTTP2_STREAM_WINDOW (256 * 1024)
+#define HTTP2_CONNECTION_WINDOW (1024 * 1024)
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_WINDOW 0x7fffffff
+// Header block limit, CONTINUATION frames included
+#define HTTP2_MAX_HEADER_BLOCK (64 * 1024)
+
+enum http2_frame_type {
+  HTTP2_DATA = 0,
+  HTTP2_HEADERS,
+  HTTP2_PRIORITY,
+  HTTP2_RST_STREAM,
+  HTTP2_SETTINGS,
+  HTTP2_PUSH_PROMISE,
+  HTTP2_PING,
+  HTTP2_GOAWAY,
+  HTTP2_WINDOW_UPDATE,
+  HTTP2_CONTINUATION
+};
+
+enum http2_flags {
+  HTTP2_FLAG_END_STREAM = 0x1,
+  HTTP2_FLAG_ACK = 0x1,
+  HTTP2_FLAG_END_HEADERS = 0x4,
+  HTTP2_FLAG_PADDED = 0x8,
+  HTTP2_FLAG_PRIORITY = 0x20
+};
+
+enum http2_error_code {
+  HTTP2_NO_ERROR = 0,
+  HTTP2_PROTOCOL_ERROR,
+  HTTP2_INTERNAL_ERROR,
+  HTTP2_FLOW_CONTROL_ERROR,
+  HTTP2_SETTINGS_TIMEOUT,
+  HTTP2_STREAM_CLOSED,
+  HTTP2_FRAME_SIZE_ERROR,
+  HTTP2_REFUSED_STREAM,
+  HTTP2_CANCEL,
+  HTTP2_COMPRESSION_ERROR,
+  HTTP2_CONNECT_ERROR,
+  HTTP2_ENHANCE_YOUR_CALM
+};
+
+struct http2_session_s;
+struct http2_stream_s;
+typedef void (*http2_stream_cb)(struct http2_stream_s *stream);
+typedef void (*http2_session_cb)(struct http2_session_s *session);
+
+// Chunk of request or response body, followed by its data
+typedef struct http2_data_s {
+  QUEUE member;
+  size_t len;
+  // Bytes of a response chunk already framed
+  size_t offset;
+  // Flow control window a request chunk gives back once it was read
+  uint32_t window;
+  char data[];
+} http2_data_t;
+
+// One request and its response. The stream is the root of a link chain of
+// its own, which reads the request in HTTP/1.1 form and writes an HTTP/1.1
+// response, so each stream is served like a connection of its own.
+typedef struct http2_stream_s {
+  uv_link_t link;
+  // NULL once the stream left the session
+  struct http2_session_s *session;
+  uint32_t id;
+  QUEUE member;
+
+  // Request waiting to be read by the chain
+  QUEUE input;
+  bool reading;
+  bool ready;
+  QUEUE ready_member;
+  // Client ended the request
+  bool end_received;
+  // Request body has no Content-Length, it goes upstream chunked
+  bool chunked;
+  bool head;
+  int64_t recv_window;
+  uint32_t recv_consumed;
+
+  // Response parsed from what the chain writes
+  http_parser parser;
+  http_headers_t headers;
+  bool complete;
+  // END_STREAM or RST_STREAM queued, nothing more is sent on the stream
+  bool end_sent;
+  bool reset;
+  int64_t send_window;
+  // Body waiting for flow control windows
+  QUEUE output;
+  size_t output_size;
+  // Writes to the connection not completed yet
+  QUEUE writes;
+  // Notified when body held back by flow control was written
+  buf_waiter_t *write_waiter;
+  // Shutdown completes once the body is out
+  uv_link_t *shutdown_source;
+  uv_link_shutdown_cb shutdown_cb;
+  void *shutdown_arg;
+  bool shutting_down;
+  bool closed;
+
+  // Freed after the callback running when it was released
+  int busy;
+  bool released;
+} http2_stream_t;
+
+// HTTP/2 connection negotiated with ALPN, the link at the end of the TLS
+// chain. Requests are handed to new streams, everything else is answered
+// by the session itself.
+typedef struct http2_session_s {
+  uv_link_t link;
+  buf_pool_t *buffers;
+  uv_loop_t *loop;
+  hpack_decoder_t decoder;
+  size_t preface_len;
+  bool started;
+  // Frame split across reads
+  char *partial;
+  size_t partial_len;
+  // Header block continued in CONTINUATION frames
+  arena_t header_block;
+  uint32_t header_stream;
+  bool header_end_stream;
+
+  // Request of the header block being decoded
+  http_headers_t request;
+  http_slice_t method;
+  http_slice_t path;
+  http_slice_t authority;
+  bool has_method;
+  bool has_path;
+  bool has_authority;
+  bool regular_headers;
+  bool content_length;
+  bool malformed;
+
+  QUEUE streams;
+  int num_streams;
+  uint32_t last_stream_id;
+  // Streams with input for their chains, delivered from the idle handle
+  QUEUE ready;
+  // Writes without frames, completed from there as well
+  QUEUE empty_writes;
+  uv_idle_t idle;
+  int64_t send_window;
+  int64_t recv_window;
+  uint32_t recv_consumed;
+  uint32_t peer_initial_window;
+  bool goaway_sent;
+  // Connection error, nothing more is read
+  bool failed;
+  bool closing;
+
+  // Frames of one write being assembled
+  uv_buf_t *batch;
+  unsigned int num_batch;
+  unsigned int max_batch;
+  // Flags of the last frame which may end the stream
+  char *end_flags;
+  bool batch_ended;
+  arena_t scratch;
+
+  // New stream, the callback chains it and starts reading
+  http2_stream_cb stream_cb;
+  // Stream ended by the client or lost with the connection, its chain is
+  // closed without shutdown
+  http2_stream_cb reset_cb;
+  // Response of a stream was sent completely
+  http2_stream_cb done_cb;
+  // Connection failed or was closed by the client
+  http2_session_cb error_cb;
+  uv_link_t *close_source;
+  uv_link_close_cb close_cb;
+} http2_session_t;
+
+http2_session_t *http2_session_new(uv_loop_t *loop, buf_pool_t *buffers);
+void http2_session_free(http2_session_t *session);
+size_t http2_stream_queue_size(http2_stream_t *stream);
+void http2_stream_free(http2_stream_t *stream);
+
+#endif  // _BPROXY_HTTP2_H_
@@ -0,0 +1,26 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_KTLS_H_
+#define _BPROXY_KTLS_H_
+
+#include <stdbool.h>
+
+#include "openssl/ssl.h"
+#include "uv.h"
+
+// Kernel TLS (Linux only). Once the handshake is done, the keys of a TLS 1.2
+// AES-GCM session are installed on its socket, which then encrypts and
+// decrypts records itself and carries plain bytes to and from userspace.
+
+// Probes a loopback connection, false when the kernel has no TLS module
+bool ktls_supported(void);
+// Returns UV_ENOTSUP when the session can't be offloaded and the socket was
+// left alone. Other errors leave the socket half configured.
+int ktls_start(SSL *ssl, uv_os_fd_t fd);
+
+#endif  // _BPROXY_KTLS_H_
@@ -9,18 +9,20 @@
 #define _BPROXY_LOG_H_
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
+// Records waiting to be written, messages are cut to LOG_MAX_MESSAGE bytes
+#define LOG_RING_SIZE 4096
+#define LOG_MAX_MESSAGE 480
+// Bytes written with one call by the log thread
+#define LOG_BATCH_SIZE (64 * 1024)
 
-static struct {
-  FILE *fp;
-  int level;
-  int quiet;
-} L;
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
 #define log_debug(...) log_log(LOG_DEBUG, __VA_ARGS__)
 #define log_info(...) log_log(LOG_INFO, __VA_ARGS__)
@@ -31,6 +33,10 @@ static struct {
 void log_set_fp(FILE *fp);
 void log_set_level(int level);
 void log_set_quiet(int enable);
+int log_open(const char *path);
+void log_reopen(void);
+void log_start(void);
+void log_stop(void);
 
 void log_log(int level, const char *fmt, ...);
 
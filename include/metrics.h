@@ -0,0 +1,90 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_METRICS_H_
+#define _BPROXY_METRICS_H_
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "uv.h"
+
+// Histogram bucket i counts durations up to 2^i microseconds, the last
+// one everything above 2^24 (about 16 s)
+#define METRICS_BUCKETS 26
+
+// Counters have a single writer, the worker owning them. Relaxed stores
+// keep the update a plain add while scrapes from other threads read whole
+// values.
+#define METRICS_ADD(counter, n) \
+  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define METRICS_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef struct metrics_histogram_s {
+  uint64_t buckets[METRICS_BUCKETS];
+  uint64_t count;
+  // Microseconds
+  uint64_t sum;
+} metrics_histogram_t;
+
+// Counters of one worker for one proxy
+typedef struct metrics_s {
+  // Responses by status class, 1xx to 5xx
+  uint64_t responses[5];
+  // Read from clients and from upstreams, before compression
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t gzip_bytes_in;
+  uint64_t gzip_bytes_out;
+  // Nanoseconds spent compressing
+  uint64_t gzip_time;
+  uint64_t ssl_full_handshakes;
+  uint64_t ssl_resumed_handshakes;
+  // Incremented and decremented by the same worker, may wrap in between
+  uint64_t connections;
+  // Request start until response headers
+  metrics_histogram_t request_latency;
+  metrics_histogram_t upstream_connect;
+  metrics_histogram_t ssl_handshake;
+} metrics_t;
+
+// Counters of one worker by host, the first host of each proxy. Hosts are
+// only ever prepended, so a reload keeps counters of hosts it removes and
+// scrapes walk the list while the worker adds to it.
+typedef struct metrics_host_s {
+  struct metrics_host_s *next;
+  char *host;
+  metrics_t metrics;
+} metrics_host_t;
+
+typedef void (*metrics_scrape_cb)(arena_t *out);
+
+// Admin listener answering every request with the scraped metrics
+typedef struct metrics_server_s {
+  uv_tcp_t tcp;
+  metrics_scrape_cb scrape;
+} metrics_server_t;
+
+void metrics_observe(metrics_histogram_t *histogram, uint64_t usec);
+void metrics_response(metrics_t *metrics, int status, uint64_t usec);
+void metrics_merge(metrics_t *dst, const metrics_t *src);
+metrics_t *metrics_get(metrics_host_t **list, const char *host);
+void metrics_print(arena_t *out, const char **hosts, const metrics_t *metrics,
+                   int num_hosts);
+void metrics_print_cache(arena_t *out, const cache_stats_t *stats);
+int metrics_listen(metrics_server_t *server, uv_loop_t *loop,
+                   const char *address, unsigned short port,
+                   uv_os_sock_t inherited, metrics_scrape_cb scrape);
+
+#endif  // _BPROXY_METRICS_H_
@@ -0,0 +1,50 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_ROUTER_H_
+#define _BPROXY_ROUTER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct router_entry_s {
+  const char *key;
+  size_t len;
+  uint32_t hash;
+  int index;
+} router_entry_t;
+
+typedef struct router_table_s {
+  router_entry_t *entries;
+  size_t size;
+  size_t count;
+} router_table_t;
+
+// Host routing table compiled from the configured hosts. Exact hosts live in
+// one hash table. "*.example.com" wildcards form a reversed-label trie whose
+// nodes are stored in a second hash table addressed by their whole suffix
+// (".com" -> ".example.com"), so walking the labels of a hostname costs one
+// probe per label. Other wildcards ("*example.com", "*") are rare and kept
+// in a list.
+//
+// Lookup returns the lowest index among all matching hosts, which keeps the
+// "first proxy in configuration wins" rule of the linear scan.
+typedef struct router_s {
+  router_table_t exact;
+  router_table_t wildcards;
+  const char **suffixes;
+  int *suffix_indexes;
+  int num_suffixes;
+} router_t;
+
+router_t *router_new();
+void router_free(router_t *router);
+void router_add(router_t *router, const char *host, int index);
+int router_lookup(const router_t *router, const char *hostname);
+
+#endif  // _BPROXY_ROUTER_H_
@@ -0,0 +1,75 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_SSL_SESSIONS_H_
+#define _BPROXY_SSL_SESSIONS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "openssl/ssl.h"
+#include "queue.h"
+#include "uv.h"
+
+// Ticket key in the 48 byte format of nginx' ssl_session_ticket_key
+#define SSL_TICKET_KEY_SIZE 48
+#define SSL_MAX_TICKET_KEYS 8
+
+typedef struct ssl_ticket_key_s {
+  unsigned char name[16];
+  unsigned char aes_key[16];
+  unsigned char hmac_key[16];
+} ssl_ticket_key_t;
+
+typedef struct ssl_session_entry_s {
+  struct ssl_session_entry_s *next;
+  QUEUE lru;
+  uint32_t hash;
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned int id_len;
+  time_t expires;
+  unsigned char *der;
+  int der_len;
+} ssl_session_entry_t;
+
+// Session state shared by the SSL contexts of all workers, so a client
+// resumes no matter which worker accepts its next connection. Sessions are
+// kept serialized in a bounded LRU, tickets are protected by a key set whose
+// first key encrypts and all keys decrypt.
+typedef struct ssl_sessions_s {
+  uv_mutex_t lock;
+  ssl_session_entry_t **buckets;
+  size_t num_buckets;
+  size_t num_entries;
+  size_t max_entries;
+  QUEUE lru;
+  long timeout;
+
+  bool tickets;
+  ssl_ticket_key_t keys[SSL_MAX_TICKET_KEYS];
+  int num_keys;
+  // Keys are read from here when set, generated and rotated otherwise
+  char *key_file;
+  time_t key_file_mtime;
+  time_t keys_rotated;
+} ssl_sessions_t;
+
+ssl_sessions_t *ssl_sessions_new(size_t max_entries, long timeout,
+                                 bool tickets, const char *key_file);
+void ssl_sessions_setup(ssl_sessions_t *sessions, SSL_CTX *ctx);
+bool ssl_sessions_client_hello_name(const unsigned char *msg, size_t len,
+                                    char *name, size_t size);
+// Session id context of a proxy, the SHA-256 of its host names. Sessions
+// only resume on the proxy whose context they carry.
+void ssl_sessions_proxy_sid_ctx(char **hosts, int num_hosts,
+                                unsigned char sid_ctx[SSL_MAX_SID_CTX_LENGTH]);
+void ssl_sessions_rotate(ssl_sessions_t *sessions);
+
+#endif  // _BPROXY_SSL_SESSIONS_H_
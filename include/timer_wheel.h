@@ -0,0 +1,58 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_TIMER_WHEEL_H_
+#define _BPROXY_TIMER_WHEEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "uv.h"
+
+// Milliseconds per tick, timeouts fire up to one tick late
+#define TIMER_WHEEL_TICK 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// 64^4 ticks of 100ms, about 19 days
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer_wheel_entry_s;
+typedef void (*timer_wheel_cb)(struct timer_wheel_entry_s *entry);
+
+// Embedded in the object it times out, so starting and stopping don't
+// allocate
+typedef struct timer_wheel_entry_s {
+  QUEUE member;
+  // Tick the entry expires on
+  uint64_t expires;
+  timer_wheel_cb cb;
+  void *data;
+} timer_wheel_entry_t;
+
+// Hierarchical timing wheel (as the Linux kernel had it). Starting and
+// stopping an entry is O(1), and a tick only touches one slot and, every
+// 64 ticks, spreads a slot of the next level over the one below. Runs on
+// one loop, entries must be started and stopped on its thread.
+typedef struct timer_wheel_s {
+  uv_timer_t timer;
+  // Next tick to run
+  uint64_t now;
+  QUEUE slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  unsigned int count;
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, uv_loop_t *loop);
+void timer_wheel_entry_init(timer_wheel_entry_t *entry, timer_wheel_cb cb,
+                            void *data);
+void timer_wheel_start(timer_wheel_t *wheel, timer_wheel_entry_t *entry,
+                       uint64_t timeout);
+void timer_wheel_stop(timer_wheel_t *wheel, timer_wheel_entry_t *entry);
+bool timer_wheel_active(const timer_wheel_entry_t *entry);
+
+#endif  // _BPROXY_TIMER_WHEEL_H_
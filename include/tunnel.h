@@ -0,0 +1,49 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_TUNNEL_H_
+#define _BPROXY_TUNNEL_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "uv.h"
+
+#define TUNNEL_PIPE_SIZE (1024 * 1024)
+#define TUNNEL_MAX_PENDING (256 * 1024)
+
+// Bytes read from one socket of the tunnel and not yet written to the other
+typedef struct tunnel_flow_s {
+  int pipe[2];
+  size_t pending;
+  // Pipe may be full, don't read until some of it was written
+  bool blocked;
+  bool eof;
+  bool shutdown;
+} tunnel_flow_t;
+
+typedef struct tunnel_side_s {
+  uv_poll_t poll;
+  int fd;
+  int events;
+  // Data read from this side
+  tunnel_flow_t flow;
+} tunnel_side_t;
+
+// Opaque byte tunnel between client and upstream sockets (ssl passthrough,
+// upgraded websockets). Data moves with splice() through a pipe per
+// direction and never enters userspace. Linux only.
+typedef struct tunnel_s {
+  tunnel_side_t client;
+  tunnel_side_t upstream;
+  int num_closed;
+} tunnel_t;
+
+int tunnel_start(uv_loop_t *loop, int client_fd, int upstream_fd);
+
+#endif  // _BPROXY_TUNNEL_H_
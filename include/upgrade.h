@@ -0,0 +1,49 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_UPGRADE_H_
+#define _BPROXY_UPGRADE_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "uv.h"
+
+// Set in the environment of the new process to its end of the socket pair
+#define UPGRADE_ENV "BPROXY_UPGRADE_FD"
+// Limit of descriptors in one SCM_RIGHTS message on Linux
+#define UPGRADE_MAX_LISTENERS 253
+
+struct upgrade_s;
+// Status is 0 once the new process listens, an error when it failed
+typedef void (*upgrade_cb)(struct upgrade_s *upgrade, int status);
+
+// Binary upgrade seen from the old process. The new process gets the
+// listening sockets over a UNIX socket pair and answers once it accepts
+// connections on them, so no connection is refused in between.
+typedef struct upgrade_s {
+  uv_process_t process;
+  uv_pipe_t pipe;
+  upgrade_cb cb;
+  // Handles not closed yet, a new upgrade waits for them
+  int handles;
+  bool done;
+} upgrade_t;
+
+int upgrade_start(upgrade_t *upgrade, uv_loop_t *loop, char **argv,
+                  const uv_os_sock_t *fds, const unsigned short *ports,
+                  int num, upgrade_cb cb);
+bool upgrade_busy(upgrade_t *upgrade);
+
+// New process side
+int upgrade_receive();
+uv_os_sock_t upgrade_take_listener(unsigned short port);
+void upgrade_ready();
+
+#endif  // _BPROXY_UPGRADE_H_
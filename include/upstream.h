@@ -0,0 +1,37 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#ifndef _BPROXY_UPSTREAM_H_
+#define _BPROXY_UPSTREAM_H_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "log.h"
+#include "queue.h"
+#include "uv.h"
+
+// Connection to an upstream server. The tcp handle comes first so an
+// upstream_t can be used wherever a uv_tcp_t is expected.
+typedef struct upstream_s {
+  uv_tcp_t handle;
+  proxy_config_t *config;
+  upstream_target_t *target;
+  unsigned int num_requests;
+  uint64_t idle_since;
+  QUEUE member;
+} upstream_t;
+
+upstream_t *upstream_new(uv_loop_t *loop, proxy_config_t *config,
+                         upstream_target_t *target);
+upstream_t *upstream_pool_get(upstream_target_t *target);
+void upstream_pool_put(upstream_t *upstream);
+void upstream_close(upstream_t *upstream);
+void upstream_pool_sweep(proxy_config_t *config, uint64_t now);
+void upstream_pool_close(proxy_config_t *config);
+
+#endif  // _BPROXY_UPSTREAM_H_
@@ -0,0 +1,54 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "arena.h"
+
+// Returns the offset of len uninitialized bytes
+uint32_t arena_alloc(arena_t *arena, size_t len) {
+  if (arena->len + len > arena->size) {
+    size_t size = arena->size ? arena->size : ARENA_INITIAL_SIZE;
+    while (size < arena->len + len) {
+      size *= 2;
+    }
+    arena->base = realloc(arena->base, size);
+    if (!arena->base) {
+      abort();
+    }
+    arena->size = size;
+  }
+  uint32_t offset = arena->len;
+  arena->len += len;
+  return offset;
+}
+
+// Copies data as a NUL terminated string
+uint32_t arena_strndup(arena_t *arena, const char *data, size_t len) {
+  uint32_t offset = arena_alloc(arena, len + 1);
+  memcpy(&arena->base[offset], data, len);
+  arena->base[offset + len] = '\0';
+  return offset;
+}
+
+// Appends data to the string allocated last
+void arena_strncat(arena_t *arena, const char *data, size_t len) {
+  arena->len--;
+  arena_strndup(arena, data, len);
+}
+
+void arena_reset(arena_t *arena) {
+  if (arena->size > ARENA_KEEP_SIZE) {
+    arena_free(arena);
+  }
+  arena->len = 0;
+}
+
+void arena_free(arena_t *arena) {
+  free(arena->base);
+  arena->base = NULL;
+  arena->len = 0;
+  arena->size = 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "balancer.h"
+
+#include <stdio.h>
+
+#include "log.h"
+
+static const char *policy_names[] = {"round_robin", "least_outstanding",
+                                     "p2c", "hash"};
+
+// FNV-1a with the murmur3 finalizer, FNV alone spreads similar keys poorly
+static uint32_t balancer_hash(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+// xorshift32
+static uint32_t balancer_random(balancer_t *balancer) {
+  uint32_t x = balancer->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  balancer->random = x;
+  return x;
+}
+
+static int balancer_point_compare(const void *a, const void *b) {
+  uint32_t x = ((const balancer_point_t *)a)->hash;
+  uint32_t y = ((const balancer_point_t *)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+// Returns -1 for unknown names
+int balancer_policy(const char *name) {
+  for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+    if (strcmp(name, policy_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int balancer_add(balancer_t *balancer, const char *ip, unsigned short port,
+                 int weight) {
+  struct sockaddr_storage addr;
+  memset(&addr, 0, sizeof addr);
+  if (uv_ip4_addr(ip, port, (struct sockaddr_in *)&addr) &&
+      uv_ip6_addr(ip, port, (struct sockaddr_in6 *)&addr)) {
+    log_error("invalid upstream address: %s", ip);
+    return 1;
+  }
+  if (weight < 1 || weight > BALANCER_MAX_WEIGHT) {
+    log_error("upstream weight of %s must be 1 to %d", ip,
+              BALANCER_MAX_WEIGHT);
+    return 1;
+  }
+
+  balancer->targets = realloc(balancer->targets, (balancer->num_targets + 1) *
+                                                     sizeof(upstream_target_t));
+  upstream_target_t *target = &balancer->targets[balancer->num_targets++];
+  memset(target, 0, sizeof *target);
+  target->addr = addr;
+  snprintf(target->name, sizeof target->name,
+           addr.ss_family == AF_INET6 ? "[%s]:%d" : "%s:%d", ip, port);
+  target->weight = weight;
+  return 0;
+}
+
+// Called once all targets are added, they don't move anymore
+void balancer_build(balancer_t *balancer) {
+  int num = balancer->num_targets;
+  balancer->outstanding = calloc(num > 0 ? num : 1, sizeof(uint32_t));
+  balancer->down_until = calloc(num > 0 ? num : 1, sizeof(uint64_t));
+  balancer->cumulative = malloc((num > 0 ? num : 1) * sizeof(int));
+  balancer->total_weight = 0;
+  for (int i = 0; i < num; i++) {
+    QUEUE_INIT(&balancer->targets[i].idle_upstreams);
+    balancer->total_weight += balancer->targets[i].weight;
+    balancer->cumulative[i] = balancer->total_weight;
+  }
+  balancer->random = (uint32_t)uv_hrtime() | 1;
+
+  if (balancer->policy == BALANCE_HASH) {
+    balancer->num_points = balancer->total_weight * BALANCER_POINTS_PER_WEIGHT;
+    balancer->ring = malloc(balancer->num_points * sizeof(balancer_point_t));
+    int n = 0;
+    for (int i = 0; i < num; i++) {
+      int points = balancer->targets[i].weight * BALANCER_POINTS_PER_WEIGHT;
+      for (int p = 0; p < points; p++) {
+        char key[80];
+        snprintf(key, sizeof key, "%s-%d", balancer->targets[i].name, p);
+        balancer->ring[n].hash = balancer_hash(key);
+        balancer->ring[n].target = i;
+        n++;
+      }
+    }
+    qsort(balancer->ring, balancer->num_points, sizeof(balancer_point_t),
+          balancer_point_compare);
+  }
+}
+
+// Health of a target changed
+void balancer_update(balancer_t *balancer, int index) {
+  upstream_target_t *target = &balancer->targets[index];
+  balancer->down_until[index] =
+      target->probe_failed ? UINT64_MAX : target->ejected_until;
+}
+
+// Target a has less load per weight than target b
+static bool balancer_less(balancer_t *balancer, int a, int b) {
+  return (uint64_t)balancer->outstanding[a] * balancer->targets[b].weight <
+         (uint64_t)balancer->outstanding[b] * balancer->targets[a].weight;
+}
+
+static int balancer_weighted_random(balancer_t *balancer) {
+  int r = balancer_random(balancer) % balancer->total_weight;
+  int lo = 0;
+  int hi = balancer->num_targets - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (balancer->cumulative[mid] > r) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// Spreads requests by weight without bursts to one target (as nginx does)
+static int balancer_round_robin(balancer_t *balancer, uint64_t now) {
+  int best = -1;
+  int total_weight = 0;
+  for (int i = 0; i < balancer->num_targets; i++) {
+    upstream_target_t *target = &balancer->targets[i];
+    if (balancer->down_until[i] > now) {
+      continue;
+    }
+    target->current_weight += target->weight;
+    total_weight += target->weight;
+    if (best < 0 ||
+        target->current_weight > balancer->targets[best].current_weight) {
+      best = i;
+    }
+  }
+  if (best >= 0) {
+    balancer->targets[best].current_weight -= total_weight;
+  }
+  return best;
+}
+
+// Scans from a rotating start, so ties don't all go to the first target
+static int balancer_least_outstanding(balancer_t *balancer, uint64_t now) {
+  int num = balancer->num_targets;
+  int best = -1;
+  for (int n = 0; n < num; n++) {
+    int i = (balancer->next + n) % num;
+    if (balancer->down_until[i] <= now &&
+        (best < 0 || balancer_less(balancer, i, best))) {
+      best = i;
+    }
+  }
+  balancer->next = (balancer->next + 1) % num;
+  return best;
+}
+
+// Two random targets, the less loaded one wins. Scans all targets when a
+// draw hits one which is down.
+static int balancer_p2c(balancer_t *balancer, uint64_t now) {
+  int a = balancer_weighted_random(balancer);
+  int b = balancer_weighted_random(balancer);
+  if (a == b) {
+    b = (a + 1 + balancer_random(balancer) % (balancer->num_targets - 1)) %
+        balancer->num_targets;
+  }
+  if (balancer->down_until[a] > now || balancer->down_until[b] > now) {
+    return balancer_least_outstanding(balancer, now);
+  }
+  return balancer_less(balancer, b, a) ? b : a;
+}
+
+// Keys of a target which is down move on to the next one on the ring
+static int balancer_consistent_hash(balancer_t *balancer, const char *key,
+                                    uint64_t now) {
+  uint32_t hash = balancer_hash(key ? key : "");
+  int lo = 0;
+  int hi = balancer->num_points;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (balancer->ring[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (int n = 0; n < balancer->num_points; n++) {
+    int target = balancer->ring[(lo + n) % balancer->num_points].target;
+    if (balancer->down_until[target] <= now) {
+      return target;
+    }
+  }
+  return -1;
+}
+
+// Returns the target index, -1 when the proxy has none which is up. Key is
+// used by BALANCE_HASH only.
+int balancer_pick(balancer_t *balancer, const char *key, uint64_t now) {
+  if (balancer->num_targets < 2) {
+    return balancer->num_targets == 1 && balancer->down_until[0] <= now ? 0
+                                                                        : -1;
+  }
+  switch (balancer->policy) {
+    case BALANCE_LEAST_OUTSTANDING:
+      return balancer_least_outstanding(balancer, now);
+    case BALANCE_P2C:
+      return balancer_p2c(balancer, now);
+    case BALANCE_HASH:
+      return balancer_consistent_hash(balancer, key, now);
+    default:
+      return balancer_round_robin(balancer, now);
+  }
+}
+
+void balancer_free(balancer_t *balancer) {
+  free(balancer->targets);
+  free(balancer->outstanding);
+  free(balancer->down_until);
+  free(balancer->cumulative);
+  free(balancer->ring);
+  free(balancer->hash_header);
+}
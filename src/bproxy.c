@@ -7,6 +7,7 @@
  */
 #include "bproxy.h"
 #include <arpa/inet.h>
+#include <unistd.h>
 #include "log.h"
 
 #include <assert.h>
@@ -18,7 +19,11 @@
   if ((V) == NULL) abort()
 
 static void write_link_cb(uv_link_t *source, int status, void *arg) {
-  free(arg);
+  buf_free(arg);
+  conn_written(source->data);
+  if (status == 0) {
+    conn_splice(source->data);
+  }
 }
 
 static void observer_connection_link_shutdown_cb(uv_link_t *source, int status,
@@ -32,11 +37,24 @@ static void observer_connection_link_shutdown_cb(uv_link_t *source, int status,
 static void client_connection_link_close_cb(uv_link_t *link) {
   conn_t *conn;
   conn = link->data;
-  SSL_free(conn->ssl);
-  conn->ssl = NULL;
-  free(conn->handle);
+  if (conn->stream) {
+    // Socket belongs to the HTTP/2 connection, which goes idle with its last
+    // stream
+    conn_t *session = conn->session;
+    conn->session = NULL;
+    if (session && session->http2->num_streams == 0 &&
+        !session->http2->goaway_sent && !session->http2->closing) {
+      conn_wait(session, WAIT_CLIENT_IDLE);
+    }
+  } else {
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    free(conn->handle);
+  }
   conn->handle = NULL;
-  conn_close(conn);
+  if (!conn->handle_closing) {
+    conn_close(conn);
+  }
 }
 
 void free_raw_requests_queue(conn_t *conn) {
@@ -44,121 +62,703 @@ void free_raw_requests_queue(conn_t *conn) {
     buf_queue_t *bq =
         QUEUE_DATA(QUEUE_NEXT(&conn->raw_requests), buf_queue_t, member);
     QUEUE_REMOVE(&bq->member);
-    free(bq);
+    buf_free(bq);
+  }
+}
+
+static void observer_alloc_cb(uv_link_t *link, size_t suggested_size,
+                              uv_buf_t *buf) {
+  conn_t *conn = link->data;
+  *buf = uv_buf_init(buf_pool_alloc(&conn->worker->buffers, suggested_size),
+                     suggested_size);
+}
+
+// Streams share the socket of their HTTP/2 connection and are closed on
+// their own
+static bool conn_client_closing(conn_t *conn) {
+  if (conn->stream) {
+    return conn->stream->closed;
+  }
+  return uv_is_closing((uv_handle_t *)conn->handle);
+}
+
+// Last link of the client's chain
+static uv_link_t *conn_client_link(conn_t *conn) {
+  return conn->http2 ? &conn->http2->link : &conn->observer;
+}
+
+// Bytes written to the client which its socket didn't take yet, including
+// TLS records uv_ssl_t holds on to
+static size_t conn_client_queue_size(conn_t *conn) {
+  if (conn->stream) {
+    return http2_stream_queue_size(conn->stream);
+  }
+  size_t size = uv_stream_get_write_queue_size(conn->handle);
+  if (conn->ssl_link) {
+    size += uv_ssl_get_write_queue_size(conn->ssl_link);
+  }
+  return size;
+}
+
+// A fast peer is only read as long as the other side keeps up, so a slow
+// client doesn't make the whole response pile up in memory
+static void conn_check_congestion(conn_t *conn) {
+  config_t *config = conn->server_config;
+  if (!conn->handle || !conn->proxy_handle || conn_client_closing(conn) ||
+      uv_is_closing((uv_handle_t *)conn->proxy_handle)) {
+    return;
+  }
+
+  size_t size = conn_client_queue_size(conn);
+  if (!conn->client_congested && size > config->write_high_water) {
+    conn->client_congested = true;
+    if (!conn->proxy_paused) {
+      uv_read_stop((uv_stream_t *)conn->proxy_handle);
+    }
+  } else if (conn->client_congested && size <= config->write_low_water) {
+    conn->client_congested = false;
+    if (!conn->proxy_paused) {
+      uv_read_start((uv_stream_t *)conn->proxy_handle, alloc_cb,
+                    proxy_read_cb);
+    }
+  }
+
+  size = uv_stream_get_write_queue_size((uv_stream_t *)conn->proxy_handle);
+  if (!conn->proxy_congested && size > config->write_high_water) {
+    conn->proxy_congested = true;
+    if (!conn->client_paused) {
+      uv_link_read_stop(&conn->observer);
+    }
+  } else if (conn->proxy_congested && size <= config->write_low_water) {
+    conn->proxy_congested = false;
+    if (!conn->client_paused) {
+      uv_link_read_start(&conn->observer);
+    }
+  }
+}
+
+// A write to either side completed
+static void conn_written(conn_t *conn) {
+  if (conn->wait == WAIT_UPSTREAM_IDLE || conn->wait == WAIT_CLIENT_IDLE) {
+    // Slow clients still making progress don't time out
+    conn_wait(conn, conn->wait);
+  }
+  conn_check_congestion(conn);
+}
+
+static void conn_write_waiter_cb(buf_waiter_t *waiter) {
+  conn_written(waiter->data);
+}
+
+// Frames a pipelined request which waited for the previous response
+static void conn_next_request(conn_t *conn) {
+  if (!conn->client_paused && conn->handle && !conn_client_closing(conn)) {
+    http_link_resume(&conn->http_link);
+  }
+}
+
+// Reads are resumed once enough buffers were released
+static void conn_resume_cb(buf_waiter_t *waiter) {
+  conn_t *conn = waiter->data;
+  if (conn->client_paused) {
+    conn->client_paused = false;
+    if (conn->handle && !conn_client_closing(conn) && !conn->proxy_congested) {
+      uv_link_read_start(&conn->observer);
+      conn_next_request(conn);
+    }
+  }
+  if (conn->proxy_paused) {
+    conn->proxy_paused = false;
+    if (conn->proxy_handle &&
+        !uv_is_closing((uv_handle_t *)conn->proxy_handle) &&
+        !conn->client_congested) {
+      uv_read_start((uv_stream_t *)conn->proxy_handle, alloc_cb,
+                    proxy_read_cb);
+    }
   }
 }
 
+// Offloaded compression has caught up with the response
+static void conn_gzip_drain_cb(buf_waiter_t *waiter) {
+  conn_t *conn = waiter->data;
+  if (conn->gzip_closing) {
+    conn_close(conn);
+  } else if (buf_pool_full(&conn->worker->buffers)) {
+    buf_pool_wait(&conn->worker->buffers, &conn->buffers_waiter);
+  } else {
+    conn_resume_cb(&conn->buffers_waiter);
+  }
+}
+
+// Neither more of the response nor the next request is read while frames
+// are compressed on the thread pool, so output stays in order
+static void conn_gzip_wait(conn_t *conn) {
+  if (!conn->client_paused) {
+    conn->client_paused = true;
+    uv_link_read_stop(&conn->observer);
+  }
+  if (!conn->proxy_paused && conn->proxy_handle) {
+    conn->proxy_paused = true;
+    uv_read_stop((uv_stream_t *)conn->proxy_handle);
+  }
+}
+
+// Moves the connection's counters to the proxy it is routed to, NULL for
+// connections not routed to any
+static void conn_set_metrics(conn_t *conn, proxy_config_t *proxy_config) {
+  metrics_t *metrics =
+      proxy_config ? proxy_config->metrics : conn->worker->unrouted;
+  http_link_context_t *context = &conn->http_link_context;
+  if (context->metrics != metrics) {
+    // Streams are not counted as connections
+    if (!conn->stream) {
+      METRICS_ADD(context->metrics->connections, -1);
+      METRICS_ADD(metrics->connections, 1);
+    }
+    context->metrics = metrics;
+  }
+}
+
+static const char *conn_wait_names[] = {"client header", "client idle",
+                                        "upstream connect", "upstream header",
+                                        "upstream idle", "tunnel"};
+
+// Restarts the connection's timeout for what it waits for now
+static void conn_wait(conn_t *conn, enum conn_wait wait) {
+  config_t *config = conn->server_config;
+  uint64_t timeout = 0;
+  switch (wait) {
+    case WAIT_CLIENT_HEADER:
+      timeout = config->client_header_timeout;
+      break;
+    case WAIT_CLIENT_IDLE:
+      timeout = config->client_idle_timeout;
+      break;
+    case WAIT_UPSTREAM_CONNECT:
+      timeout = config->upstream_connect_timeout;
+      break;
+    case WAIT_UPSTREAM_HEADER:
+      timeout = config->upstream_header_timeout;
+      break;
+    case WAIT_UPSTREAM_IDLE:
+      timeout = config->upstream_idle_timeout;
+      break;
+    default:
+      break;
+  }
+  conn->wait = wait;
+  if (timeout > 0) {
+    timer_wheel_start(&conn->worker->timeouts, &conn->timeout, timeout);
+  } else {
+    timer_wheel_stop(&conn->worker->timeouts, &conn->timeout);
+  }
+  if (wait == WAIT_CLIENT_IDLE || wait == WAIT_NONE) {
+    timer_wheel_stop(&conn->worker->timeouts, &conn->request_timeout);
+  }
+}
+
+// Request was read and goes upstream
+static void conn_request_start(conn_t *conn) {
+  if (conn->server_config->request_timeout > 0) {
+    timer_wheel_start(&conn->worker->timeouts, &conn->request_timeout,
+                      conn->server_config->request_timeout);
+  }
+}
+
+// Answers a request with a static page and closes the connection, as the
+// pages tell the client
+static void conn_respond(conn_t *conn, const char *resp, size_t len,
+                         int status) {
+  http_link_context_t *context = &conn->http_link_context;
+  char *buf = buf_pool_alloc(&conn->worker->buffers, len);
+  memcpy(buf, resp, len);
+  uv_buf_t tmp_buf = uv_buf_init(buf, len);
+  metrics_response(context->metrics, status,
+                   (uv_hrtime() - context->request_time) / 1000);
+  conn_wait(conn, WAIT_CLIENT_IDLE);
+  uv_link_write(&conn->observer, &tmp_buf, 1, NULL, write_link_cb, buf);
+  conn_close(conn);
+}
+
+// Closes the connection, answering 504 when the upstream didn't start its
+// response yet
+static void conn_timeout_cb(timer_wheel_entry_t *entry) {
+  conn_t *conn = entry->data;
+  http_link_context_t *context = &conn->http_link_context;
+  bool upstream = entry == &conn->request_timeout ||
+                  conn->wait == WAIT_UPSTREAM_CONNECT ||
+                  conn->wait == WAIT_UPSTREAM_HEADER ||
+                  conn->wait == WAIT_UPSTREAM_IDLE;
+  log_debug("%s - %s timeout", context->peer_ip,
+            entry == &conn->request_timeout ? "request"
+                                            : conn_wait_names[conn->wait]);
+  if (conn->wait == WAIT_UPSTREAM_CONNECT && conn->target >= 0) {
+    health_report(conn->config, conn->target, false,
+                  uv_now(conn->worker->loop));
+  }
+  if (upstream && context->initial_reply && !conn->config->ssl_passthrough) {
+    const char *resp = conn->server_config->templates->status_504_template;
+    conn_respond(conn, resp, strlen(resp), 504);
+  } else {
+    conn_close(conn);
+  }
+}
+
+// Answers the request from the cache when a fresh copy is stored, the
+// request is then not forwarded upstream
+static bool conn_cache_hit(conn_t *conn) {
+  http_link_context_t *context = &conn->http_link_context;
+  if (!context->cache_hit) {
+    return false;
+  }
+  context->cache_hit = false;
+  cache_entry_t *entry = context->cache_entry;
+  context->cache_entry = NULL;
+  if (!context->request.complete || context->pending_responses != 1) {
+    // Earlier responses are still on their way, keep them in order
+    cache_release(entry);
+    cache_count(context->cache, CACHE_MISS);
+    return false;
+  }
+
+  context->pending_responses--;
+  cache_count(context->cache, CACHE_HIT);
+  conn_wait(conn, WAIT_CLIENT_IDLE);
+  metrics_response(context->metrics, 200,
+                   (uv_hrtime() - context->request_time) / 1000);
+  log_debug("%s - [cache] - \"%s\" %s", context->peer_ip,
+            http_str(&context->request.headers, context->request.status_line),
+            context->request.host);
+  QUEUE *q;
+  QUEUE_FOREACH(q, &conn->raw_requests) {
+    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
+    buf_free(bq->buf.base);
+  }
+  free_raw_requests_queue(conn);
+  if (http_cache_write(context, entry) != 0 || !context->request.keepalive) {
+    conn_close(conn);
+  }
+  return true;
+}
+
+// Keeps a copy of a request about to go over a reused upstream connection,
+// which the server may have closed in the meantime. Only complete requests
+// of idempotent methods are sent again, once.
+static void conn_keep_retry(conn_t *conn) {
+  http_link_context_t *context = &conn->http_link_context;
+  switch (context->request.method) {
+  case HTTP_GET:
+  case HTTP_HEAD:
+  case HTTP_OPTIONS:
+  case HTTP_PUT:
+  case HTTP_DELETE:
+    break;
+  default:
+    return;
+  }
+  if (conn->retried || context->type != TYPE_REQUEST ||
+      !context->request.complete || context->pending_responses != 1) {
+    return;
+  }
+  size_t len = 0;
+  QUEUE *q;
+  QUEUE_FOREACH(q, &conn->raw_requests) {
+    len += QUEUE_DATA(q, buf_queue_t, member)->buf.len;
+  }
+  if (len == 0) {
+    return;
+  }
+  char *base = buf_pool_alloc(&conn->worker->buffers, len);
+  conn->retry_buf = uv_buf_init(base, len);
+  QUEUE_FOREACH(q, &conn->raw_requests) {
+    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
+    memcpy(base, bq->buf.base, bq->buf.len);
+    base += bq->buf.len;
+  }
+}
+
+static void conn_drop_retry(conn_t *conn) {
+  if (conn->retry_buf.base) {
+    buf_free(conn->retry_buf.base);
+    conn->retry_buf = uv_buf_init(NULL, 0);
+  }
+}
+
+// Sends a request to its proxy, over the upstream connection of the previous
+// request when that one is idle and belongs to the same proxy
+static void conn_route_request(conn_t *conn, proxy_config_t *proxy_config) {
+  config_t *config = conn->server_config;
+  if (!proxy_config) {
+    const char *resp = config->templates->status_404_template;
+    conn_respond(conn, resp, strlen(resp), 404);
+    return;
+  } else if (proxy_config->force_ssl && !conn->http_link_context.https) {
+    char resp[4096];
+    http_301_response(resp, &conn->http_link_context.request,
+                      config->secure_port);
+    conn_respond(conn, resp, strlen(resp), 301);
+    return;
+  }
+  conn->retried = false;
+  if (conn->proxy_handle &&
+      (!conn->proxy_idle || conn->config != proxy_config)) {
+    proxy_release(conn, false);
+  }
+  conn->config = proxy_config;
+  if (conn_cache_hit(conn)) {
+    return;
+  }
+  if (!conn->proxy_handle) {
+    proxy_http_request(conn);
+    return;
+  }
+
+  conn->proxy_idle = false;
+  conn->target_reported = false;
+  conn_request_start(conn);
+  conn_wait(conn, WAIT_UPSTREAM_HEADER);
+  conn_keep_retry(conn);
+  write_raw_requests(conn);
+  conn_check_congestion(conn);
+}
+
 static void client_connection_read_cb(uv_link_t *observer, ssize_t nread,
                                       const uv_buf_t *buf) {
   conn_t *conn = (conn_t *)observer->data;
+  config_t *config = conn->server_config;
+  buf_pool_t *buffers = &conn->worker->buffers;
   if (nread > 0) {
-    buf_queue_t *buf_queue_body_node = malloc(sizeof *buf_queue_body_node);
-    buf_queue_body_node->buf.base = buf->base;
+    char *base = buf->base;
+    bool passthrough = conn->passthrough_pending;
+    if (passthrough) {
+      // ClientHello replayed by uv_ssl_t is not allocated from the pool
+      conn->passthrough_pending = false;
+      base = buf_pool_alloc(buffers, nread);
+      memcpy(base, buf->base, nread);
+      free(buf->base);
+    }
+    buf_queue_t *buf_queue_body_node =
+        buf_pool_alloc(buffers, sizeof *buf_queue_body_node);
+    buf_queue_body_node->buf.base = base;
     buf_queue_body_node->buf.len = nread;
     QUEUE_INIT(&buf_queue_body_node->member);
     QUEUE_INSERT_TAIL(&conn->raw_requests, &buf_queue_body_node->member);
 
-    if (conn->proxy_handle) {
-      QUEUE *q;
-      QUEUE_FOREACH(q, &conn->raw_requests) {
-        buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
-        write_buf((uv_stream_t *)conn->proxy_handle, bq->buf.base, bq->buf.len);
-        free(bq->buf.base);
-      }
-      free_raw_requests_queue(conn);
-    } else {
+    http_link_context_t *context = &conn->http_link_context;
+    if (passthrough ||
+        (context->request.headers_received && !context->request.headers_sent)) {
+      // Headers of a new request, each one on the connection is routed by
+      // its own Host header
       proxy_config_t *proxy_config =
-          find_proxy_config(conn->http_link_context.request.hostname);
-      if (!proxy_config) {
-        char *resp =
-            malloc(strlen(server->config->templates->status_404_template) *
-                   sizeof(char));
-        strncpy(resp, server->config->templates->status_404_template,
-                strlen(server->config->templates->status_404_template));
-        uv_buf_t tmp_buf = uv_buf_init(resp, strlen(resp));
-        uv_link_write((uv_link_t *)observer, &tmp_buf, 1, NULL, write_link_cb,
-                      resp);
-        return;
-      } else if (proxy_config->force_ssl && !conn->http_link_context.https) {
-        char *resp = malloc(4096 * sizeof(char));
-        http_301_response(resp, &conn->http_link_context.request,
-                          server->config->secure_port);
-        uv_buf_t tmp_buf = uv_buf_init(resp, strlen(resp));
-        uv_link_write((uv_link_t *)observer, &tmp_buf, 1, NULL, write_link_cb,
-                      resp);
-        return;
+          find_proxy_config(config, context->request.hostname);
+      conn_set_metrics(conn, proxy_config);
+      METRICS_ADD(context->metrics->bytes_in, nread);
+      conn_route_request(conn, proxy_config);
+    } else if (conn->proxy_handle) {
+      METRICS_ADD(context->metrics->bytes_in, nread);
+      if (conn->wait == WAIT_UPSTREAM_HEADER) {
+        // Request body is still coming
+        conn_wait(conn, WAIT_UPSTREAM_HEADER);
       }
-      conn->config = proxy_config;
-      proxy_http_request(proxy_config->ip, proxy_config->port, conn);
+      write_raw_requests(conn);
+      conn_check_congestion(conn);
+    }
+
+    if (buf_pool_full(buffers) && !conn->client_paused) {
+      conn->client_paused = true;
+      uv_link_read_stop(observer);
+      buf_pool_wait(buffers, &conn->buffers_waiter);
     }
   }
 
   if (nread < 0) {
     if (nread == -400) {
-      char *resp =
-          malloc(strlen(server->config->templates->status_400_template) *
-                 sizeof(char));
-      strncpy(resp, server->config->templates->status_400_template,
-              strlen(server->config->templates->status_400_template));
-      uv_buf_t tmp_buf = uv_buf_init(resp, strlen(resp));
-      uv_link_write((uv_link_t *)observer, &tmp_buf, 1, NULL, write_link_cb,
-                    resp);
+      const char *resp = config->templates->status_400_template;
+      conn_respond(conn, resp, strlen(resp), 400);
     } else {
       conn_close(conn);
     }
   }
   if (nread <= 0) {
     if (buf) {
-      free(buf->base);
+      buf_free(buf->base);
     }
   }
 }
 
+// Hands the TLS records of the connection to its socket. Returns false while
+// uv_ssl_t still holds some of them, the switch is tried again then.
+static bool conn_ktls_start(conn_t *conn) {
+  if (!conn->handle || conn_client_closing(conn) || !conn->ssl_link) {
+    return true;
+  }
+  if (!uv_ssl_is_idle(conn->ssl_link)) {
+    return false;
+  }
+  uv_os_fd_t fd;
+  int err = uv_fileno((uv_handle_t *)conn->handle, &fd);
+  if (!err) {
+    err = ktls_start(conn->ssl, fd);
+  }
+  if (err == UV_ENOTSUP) {
+    // Cipher or kernel can't do it, stay with uv_ssl_t
+    return true;
+  }
+  if (err) {
+    log_warn("could not start kernel TLS: %s", uv_strerror(err));
+    conn->handle_flushed = true;
+    conn_close(conn);
+    return true;
+  }
+
+  uv_ssl_detach(conn->ssl_link);
+  conn->ssl_link = NULL;
+  conn->ktls = true;
+  // The kernel doesn't send close_notify, the session stays resumable
+  // anyway
+  SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+  return true;
+}
+
+static void ktls_check_cb(uv_check_t *handle) {
+  worker_t *worker = handle->data;
+  QUEUE conns;
+  QUEUE_MOVE(&worker->ktls_conns, &conns);
+  while (!QUEUE_EMPTY(&conns)) {
+    QUEUE *q = QUEUE_HEAD(&conns);
+    conn_t *conn = QUEUE_DATA(q, conn_t, ktls_member);
+    QUEUE_REMOVE(q);
+    conn->ktls_pending = false;
+    if (!conn_ktls_start(conn)) {
+      conn->ktls_pending = true;
+      QUEUE_INSERT_TAIL(&worker->ktls_conns, q);
+    }
+  }
+  if (QUEUE_EMPTY(&worker->ktls_conns)) {
+    uv_check_stop(handle);
+  }
+}
+
+// OpenSSL looks the session of a ClientHello up before the servername
+// callback runs. The session id context of the proxy asked for is set first,
+// so a session of another proxy misses and gets a full handshake.
+static void ssl_msg_cb(int write_p, int version, int content_type,
+                       const void *buf, size_t len, SSL *s, void *arg) {
+  char hostname[TLSEXT_MAXLEN_host_name + 1];
+  if (write_p || content_type != SSL3_RT_HANDSHAKE ||
+      !ssl_sessions_client_hello_name(buf, len, hostname, sizeof(hostname))) {
+    return;
+  }
+  conn_t *conn = SSL_get_app_data(s);
+  proxy_config_t *proxy_config =
+      find_proxy_config(conn->server_config, hostname);
+  if (proxy_config && proxy_config->ssl_context) {
+    SSL_set_session_id_context(s, proxy_config->ssl_sid_ctx,
+                               sizeof(proxy_config->ssl_sid_ctx));
+  }
+}
+
+static void ssl_info_cb(const SSL *s, int where, int ret) {
+  conn_t *conn = SSL_get_app_data(s);
+  if (where & SSL_CB_HANDSHAKE_START) {
+    conn->handshake_start = uv_hrtime();
+  }
+  if (!(where & SSL_CB_HANDSHAKE_DONE)) {
+    return;
+  }
+  metrics_t *metrics = conn->http_link_context.metrics;
+  if (SSL_session_reused((SSL *)s)) {
+    METRICS_ADD(conn->worker->ssl_resumed_handshakes, 1);
+    METRICS_ADD(metrics->ssl_resumed_handshakes, 1);
+  } else {
+    METRICS_ADD(conn->worker->ssl_full_handshakes, 1);
+    METRICS_ADD(metrics->ssl_full_handshakes, 1);
+  }
+  metrics_observe(&metrics->ssl_handshake,
+                  (uv_hrtime() - conn->handshake_start) / 1000);
+
+  if (conn->http2_selected && !conn->http2) {
+    conn_http2_start(conn);
+  }
+
+  if (conn->server_config->ktls && server->ktls && !conn->ktls_pending &&
+      !conn->passthrough_pending) {
+    // uv_ssl_t is still in the middle of this handshake's records
+    conn->ktls_pending = true;
+    QUEUE_INSERT_TAIL(&conn->worker->ktls_conns, &conn->ktls_member);
+    uv_check_start(&conn->worker->ktls_check, ktls_check_cb);
+  }
+}
+
+// Registered once on the default context of the worker, the certificate of
+// the hostname comes with the context of its proxy
 static int ssl_servername_cb(SSL *s, int *ad, void *arg) {
+  conn_t *conn = SSL_get_app_data(s);
   const char *hostname = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
   if (!hostname || hostname[0] == '\0') {
     return SSL_TLSEXT_ERR_NOACK;
   }
-  proxy_config_t *proxy_config = find_proxy_config(hostname);
+  proxy_config_t *proxy_config =
+      find_proxy_config(conn->server_config, hostname);
+  conn->sni_config = proxy_config;
+  conn_set_metrics(conn, proxy_config);
   if (!proxy_config) {
-    SSL_set_SSL_CTX(s, default_ctx);
+    SSL_set_SSL_CTX(s, conn->worker->default_ctx);
     return SSL_TLSEXT_ERR_NOACK;
   }
   if (proxy_config && proxy_config->ssl_context) {
     SSL_set_SSL_CTX(s, proxy_config->ssl_context);
   } else if (proxy_config && proxy_config->ssl_passthrough) {
-    conn_t *conn = arg;
     strcpy(conn->http_link_context.request.hostname, hostname);
 
     uv_link_unchain((uv_link_t *)conn->ssl_link, &conn->http_link);
     uv_link_unchain(&conn->http_link, (uv_link_t *)&conn->observer);
     uv_link_chain((uv_link_t *)conn->ssl_link, (uv_link_t *)&conn->observer);
 
+    conn->passthrough_pending = true;
     uv_ssl_cancel(conn->ssl_link);
   } else {
     log_error("SSL/TLS not configured properly for: %s", hostname);
-    SSL_set_SSL_CTX(s, default_ctx);
+    SSL_set_SSL_CTX(s, conn->worker->default_ctx);
     return SSL_TLSEXT_ERR_OK;
   }
   return SSL_TLSEXT_ERR_OK;
 }
 
-void conn_init(uv_stream_t *handle) {
-  int err = 0;
-  bool ssl_conn = false;
-
+// State of a client connection or an HTTP/2 stream, which reads requests
+// through its own HTTP/1.1 links
+static conn_t *conn_new(worker_t *worker, uv_stream_t *handle,
+                        config_t *config) {
   conn_t *conn = malloc(sizeof(conn_t));
   memset(conn, 0, sizeof *conn);
+  conn->worker = worker;
   conn->handle = handle;
+  conn->server_config = config;
+  conn->server_config->refs++;
+  conn->target = -1;
+  timer_wheel_entry_init(&conn->timeout, conn_timeout_cb, conn);
+  timer_wheel_entry_init(&conn->request_timeout, conn_timeout_cb, conn);
+  conn_wait(conn, WAIT_CLIENT_HEADER);
 
   QUEUE_INIT(&conn->raw_requests);
-
-  CHECK(uv_link_source_init(&conn->source, (uv_stream_t *)conn->handle));
-  conn->source.data = conn;
+  conn->buffers_waiter.cb = conn_resume_cb;
+  conn->buffers_waiter.data = conn;
+  conn->gzip_waiter.cb = conn_gzip_drain_cb;
+  conn->gzip_waiter.data = conn;
 
   CHECK(uv_link_init(&conn->observer, &proxy_methods));
+  conn->observer.data = conn;
   CHECK(uv_link_init(&conn->http_link, &http_link_methods));
-  http_link_init(&conn->http_link, &conn->http_link_context, server->config);
+  http_link_init(&conn->http_link, &conn->http_link_context,
+                 conn->server_config, &worker->buffers);
+  conn->http_link_context.gzip_waiter = &conn->gzip_waiter;
+  conn->write_waiter.cb = conn_write_waiter_cb;
+  conn->write_waiter.data = conn;
+  conn->http_link_context.write_waiter = &conn->write_waiter;
+  conn->http_link_context.cache = server->cache;
+  conn->http_link_context.metrics = worker->unrouted;
+  return conn;
+}
+
+// Request of an HTTP/2 stream goes through the same links as one read from
+// a connection
+static void conn_stream_cb(http2_stream_t *stream) {
+  conn_t *session = stream->session->link.data;
+  conn_t *conn = conn_new(session->worker, session->handle,
+                          session->server_config);
+  conn->stream = stream;
+  conn->session = session;
+  conn->http_link_context.https = true;
+  strcpy(conn->http_link_context.peer_ip, session->http_link_context.peer_ip);
+  stream->link.data = conn;
+  stream->write_waiter = &conn->write_waiter;
+  CHECK(uv_link_chain(&stream->link, &conn->http_link));
+  CHECK(uv_link_chain(&conn->http_link, &conn->observer));
+  // Connection doesn't time out while it has streams
+  conn_wait(session, WAIT_NONE);
+  CHECK(uv_link_read_start(&conn->observer));
+}
+
+// Stream was reset by the client or lost with its connection, there is
+// nothing to flush
+static void conn_stream_reset_cb(http2_stream_t *stream) {
+  conn_t *conn = stream->link.data;
+  if (!stream->session) {
+    conn->session = NULL;
+  }
+  conn->handle_flushed = true;
+  conn_close(conn);
+}
+
+static void conn_stream_done_cb(http2_stream_t *stream) {
+  conn_t *conn = stream->link.data;
+  conn->handle_flushed = true;
+  conn_close(conn);
+}
+
+static void conn_session_error_cb(http2_session_t *session) {
+  conn_close(session->link.data);
+}
+
+// Serves the connection with an HTTP/2 session instead of the HTTP/1.1 links
+static void conn_http2_start(conn_t *conn) {
+  http2_session_t *session =
+      http2_session_new(conn->worker->loop, &conn->worker->buffers);
+  session->link.data = conn;
+  session->stream_cb = conn_stream_cb;
+  session->reset_cb = conn_stream_reset_cb;
+  session->done_cb = conn_stream_done_cb;
+  session->error_cb = conn_session_error_cb;
+  conn->http2 = session;
+
+  uv_link_unchain((uv_link_t *)conn->ssl_link, &conn->http_link);
+  uv_link_unchain(&conn->http_link, &conn->observer);
+  CHECK(uv_link_chain((uv_link_t *)conn->ssl_link, &session->link));
+}
+
+// Offers h2 for proxies which enable it, runs after ssl_servername_cb. It may
+// run on the thread pool, the session is started by ssl_info_cb.
+static int ssl_alpn_cb(SSL *s, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+  conn_t *conn = SSL_get_app_data(s);
+  proxy_config_t *proxy_config = conn->sni_config;
+  bool http2 = proxy_config && proxy_config->http2 &&
+               proxy_config->ssl_context && !conn->passthrough_pending;
+  const char *protos = http2 ? "\x02h2\x08http/1.1" : "\x08http/1.1";
+  if (SSL_select_next_proto((unsigned char **)out, outlen,
+                            (const unsigned char *)protos, strlen(protos), in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  conn->http2_selected = *outlen == 2 && memcmp(*out, "h2", 2) == 0;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+// Runs once the certificate of a full handshake is picked. Passthrough
+// connections stop there, nothing is signed for a ClientHello which is
+// replayed upstream. Others are suspended once, so uv_ssl_t continues them
+// on the thread pool.
+static int ssl_cert_cb(SSL *s, void *arg) {
+  conn_t *conn = SSL_get_app_data(s);
+  if (conn->passthrough_pending) {
+    return -1;
+  }
+  if (!conn->server_config->ssl_offload || conn->handshake_offloaded) {
+    return 1;
+  }
+  conn->handshake_offloaded = true;
+  return -1;
+}
+
+void conn_init(worker_t *worker, uv_stream_t *handle) {
+  int err = 0;
+  bool ssl_conn = false;
+
+  conn_t *conn = conn_new(worker, handle, worker->config);
+  METRICS_ADD(conn->http_link_context.metrics->connections, 1);
+  CHECK(uv_link_source_init(&conn->source, (uv_stream_t *)conn->handle));
+  conn->source.data = conn;
 
   // Get remote address
   struct sockaddr_storage addr = {0};
@@ -173,7 +773,7 @@ void conn_init(uv_stream_t *handle) {
                 conn->http_link_context.peer_ip,
                 sizeof(conn->http_link_context.peer_ip));
   }
-  // Get local port
+  // Get local port, listeners keep the ports they were started with
   alen = sizeof addr;
   uv_tcp_getsockname((uv_tcp_t *)conn->handle, (struct sockaddr *)&addr, &alen);
   if (addr.ss_family == AF_INET) {
@@ -187,11 +787,13 @@ void conn_init(uv_stream_t *handle) {
   conn->http_link_context.https = ssl_conn;
 
   if (ssl_conn) {
-    CHECK_ALLOC(conn->ssl = SSL_new(default_ctx));
-    SSL_CTX_set_tlsext_servername_callback(default_ctx, ssl_servername_cb);
+    CHECK_ALLOC(conn->ssl = SSL_new(worker->default_ctx));
+    SSL_set_app_data(conn->ssl, conn);
+    SSL_set_info_callback(conn->ssl, ssl_info_cb);
+    SSL_set_msg_callback(conn->ssl, ssl_msg_cb);
     SSL_set_accept_state(conn->ssl);
     CHECK_ALLOC(conn->ssl_link =
-                    uv_ssl_create(uv_default_loop(), conn->ssl, &err));
+                    uv_ssl_create(worker->loop, conn->ssl, &err));
     CHECK(err);
     ((uv_link_t *)conn->ssl_link)->data = conn;
     CHECK(
@@ -203,83 +805,150 @@ void conn_init(uv_stream_t *handle) {
   CHECK(uv_link_chain((uv_link_t *)&conn->http_link,
                       (uv_link_t *)&conn->observer));
 
-  conn->observer.data = conn;
   CHECK(uv_link_read_start((uv_link_t *)&conn->observer));
 }
 
 void conn_close(conn_t *conn) {
+  timer_wheel_stop(&conn->worker->timeouts, &conn->timeout);
+  timer_wheel_stop(&conn->worker->timeouts, &conn->request_timeout);
+  // Writes completing while the handles close don't arm it again
+  conn->wait = WAIT_NONE;
   if (conn->proxy_handle) {
     if (!uv_is_closing((uv_handle_t *)conn->proxy_handle)) {
       uv_close((uv_handle_t *)conn->proxy_handle, proxy_close_cb);
     }
   }
   if (conn->handle) {
-    if (!uv_is_closing((uv_handle_t *)conn->handle)) {
+    if (!conn_client_closing(conn)) {
       if (!conn->handle_flushed) {
-        uv_link_shutdown((uv_link_t *)&conn->observer,
+        uv_link_shutdown(conn_client_link(conn),
                          observer_connection_link_shutdown_cb, NULL);
       } else {
-        uv_link_close((uv_link_t *)&conn->observer,
-                      client_connection_link_close_cb);
+        conn->handle_closing = true;
+        uv_link_close(conn_client_link(conn), client_connection_link_close_cb);
+        conn->handle_closing = false;
       }
     }
   }
   if (!conn->handle && !conn->proxy_handle) {
     QUEUE *q;
+    if (conn->ktls_pending) {
+      QUEUE_REMOVE(&conn->ktls_member);
+    }
     QUEUE_FOREACH(q, &conn->raw_requests) {
       buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
-      free(bq->buf.base);
+      buf_free(bq->buf.base);
     }
     free_raw_requests_queue(conn);
+    conn_drop_retry(conn);
+    buf_pool_cancel_wait(&conn->buffers_waiter);
+    if (conn->stream) {
+      http2_stream_free(conn->stream);
+    } else {
+      METRICS_ADD(conn->http_link_context.metrics->connections, -1);
+    }
+    if (conn->http2) {
+      http2_session_free(conn->http2);
+    }
+    config_release(conn->server_config);
     free(conn);
   }
 }
 
 void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-  *buf = uv_buf_init((char *)malloc(suggested_size), suggested_size);
+  worker_t *worker = handle->loop->data;
+  *buf = uv_buf_init(buf_pool_alloc(&worker->buffers, suggested_size),
+                     suggested_size);
 }
 
-void write_buf(uv_stream_t *handle, char *data, int len) {
-  if (len == 0) {
-    return;
-  }
-  write_req_t *wr;
-  wr = (write_req_t *)malloc(sizeof *wr);
-  char *d = malloc(len);
-  memcpy(d, data, len);
-  wr->buf = uv_buf_init((char *)d, len);
+// Moves all queued request data to a single writev to the upstream. Buffers
+// are released once written.
+void write_raw_requests(conn_t *conn) {
+  uv_stream_t *handle = (uv_stream_t *)conn->proxy_handle;
+  unsigned int nbufs = 0;
+  QUEUE *q;
+  QUEUE_FOREACH(q, &conn->raw_requests) { nbufs++; }
+
+  write_req_t *wr = buf_pool_alloc(&conn->worker->buffers,
+                                   sizeof *wr + nbufs * sizeof(uv_buf_t));
   wr->req.data = wr;
-  if (uv_is_writable((const uv_stream_t *)handle) &&
-      !uv_is_closing((const uv_handle_t *)handle) &&
-      uv_write(&wr->req, handle, &wr->buf, 1, write_cb)) {
-    log_error("could not write to destination!");
+  wr->nbufs = 0;
+  QUEUE_FOREACH(q, &conn->raw_requests) {
+    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
+    wr->bufs[wr->nbufs++] = bq->buf;
+  }
+  free_raw_requests_queue(conn);
+  wr->req.handle = handle;
+
+  if (nbufs == 0 || !uv_is_writable(handle) ||
+      uv_is_closing((uv_handle_t *)handle)) {
+    write_cb(&wr->req, 0);
     return;
   }
+  int err = uv_write(&wr->req, handle, wr->bufs, nbufs, write_cb);
+  if (err) {
+    write_cb(&wr->req, err);
+  }
 }
 
 void write_cb(uv_write_t *req, int status) {
+  write_req_t *wr = (write_req_t *)req->data;
   if (status < 0) {
     log_error("error writing to destination!");
-    return;
   }
-  write_req_t *wr = (write_req_t *)req->data;
-  free(wr->buf.base);
-  free(wr);
+  for (unsigned int i = 0; i < wr->nbufs; i++) {
+    buf_free(wr->bufs[i].base);
+  }
+  buf_free(wr);
+  // Upstream connections are detached from their client connection once
+  // released
+  conn_t *conn = req->handle->data;
+  if (status == 0 && conn) {
+    conn_written(conn);
+    conn_splice(conn);
+  }
+}
+
+// Upstream connection is not used for the connection's requests anymore
+static void conn_release_target(conn_t *conn) {
+  if (conn->target >= 0) {
+    conn->config->balancer.outstanding[conn->target]--;
+    conn->target = -1;
+  }
 }
 
 void proxy_close_cb(uv_handle_t *peer) {
   conn_t *conn = peer->data;
   conn->proxy_handle = NULL;
+  conn_release_target(conn);
+  conn_drop_retry(conn);
   free(peer);
 
   free_raw_requests_queue(conn);
   conn_close(conn);
 }
 
+// Sends the request kept by conn_keep_retry() again on a new upstream
+// connection, the reused one was closed before it answered
+static void proxy_retry(conn_t *conn) {
+  log_debug("upstream connection closed before response, retrying request");
+  buf_queue_t *bq = buf_pool_alloc(&conn->worker->buffers, sizeof *bq);
+  bq->buf = conn->retry_buf;
+  conn->retry_buf = uv_buf_init(NULL, 0);
+  QUEUE_INIT(&bq->member);
+  QUEUE_INSERT_HEAD(&conn->raw_requests, &bq->member);
+  conn->retried = true;
+  proxy_release(conn, false);
+  proxy_http_request(conn);
+}
+
 void proxy_read_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
   conn_t *conn = (conn_t *)handle->data;
 
   if (nread > 0) {
+    // Response started, the request is not sent again
+    conn_drop_retry(conn);
+    METRICS_ADD(conn->http_link_context.metrics->bytes_out, nread);
     // Set keep alive for websockets
     if (conn->http_link_context.type == TYPE_WEBSOCKET &&
         conn->http_link_context.initial_reply) {
@@ -290,19 +959,169 @@ void proxy_read_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
     uv_buf_t tmp_buf = uv_buf_init(buf->base, nread);
     int err = uv_link_write((uv_link_t *)&conn->observer, &tmp_buf, 1, NULL,
                             write_link_cb, buf->base);
+    if (!err && !conn->target_reported && conn->target >= 0 &&
+        conn->http_link_context.response.headers_received) {
+      conn->target_reported = true;
+      health_report(
+          conn->config, conn->target,
+          conn->http_link_context.response.parser.status_code < 500,
+          uv_now(conn->worker->loop));
+    }
+    http_link_context_t *context = &conn->http_link_context;
+    if (context->type == TYPE_WEBSOCKET && context->response.headers_received) {
+      conn_wait(conn, WAIT_NONE);
+    } else if (context->type == TYPE_REQUEST && context->response.complete &&
+               context->pending_responses == 0) {
+      conn_wait(conn, WAIT_CLIENT_IDLE);
+    } else if (conn->wait != WAIT_NONE) {
+      conn_wait(conn, WAIT_UPSTREAM_IDLE);
+    }
     if (err) {
       log_error("error writing to client: %s", uv_err_name(err));
       conn_close(conn);
+    } else if (!http_gzip_idle(&conn->http_link_context)) {
+      if (proxy_reusable(conn)) {
+        proxy_release(conn, true);
+      }
+      conn_gzip_wait(conn);
+    } else if (proxy_reusable(conn)) {
+      proxy_release(conn, true);
+    } else if (buf_pool_full(&conn->worker->buffers) && !conn->proxy_paused) {
+      conn->proxy_paused = true;
+      uv_read_stop((uv_stream_t *)conn->proxy_handle);
+      buf_pool_wait(&conn->worker->buffers, &conn->buffers_waiter);
+    } else {
+      conn_check_congestion(conn);
     }
+    if (!err) {
+      conn->proxy_idle = conn->proxy_handle && proxy_finished(conn);
+      conn_next_request(conn);
+    }
+  } else if (nread < 0 && conn->retry_buf.base) {
+    proxy_retry(conn);
+  } else if (nread < 0 && conn->proxy_idle) {
+    // Server closed a connection kept for the next request
+    proxy_release(conn, false);
   } else if (nread < 0) {
     if (nread != UV_EOF) {
       log_error("could not read from socket! (%s)", uv_strerror(nread));
+    } else if (conn->http_link_context.response.enable_compression &&
+               !conn->http_link_context.response.complete) {
+      // Body ended with the connection, let the compressor finish it
+      uv_buf_t tmp_buf = uv_buf_init(NULL, 0);
+      uv_link_write((uv_link_t *)&conn->observer, &tmp_buf, 1, NULL,
+                    write_link_cb, NULL);
+    }
+    if (nread == UV_EOF && !http_gzip_idle(&conn->http_link_context)) {
+      // Close once the last frames were written
+      conn->gzip_closing = true;
+      conn_gzip_wait(conn);
+    } else {
+      conn_close(conn);
     }
-    conn_close(conn);
   }
   if (nread <= 0) {
-    free(buf->base);
+    buf_free(buf->base);
+  }
+}
+
+// Whole response has been forwarded and both sides agreed on keep-alive, so
+// the upstream connection can serve another request
+static bool proxy_finished(conn_t *conn) {
+  http_link_context_t *context = &conn->http_link_context;
+  return context->type == TYPE_REQUEST && context->request.complete &&
+         context->request.keepalive && context->response.complete &&
+         context->response.keepalive && context->pending_responses == 0;
+}
+
+// Finished upstream connection goes back to the pool. Pools of a replaced
+// configuration are not used anymore.
+static bool proxy_reusable(conn_t *conn) {
+  return conn->server_config == conn->worker->config &&
+         !conn->worker->draining &&
+         conn->config->keepalive_max_idle > 0 && proxy_finished(conn);
+}
+
+// Detaches the upstream connection from the client connection, it is pooled
+// when reuse is set and closed otherwise
+void proxy_release(conn_t *conn, bool reuse) {
+  upstream_t *upstream = (upstream_t *)conn->proxy_handle;
+  conn->proxy_handle = NULL;
+  conn->proxy_idle = false;
+  conn_release_target(conn);
+  conn_drop_retry(conn);
+  if (reuse) {
+    upstream_pool_put(upstream);
+  } else {
+    upstream->handle.data = NULL;
+    upstream_close(upstream);
+  }
+  // The next upstream starts uncongested
+  conn->client_congested = false;
+  if (conn->proxy_congested) {
+    conn->proxy_congested = false;
+    if (!conn->client_paused) {
+      uv_link_read_start(&conn->observer);
+    }
+  }
+}
+
+static void proxy_send_requests(conn_t *conn) {
+  uv_read_start((uv_stream_t *)conn->proxy_handle, alloc_cb, proxy_read_cb);
+  write_raw_requests(conn);
+  conn_splice(conn);
+}
+
+// Hands connections which only shuttle opaque bytes (ssl passthrough,
+// upgraded websockets) over to a splice tunnel, once nothing they read is
+// still waiting in userspace.
+static void conn_splice(conn_t *conn) {
+  http_link_context_t *context = &conn->http_link_context;
+  if (!conn->server_config->splice || conn->splice_failed || !conn->config ||
+      !conn->handle || !conn->proxy_handle) {
+    return;
+  }
+  bool passthrough = context->https && conn->config->ssl_passthrough;
+  // Sockets carry plain bytes unless uv_ssl_t encrypts them
+  bool websocket = (!context->https || conn->ktls) &&
+                   context->type == TYPE_WEBSOCKET &&
+                   context->response.headers_send &&
+                   context->response.parser.status_code == 101;
+  if (!passthrough && !websocket) {
+    return;
+  }
+  if (uv_is_closing((uv_handle_t *)conn->handle) ||
+      uv_is_closing((uv_handle_t *)conn->proxy_handle) ||
+      !QUEUE_EMPTY(&conn->raw_requests) ||
+      uv_stream_get_write_queue_size(conn->handle) > 0 ||
+      uv_stream_get_write_queue_size((uv_stream_t *)conn->proxy_handle) > 0) {
+    return;
+  }
+
+  uv_os_fd_t client_fd = -1;
+  uv_os_fd_t upstream_fd = -1;
+  if (!uv_fileno((uv_handle_t *)conn->handle, &client_fd)) {
+    client_fd = dup(client_fd);
+  }
+  if (!uv_fileno((uv_handle_t *)conn->proxy_handle, &upstream_fd)) {
+    upstream_fd = dup(upstream_fd);
   }
+  if (client_fd < 0 || upstream_fd < 0 ||
+      tunnel_start(conn->worker->loop, client_fd, upstream_fd)) {
+    // Keep forwarding through the event loop
+    if (client_fd >= 0) {
+      close(client_fd);
+    }
+    if (upstream_fd >= 0) {
+      close(upstream_fd);
+    }
+    conn->splice_failed = true;
+    return;
+  }
+
+  // Sockets belong to the tunnel now, close handles without shutting down
+  conn->handle_flushed = true;
+  conn_close(conn);
 }
 
 void proxy_connect_cb(uv_connect_t *req, int status) {
@@ -310,52 +1129,95 @@ void proxy_connect_cb(uv_connect_t *req, int status) {
   QUEUE *q;
   free(req);
 
+  if (status == UV_ECANCELED) {
+    // Connection is closing
+    return;
+  }
   if (status < 0) {
+    health_report(conn->config, conn->target, false,
+                  uv_now(conn->worker->loop));
     QUEUE_FOREACH(q, &conn->raw_requests) {
       buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
-      free(bq->buf.base);
+      buf_free(bq->buf.base);
     }
     free_raw_requests_queue(conn);
     if (conn->config->ssl_passthrough) {
       conn_close(conn);
     } else {
-      char *resp =
-          malloc(strlen(server->config->templates->status_502_template) *
-                 sizeof(char));
-      strcpy(resp, server->config->templates->status_502_template);
-      uv_buf_t tmp_buf = uv_buf_init(resp, strlen(resp));
-      uv_link_write((uv_link_t *)&conn->observer, &tmp_buf, 1, NULL,
-                    write_link_cb, resp);
+      const char *resp = conn->server_config->templates->status_502_template;
+      conn_respond(conn, resp, strlen(resp), 502);
     }
     return;
   }
 
-  uv_read_start((uv_stream_t *)conn->proxy_handle, alloc_cb, proxy_read_cb);
-  QUEUE_FOREACH(q, &conn->raw_requests) {
-    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
-    write_buf((uv_stream_t *)conn->proxy_handle, bq->buf.base, bq->buf.len);
-    free(bq->buf.base);
+  metrics_observe(&conn->http_link_context.metrics->upstream_connect,
+                  (uv_hrtime() - conn->connect_start) / 1000);
+
+  conn_wait(conn, conn->config->ssl_passthrough ? WAIT_NONE
+                                                : WAIT_UPSTREAM_HEADER);
+  proxy_send_requests(conn);
+}
+
+// Key of consistent hashing, the configured header or the client address
+static const char *conn_balance_key(conn_t *conn) {
+  balancer_t *balancer = &conn->config->balancer;
+  http_link_context_t *context = &conn->http_link_context;
+  if (balancer->policy != BALANCE_HASH) {
+    return NULL;
   }
-  free_raw_requests_queue(conn);
+  const char *value =
+      balancer->hash_header
+          ? http_header_find(&context->request.headers, balancer->hash_header)
+          : NULL;
+  return value ? value : context->peer_ip;
 }
 
-void proxy_http_request(char *ip, unsigned short port, conn_t *conn) {
-  struct sockaddr_in dest;
-  uv_ip4_addr(ip, port, &dest);
-  conn->proxy_handle = malloc(sizeof *conn->proxy_handle);
-  memset(conn->proxy_handle, 0, sizeof *conn->proxy_handle);
+void proxy_http_request(conn_t *conn) {
+  balancer_t *balancer = &conn->config->balancer;
+  int index = balancer_pick(balancer, conn_balance_key(conn),
+                            uv_now(conn->worker->loop));
+  if (index < 0) {
+    const char *resp = conn->server_config->templates->status_502_template;
+    conn_respond(conn, resp, strlen(resp), 502);
+    return;
+  }
+  upstream_target_t *target = &balancer->targets[index];
+  conn->target = index;
+  conn->target_reported = false;
+  balancer->outstanding[index]++;
+  if (!conn->retried) {
+    conn_request_start(conn);
+  }
+
+  // A retried request goes over a new connection
+  upstream_t *upstream = conn->retried ? NULL : upstream_pool_get(target);
+  if (upstream) {
+    upstream->num_requests++;
+    conn->proxy_handle = &upstream->handle;
+    conn->proxy_handle->data = conn;
+    conn_wait(conn, WAIT_UPSTREAM_HEADER);
+    conn_keep_retry(conn);
+    proxy_send_requests(conn);
+    return;
+  }
+
+  upstream = upstream_new(conn->worker->loop, conn->config, target);
+  upstream->num_requests++;
+  conn->proxy_handle = &upstream->handle;
   conn->proxy_handle->data = conn;
 
-  uv_tcp_init(server->loop, conn->proxy_handle);
   uv_tcp_keepalive(conn->proxy_handle, 1, 60);
 
   uv_connect_t *connect_req = malloc(sizeof *connect_req);
   memset(connect_req, 0, sizeof *connect_req);
+  conn->connect_start = uv_hrtime();
+  conn_wait(conn, WAIT_UPSTREAM_CONNECT);
   uv_tcp_connect(connect_req, conn->proxy_handle,
-                 (const struct sockaddr *)&dest, proxy_connect_cb);
+                 (const struct sockaddr *)&target->addr, proxy_connect_cb);
 }
 
 void connection_cb(uv_stream_t *s, int status) {
+  worker_t *worker = s->data;
   if (status < 0) {
     log_error("connection error: %s", uv_err_name(status));
     return;
@@ -364,7 +1226,7 @@ void connection_cb(uv_stream_t *s, int status) {
   uv_stream_t *conn;
   conn = malloc(sizeof(uv_tcp_t));
 
-  if (uv_tcp_init(server->loop, (uv_tcp_t *)conn)) {
+  if (uv_tcp_init(worker->loop, (uv_tcp_t *)conn)) {
     log_error("cannot init tcp connection!");
     return;
   }
@@ -374,15 +1236,25 @@ void connection_cb(uv_stream_t *s, int status) {
     return;
   }
 
-  conn_init(conn);
+  conn_init(worker, conn);
 }
 
+// Key of the fallback certificate, ECDSA P-256 takes a fraction of a
+// millisecond where RSA 2048 takes up to seconds on small boards
 EVP_PKEY *generatePrivateKey() {
-  EVP_PKEY *pkey = NULL;
-  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-  EVP_PKEY_keygen_init(pctx);
-  EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048);
-  EVP_PKEY_keygen(pctx, &pkey);
+  EC_KEY *key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (!key) {
+    return NULL;
+  }
+  // Certificate names the curve, clients don't take explicit parameters
+  EC_KEY_set_asn1_flag(key, OPENSSL_EC_NAMED_CURVE);
+  EVP_PKEY *pkey = EVP_PKEY_new();
+  if (!pkey || !EC_KEY_generate_key(key) ||
+      !EVP_PKEY_assign_EC_KEY(pkey, key)) {
+    EVP_PKEY_free(pkey);
+    EC_KEY_free(key);
+    return NULL;
+  }
   return pkey;
 }
 
@@ -411,83 +1283,461 @@ X509 *generateCertificate(EVP_PKEY *pkey) {
   return x509;
 }
 
-proxy_config_t *find_proxy_config(const char *hostname) {
-  for (int i = 0; i < server->config->num_proxies; i++) {
-    proxy_config_t *pconf = server->config->proxies[i];
-    for (int j = 0; j < pconf->num_hosts; j++) {
-      // Compare hostnames (taking into account asterisk)
-      char *conf_host = pconf->hosts[j];
-      boolean wildcard = conf_host[0] == '*';
-      if (wildcard) {
-        // Skip asterisk
-        conf_host++;
+proxy_config_t *find_proxy_config(config_t *config, const char *hostname) {
+  int index = router_lookup(config->router, hostname);
+  return index < 0 ? NULL : config->proxies[index];
+}
+
+int server_listen(worker_t *worker, unsigned short port, uv_tcp_t *tcp) {
+  struct sockaddr_in address;
+  uv_os_fd_t fd;
+  int on = 1;
+
+  // Socket of the previous process when upgrading, it already listens
+  uv_os_sock_t inherited = upgrade_take_listener(port);
+  if (inherited >= 0) {
+    if (uv_tcp_init(worker->loop, tcp) || uv_tcp_open(tcp, inherited)) {
+      log_error("cannot use listening socket of previous process!");
+      return 1;
+    }
+    tcp->data = worker;
+  } else {
+    if (uv_tcp_init_ex(worker->loop, tcp, AF_INET)) {
+      log_error("cannot init tcp connection!");
+      return 1;
+    }
+    tcp->data = worker;
+    // Let every worker bind its own listener, the kernel spreads accepted
+    // connections between them.
+    if (server->num_workers > 1) {
+      if (uv_fileno((uv_handle_t *)tcp, &fd) ||
+          setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on)) {
+        log_error("cannot set SO_REUSEPORT on listening socket!");
+        return 1;
       }
+    }
+    uv_ip4_addr("0.0.0.0", port, &address);
+    if (uv_tcp_bind(tcp, (const struct sockaddr *)&address, 0)) {
+      log_error(
+          "cannot bind server! check your permissions and another service "
+          "running on same port.");
+      return 1;
+    }
+  }
+  if (uv_listen((uv_stream_t *)tcp, 4096, connection_cb)) {
+    log_error("server listen error!");
+    return 1;
+  }
+  if (worker->id == 0) {
+    log_info("listening on 0.0.0.0:%d", port);
+  }
+  return 0;
+}
+
+// Logs cache counters when they changed
+static void cache_timer_cb(uv_timer_t *timer) {
+  cache_stats_t stats;
+  cache_get_stats(server->cache, &stats);
+  if (stats.hits == server->cache_stats.hits &&
+      stats.revalidated == server->cache_stats.revalidated &&
+      stats.misses == server->cache_stats.misses) {
+    return;
+  }
+  server->cache_stats = stats;
+  log_info("cache: %llu hits, %llu revalidated, %llu misses, %zu entries "
+           "(%zu KB), %llu evictions",
+           (unsigned long long)stats.hits,
+           (unsigned long long)stats.revalidated,
+           (unsigned long long)stats.misses, stats.entries,
+           stats.memory / 1024, (unsigned long long)stats.evictions);
+}
 
-      ssize_t conf_i = strlen(conf_host) - 1;
-      ssize_t i = strlen(hostname) - 1;
+// Rotates ticket keys and logs handshake counters when they changed
+static void ssl_timer_cb(uv_timer_t *timer) {
+  ssl_sessions_rotate(server->ssl_sessions);
 
-      while ((i >= 0 && conf_i >= 0) && hostname[i] == conf_host[conf_i]) {
-        --i;
-        --conf_i;
+  uint64_t full = 0;
+  uint64_t resumed = 0;
+  for (int i = 0; i < server->num_workers; i++) {
+    full += METRICS_READ(server->workers[i].ssl_full_handshakes);
+    resumed += METRICS_READ(server->workers[i].ssl_resumed_handshakes);
+  }
+  if (full == server->ssl_full_handshakes &&
+      resumed == server->ssl_resumed_handshakes) {
+    return;
+  }
+  server->ssl_full_handshakes = full;
+  server->ssl_resumed_handshakes = resumed;
+  log_info("ssl: %llu full handshakes, %llu resumed",
+           (unsigned long long)full, (unsigned long long)resumed);
+}
+
+// Sums the counters of all workers per host
+static void metrics_scrape(arena_t *out) {
+  int num_hosts = 0;
+  int max_hosts = 16;
+  metrics_t *metrics = calloc(max_hosts, sizeof(metrics_t));
+  const char **hosts = malloc(max_hosts * sizeof(char *));
+  for (int i = 0; i < server->num_workers; i++) {
+    metrics_host_t *node =
+        __atomic_load_n(&server->workers[i].metrics, __ATOMIC_ACQUIRE);
+    for (; node; node = node->next) {
+      int j = 0;
+      while (j < num_hosts && strcmp(hosts[j], node->host) != 0) {
+        j++;
       }
-      if (conf_i < 0) {
-        // If wildcard, requested hostname may be longer
-        if (wildcard || i < 0) {
-          return pconf;
+      if (j == num_hosts) {
+        if (num_hosts == max_hosts) {
+          max_hosts *= 2;
+          metrics = realloc(metrics, max_hosts * sizeof(metrics_t));
+          hosts = realloc(hosts, max_hosts * sizeof(char *));
         }
+        memset(&metrics[j], 0, sizeof(metrics_t));
+        hosts[j] = node->host;
+        num_hosts++;
       }
+      metrics_merge(&metrics[j], &node->metrics);
+    }
+  }
+  metrics_print(out, hosts, metrics, num_hosts);
+  if (server->cache) {
+    cache_stats_t stats;
+    cache_get_stats(server->cache, &stats);
+    metrics_print_cache(out, &stats);
+  }
+  free(hosts);
+  free(metrics);
+}
+
+// Log file was rotated
+static void log_signal_cb(uv_signal_t *handle, int signum) { log_reopen(); }
+
+static void reload_signal_cb(uv_signal_t *handle, int signum) {
+  server_reload();
+}
+
+static void upgrade_signal_cb(uv_signal_t *handle, int signum) {
+  server_upgrade();
+}
+
+static void drain_timer_cb(uv_timer_t *timer) { uv_stop(server->loop); }
+
+// Counters and session cache are set up for a configuration before the
+// worker uses it
+static void worker_prepare_config(worker_t *worker, config_t *config) {
+  for (int i = 0; i < config->num_proxies; i++) {
+    proxy_config_t *proxy_config = config->proxies[i];
+    proxy_config->metrics = metrics_get(
+        &worker->metrics,
+        proxy_config->num_hosts > 0 ? proxy_config->hosts[0] : "");
+    if (proxy_config->ssl_context && server->ssl_sessions) {
+      ssl_sessions_setup(server->ssl_sessions, proxy_config->ssl_context);
+    }
+    if (proxy_config->ssl_context) {
+      SSL_CTX_set_alpn_select_cb(proxy_config->ssl_context, ssl_alpn_cb, NULL);
+      SSL_CTX_set_cert_cb(proxy_config->ssl_context, ssl_cert_cb, NULL);
     }
   }
+}
 
-  return NULL;
+// New connections use the reloaded configuration, the old one is freed
+// once connections accepted before are closed
+static void worker_reload_cb(uv_async_t *handle) {
+  worker_t *worker = handle->data;
+  config_t *config =
+      __atomic_exchange_n(&worker->pending_config, NULL, __ATOMIC_ACQ_REL);
+  if (!config) {
+    return;
+  }
+  worker_prepare_config(worker, config);
+  config_t *old = worker->config;
+  worker->config = config;
+  for (int i = 0; i < old->num_proxies; i++) {
+    upstream_pool_close(old->proxies[i]);
+  }
+  config_release(old);
+  if (worker->id == 0) {
+    log_info("configuration reloaded");
+  }
 }
 
-int server_listen(unsigned short port, uv_tcp_t *tcp) {
-  if (uv_tcp_init(server->loop, tcp)) {
-    log_error("cannot init tcp connection!");
-    return 1;
+// A new process accepts connections now, the loop ends once the open ones
+// are closed
+static void worker_drain_cb(uv_async_t *handle) {
+  worker_t *worker = handle->data;
+  worker->draining = true;
+  uv_close((uv_handle_t *)&worker->tcp, NULL);
+  if (server->config->secure_port > 0) {
+    uv_close((uv_handle_t *)&worker->secure_tcp, NULL);
   }
-  uv_ip4_addr("0.0.0.0", port, &server->address);
-  if (uv_tcp_bind(tcp, (const struct sockaddr *)&server->address, 0)) {
-    log_error(
-        "cannot bind server! check your permissions and another service "
-        "running on same port.");
-    return 1;
+  uv_close((uv_handle_t *)&worker->keepalive_timer, NULL);
+  for (int i = 0; i < worker->config->num_proxies; i++) {
+    upstream_pool_close(worker->config->proxies[i]);
   }
-  if (uv_listen((uv_stream_t *)tcp, 4096, connection_cb)) {
-    log_error("server listen error!");
+}
+
+static void keepalive_timer_cb(uv_timer_t *timer) {
+  worker_t *worker = timer->data;
+  uint64_t now = uv_now(worker->loop);
+  for (int i = 0; i < worker->config->num_proxies; i++) {
+    upstream_pool_sweep(worker->config->proxies[i], now);
+  }
+  health_check(worker->config, worker->loop, now);
+}
+
+int worker_init(worker_t *worker) {
+  config_t *config = worker->config;
+
+  buf_pool_init(&worker->buffers, worker->loop, config->buffers_max_memory,
+                config->buffers_hugepages);
+  timer_wheel_init(&worker->timeouts, worker->loop);
+  worker->unrouted = metrics_get(&worker->metrics, "");
+
+  if (server_listen(worker, config->port, &worker->tcp)) {
     return 1;
   }
-  log_info("listening on 0.0.0.0:%d", port);
+
+  worker_prepare_config(worker, config);
+  CHECK(uv_async_init(worker->loop, &worker->reload_async, worker_reload_cb));
+  worker->reload_async.data = worker;
+  uv_unref((uv_handle_t *)&worker->reload_async);
+  CHECK(uv_async_init(worker->loop, &worker->drain_async, worker_drain_cb));
+  worker->drain_async.data = worker;
+  uv_unref((uv_handle_t *)&worker->drain_async);
+
+  CHECK(uv_timer_init(worker->loop, &worker->keepalive_timer));
+  worker->keepalive_timer.data = worker;
+  CHECK(uv_timer_start(&worker->keepalive_timer, keepalive_timer_cb, 1000,
+                       1000));
+
+  if (config->secure_port > 0) {
+    // Initialize SSL_CTX
+    CHECK_ALLOC(worker->default_ctx = SSL_CTX_new(SSLv23_method()));
+    CHECK(uv_ssl_setup_recommended_secure_context(worker->default_ctx));
+
+    // Key material is generated once and shared by all workers
+    if (!server->default_pkey) {
+      CHECK_ALLOC(server->default_pkey = generatePrivateKey());
+      server->default_x509 = generateCertificate(server->default_pkey);
+    }
+
+    SSL_CTX_use_certificate(worker->default_ctx, server->default_x509);
+    SSL_CTX_use_PrivateKey(worker->default_ctx, server->default_pkey);
+
+    SSL_CTX_set_verify(worker->default_ctx, SSL_VERIFY_NONE, 0);
+    SSL_CTX_set_alpn_select_cb(worker->default_ctx, ssl_alpn_cb, NULL);
+    SSL_CTX_set_tlsext_servername_callback(worker->default_ctx,
+                                           ssl_servername_cb);
+    SSL_CTX_set_cert_cb(worker->default_ctx, ssl_cert_cb, NULL);
+
+    ssl_sessions_setup(server->ssl_sessions, worker->default_ctx);
+
+    QUEUE_INIT(&worker->ktls_conns);
+    CHECK(uv_check_init(worker->loop, &worker->ktls_check));
+    worker->ktls_check.data = worker;
+    uv_unref((uv_handle_t *)&worker->ktls_check);
+
+    if (server_listen(worker, config->secure_port, &worker->secure_tcp)) {
+      return 1;
+    }
+  }
+
   return 0;
 }
 
+void worker_run(void *arg) {
+  worker_t *worker = arg;
+  uv_run(worker->loop, UV_RUN_DEFAULT);
+  __atomic_store_n(&worker->drained, true, __ATOMIC_RELEASE);
+}
+
 int server_init() {
   server->loop = uv_default_loop();
-
-  server_listen(server->config->port, &server->tcp);
+  server->num_workers = server->config->workers;
+  server->workers = calloc(server->num_workers, sizeof(worker_t));
+
+  CHECK(uv_signal_init(server->loop, &server->log_signal));
+  CHECK(uv_signal_start(&server->log_signal, log_signal_cb, SIGUSR1));
+  uv_unref((uv_handle_t *)&server->log_signal);
+  CHECK(uv_signal_init(server->loop, &server->reload_signal));
+  CHECK(uv_signal_start(&server->reload_signal, reload_signal_cb, SIGHUP));
+  uv_unref((uv_handle_t *)&server->reload_signal);
+  CHECK(uv_signal_init(server->loop, &server->upgrade_signal));
+  CHECK(uv_signal_start(&server->upgrade_signal, upgrade_signal_cb, SIGUSR2));
+  uv_unref((uv_handle_t *)&server->upgrade_signal);
+
+  if (server->config->cache_max_memory > 0) {
+    server->cache = cache_new(server->config->cache_max_memory,
+                              server->config->cache_max_entry_size);
+    CHECK(uv_timer_init(server->loop, &server->cache_timer));
+    CHECK(uv_timer_start(&server->cache_timer, cache_timer_cb, 60000, 60000));
+    uv_unref((uv_handle_t *)&server->cache_timer);
+  }
 
   if (server->config->secure_port > 0) {
-    // Initialize SSL_CTX
-    CHECK_ALLOC(default_ctx = SSL_CTX_new(SSLv23_method()));
-    CHECK(uv_ssl_setup_recommended_secure_context(default_ctx));
+    config_t *config = server->config;
+    server->ssl_sessions = ssl_sessions_new(
+        config->ssl_session_cache_size, config->ssl_session_timeout,
+        config->ssl_session_tickets, config->ssl_ticket_key_file);
+    CHECK(uv_timer_init(server->loop, &server->ssl_timer));
+    CHECK(uv_timer_start(&server->ssl_timer, ssl_timer_cb, 60000, 60000));
+    uv_unref((uv_handle_t *)&server->ssl_timer);
+
+    server->ktls = ktls_supported();
+    if (config->ktls && !server->ktls) {
+      log_warn("kernel TLS is not available, TLS stays in userspace");
+    }
+  }
+
+  for (int i = 0; i < server->num_workers; i++) {
+    worker_t *worker = &server->workers[i];
+    worker->id = i;
+    if (i == 0) {
+      // First worker runs on the main thread and reuses the parsed config,
+      // the server keeps a reference to compare reloads with
+      worker->loop = server->loop;
+      worker->config = server->config;
+      worker->config->refs++;
+    } else {
+      worker->loop = malloc(sizeof *worker->loop);
+      CHECK(uv_loop_init(worker->loop));
+      // Errors were already reported while parsing the first copy
+      worker->config = malloc(sizeof(config_t));
+      if (parse_config(server->config_json, worker->config, true)) {
+        return 1;
+      }
+    }
+    worker->loop->data = worker;
+    if (worker_init(worker)) {
+      return 1;
+    }
+  }
 
-    EVP_PKEY *pkey = generatePrivateKey();
-    X509 *x509 = generateCertificate(pkey);
+  if (server->config->metrics_port > 0 &&
+      metrics_listen(&server->metrics_server, server->loop,
+                     server->config->metrics_address,
+                     server->config->metrics_port,
+                     upgrade_take_listener(server->config->metrics_port),
+                     metrics_scrape)) {
+    return 1;
+  }
+  // Everything listens, the previous process may stop accepting
+  upgrade_ready();
 
-    SSL_CTX_use_certificate(default_ctx, x509);
-    SSL_CTX_use_PrivateKey(default_ctx, pkey);
+  for (int i = 1; i < server->num_workers; i++) {
+    worker_t *worker = &server->workers[i];
+    CHECK(uv_thread_create(&worker->thread, worker_run, worker));
+  }
+  if (server->num_workers > 1) {
+    log_info("started %d workers", server->num_workers);
+  }
 
-    RSA *rsa = RSA_generate_key(2048, RSA_F4, NULL, NULL);
-    SSL_CTX_set_tmp_rsa(default_ctx, rsa);
-    RSA_free(rsa);
+  return 0;
+}
 
-    SSL_CTX_set_verify(default_ctx, SSL_VERIFY_NONE, 0);
+// Parses the configuration file again, one copy per worker. Nothing changes
+// unless every copy is usable.
+void server_reload() {
+  char *json = read_file(server->config_file);
+  if (!json) {
+    log_error("configuration not reloaded");
+    return;
+  }
+  config_t **configs = calloc(server->num_workers, sizeof(config_t *));
+  int err = 0;
+  for (int i = 0; i < server->num_workers && !err; i++) {
+    configs[i] = malloc(sizeof(config_t));
+    // Errors were already reported while parsing the first copy
+    err = parse_config(json, configs[i], i > 0);
+  }
+  free(json);
+  if (err) {
+    for (int i = 0; i < server->num_workers && configs[i]; i++) {
+      config_free(configs[i]);
+    }
+    free(configs);
+    log_error("configuration not reloaded");
+    return;
+  }
 
-    server_listen(server->config->secure_port, &server->secure_tcp);
+  config_check_reload(server->config, configs[0]);
+  for (int i = 0; i < server->num_workers; i++) {
+    worker_t *worker = &server->workers[i];
+    config_t *old = __atomic_exchange_n(&worker->pending_config, configs[i],
+                                        __ATOMIC_ACQ_REL);
+    if (old) {
+      // Replaced before the worker got to it, never used
+      config_free(old);
+    }
+    uv_async_send(&worker->reload_async);
   }
+  free(configs);
+}
 
-  return 0;
+static void server_upgrade_cb(upgrade_t *upgrade, int status) {
+  if (status) {
+    log_error("new process did not start, still serving connections");
+    return;
+  }
+  long timeout = server->workers[0].config->drain_timeout;
+  log_info("new process is serving, closing connections within %ld seconds",
+           timeout);
+  server->drain_deadline = uv_hrtime() + timeout * 1000000000ull;
+  CHECK(uv_timer_init(server->loop, &server->drain_timer));
+  CHECK(uv_timer_start(&server->drain_timer, drain_timer_cb, timeout * 1000,
+                       0));
+  uv_unref((uv_handle_t *)&server->drain_timer);
+  if (server->config->metrics_port > 0) {
+    uv_close((uv_handle_t *)&server->metrics_server.tcp, NULL);
+  }
+  for (int i = 0; i < server->num_workers; i++) {
+    uv_async_send(&server->workers[i].drain_async);
+  }
+}
+
+// Starts the binary again with the listening sockets of all workers. This
+// process drains its connections once the new one accepts.
+void server_upgrade() {
+  if (upgrade_busy(&server->upgrade)) {
+    log_warn("upgrade already in progress");
+    return;
+  }
+  uv_os_sock_t fds[UPGRADE_MAX_LISTENERS];
+  unsigned short ports[UPGRADE_MAX_LISTENERS];
+  int num = 0;
+  for (int i = 0; i < server->num_workers && num + 3 <= UPGRADE_MAX_LISTENERS;
+       i++) {
+    worker_t *worker = &server->workers[i];
+    if (!uv_fileno((uv_handle_t *)&worker->tcp, &fds[num])) {
+      ports[num++] = server->config->port;
+    }
+    if (server->config->secure_port > 0 &&
+        !uv_fileno((uv_handle_t *)&worker->secure_tcp, &fds[num])) {
+      ports[num++] = server->config->secure_port;
+    }
+  }
+  if (server->config->metrics_port > 0 &&
+      !uv_fileno((uv_handle_t *)&server->metrics_server.tcp, &fds[num])) {
+    ports[num++] = server->config->metrics_port;
+  }
+  upgrade_start(&server->upgrade, server->loop, server->argv, fds, ports, num,
+                server_upgrade_cb);
+}
+
+// Main loop ended after an upgrade, other workers get until the drain
+// deadline to close their connections
+void server_drain_wait() {
+  for (int i = 1; i < server->num_workers; i++) {
+    while (!__atomic_load_n(&server->workers[i].drained, __ATOMIC_ACQUIRE) &&
+           uv_hrtime() < server->drain_deadline) {
+      usleep(100000);
+    }
+  }
+  if (uv_hrtime() < server->drain_deadline) {
+    log_info("connections drained, exiting");
+  } else {
+    log_warn("drain_timeout reached, closing remaining connections");
+  }
 }
 
 void parse_args(int argc, char **argv) {
@@ -514,10 +1764,42 @@ void parse_args(int argc, char **argv) {
   if (!strcmp(server->config_file, "")) {
     usage();
   } else {
-    char *json = read_file(server->config_file);
-    parse_config(json, server->config);
-    free(json);
+    server->config_json = read_file(server->config_file);
+    if (!server->config_json ||
+        parse_config(server->config_json, server->config, false)) {
+      exit(1);
+    }
+  }
+
+  if (server->config->log_file && log_open(server->config->log_file)) {
+    log_error("cannot open file for writing: %s!", server->config->log_file);
+  }
+}
+
+// OpenSSL 1.0.x needs locking callbacks before it is used from more than one
+// thread.
+static uv_mutex_t *ssl_locks;
+
+static void ssl_locking_cb(int mode, int n, const char *file, int line) {
+  if (mode & CRYPTO_LOCK) {
+    uv_mutex_lock(&ssl_locks[n]);
+  } else {
+    uv_mutex_unlock(&ssl_locks[n]);
+  }
+}
+
+static void ssl_threadid_cb(CRYPTO_THREADID *id) {
+  CRYPTO_THREADID_set_numeric(id, (unsigned long)uv_thread_self());
+}
+
+static void ssl_threads_init(void) {
+  int num_locks = CRYPTO_num_locks();
+  ssl_locks = malloc(num_locks * sizeof(uv_mutex_t));
+  for (int i = 0; i < num_locks; i++) {
+    CHECK(uv_mutex_init(&ssl_locks[i]));
   }
+  CRYPTO_THREADID_set_callback(ssl_threadid_cb);
+  CRYPTO_set_locking_callback(ssl_locking_cb);
 }
 
 static void ignore_sigpipe(void) {
@@ -549,15 +1831,21 @@ int main(int argc, char **argv) {
   OpenSSL_add_all_digests();
   SSL_load_error_strings();
   ERR_load_crypto_strings();
+  ssl_threads_init();
 
   server = malloc(sizeof(server_t));
+  memset(server, 0, sizeof *server);
   server->config = malloc(sizeof(config_t));
+  server->argv = argv;
   parse_args(argc, argv);
+  log_start();
 
-  if (server_init()) {
+  if (upgrade_receive() || server_init()) {
     return 1;
   }
+  // Runs until the connections are drained after an upgrade
   uv_run(server->loop, UV_RUN_DEFAULT);
+  server_drain_wait();
   return 0;
 }
 
@@ -571,7 +1859,7 @@ uv_link_methods_t proxy_methods =
   .shutdown = uv_link_default_shutdown,
   .close = uv_link_default_close,
 
-  .alloc_cb_override = uv_link_default_alloc_cb_override,
+  .alloc_cb_override = observer_alloc_cb,
   .read_cb_override = client_connection_read_cb
 };
 // clang-format on
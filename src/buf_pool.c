@@ -0,0 +1,204 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "buf_pool.h"
+#include <sys/mman.h>
+#include "log.h"
+
+static size_t buf_class_size(int size_class) {
+  return (size_t)1 << (BUF_POOL_MIN_SHIFT + size_class * BUF_POOL_CLASS_SHIFT);
+}
+
+static int buf_size_class(size_t size) {
+  for (int i = 0; i < BUF_POOL_NUM_CLASSES; i++) {
+    if (size <= buf_class_size(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void *buf_map(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Maps size bytes (multiple of slab size) aligned to the slab size
+static buf_slab_t *buf_pool_map_slab(buf_pool_t *pool, size_t size) {
+  char *ptr = NULL;
+#ifdef MAP_HUGETLB
+  if (pool->hugepages) {
+    // Hugepage mappings are always aligned to the hugepage size
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      // No reserved hugepages (vm.nr_hugepages), don't try again
+      log_warn("hugepages not available, using regular pages for buffers");
+      pool->hugepages = false;
+      ptr = NULL;
+    }
+  }
+#endif
+  if (!ptr) {
+    // Over-allocate and trim to get an aligned mapping
+    ptr = buf_map(size + BUF_POOL_SLAB_SIZE);
+    if (!ptr) {
+      log_fatal("could not allocate buffer memory!");
+      abort();
+    }
+    size_t head = -(uintptr_t)ptr & (BUF_POOL_SLAB_SIZE - 1);
+    if (head > 0) {
+      munmap(ptr, head);
+    }
+    munmap(ptr + head + size, BUF_POOL_SLAB_SIZE - head);
+    ptr += head;
+  }
+
+  buf_slab_t *slab = (buf_slab_t *)ptr;
+  slab->pool = pool;
+  slab->size = size;
+  pool->num_slabs++;
+  return slab;
+}
+
+static buf_slab_t *buf_slab_of(void *ptr) {
+  return (buf_slab_t *)((uintptr_t)ptr & ~(uintptr_t)(BUF_POOL_SLAB_SIZE - 1));
+}
+
+static buf_header_t *buf_header_of(void *ptr) {
+  buf_slab_t *slab = buf_slab_of(ptr);
+  char *first = (char *)(slab + 1);
+  size_t index = ((char *)ptr - first) / slab->stride;
+  return (buf_header_t *)(first + index * slab->stride);
+}
+
+// Carves a new slab into blocks of given class and puts them on free list
+static void buf_pool_grow(buf_pool_t *pool, int size_class) {
+  buf_slab_t *slab = buf_pool_map_slab(pool, BUF_POOL_SLAB_SIZE);
+  slab->size_class = size_class;
+  slab->stride = sizeof(buf_header_t) + buf_class_size(size_class);
+
+  char *first = (char *)(slab + 1);
+  size_t count = (BUF_POOL_SLAB_SIZE - sizeof(buf_slab_t)) / slab->stride;
+  for (size_t i = count; i-- > 0;) {
+    buf_header_t *header = (buf_header_t *)&first[i * slab->stride];
+    header->next = pool->free_lists[size_class];
+    pool->free_lists[size_class] = header;
+  }
+}
+
+static void buf_pool_resume_cb(uv_idle_t *handle) {
+  buf_pool_t *pool = handle->data;
+  uv_idle_stop(handle);
+
+  // Waiters may free memory or wait again while being resumed
+  QUEUE waiters;
+  QUEUE_MOVE(&pool->waiters, &waiters);
+  while (!QUEUE_EMPTY(&waiters)) {
+    buf_waiter_t *waiter =
+        QUEUE_DATA(QUEUE_HEAD(&waiters), buf_waiter_t, member);
+    QUEUE_REMOVE(&waiter->member);
+    waiter->waiting = false;
+    waiter->cb(waiter);
+  }
+}
+
+void buf_pool_init(buf_pool_t *pool, uv_loop_t *loop, size_t max_memory,
+                   bool hugepages) {
+  memset(pool, 0, sizeof *pool);
+  pool->loop = loop;
+  pool->max_memory = max_memory;
+  pool->hugepages = hugepages;
+  QUEUE_INIT(&pool->waiters);
+  uv_idle_init(loop, &pool->resume_handle);
+  pool->resume_handle.data = pool;
+  uv_unref((uv_handle_t *)&pool->resume_handle);
+}
+
+void *buf_pool_alloc(buf_pool_t *pool, size_t size) {
+  buf_header_t *header;
+  int size_class = buf_size_class(size);
+
+  if (size_class < 0) {
+    // Large blocks get a slab of their own, returned to the system on free
+    size_t stride = sizeof(buf_header_t) + size;
+    size_t slab_size = (sizeof(buf_slab_t) + stride + BUF_POOL_SLAB_SIZE - 1) &
+                       ~(size_t)(BUF_POOL_SLAB_SIZE - 1);
+    buf_slab_t *slab = buf_pool_map_slab(pool, slab_size);
+    slab->size_class = -1;
+    slab->stride = stride;
+    header = (buf_header_t *)(slab + 1);
+  } else {
+    if (!pool->free_lists[size_class]) {
+      buf_pool_grow(pool, size_class);
+    }
+    header = pool->free_lists[size_class];
+    pool->free_lists[size_class] = header->next;
+  }
+
+  header->next = NULL;
+  header->attached = NULL;
+  header->refs = 1;
+  pool->in_use += buf_slab_of(header)->stride;
+  return header + 1;
+}
+
+void buf_ref(void *ptr) { buf_header_of(ptr)->refs++; }
+
+void buf_attach(void *ptr, void *other) {
+  buf_header_t *header = buf_header_of(ptr);
+  buf_header_t *other_header = buf_header_of(other);
+  other_header->attached = header->attached;
+  header->attached = other_header;
+}
+
+void buf_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  buf_header_t *header = buf_header_of(ptr);
+  while (header && --header->refs == 0) {
+    buf_header_t *attached = header->attached;
+    buf_slab_t *slab = buf_slab_of(header);
+    buf_pool_t *pool = slab->pool;
+
+    pool->in_use -= slab->stride;
+    if (slab->size_class < 0) {
+      pool->num_slabs--;
+      munmap(slab, slab->size);
+    } else {
+      header->next = pool->free_lists[slab->size_class];
+      pool->free_lists[slab->size_class] = header;
+    }
+
+    if (!QUEUE_EMPTY(&pool->waiters) &&
+        pool->in_use < pool->max_memory / 4 * 3) {
+      uv_idle_start(&pool->resume_handle, buf_pool_resume_cb);
+    }
+    header = attached;
+  }
+}
+
+bool buf_pool_full(buf_pool_t *pool) {
+  return pool->max_memory > 0 && pool->in_use >= pool->max_memory;
+}
+
+void buf_pool_wait(buf_pool_t *pool, buf_waiter_t *waiter) {
+  if (waiter->waiting) {
+    return;
+  }
+  waiter->waiting = true;
+  QUEUE_INSERT_TAIL(&pool->waiters, &waiter->member);
+}
+
+void buf_pool_cancel_wait(buf_waiter_t *waiter) {
+  if (waiter->waiting) {
+    waiter->waiting = false;
+    QUEUE_REMOVE(&waiter->member);
+  }
+}
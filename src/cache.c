@@ -0,0 +1,242 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "cache.h"
+
+#define CACHE_INITIAL_BUCKETS 256
+
+// FNV-1a
+static uint32_t cache_hash(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static char *cache_strdup(const char *s) {
+  if (!s) {
+    return NULL;
+  }
+  size_t len = strlen(s) + 1;
+  char *copy = malloc(len);
+  memcpy(copy, s, len);
+  return copy;
+}
+
+static size_t cache_entry_size(const cache_entry_t *entry) {
+  return sizeof(cache_entry_t) + entry->headers_len + entry->body_size;
+}
+
+static void cache_entry_free(cache_entry_t *entry) {
+  free(entry->key);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry->headers);
+  free(entry->body);
+  free(entry);
+}
+
+uint64_t cache_now() { return uv_hrtime() / 1000000; }
+
+cache_t *cache_new(size_t max_memory, size_t max_entry_size) {
+  cache_t *cache = calloc(1, sizeof(cache_t));
+  if (uv_mutex_init(&cache->lock) != 0) {
+    abort();
+  }
+  cache->num_buckets = CACHE_INITIAL_BUCKETS;
+  cache->buckets = calloc(cache->num_buckets, sizeof(cache_entry_t *));
+  QUEUE_INIT(&cache->lru);
+  cache->max_memory = max_memory;
+  cache->max_entry_size = max_entry_size;
+  return cache;
+}
+
+// Entry is filled by the caller before cache_insert()
+cache_entry_t *cache_entry_new(cache_t *cache, const char *key,
+                               const char *etag, const char *last_modified,
+                               uint64_t expires) {
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  entry->cache = cache;
+  entry->key = cache_strdup(key);
+  entry->hash = cache_hash(key);
+  entry->etag = cache_strdup(etag);
+  entry->last_modified = cache_strdup(last_modified);
+  entry->expires = expires;
+  entry->refs = 1;
+  return entry;
+}
+
+// Returns false once the body would not fit in a cache entry
+bool cache_entry_append(cache_entry_t *entry, const char *data, size_t len) {
+  if (entry->body_len + len > entry->cache->max_entry_size) {
+    return false;
+  }
+  if (entry->body_len + len > entry->body_size) {
+    size_t size = entry->body_size ? entry->body_size : 4096;
+    while (size < entry->body_len + len) {
+      size *= 2;
+    }
+    entry->body = realloc(entry->body, size);
+    entry->body_size = size;
+  }
+  memcpy(entry->body + entry->body_len, data, len);
+  entry->body_len += len;
+  return true;
+}
+
+void cache_entry_set_headers(cache_entry_t *entry, const char *headers,
+                             size_t len) {
+  free(entry->headers);
+  entry->headers = malloc(len);
+  memcpy(entry->headers, headers, len);
+  entry->headers_len = len;
+}
+
+// Caller holds the lock
+static void cache_unlink(cache_t *cache, cache_entry_t *entry) {
+  cache_entry_t **link = &cache->buckets[entry->hash % cache->num_buckets];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  QUEUE_REMOVE(&entry->lru);
+  cache->stats.memory -= cache_entry_size(entry);
+  cache->stats.entries--;
+  if (--entry->refs == 0) {
+    cache_entry_free(entry);
+  }
+}
+
+static void cache_grow(cache_t *cache) {
+  size_t num_buckets = cache->num_buckets * 2;
+  cache_entry_t **buckets = calloc(num_buckets, sizeof(cache_entry_t *));
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    cache_entry_t *entry = cache->buckets[i];
+    while (entry) {
+      cache_entry_t *next = entry->next;
+      entry->next = buckets[entry->hash % num_buckets];
+      buckets[entry->hash % num_buckets] = entry;
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->num_buckets = num_buckets;
+}
+
+static cache_entry_t *cache_find(cache_t *cache, const char *key,
+                                 uint32_t hash) {
+  cache_entry_t *entry = cache->buckets[hash % cache->num_buckets];
+  while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+// Takes over the caller's reference. An older entry with the same key is
+// replaced, least recently used ones are evicted to stay within memory.
+void cache_insert(cache_entry_t *entry) {
+  cache_t *cache = entry->cache;
+  // Trim the body buffer, it is kept for as long as the entry lives
+  if (entry->body_size > entry->body_len && entry->body_len > 0) {
+    entry->body = realloc(entry->body, entry->body_len);
+    entry->body_size = entry->body_len;
+  }
+  size_t size = cache_entry_size(entry);
+  if (size > cache->max_memory) {
+    cache_entry_free(entry);
+    return;
+  }
+
+  uv_mutex_lock(&cache->lock);
+  cache_entry_t *old = cache_find(cache, entry->key, entry->hash);
+  if (old) {
+    cache_unlink(cache, old);
+  }
+  while (cache->stats.memory + size > cache->max_memory) {
+    cache_entry_t *last = QUEUE_DATA(QUEUE_PREV(&cache->lru), cache_entry_t,
+                                     lru);
+    cache_unlink(cache, last);
+    cache->stats.evictions++;
+  }
+  if (cache->stats.entries + 1 > cache->num_buckets) {
+    cache_grow(cache);
+  }
+  cache_entry_t **bucket = &cache->buckets[entry->hash % cache->num_buckets];
+  entry->next = *bucket;
+  *bucket = entry;
+  QUEUE_INSERT_HEAD(&cache->lru, &entry->lru);
+  cache->stats.memory += size;
+  cache->stats.entries++;
+  cache->stats.stores++;
+  uv_mutex_unlock(&cache->lock);
+}
+
+// Returns a referenced entry, fresh or not, or NULL
+cache_entry_t *cache_lookup(cache_t *cache, const char *key) {
+  uint32_t hash = cache_hash(key);
+  uv_mutex_lock(&cache->lock);
+  cache_entry_t *entry = cache_find(cache, key, hash);
+  if (entry) {
+    entry->refs++;
+    QUEUE_REMOVE(&entry->lru);
+    QUEUE_INSERT_HEAD(&cache->lru, &entry->lru);
+  }
+  uv_mutex_unlock(&cache->lock);
+  return entry;
+}
+
+bool cache_fresh(cache_entry_t *entry) {
+  uv_mutex_lock(&entry->cache->lock);
+  bool fresh = entry->expires > cache_now();
+  uv_mutex_unlock(&entry->cache->lock);
+  return fresh;
+}
+
+// Upstream confirmed the entry is still valid
+void cache_refresh(cache_entry_t *entry, uint64_t expires) {
+  uv_mutex_lock(&entry->cache->lock);
+  entry->expires = expires;
+  uv_mutex_unlock(&entry->cache->lock);
+}
+
+void cache_release(cache_entry_t *entry) {
+  if (!entry) {
+    return;
+  }
+  cache_t *cache = entry->cache;
+  uv_mutex_lock(&cache->lock);
+  bool last = --entry->refs == 0;
+  uv_mutex_unlock(&cache->lock);
+  if (last) {
+    cache_entry_free(entry);
+  }
+}
+
+void cache_count(cache_t *cache, enum cache_result result) {
+  uv_mutex_lock(&cache->lock);
+  switch (result) {
+    case CACHE_HIT:
+      cache->stats.hits++;
+      break;
+    case CACHE_REVALIDATED:
+      cache->stats.revalidated++;
+      break;
+    case CACHE_MISS:
+      cache->stats.misses++;
+      break;
+  }
+  uv_mutex_unlock(&cache->lock);
+}
+
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+  uv_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  uv_mutex_unlock(&cache->lock);
+}
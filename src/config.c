@@ -5,14 +5,17 @@
  * Use of this source code is governed by an MIT-style license that can be
  * found in the LICENSE file at https://github.com/bleenco/bproxy
  */
+#include <stdarg.h>
+
 #include "config.h"
 #include "log.h"
+#include "ssl_sessions.h"
 
 char *read_file(char *path) {
   FILE *f = fopen(path, "rb");
   if (!f) {
-    log_fatal("could not open file to read: %s!", path);
-    exit(1);
+    log_error("could not open file to read: %s!", path);
+    return NULL;
   }
 
   fseek(f, 0, SEEK_END);
@@ -27,7 +30,33 @@ char *read_file(char *path) {
   return contents;
 }
 
-void parse_config(const char *json_string, config_t *config) {
+// Milliseconds of a timeout, def when it is not set
+static uint64_t config_timeout(const cJSON *timeouts, const char *name,
+                               uint64_t def) {
+  const cJSON *timeout = cJSON_GetObjectItemCaseSensitive(timeouts, name);
+  if (cJSON_IsNumber(timeout) && timeout->valuedouble >= 0) {
+    return timeout->valuedouble;
+  }
+  return def;
+}
+
+// Logs a configuration error unless the configuration is a copy parsed for
+// another worker, whose errors were reported with the first copy
+static void config_log(bool quiet, int level, const char *fmt, ...) {
+  if (quiet) {
+    return;
+  }
+  char msg[LOG_MAX_MESSAGE];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof msg, fmt, args);
+  va_end(args);
+  log_log(level, "%s", msg);
+}
+
+// Returns 0 when the configuration is usable, errors are logged unless quiet
+// is set
+int parse_config(const char *json_string, config_t *config, bool quiet) {
   const cJSON *port = NULL;
   const cJSON *secure_port = NULL;
   const cJSON *mime_type = NULL;
@@ -38,56 +67,145 @@ void parse_config(const char *json_string, config_t *config) {
   const cJSON *proxy_hosts = NULL;
   const cJSON *proxy_ip = NULL;
   const cJSON *proxy_port = NULL;
+  const cJSON *upstreams = NULL;
+  const cJSON *upstream = NULL;
+  const cJSON *upstream_ip = NULL;
+  const cJSON *upstream_port = NULL;
+  const cJSON *upstream_weight = NULL;
+  const cJSON *balance = NULL;
+  const cJSON *hash_header = NULL;
   const cJSON *log_file = NULL;
+  const cJSON *workers = NULL;
+  const cJSON *buffers = NULL;
+  const cJSON *buffers_max_memory = NULL;
+  const cJSON *buffers_hugepages = NULL;
+  const cJSON *buffers_high_water = NULL;
+  const cJSON *buffers_low_water = NULL;
+  const cJSON *splice = NULL;
+  const cJSON *ktls = NULL;
+  const cJSON *gzip_offload = NULL;
+  const cJSON *gzip_offload_min_size = NULL;
+  const cJSON *ssl_offload = NULL;
+  const cJSON *cache = NULL;
+  const cJSON *cache_max_memory = NULL;
+  const cJSON *cache_max_entry_size = NULL;
+  const cJSON *ssl_sessions = NULL;
+  const cJSON *ssl_session_cache_size = NULL;
+  const cJSON *ssl_session_timeout = NULL;
+  const cJSON *ssl_session_tickets = NULL;
+  const cJSON *ssl_ticket_key_file = NULL;
+  const cJSON *metrics = NULL;
+  const cJSON *metrics_port = NULL;
+  const cJSON *metrics_address = NULL;
+  const cJSON *drain_timeout = NULL;
+  const cJSON *timeouts = NULL;
   const cJSON *certificate_path = NULL;
   const cJSON *key_path = NULL;
   const cJSON *ssl_passthrough = NULL;
   const cJSON *force_ssl = NULL;
+  const cJSON *http2 = NULL;
+  const cJSON *keepalive = NULL;
+  const cJSON *keepalive_max_idle = NULL;
+  const cJSON *keepalive_idle_timeout = NULL;
+  const cJSON *keepalive_max_requests = NULL;
+  const cJSON *health_check = NULL;
+  const cJSON *health_interval = NULL;
+  const cJSON *health_timeout = NULL;
+  const cJSON *health_path = NULL;
+  const cJSON *health_status = NULL;
+  const cJSON *outlier = NULL;
+  const cJSON *max_fails = NULL;
+  const cJSON *eject_time = NULL;
+  const cJSON *max_eject_time = NULL;
   const cJSON *templates = NULL;
   const cJSON *status_400_template = NULL;
   const cJSON *status_404_template = NULL;
   const cJSON *status_502_template = NULL;
+  const cJSON *status_504_template = NULL;
 
   memset(config, 0, sizeof *config);
+  config->refs = 1;
 
   cJSON *json = cJSON_Parse(json_string);
   if (!json) {
     const char *error_ptr = cJSON_GetErrorPtr();
     if (error_ptr) {
-      log_fatal("could not parse configuration JSON, error before: %s\n",
-                error_ptr);
+      config_log(quiet, LOG_ERROR,
+                 "could not parse configuration JSON, error before: %s\n",
+                 error_ptr);
     }
 
     cJSON_Delete(json);
-    exit(1);
+    return 1;
   }
 
   port = cJSON_GetObjectItemCaseSensitive(json, "port");
   if (cJSON_IsNumber(port) && port->valueint) {
     config->port = port->valueint;
   } else {
-    log_fatal("could not find listen port in configuration JSON!");
+    config_log(quiet, LOG_ERROR,
+               "could not find listen port in configuration JSON!");
     cJSON_Delete(json);
-    exit(1);
+    return 1;
   }
 
   secure_port = cJSON_GetObjectItemCaseSensitive(json, "secure_port");
   if (cJSON_IsNumber(secure_port) && secure_port->valueint) {
     config->secure_port = secure_port->valueint;
   } else if (secure_port) {
-    log_fatal("secure_port in wrong format in configuration JSON!");
+    config_log(quiet, LOG_ERROR,
+               "secure_port in wrong format in configuration JSON!");
     cJSON_Delete(json);
-    exit(1);
+    return 1;
+  }
+
+  config->workers = 1;
+  workers = cJSON_GetObjectItemCaseSensitive(json, "workers");
+  if (cJSON_IsNumber(workers) && workers->valueint > 0) {
+    config->workers = workers->valueint;
+  } else if (workers) {
+    config_log(quiet, LOG_ERROR,
+               "workers in wrong format in configuration JSON!");
+    cJSON_Delete(json);
+    return 1;
+  }
+
+  buffers = cJSON_GetObjectItemCaseSensitive(json, "buffers");
+  buffers_max_memory = cJSON_GetObjectItemCaseSensitive(buffers, "max_memory");
+  if (cJSON_IsNumber(buffers_max_memory) && buffers_max_memory->valueint > 0) {
+    config->buffers_max_memory =
+        (size_t)buffers_max_memory->valueint * 1024 * 1024;
+  }
+  buffers_hugepages = cJSON_GetObjectItemCaseSensitive(buffers, "hugepages");
+  if (cJSON_IsBool(buffers_hugepages)) {
+    config->buffers_hugepages = buffers_hugepages->type == cJSON_True;
+  }
+  config->write_high_water = 256 * 1024;
+  buffers_high_water = cJSON_GetObjectItemCaseSensitive(buffers, "high_water");
+  if (cJSON_IsNumber(buffers_high_water) && buffers_high_water->valueint > 0) {
+    config->write_high_water = (size_t)buffers_high_water->valueint * 1024;
+  }
+  config->write_low_water = config->write_high_water / 4;
+  buffers_low_water = cJSON_GetObjectItemCaseSensitive(buffers, "low_water");
+  if (cJSON_IsNumber(buffers_low_water) && buffers_low_water->valueint >= 0 &&
+      (size_t)buffers_low_water->valueint * 1024 < config->write_high_water) {
+    config->write_low_water = (size_t)buffers_low_water->valueint * 1024;
+  }
+
+  splice = cJSON_GetObjectItemCaseSensitive(json, "splice");
+  if (cJSON_IsBool(splice)) {
+    config->splice = splice->type == cJSON_True;
+  }
+
+  ktls = cJSON_GetObjectItemCaseSensitive(json, "ktls");
+  if (cJSON_IsBool(ktls)) {
+    config->ktls = ktls->type == cJSON_True;
   }
 
   log_file = cJSON_GetObjectItemCaseSensitive(json, "log_file");
   if (cJSON_IsString(log_file) && log_file->valuestring) {
-    FILE *fp = fopen(log_file->valuestring, "w+");
-    if (fp) {
-      log_set_fp(fp);
-    } else {
-      log_error("cannot open file for writing: %s!", log_file->valuestring);
-    }
+    config->log_file = malloc(strlen(log_file->valuestring) + 1);
+    strcpy(config->log_file, log_file->valuestring);
   }
 
   config->num_gzip_mime_types = 0;
@@ -104,7 +222,104 @@ void parse_config(const char *json_string, config_t *config) {
     }
   }
 
-  config->templates = malloc(sizeof(templates_t));
+  gzip_offload = cJSON_GetObjectItemCaseSensitive(json, "gzip_offload");
+  if (cJSON_IsBool(gzip_offload)) {
+    config->gzip_offload = gzip_offload->type == cJSON_True;
+  }
+  config->gzip_offload_min_size = 64 * 1024;
+  gzip_offload_min_size =
+      cJSON_GetObjectItemCaseSensitive(json, "gzip_offload_min_size");
+  if (cJSON_IsNumber(gzip_offload_min_size) &&
+      gzip_offload_min_size->valueint >= 0) {
+    config->gzip_offload_min_size = gzip_offload_min_size->valueint;
+  }
+
+  ssl_offload = cJSON_GetObjectItemCaseSensitive(json, "ssl_offload");
+  if (cJSON_IsBool(ssl_offload)) {
+    config->ssl_offload = ssl_offload->type == cJSON_True;
+  }
+
+  cache = cJSON_GetObjectItemCaseSensitive(json, "cache");
+  cache_max_memory = cJSON_GetObjectItemCaseSensitive(cache, "max_memory");
+  if (cJSON_IsNumber(cache_max_memory) && cache_max_memory->valueint > 0) {
+    config->cache_max_memory = (size_t)cache_max_memory->valueint * 1024 * 1024;
+  }
+  config->cache_max_entry_size = 1024 * 1024;
+  cache_max_entry_size =
+      cJSON_GetObjectItemCaseSensitive(cache, "max_entry_size");
+  if (cJSON_IsNumber(cache_max_entry_size) &&
+      cache_max_entry_size->valueint > 0) {
+    config->cache_max_entry_size =
+        (size_t)cache_max_entry_size->valueint * 1024;
+  }
+
+  ssl_sessions = cJSON_GetObjectItemCaseSensitive(json, "ssl_sessions");
+  config->ssl_session_cache_size = 20480;
+  ssl_session_cache_size =
+      cJSON_GetObjectItemCaseSensitive(ssl_sessions, "cache_size");
+  if (cJSON_IsNumber(ssl_session_cache_size) &&
+      ssl_session_cache_size->valueint >= 0) {
+    config->ssl_session_cache_size = ssl_session_cache_size->valueint;
+  }
+  config->ssl_session_timeout = 300;
+  ssl_session_timeout =
+      cJSON_GetObjectItemCaseSensitive(ssl_sessions, "timeout");
+  if (cJSON_IsNumber(ssl_session_timeout) &&
+      ssl_session_timeout->valueint > 0) {
+    config->ssl_session_timeout = ssl_session_timeout->valueint;
+  }
+  config->ssl_session_tickets = true;
+  ssl_session_tickets =
+      cJSON_GetObjectItemCaseSensitive(ssl_sessions, "tickets");
+  if (cJSON_IsBool(ssl_session_tickets)) {
+    config->ssl_session_tickets = ssl_session_tickets->type == cJSON_True;
+  }
+  ssl_ticket_key_file =
+      cJSON_GetObjectItemCaseSensitive(ssl_sessions, "ticket_key_file");
+  if (cJSON_IsString(ssl_ticket_key_file) &&
+      ssl_ticket_key_file->valuestring) {
+    config->ssl_ticket_key_file =
+        malloc(strlen(ssl_ticket_key_file->valuestring) + 1);
+    strcpy(config->ssl_ticket_key_file, ssl_ticket_key_file->valuestring);
+  }
+
+  metrics = cJSON_GetObjectItemCaseSensitive(json, "metrics");
+  metrics_port = cJSON_GetObjectItemCaseSensitive(metrics, "port");
+  if (cJSON_IsNumber(metrics_port) && metrics_port->valueint > 0) {
+    config->metrics_port = metrics_port->valueint;
+  } else if (metrics_port) {
+    config_log(quiet, LOG_ERROR,
+               "metrics port in wrong format in configuration JSON!");
+    cJSON_Delete(json);
+    return 1;
+  }
+  metrics_address = cJSON_GetObjectItemCaseSensitive(metrics, "address");
+  const char *address = "127.0.0.1";
+  if (cJSON_IsString(metrics_address) && metrics_address->valuestring) {
+    address = metrics_address->valuestring;
+  }
+  config->metrics_address = malloc(strlen(address) + 1);
+  strcpy(config->metrics_address, address);
+
+  config->drain_timeout = 60;
+  drain_timeout = cJSON_GetObjectItemCaseSensitive(json, "drain_timeout");
+  if (cJSON_IsNumber(drain_timeout) && drain_timeout->valueint >= 0) {
+    config->drain_timeout = drain_timeout->valueint;
+  }
+
+  timeouts = cJSON_GetObjectItemCaseSensitive(json, "timeouts");
+  config->client_header_timeout =
+      config_timeout(timeouts, "client_header", 10000);
+  config->client_idle_timeout = config_timeout(timeouts, "client_idle", 60000);
+  config->upstream_connect_timeout =
+      config_timeout(timeouts, "upstream_connect", 5000);
+  config->upstream_header_timeout =
+      config_timeout(timeouts, "upstream_header", 60000);
+  config->upstream_idle_timeout =
+      config_timeout(timeouts, "upstream_idle", 60000);
+  config->request_timeout = config_timeout(timeouts, "request", 0);
+
+  config->templates = calloc(1, sizeof(templates_t));
   templates = cJSON_GetObjectItemCaseSensitive(json, "templates");
 
   status_400_template =
@@ -119,6 +334,10 @@ void parse_config(const char *json_string, config_t *config) {
     config->templates->status_400_template[strlen(contents)] = '\0';
   } else {
     char *contents = read_file(status_400_template->valuestring);
+    if (!contents) {
+      cJSON_Delete(json);
+      return 1;
+    }
     char *header = malloc(205 * sizeof(char));
     sprintf(header,
             "HTTP/1.1 400 Bad Request\r\n"
@@ -144,6 +363,10 @@ void parse_config(const char *json_string, config_t *config) {
     config->templates->status_404_template[strlen(contents)] = '\0';
   } else {
     char *contents = read_file(status_404_template->valuestring);
+    if (!contents) {
+      cJSON_Delete(json);
+      return 1;
+    }
     char *header = malloc(200 * sizeof(char));
     sprintf(header,
             "HTTP/1.1 404 Not Found\r\n"
@@ -169,6 +392,10 @@ void parse_config(const char *json_string, config_t *config) {
     config->templates->status_502_template[strlen(contents)] = '\0';
   } else {
     char *contents = read_file(status_502_template->valuestring);
+    if (!contents) {
+      cJSON_Delete(json);
+      return 1;
+    }
     char *header = malloc(205 * sizeof(char));
     sprintf(header,
             "HTTP/1.1 502 Bad Gateway\r\n"
@@ -182,8 +409,39 @@ void parse_config(const char *json_string, config_t *config) {
     strcat(config->templates->status_502_template, contents);
   }
 
+  status_504_template =
+      cJSON_GetObjectItemCaseSensitive(templates, "status_504_template");
+  if (!cJSON_IsString(status_504_template) ||
+      !status_504_template->valuestring ||
+      strcmp(status_504_template->valuestring, "") == 0) {
+    char *contents = malloc(4096 * sizeof(char));
+    http_504_response(contents);
+    config->templates->status_504_template = malloc(strlen(contents) + 1);
+    memcpy(config->templates->status_504_template, contents, strlen(contents));
+    config->templates->status_504_template[strlen(contents)] = '\0';
+  } else {
+    char *contents = read_file(status_504_template->valuestring);
+    if (!contents) {
+      cJSON_Delete(json);
+      return 1;
+    }
+    char *header = malloc(209 * sizeof(char));
+    sprintf(header,
+            "HTTP/1.1 504 Gateway Timeout\r\n"
+            "Content-Length: %ld\r\n"
+            "Content-Type: text/html\r\n"
+            "Connection: Close\r\n"
+            "\r\n",
+            strlen(contents));
+    config->templates->status_504_template = malloc(209 + strlen(contents) + 1);
+    memcpy(config->templates->status_504_template, header, strlen(header));
+    strcat(config->templates->status_504_template, contents);
+  }
+
   config->num_proxies = 0;
   proxies = cJSON_GetObjectItemCaseSensitive(json, "proxies");
+  config->proxies =
+      malloc(cJSON_GetArraySize(proxies) * sizeof(proxy_config_t *));
   cJSON_ArrayForEach(proxy, proxies) {
     config->num_proxies++;
 
@@ -193,6 +451,8 @@ void parse_config(const char *json_string, config_t *config) {
 
     proxy_hosts = cJSON_GetObjectItemCaseSensitive(proxy, "hosts");
     proxy_config->num_hosts = 0;
+    proxy_config->hosts =
+        malloc(cJSON_GetArraySize(proxy_hosts) * sizeof(char *));
     cJSON_ArrayForEach(proxy_host, proxy_hosts) {
       if (cJSON_IsString(proxy_host) && proxy_host->valuestring) {
         proxy_config->num_hosts++;
@@ -205,17 +465,123 @@ void parse_config(const char *json_string, config_t *config) {
       }
     }
 
+    // A single upstream may be given with ip and port
+    balancer_t *balancer = &proxy_config->balancer;
     proxy_ip = cJSON_GetObjectItemCaseSensitive(proxy, "ip");
-    if (cJSON_IsString(proxy_ip) && proxy_ip->valuestring) {
-      proxy_config->ip = malloc(20);
-      memcpy(proxy_config->ip, proxy_ip->valuestring,
-             strlen(proxy_ip->valuestring));
-      proxy_config->ip[strlen(proxy_ip->valuestring)] = '\0';
+    proxy_port = cJSON_GetObjectItemCaseSensitive(proxy, "port");
+    if (cJSON_IsString(proxy_ip) && proxy_ip->valuestring &&
+        balancer_add(balancer, proxy_ip->valuestring,
+                     cJSON_IsNumber(proxy_port) ? proxy_port->valueint : 0,
+                     1)) {
+      cJSON_Delete(json);
+      return 1;
+    }
+    upstreams = cJSON_GetObjectItemCaseSensitive(proxy, "upstreams");
+    cJSON_ArrayForEach(upstream, upstreams) {
+      upstream_ip = cJSON_GetObjectItemCaseSensitive(upstream, "ip");
+      upstream_port = cJSON_GetObjectItemCaseSensitive(upstream, "port");
+      upstream_weight = cJSON_GetObjectItemCaseSensitive(upstream, "weight");
+      if (!cJSON_IsString(upstream_ip) || !upstream_ip->valuestring ||
+          !cJSON_IsNumber(upstream_port) ||
+          balancer_add(balancer, upstream_ip->valuestring,
+                       upstream_port->valueint,
+                       cJSON_IsNumber(upstream_weight)
+                           ? upstream_weight->valueint
+                           : 1)) {
+        config_log(quiet, LOG_ERROR,
+                   "upstreams in wrong format in configuration JSON!");
+        cJSON_Delete(json);
+        return 1;
+      }
+    }
+    balance = cJSON_GetObjectItemCaseSensitive(proxy, "balance");
+    if (cJSON_IsString(balance) && balance->valuestring) {
+      int policy = balancer_policy(balance->valuestring);
+      if (policy < 0) {
+        config_log(quiet, LOG_ERROR, "unknown balance policy: %s",
+                   balance->valuestring);
+        cJSON_Delete(json);
+        return 1;
+      }
+      balancer->policy = policy;
+    }
+    hash_header = cJSON_GetObjectItemCaseSensitive(proxy, "hash_header");
+    if (cJSON_IsString(hash_header) && hash_header->valuestring) {
+      balancer->hash_header = malloc(strlen(hash_header->valuestring) + 1);
+      strcpy(balancer->hash_header, hash_header->valuestring);
+    }
+    balancer_build(balancer);
+
+    proxy_config->keepalive_idle_timeout =
+        CONFIG_DEFAULT_KEEPALIVE_IDLE_TIMEOUT;
+    proxy_config->keepalive_max_requests =
+        CONFIG_DEFAULT_KEEPALIVE_MAX_REQUESTS;
+    keepalive = cJSON_GetObjectItemCaseSensitive(proxy, "keepalive");
+    keepalive_max_idle =
+        cJSON_GetObjectItemCaseSensitive(keepalive, "max_idle");
+    if (cJSON_IsNumber(keepalive_max_idle) &&
+        keepalive_max_idle->valueint > 0) {
+      proxy_config->keepalive_max_idle = keepalive_max_idle->valueint;
+    }
+    keepalive_idle_timeout =
+        cJSON_GetObjectItemCaseSensitive(keepalive, "idle_timeout");
+    if (cJSON_IsNumber(keepalive_idle_timeout) &&
+        keepalive_idle_timeout->valueint > 0) {
+      proxy_config->keepalive_idle_timeout = keepalive_idle_timeout->valueint;
+    }
+    keepalive_max_requests =
+        cJSON_GetObjectItemCaseSensitive(keepalive, "max_requests");
+    if (cJSON_IsNumber(keepalive_max_requests) &&
+        keepalive_max_requests->valueint >= 0) {
+      proxy_config->keepalive_max_requests = keepalive_max_requests->valueint;
     }
 
-    proxy_port = cJSON_GetObjectItemCaseSensitive(proxy, "port");
-    if (cJSON_IsNumber(proxy_port) && proxy_port->valueint) {
-      proxy_config->port = proxy_port->valueint;
+    proxy_config->health_timeout = CONFIG_DEFAULT_HEALTH_TIMEOUT;
+    proxy_config->health_status = 200;
+    health_check = cJSON_GetObjectItemCaseSensitive(proxy, "health_check");
+    health_interval =
+        cJSON_GetObjectItemCaseSensitive(health_check, "interval");
+    if (cJSON_IsNumber(health_interval) && health_interval->valueint > 0) {
+      proxy_config->health_interval = health_interval->valueint;
+    } else if (health_check) {
+      config_log(
+          quiet, LOG_ERROR,
+          "health_check interval in wrong format in configuration JSON!");
+      cJSON_Delete(json);
+      return 1;
+    }
+    health_timeout = cJSON_GetObjectItemCaseSensitive(health_check, "timeout");
+    if (cJSON_IsNumber(health_timeout) && health_timeout->valueint > 0) {
+      proxy_config->health_timeout = health_timeout->valueint;
+    }
+    health_path = cJSON_GetObjectItemCaseSensitive(health_check, "path");
+    if (cJSON_IsString(health_path) && health_path->valuestring) {
+      proxy_config->health_path = malloc(strlen(health_path->valuestring) + 1);
+      strcpy(proxy_config->health_path, health_path->valuestring);
+    }
+    health_status = cJSON_GetObjectItemCaseSensitive(health_check, "status");
+    if (cJSON_IsNumber(health_status) && health_status->valueint > 0) {
+      proxy_config->health_status = health_status->valueint;
+    }
+
+    proxy_config->eject_time = CONFIG_DEFAULT_EJECT_TIME;
+    proxy_config->max_eject_time = CONFIG_DEFAULT_MAX_EJECT_TIME;
+    outlier = cJSON_GetObjectItemCaseSensitive(proxy, "outlier");
+    max_fails = cJSON_GetObjectItemCaseSensitive(outlier, "max_fails");
+    if (cJSON_IsNumber(max_fails) && max_fails->valueint >= 0) {
+      proxy_config->max_fails = max_fails->valueint;
+    }
+    eject_time = cJSON_GetObjectItemCaseSensitive(outlier, "eject_time");
+    if (cJSON_IsNumber(eject_time) && eject_time->valueint > 0) {
+      proxy_config->eject_time = eject_time->valueint;
+    }
+    max_eject_time =
+        cJSON_GetObjectItemCaseSensitive(outlier, "max_eject_time");
+    if (cJSON_IsNumber(max_eject_time) && max_eject_time->valueint > 0) {
+      proxy_config->max_eject_time = max_eject_time->valueint;
+    }
+    if (proxy_config->max_eject_time < proxy_config->eject_time) {
+      proxy_config->max_eject_time = proxy_config->eject_time;
     }
 
     bool ssl_enabled = config->secure_port > 0;
@@ -236,15 +602,17 @@ void parse_config(const char *json_string, config_t *config) {
       if (!SSL_CTX_use_certificate_chain_file(proxy_config->ssl_context,
                                               certificate_path->valuestring)) {
         int err = ERR_get_error();
-        log_error("Could not load certificate file: %s; reason: %s",
-                  certificate_path->valuestring, ERR_error_string(err, NULL));
+        config_log(quiet, LOG_ERROR,
+                   "Could not load certificate file: %s; reason: %s",
+                   certificate_path->valuestring, ERR_error_string(err, NULL));
         ssl_enabled = false;
       }
       if (ssl_enabled && !SSL_CTX_use_PrivateKey_file(proxy_config->ssl_context,
                                                       key_path->valuestring,
                                                       SSL_FILETYPE_PEM)) {
         int err = ERR_get_error();
-        log_error(
+        config_log(
+            quiet, LOG_ERROR,
             "Could not load key file: %s or key doesn't match certificate: %s; "
             "reason: %s",
             key_path->valuestring, certificate_path->valuestring,
@@ -254,7 +622,7 @@ void parse_config(const char *json_string, config_t *config) {
     }
     if (ssl_enabled) {
       if (uv_ssl_setup_recommended_secure_context(proxy_config->ssl_context)) {
-        log_error("configuring recommended secure context");
+        config_log(quiet, LOG_ERROR, "configuring recommended secure context");
         ssl_enabled = false;
       }
     }
@@ -264,11 +632,17 @@ void parse_config(const char *json_string, config_t *config) {
       proxy_config->force_ssl = force_ssl->type == cJSON_True;
     }
 
+    http2 = cJSON_GetObjectItemCaseSensitive(proxy, "http2");
+    if (cJSON_IsBool(http2)) {
+      proxy_config->http2 = http2->type == cJSON_True;
+    }
+
     ssl_passthrough =
         cJSON_GetObjectItemCaseSensitive(proxy, "ssl_passthrough");
     if (cJSON_IsBool(ssl_passthrough)) {
       if (ssl_enabled) {
-        log_warn(
+        config_log(
+            quiet, LOG_WARN,
             "ssl_passthrough enabled, certificate and key file will be "
             "ignored!");
         ssl_enabled = false;
@@ -282,10 +656,104 @@ void parse_config(const char *json_string, config_t *config) {
       SSL_CTX_free(proxy_config->ssl_context);
       proxy_config->ssl_context = NULL;
       force_ssl = false;
+    } else {
+      ssl_sessions_proxy_sid_ctx(proxy_config->hosts, proxy_config->num_hosts,
+                                 proxy_config->ssl_sid_ctx);
+    }
+  }
+
+  config->router = router_new();
+  for (int i = 0; i < config->num_proxies; i++) {
+    for (int j = 0; j < config->proxies[i]->num_hosts; j++) {
+      router_add(config->router, config->proxies[i]->hosts[j], i);
     }
   }
 
   cJSON_Delete(json);
+  return 0;
+}
+
+static bool config_string_changed(const char *a, const char *b) {
+  if (!a || !b) {
+    return a != b;
+  }
+  return strcmp(a, b) != 0;
+}
+
+// Warns about settings a reload can't apply, they keep their values from
+// startup
+void config_check_reload(const config_t *running, const config_t *config) {
+  if (config->port != running->port ||
+      config->secure_port != running->secure_port) {
+    log_warn("listen ports changed, restart to apply");
+  }
+  if (config->workers != running->workers) {
+    log_warn("workers changed, restart to apply");
+  }
+  if (config->buffers_max_memory != running->buffers_max_memory ||
+      config->buffers_hugepages != running->buffers_hugepages) {
+    log_warn("buffers changed, restart to apply");
+  }
+  if (config->cache_max_memory != running->cache_max_memory ||
+      config->cache_max_entry_size != running->cache_max_entry_size) {
+    log_warn("cache changed, restart to apply");
+  }
+  if (config->ssl_session_cache_size != running->ssl_session_cache_size ||
+      config->ssl_session_timeout != running->ssl_session_timeout ||
+      config->ssl_session_tickets != running->ssl_session_tickets ||
+      config_string_changed(config->ssl_ticket_key_file,
+                            running->ssl_ticket_key_file)) {
+    log_warn("ssl_sessions changed, restart to apply");
+  }
+  if (config->metrics_port != running->metrics_port ||
+      config_string_changed(config->metrics_address,
+                            running->metrics_address)) {
+    log_warn("metrics changed, restart to apply");
+  }
+  if (config_string_changed(config->log_file, running->log_file)) {
+    log_warn("log_file changed, restart to apply");
+  }
+}
+
+// Frees a configuration, also one parse_config() failed on. Idle upstreams
+// must have been closed already.
+void config_free(config_t *config) {
+  free(config->log_file);
+  for (int i = 0; i < config->num_gzip_mime_types; i++) {
+    free(config->gzip_mime_types[i]);
+  }
+  free(config->ssl_ticket_key_file);
+  free(config->metrics_address);
+  if (config->templates) {
+    free(config->templates->status_400_template);
+    free(config->templates->status_404_template);
+    free(config->templates->status_502_template);
+    free(config->templates->status_504_template);
+    free(config->templates);
+  }
+  for (int i = 0; i < config->num_proxies; i++) {
+    proxy_config_t *proxy_config = config->proxies[i];
+    for (int j = 0; j < proxy_config->num_hosts; j++) {
+      free(proxy_config->hosts[j]);
+    }
+    free(proxy_config->hosts);
+    balancer_free(&proxy_config->balancer);
+    free(proxy_config->health_path);
+    SSL_CTX_free(proxy_config->ssl_context);
+    free(proxy_config);
+  }
+  free(config->proxies);
+  if (config->router) {
+    router_free(config->router);
+  }
+  free(config);
+}
+
+// References are taken and released by the worker using the configuration
+void config_release(config_t *config) {
+  if (--config->refs == 0) {
+    config_free(config);
+  }
 }
 
 void http_400_response(char *resp) {
@@ -395,3 +863,23 @@ void http_502_response(char *resp) {
            "</html>\r\n",
            160 + strlen(VERSION), VERSION);
 }
+
+void http_504_response(char *resp) {
+  snprintf(resp, 1024,
+           "HTTP/1.1 504 Gateway Timeout\r\n"
+           "Content-Length: %ld\r\n"
+           "Content-Type: text/html\r\n"
+           "Connection: Close\r\n"
+           "\r\n"
+           "<html>\r\n"
+           "<head>\r\n"
+           "<title>504 Gateway Timeout</title>\r\n"
+           "</head>\r\n"
+           "<body>\r\n"
+           "<h1 align=\"center\">504 Gateway Timeout</h1>\r\n"
+           "<hr/>\r\n"
+           "<p align=\"center\">bproxy %s</p>\r\n"
+           "</body>\r\n"
+           "</html>\r\n",
+           168 + strlen(VERSION), VERSION);
+}
@@ -5,29 +5,16 @@
 #include "stdint.h"
 #include "zlib.h"
 
-int gzip_init_state(gzip_state_t *state, char *http_header) {
+int gzip_init_state(gzip_state_t *state) {
   int ret_status = 0;
 
   memset(state, 0, sizeof *state);
 
-  state->current_size_in = 0;
-  state->current_size_out = 0;
-  state->first_chunk = true;
-  state->last_chunk = false;
-
   /* allocate deflate state */
   state->strm.zalloc = Z_NULL;
   state->strm.zfree = Z_NULL;
   state->strm.opaque = Z_NULL;
 
-  size_t buf_sizes = 6000000;
-  state->raw_body = NULL;
-  state->gzip_body = malloc(buf_sizes);
-  state->chunk_body = malloc(buf_sizes);
-  state->http_header = http_header;
-
-  state->current_size_buf_out = buf_sizes;
-
   ret_status = deflateInit2(&state->strm, -1, 8, 15 + 16, 8, 0);
   if (ret_status != Z_OK) {
     printf("Init failed!");
@@ -38,69 +25,48 @@ int gzip_init_state(gzip_state_t *state, char *http_header) {
 void gzip_free_state(gzip_state_t *state) {
   if (state) {
     deflateEnd(&state->strm);
-    free(state->gzip_body);
-    free(state->chunk_body);
   }
 }
 
-int gzip_compress(gzip_state_t *state) {
-  state->strm.next_in = state->raw_body;
-  state->strm.next_out = state->gzip_body;
-
-  state->strm.avail_in = state->current_size_in;
-  state->strm.avail_out = state->current_size_buf_out;
-
-  (void)deflate(&state->strm, Z_BLOCK);
-  if (state->last_chunk) {
-    (void)deflate(&state->strm, Z_FINISH);
-  }
-
-  size_t gz_len = state->current_size_buf_out - state->strm.avail_out;
-
-  state->current_size_out = gz_len;
-
-  return 0;
+// Sets body data consumed by following gzip_frame() calls. Data must stay
+// valid until no more frames are pending.
+void gzip_input(gzip_state_t *state, const char *data, size_t len) {
+  state->strm.next_in = (unsigned char *)data;
+  state->strm.avail_in = len;
 }
 
-void gzip_chunk_compress(gzip_state_t *state) {
-  int gz_size = state->current_size_out;
+// Compresses input into a single chunk written to out, which must hold
+// GZIP_FRAME_SIZE bytes. Returns chunk length (0 when there is nothing to
+// send) and sets frame to its start. Call again while state->pending is set.
+// Every input is flushed, so data is not held back waiting for more.
+size_t gzip_frame(gzip_state_t *state, char *out, bool finish, char **frame) {
   // Message def: hex size, \r\n, gzip content, \r\n, (if last add) 0 \r\n\r\n
-  char *head_def = "%X\r\n";
-
-  char head[200];
-
-  char *tail = "\r\n";
-  if (state->last_chunk) {
-    tail = "\r\n0\r\n\r\n";
+  char *data = out + GZIP_FRAME_HEAD;
+  size_t size = GZIP_FRAME_SIZE - GZIP_FRAME_HEAD - GZIP_FRAME_TAIL;
+
+  state->strm.next_out = (unsigned char *)data;
+  state->strm.avail_out = size;
+  int ret = deflate(&state->strm, finish ? Z_FINISH : Z_SYNC_FLUSH);
+  size_t gz_size = size - state->strm.avail_out;
+  if (finish) {
+    state->pending = ret == Z_OK;
+  } else {
+    state->pending = ret == Z_OK && state->strm.avail_out == 0;
   }
 
-  int head_len = sprintf(head, head_def, gz_size);
-  int tail_len = strlen(tail);
-
-  size_t offset = 0;
-  size_t copy_len;
-
-  if (state->first_chunk) {
-    // Copy http header
-    copy_len = strlen(state->http_header);
-    memcpy(state->chunk_body + offset, state->http_header, copy_len);
-    offset += copy_len;
+  char *end = data + gz_size;
+  *frame = data;
+  if (gz_size > 0) {
+    char head[GZIP_FRAME_HEAD + 1];
+    int head_len = snprintf(head, sizeof(head), "%zX\r\n", gz_size);
+    *frame = data - head_len;
+    memcpy(*frame, head, head_len);
+    memcpy(end, "\r\n", 2);
+    end += 2;
   }
-
-  // Copy head
-  copy_len = head_len;
-  memcpy(state->chunk_body + offset, head, copy_len);
-  offset += copy_len;
-
-  // Copy body
-  copy_len = gz_size;
-  memcpy(state->chunk_body + offset, state->gzip_body, copy_len);
-  offset += copy_len;
-
-  // Copy tail
-  copy_len = tail_len;
-  memcpy(state->chunk_body + offset, tail, copy_len);
-  offset += copy_len;
-
-  state->current_size_out = offset;
+  if (finish && !state->pending) {
+    memcpy(end, "0\r\n\r\n", 5);
+    end += 5;
+  }
+  return end - *frame;
 }
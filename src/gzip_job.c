@@ -0,0 +1,172 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "gzip_job.h"
+
+#include <string.h>
+
+// Room for deflate block and flush markers added to each input
+#define GZIP_JOB_INPUT_OVERHEAD 64
+
+static void gzip_job_work_cb(uv_work_t *req);
+static void gzip_job_after_work_cb(uv_work_t *req, int status);
+
+// Takes over state, which is released with the job
+gzip_job_t *gzip_job_new(buf_pool_t *buffers, gzip_state_t *state,
+                         gzip_job_cb cb, void *data) {
+  gzip_job_t *job = calloc(1, sizeof(gzip_job_t));
+  job->req.data = job;
+  job->buffers = buffers;
+  job->state = state;
+  job->cb = cb;
+  job->data = data;
+  QUEUE_INIT(&job->inputs);
+  QUEUE_INIT(&job->running);
+  QUEUE_INIT(&job->done);
+  return job;
+}
+
+// Data must point into a pool buffer, it is kept until compressed
+void gzip_job_push(gzip_job_t *job, const char *data, size_t len,
+                   bool finish) {
+  gzip_input_t *input = buf_pool_alloc(job->buffers, sizeof(gzip_input_t));
+  input->data = data;
+  input->len = len;
+  input->finish = finish;
+  if (data) {
+    buf_ref((void *)data);
+  }
+  QUEUE_INSERT_TAIL(&job->inputs, &input->member);
+}
+
+// Starts a round for inputs pushed so far, unless one is running already
+void gzip_job_submit(gzip_job_t *job) {
+  if (job->busy || (QUEUE_EMPTY(&job->inputs) && QUEUE_EMPTY(&job->running))) {
+    return;
+  }
+
+  size_t pending_len = 0;
+  QUEUE *q;
+  QUEUE_FOREACH(q, &job->inputs) {
+    pending_len += QUEUE_DATA(q, gzip_input_t, member)->len;
+    pending_len += GZIP_JOB_INPUT_OVERHEAD;
+  }
+  QUEUE_FOREACH(q, &job->running) {
+    pending_len += QUEUE_DATA(q, gzip_input_t, member)->len;
+    pending_len += GZIP_JOB_INPUT_OVERHEAD;
+  }
+  if (!QUEUE_EMPTY(&job->inputs)) {
+    QUEUE_ADD(&job->running, &job->inputs);
+    QUEUE_INIT(&job->inputs);
+  }
+
+  // Output never grows much over input, don't reserve more than needed
+  size_t payload = GZIP_FRAME_SIZE - GZIP_FRAME_HEAD - GZIP_FRAME_TAIL;
+  size_t num_out = pending_len / payload + 1;
+  job->num_out = num_out < GZIP_JOB_MAX_FRAMES ? num_out : GZIP_JOB_MAX_FRAMES;
+  for (unsigned int i = 0; i < job->num_out; i++) {
+    job->out[i] = buf_pool_alloc(job->buffers, GZIP_FRAME_SIZE);
+  }
+  job->num_frames = 0;
+  job->busy = true;
+  uv_queue_work(job->buffers->loop, &job->req, gzip_job_work_cb,
+                gzip_job_after_work_cb);
+}
+
+bool gzip_job_idle(gzip_job_t *job) {
+  return !job->busy && QUEUE_EMPTY(&job->inputs) &&
+         QUEUE_EMPTY(&job->running);
+}
+
+static void gzip_job_release(gzip_job_t *job) {
+  QUEUE *lists[3] = {&job->inputs, &job->running, &job->done};
+  for (int i = 0; i < 3; i++) {
+    while (!QUEUE_EMPTY(lists[i])) {
+      QUEUE *q = QUEUE_HEAD(lists[i]);
+      QUEUE_REMOVE(q);
+      gzip_input_t *input = QUEUE_DATA(q, gzip_input_t, member);
+      buf_free((void *)input->data);
+      buf_free(input);
+    }
+  }
+  gzip_free_state(job->state);
+  free(job->state);
+  free(job);
+}
+
+// Frames not yet taken over are dropped with the job
+void gzip_job_free(gzip_job_t *job) {
+  if (!job) {
+    return;
+  }
+  if (job->busy) {
+    job->closed = true;
+    return;
+  }
+  gzip_job_release(job);
+}
+
+// Runs on a thread pool thread, touches only the job's own lists and the
+// output buffers reserved for this round
+static void gzip_job_work_cb(uv_work_t *req) {
+  gzip_job_t *job = req->data;
+  uint64_t start = uv_hrtime();
+  unsigned int next = 0;
+  while (next < job->num_out && !QUEUE_EMPTY(&job->running)) {
+    QUEUE *q = QUEUE_HEAD(&job->running);
+    gzip_input_t *input = QUEUE_DATA(q, gzip_input_t, member);
+    if (!job->started) {
+      gzip_input(job->state, input->data, input->len);
+      job->started = true;
+    }
+    char *frame;
+    size_t frame_len =
+        gzip_frame(job->state, job->out[next], input->finish, &frame);
+    if (frame_len > 0) {
+      job->frames[next++] = uv_buf_init(frame, frame_len);
+    }
+    if (!job->state->pending) {
+      job->started = false;
+      QUEUE_REMOVE(q);
+      QUEUE_INSERT_TAIL(&job->done, q);
+    }
+  }
+  job->num_frames = next;
+  job->work_time = uv_hrtime() - start;
+}
+
+static void gzip_job_after_work_cb(uv_work_t *req, int status) {
+  gzip_job_t *job = req->data;
+  job->busy = false;
+
+  while (!QUEUE_EMPTY(&job->done)) {
+    QUEUE *q = QUEUE_HEAD(&job->done);
+    QUEUE_REMOVE(q);
+    gzip_input_t *input = QUEUE_DATA(q, gzip_input_t, member);
+    buf_free((void *)input->data);
+    buf_free(input);
+  }
+  for (unsigned int i = job->num_frames; i < job->num_out; i++) {
+    buf_free(job->out[i]);
+  }
+
+  if (job->closed) {
+    for (unsigned int i = 0; i < job->num_frames; i++) {
+      buf_free(job->frames[i].base);
+    }
+    gzip_job_release(job);
+    return;
+  }
+
+  // Next round starts before frames are handed over, so the callback sees
+  // whether compression has caught up
+  unsigned int num_frames = job->num_frames;
+  uv_buf_t frames[GZIP_JOB_MAX_FRAMES];
+  memcpy(frames, job->frames, num_frames * sizeof(uv_buf_t));
+  gzip_job_submit(job);
+  job->cb(job, frames, num_frames);
+}
@@ -0,0 +1,191 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "health.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+// Outcome of a request sent to a target: a connect error or 5xx response
+// counts as failure. Targets failing max_fails requests in a row are ejected,
+// for twice as long as last time when no request succeeded since.
+void health_report(proxy_config_t *proxy_config, int target, bool ok,
+                   uint64_t now) {
+  upstream_target_t *t = &proxy_config->balancer.targets[target];
+  if (ok) {
+    t->fails = 0;
+    t->ejections = 0;
+    return;
+  }
+  if (proxy_config->max_fails == 0 || ++t->fails < proxy_config->max_fails) {
+    return;
+  }
+
+  uint64_t eject_time = proxy_config->eject_time;
+  for (int i = 0; i < t->ejections && eject_time < proxy_config->max_eject_time;
+       i++) {
+    eject_time *= 2;
+  }
+  if (eject_time > proxy_config->max_eject_time) {
+    eject_time = proxy_config->max_eject_time;
+  }
+  t->fails = 0;
+  t->ejections++;
+  t->ejected_until = now + eject_time;
+  balancer_update(&proxy_config->balancer, target);
+  log_warn("upstream %s ejected for %llus after %d failures", t->name,
+           (unsigned long long)(eject_time / 1000), proxy_config->max_fails);
+}
+
+static void health_close_cb(uv_handle_t *handle) {
+  health_probe_t *probe = handle->data;
+  if (--probe->handles > 0) {
+    return;
+  }
+  probe->proxy_config->balancer.targets[probe->target].probing = false;
+  config_release(probe->config);
+  free(probe);
+}
+
+static void health_finish(health_probe_t *probe, bool ok) {
+  if (probe->done) {
+    return;
+  }
+  probe->done = true;
+
+  proxy_config_t *proxy_config = probe->proxy_config;
+  upstream_target_t *target = &proxy_config->balancer.targets[probe->target];
+  if (target->probe_failed != !ok) {
+    if (ok) {
+      log_info("upstream %s is up", target->name);
+    } else {
+      log_warn("upstream %s is down", target->name);
+    }
+  }
+  // An ejection runs its course, a probe can pass while requests fail
+  target->probe_failed = !ok;
+  balancer_update(&proxy_config->balancer, probe->target);
+
+  uv_close((uv_handle_t *)&probe->tcp, health_close_cb);
+  uv_close((uv_handle_t *)&probe->timer, health_close_cb);
+}
+
+static void health_timer_cb(uv_timer_t *timer) {
+  health_finish(timer->data, false);
+}
+
+static void health_alloc_cb(uv_handle_t *handle, size_t suggested_size,
+                            uv_buf_t *buf) {
+  health_probe_t *probe = handle->data;
+  *buf = uv_buf_init(probe->status_line + probe->len,
+                     sizeof probe->status_line - probe->len);
+}
+
+// Only the status line matters, the rest of the response is not read
+static void health_read_cb(uv_stream_t *stream, ssize_t nread,
+                           const uv_buf_t *buf) {
+  health_probe_t *probe = stream->data;
+  if (nread < 0) {
+    health_finish(probe, false);
+    return;
+  }
+  probe->len += nread;
+  if (probe->len < sizeof probe->status_line) {
+    return;
+  }
+  // "HTTP/1.x NNN", the buffer holds exactly that and no terminator
+  const char *line = probe->status_line;
+  int status = 0;
+  if (strncmp(line, "HTTP/1.", 7) == 0 && line[8] == ' ' &&
+      isdigit((unsigned char)line[9]) && isdigit((unsigned char)line[10]) &&
+      isdigit((unsigned char)line[11])) {
+    status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+  }
+  health_finish(probe, status == probe->proxy_config->health_status);
+}
+
+static void health_write_cb(uv_write_t *req, int status) {
+  if (status < 0) {
+    health_finish(req->data, false);
+  }
+}
+
+static void health_connect_cb(uv_connect_t *req, int status) {
+  health_probe_t *probe = req->data;
+  if (status < 0 || probe->done) {
+    health_finish(probe, false);
+    return;
+  }
+  if (!probe->proxy_config->health_path) {
+    health_finish(probe, true);
+    return;
+  }
+
+  uv_buf_t buf = uv_buf_init(probe->request, strlen(probe->request));
+  probe->write.data = probe;
+  if (uv_write(&probe->write, (uv_stream_t *)&probe->tcp, &buf, 1,
+               health_write_cb) ||
+      uv_read_start((uv_stream_t *)&probe->tcp, health_alloc_cb,
+                    health_read_cb)) {
+    health_finish(probe, false);
+  }
+}
+
+static void health_probe(config_t *config, proxy_config_t *proxy_config,
+                         int target, uv_loop_t *loop) {
+  health_probe_t *probe = calloc(1, sizeof(health_probe_t));
+  upstream_target_t *t = &proxy_config->balancer.targets[target];
+  probe->config = config;
+  probe->proxy_config = proxy_config;
+  probe->target = target;
+  if (proxy_config->health_path) {
+    snprintf(probe->request, sizeof probe->request,
+             "GET %s HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "User-Agent: bproxy/%s\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             proxy_config->health_path,
+             proxy_config->num_hosts > 0 ? proxy_config->hosts[0] : t->name,
+             VERSION);
+  }
+  config->refs++;
+  t->probing = true;
+
+  probe->handles = 2;
+  probe->tcp.data = probe;
+  probe->timer.data = probe;
+  probe->connect.data = probe;
+  uv_tcp_init(loop, &probe->tcp);
+  uv_timer_init(loop, &probe->timer);
+  uv_timer_start(&probe->timer, health_timer_cb, proxy_config->health_timeout,
+                 0);
+  if (uv_tcp_connect(&probe->connect, &probe->tcp,
+                     (const struct sockaddr *)&t->addr, health_connect_cb)) {
+    health_finish(probe, false);
+  }
+}
+
+// Starts probes of targets which are due, called every second by the worker
+// using the configuration
+void health_check(config_t *config, uv_loop_t *loop, uint64_t now) {
+  for (int i = 0; i < config->num_proxies; i++) {
+    proxy_config_t *proxy_config = config->proxies[i];
+    if (proxy_config->health_interval == 0) {
+      continue;
+    }
+    balancer_t *balancer = &proxy_config->balancer;
+    for (int j = 0; j < balancer->num_targets; j++) {
+      upstream_target_t *target = &balancer->targets[j];
+      if (target->probing || target->next_probe > now) {
+        continue;
+      }
+      target->next_probe = now + proxy_config->health_interval;
+      health_probe(config, proxy_config, j, loop);
+    }
+  }
+}
@@ -0,0 +1,392 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "hpack.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <strings.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_HUFFMAN_MAX_BITS 30
+#define HPACK_HUFFMAN_EOS 256
+
+// RFC 7541 Appendix A
+static const struct {
+  const char *name;
+  const char *value;
+} hpack_static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+
+// The Huffman code of RFC 7541 Appendix B is canonical, so codes of each
+// length and the symbols in code order are all it takes to decode it
+static const uint8_t hpack_huffman_counts[HPACK_HUFFMAN_MAX_BITS + 1] = {
+    0, 0,  0,  0,  0,  10, 26, 32, 6,  0,  5, 3, 2, 6, 2, 3,
+    0, 0,  0,  3,  8,  13, 26, 29, 12, 4,  15, 19, 29, 0, 4};
+
+static const uint16_t hpack_huffman_symbols[] = {
+    48,  49,  50,  97,  99,  101, 105, 111, 115, 116, 32,  37,  45,  46,  47,
+    51,  52,  53,  54,  55,  56,  57,  61,  65,  95,  98,  100, 102, 103, 104,
+    108, 109, 110, 112, 114, 117, 58,  66,  67,  68,  69,  70,  71,  72,  73,
+    74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38,  42,  44,  59,  88,  90,  33,
+    34,  40,  41,  63,  39,  43,  124, 35,  62,  0,   36,  64,  91,  93,  126,
+    94,  125, 60,  96,  123, 92,  195, 208, 128, 130, 131, 162, 184, 194, 224,
+    226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181,
+    185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1,   135, 137, 138, 139,
+    140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174,
+    175, 180, 182, 183, 188, 191, 197, 231, 239, 9,   142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202,
+    205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2,
+    3,   4,   5,   6,   7,   8,   11,  12,  14,  15,  16,  17,  18,  19,  20,
+    21,  23,  24,  25,  26,  27,  28,  29,  30,  31,  127, 220, 249, 10,  13,
+    22,  256};
+
+void hpack_decoder_init(hpack_decoder_t *decoder) {
+  memset(decoder, 0, sizeof *decoder);
+  decoder->max_size = HPACK_TABLE_SIZE;
+}
+
+// Integers fit in 28 bits, anything larger is rejected
+static int hpack_integer(const uint8_t **p, const uint8_t *end, int prefix,
+                         uint32_t *value) {
+  if (*p >= end) {
+    return HPACK_ERROR;
+  }
+  uint32_t mask = (1 << prefix) - 1;
+  uint32_t v = *(*p)++ & mask;
+  if (v == mask) {
+    int shift = 0;
+    uint8_t b;
+    do {
+      if (*p >= end || shift > 21) {
+        return HPACK_ERROR;
+      }
+      b = *(*p)++;
+      v += (uint32_t)(b & 127) << shift;
+      shift += 7;
+    } while (b & 128);
+  }
+  *value = v;
+  return HPACK_OK;
+}
+
+// Decodes bit by bit, at every length a code is looked up among the codes of
+// that length (as puff.c in zlib does)
+static int hpack_huffman_decode(arena_t *arena, const uint8_t *data,
+                                size_t len, uint32_t *offset, size_t *out_len) {
+  // Codes are 5 bits at least
+  *offset = arena_alloc(arena, len * 8 / 5 + 1);
+  char *out = &arena->base[*offset];
+  size_t n = 0;
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code |= (data[i] >> bit) & 1;
+      int count = hpack_huffman_counts[++bits];
+      if (code - first < count) {
+        int symbol = hpack_huffman_symbols[index + code - first];
+        if (symbol == HPACK_HUFFMAN_EOS) {
+          return HPACK_ERROR;
+        }
+        out[n++] = symbol;
+        code = first = index = bits = 0;
+      } else {
+        if (bits == HPACK_HUFFMAN_MAX_BITS) {
+          return HPACK_ERROR;
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+    }
+  }
+  // Padding is the start of EOS, up to 7 one bits
+  if (bits > 7 || (code >> 1) != (1 << bits) - 1) {
+    return HPACK_ERROR;
+  }
+  out[n] = '\0';
+  *out_len = n;
+  return HPACK_OK;
+}
+
+// Copies a string literal into the strings of the block
+static int hpack_string(hpack_decoder_t *decoder, const uint8_t **p,
+                        const uint8_t *end, uint32_t *offset, size_t *len) {
+  if (*p >= end) {
+    return HPACK_ERROR;
+  }
+  bool huffman = **p & 0x80;
+  uint32_t length;
+  if (hpack_integer(p, end, 7, &length) || length > (size_t)(end - *p)) {
+    return HPACK_ERROR;
+  }
+  const uint8_t *data = *p;
+  *p += length;
+  if (huffman) {
+    return hpack_huffman_decode(&decoder->strings, data, length, offset, len);
+  }
+  *offset = arena_strndup(&decoder->strings, (const char *)data, length);
+  *len = length;
+  return HPACK_OK;
+}
+
+static void hpack_evict(hpack_decoder_t *decoder, size_t max_size) {
+  while (decoder->num > 0 && decoder->size > max_size) {
+    int last = (decoder->first + decoder->num - 1) % HPACK_MAX_ENTRIES;
+    hpack_entry_t *entry = &decoder->entries[last];
+    decoder->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    free(entry->name);
+    decoder->num--;
+  }
+}
+
+static int hpack_lookup(hpack_decoder_t *decoder, uint32_t index,
+                        hpack_entry_t *out) {
+  if (index == 0) {
+    return HPACK_ERROR;
+  }
+  if (index <= HPACK_STATIC_ENTRIES) {
+    out->name = (char *)hpack_static_table[index - 1].name;
+    out->name_len = strlen(out->name);
+    out->value = hpack_static_table[index - 1].value;
+    out->value_len = strlen(out->value);
+    return HPACK_OK;
+  }
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= (uint32_t)decoder->num) {
+    return HPACK_ERROR;
+  }
+  *out = decoder->entries[(decoder->first + index) % HPACK_MAX_ENTRIES];
+  return HPACK_OK;
+}
+
+// Copies the field into a new entry before evicting, as the name may refer
+// to an entry being evicted. Entries larger than the table only empty it.
+static int hpack_insert(hpack_decoder_t *decoder, hpack_entry_t *field,
+                        hpack_header_cb cb, void *arg) {
+  hpack_entry_t entry;
+  entry.name = malloc(field->name_len + field->value_len + 2);
+  memcpy(entry.name, field->name, field->name_len);
+  entry.name[field->name_len] = '\0';
+  entry.name_len = field->name_len;
+  char *value = entry.name + field->name_len + 1;
+  memcpy(value, field->value, field->value_len);
+  value[field->value_len] = '\0';
+  entry.value = value;
+  entry.value_len = field->value_len;
+
+  size_t size = entry.name_len + entry.value_len + HPACK_ENTRY_OVERHEAD;
+  if (size > decoder->max_size) {
+    hpack_evict(decoder, 0);
+    int err = cb(arg, entry.name, entry.name_len, entry.value, entry.value_len);
+    free(entry.name);
+    return err;
+  }
+  hpack_evict(decoder, decoder->max_size - size);
+  decoder->first = (decoder->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+  decoder->entries[decoder->first] = entry;
+  decoder->num++;
+  decoder->size += size;
+  return cb(arg, entry.name, entry.name_len, entry.value, entry.value_len);
+}
+
+// Decodes one complete header block. Errors leave the table out of sync
+// with the peer, so they end the connection.
+int hpack_decode(hpack_decoder_t *decoder, const uint8_t *data, size_t len,
+                 hpack_header_cb cb, void *arg) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  arena_reset(&decoder->strings);
+  while (p < end) {
+    uint8_t b = *p;
+    uint32_t index;
+    hpack_entry_t field;
+    if (b & 0x80) {
+      if (hpack_integer(&p, end, 7, &index) ||
+          hpack_lookup(decoder, index, &field)) {
+        return HPACK_ERROR;
+      }
+      if (cb(arg, field.name, field.name_len, field.value, field.value_len)) {
+        return HPACK_ERROR;
+      }
+      continue;
+    }
+    if ((b & 0xe0) == 0x20) {
+      uint32_t size;
+      if (hpack_integer(&p, end, 5, &size) || size > HPACK_TABLE_SIZE) {
+        return HPACK_ERROR;
+      }
+      decoder->max_size = size;
+      hpack_evict(decoder, size);
+      continue;
+    }
+
+    // Literal, added to the table with incremental indexing only
+    bool indexing = b & 0x40;
+    if (hpack_integer(&p, end, indexing ? 6 : 4, &index)) {
+      return HPACK_ERROR;
+    }
+    uint32_t name_offset = 0;
+    if (index == 0) {
+      if (hpack_string(decoder, &p, end, &name_offset, &field.name_len)) {
+        return HPACK_ERROR;
+      }
+    } else if (hpack_lookup(decoder, index, &field)) {
+      return HPACK_ERROR;
+    }
+    uint32_t value_offset;
+    if (hpack_string(decoder, &p, end, &value_offset, &field.value_len)) {
+      return HPACK_ERROR;
+    }
+    // Strings may have moved as the arena grew
+    if (index == 0) {
+      field.name = &decoder->strings.base[name_offset];
+    }
+    field.value = &decoder->strings.base[value_offset];
+    if (indexing) {
+      if (hpack_insert(decoder, &field, cb, arg)) {
+        return HPACK_ERROR;
+      }
+    } else if (cb(arg, field.name, field.name_len, field.value,
+                  field.value_len)) {
+      return HPACK_ERROR;
+    }
+  }
+  return HPACK_OK;
+}
+
+void hpack_decoder_free(hpack_decoder_t *decoder) {
+  hpack_evict(decoder, 0);
+  arena_free(&decoder->strings);
+}
+
+static size_t hpack_put_integer(char *out, uint8_t first, int prefix,
+                                size_t value) {
+  size_t mask = (1 << prefix) - 1;
+  if (value < mask) {
+    out[0] = first | value;
+    return 1;
+  }
+  out[0] = first | mask;
+  value -= mask;
+  size_t n = 1;
+  while (value >= 128) {
+    out[n++] = (value & 127) | 128;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+// Strings are sent as they are, Huffman coding them is not worth the time
+static size_t hpack_put_string(char *out, const char *data, size_t len,
+                               bool lower) {
+  size_t n = hpack_put_integer(out, 0, 7, len);
+  for (size_t i = 0; i < len; i++) {
+    out[n + i] = lower ? tolower((unsigned char)data[i]) : data[i];
+  }
+  return n + len;
+}
+
+size_t hpack_encode_status(char *out, int status) {
+  char value[8];
+  snprintf(value, sizeof value, "%03d", status);
+  for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+    if (strcmp(hpack_static_table[i].name, ":status") == 0 &&
+        strcmp(hpack_static_table[i].value, value) == 0) {
+      return hpack_put_integer(out, 0x80, 7, i + 1);
+    }
+  }
+  // Literal without indexing, name of static entry 8
+  size_t n = hpack_put_integer(out, 0, 4, 8);
+  return n + hpack_put_string(out + n, value, strlen(value), false);
+}
+
+// Literal without indexing, names are lowercased as HTTP/2 requires
+size_t hpack_encode_header(char *out, const char *name, size_t name_len,
+                           const char *value, size_t value_len) {
+  size_t n = 0;
+  for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+    const char *static_name = hpack_static_table[i].name;
+    if (strlen(static_name) == name_len &&
+        strncasecmp(static_name, name, name_len) == 0) {
+      n = hpack_put_integer(out, 0, 4, i + 1);
+      break;
+    }
+  }
+  if (n == 0) {
+    out[n++] = 0;
+    n += hpack_put_string(out + n, name, name_len, true);
+  }
+  return n + hpack_put_string(out + n, value, value_len, false);
+}
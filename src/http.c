@@ -15,49 +15,153 @@
     (*d) = '\0';            \
   } while (0);
 
+// Strings of the previous request are not used anymore, its response was
+// sent before the next request is parsed
 int message_begin_cb(http_parser *p) {
   http_link_context_t *context = p->data;
   http_request_t *request = &context->request;
-  for (int i = 0; i < MAX_HEADERS; i++) {
-    request->headers[i][0][0] = 0;
-    request->headers[i][1][0] = 0;
-  }
-  request->num_headers = 0;
-  request->last_header_element = NONE;
+  http_headers_reset(&request->headers);
+  request->host[0] = '\0';
+  request->hostname[0] = '\0';
   request->upgrade = 0;
   request->keepalive = 0;
+  context->pending_responses++;
   return 0;
 }
 
 int url_cb(http_parser *p, const char *buf, size_t len) {
   http_link_context_t *context = p->data;
-  http_request_t *request = &context->request;
-  free(request->url);
-  request->url = malloc((len + 1) * sizeof(char));
-  memcpy(request->url, buf, len);
-  request->url[len] = '\0';
+  http_headers_t *headers = &context->request.headers;
+  if (headers->last == URL) {
+    arena_strncat(&headers->arena, buf, len);
+    context->request.url.len += len;
+  } else {
+    context->request.url = http_slice(headers, buf, len);
+  }
+  headers->last = URL;
   return 0;
 }
 
+static void http_headers_grow(http_headers_t *headers) {
+  if (headers->num == headers->max) {
+    headers->max = headers->max ? headers->max * 2 : 16;
+    headers->list =
+        realloc(headers->list, headers->max * sizeof(*headers->list));
+  }
+}
+
+// Parser callbacks may deliver an element in several pieces, which are
+// contiguous in the arena as nothing else is stored in between
+void http_headers_field(http_headers_t *headers, const char *buf,
+                        size_t len) {
+  http_header_t *header;
+  if (headers->last == FIELD) {
+    header = &headers->list[headers->num - 1];
+    arena_strncat(&headers->arena, buf, len);
+    header->name.len += len;
+  } else {
+    http_headers_grow(headers);
+    header = &headers->list[headers->num++];
+    header->name = http_slice(headers, buf, len);
+  }
+  // Empty until a value arrives, the terminator of the name serves as ""
+  header->value.offset = header->name.offset + header->name.len;
+  header->value.len = 0;
+  headers->last = FIELD;
+}
+
+void http_headers_value(http_headers_t *headers, const char *buf,
+                        size_t len) {
+  http_header_t *header = &headers->list[headers->num - 1];
+  if (headers->last == VALUE) {
+    arena_strncat(&headers->arena, buf, len);
+    header->value.len += len;
+  } else {
+    header->value = http_slice(headers, buf, len);
+  }
+  headers->last = VALUE;
+}
+
 int headers_field_cb(http_parser *p, const char *buf, size_t len) {
   http_link_context_t *context = p->data;
-  http_request_t *request = &context->request;
-  if (request->last_header_element != FIELD) {
-    request->num_headers++;
-  }
-  strncat(request->headers[request->num_headers - 1][0], buf, len);
-  request->last_header_element = FIELD;
+  http_headers_field(&context->request.headers, buf, len);
   return 0;
 }
 
 int headers_value_cb(http_parser *p, const char *buf, size_t len) {
   http_link_context_t *context = p->data;
-  http_request_t *request = &context->request;
-  strncat(request->headers[request->num_headers - 1][1], buf, len);
-  request->last_header_element = VALUE;
+  http_headers_value(&context->request.headers, buf, len);
   return 0;
 }
 
+http_slice_t http_slice(http_headers_t *headers, const char *data,
+                        size_t len) {
+  http_slice_t slice = {arena_strndup(&headers->arena, data, len), len};
+  return slice;
+}
+
+// Valid until the next string is stored
+char *http_str(const http_headers_t *headers, http_slice_t slice) {
+  return &headers->arena.base[slice.offset];
+}
+
+// Value of the first header called name, NULL when missing
+const char *http_header_find(const http_headers_t *headers, const char *name) {
+  for (int i = 0; i < headers->num; i++) {
+    if (strcasecmp(http_str(headers, headers->list[i].name), name) == 0) {
+      return http_str(headers, headers->list[i].value);
+    }
+  }
+  return NULL;
+}
+
+void http_headers_add(http_headers_t *headers, const char *name,
+                      const char *value) {
+  http_headers_grow(headers);
+  http_header_t *header = &headers->list[headers->num++];
+  header->name = http_slice(headers, name, strlen(name));
+  header->value = http_slice(headers, value, strlen(value));
+  headers->last = NONE;
+}
+
+void http_headers_reset(http_headers_t *headers) {
+  arena_reset(&headers->arena);
+  if (headers->max > HTTP_KEEP_HEADERS) {
+    free(headers->list);
+    headers->list = NULL;
+    headers->max = 0;
+  }
+  headers->num = 0;
+  headers->last = NONE;
+}
+
+// Request line as forwarded upstream, built from the parsed parts as the
+// line may have been split across reads
+static http_slice_t http_request_line(http_request_t *request) {
+  http_headers_t *headers = &request->headers;
+  const char *method = http_method_str(request->method);
+  char version[16];
+  snprintf(version, sizeof(version), " HTTP/%d.%d", request->http_major,
+           request->http_minor);
+
+  size_t len = strlen(method) + 1 + request->url.len + strlen(version);
+  http_slice_t slice = {arena_alloc(&headers->arena, len + 1), len};
+  char *c = http_str(headers, slice);
+  APPEND_STRING(c, method);
+  APPEND_STRING(c, " ");
+  APPEND_STRING(c, http_str(headers, request->url));
+  APPEND_STRING(c, version);
+  return slice;
+}
+
+void http_headers_free(http_headers_t *headers) {
+  arena_free(&headers->arena);
+  free(headers->list);
+  headers->list = NULL;
+  headers->num = 0;
+  headers->max = 0;
+}
+
 int headers_complete_cb(http_parser *p) {
   http_link_context_t *context = p->data;
   http_request_t *request = &context->request;
@@ -67,17 +171,24 @@ int headers_complete_cb(http_parser *p) {
   request->method = p->method;
   request->upgrade = p->upgrade;
   request->content_length = p->content_length;
+  request->status_line = http_request_line(request);
 
   request->enable_compression = false;
 
-  for (int i = 0; i < request->num_headers; i++) {
-    if (strcasecmp(request->headers[i][0], "Host") == 0) {
-      int nob = strlen(request->headers[i][1]);
-      memcpy(request->host, request->headers[i][1], nob);
-      request->host[nob] = '\0';
+  http_headers_t *headers = &request->headers;
+  for (int i = 0; i < headers->num; i++) {
+    const char *name = http_str(headers, headers->list[i].name);
+    const char *value = http_str(headers, headers->list[i].value);
+    if (strcasecmp(name, "Host") == 0) {
+      // No DNS name is this long, the request is answered with 400
+      if (strlen(value) >= sizeof(request->host)) {
+        log_warn("refused Host header of %zu bytes", strlen(value));
+        return -1;
+      }
+      strcpy(request->host, value);
       parse_requested_host(request);
-    } else if (strcasecmp(request->headers[i][0], "Accept-Encoding") == 0) {
-      if (strstr(request->headers[i][1], "gzip")) {
+    } else if (strcasecmp(name, "Accept-Encoding") == 0) {
+      if (strstr(value, "gzip")) {
         request->enable_compression = true;
       }
     }
@@ -85,16 +196,14 @@ int headers_complete_cb(http_parser *p) {
 
   // Proxy headers
   char *proto = context->https ? "https" : "http";
-
-  strcpy(request->headers[request->num_headers][0], "X-Forwarded-For");
-  strcpy(request->headers[request->num_headers++][1], context->peer_ip);
-
-  strcpy(request->headers[request->num_headers][0], "X-Forwarded-Host");
-  strcpy(request->headers[request->num_headers++][1], request->host);
-
-  strcpy(request->headers[request->num_headers][0], "X-Forwarded-Proto");
-  strcpy(request->headers[request->num_headers++][1], proto);
-
+  http_headers_add(headers, "X-Forwarded-For", context->peer_ip);
+  http_headers_add(headers, "X-Forwarded-Host", request->host);
+  http_headers_add(headers, "X-Forwarded-Proto", proto);
+
+  http_cache_request(context);
+  request->headers_received = true;
+  // Stop here so the framer knows where headers end
+  http_parser_pause(p, 1);
   return 0;
 }
 
@@ -103,6 +212,8 @@ int body_cb(http_parser *p, const char *buf, size_t length) { return 0; }
 int message_complete_cb(http_parser *p) {
   http_link_context_t *context = p->data;
   context->request.complete = true;
+  // A pipelined request after this one waits for its response
+  http_parser_pause(p, 1);
   return 0;
 }
 
@@ -168,7 +279,7 @@ void http_301_response(char *resp, const http_request_t *request,
                        unsigned short port) {
   char new_url[3072];
   snprintf(new_url, 1024, "https://%s:%d%s", request->hostname, port,
-           request->url);
+           http_str(&request->headers, request->url));
   snprintf(resp, 4096,
            "HTTP/1.1 301 Moved Permanently\r\n"
            "Content-Length: %ld\r\n"
@@ -191,34 +302,20 @@ void http_301_response(char *resp, const http_request_t *request,
 
 int response_message_begin_cb(http_parser *p) {
   http_link_context_t *context = p->data;
-  http_response_t *response = &context->response;
-  for (int i = 0; i < MAX_HEADERS; i++) {
-    response->headers[i][0][0] = 0;
-    response->headers[i][1][0] = 0;
-  }
-  response->num_headers = 0;
-  response->last_header_element = NONE;
-  response->expected_data_len = 0;
-  response->processed_data_len = 0;
+  context->response.headers.num = 0;
+  context->response.headers.last = NONE;
   return 0;
 }
 
 int response_headers_field_cb(http_parser *p, const char *buf, size_t len) {
   http_link_context_t *context = p->data;
-  http_response_t *response = &context->response;
-  if (response->last_header_element != FIELD) {
-    response->num_headers++;
-  }
-  strncat(response->headers[response->num_headers - 1][0], buf, len);
-  response->last_header_element = FIELD;
+  http_headers_field(&context->response.headers, buf, len);
   return 0;
 }
 
 int response_headers_value_cb(http_parser *p, const char *buf, size_t len) {
   http_link_context_t *context = p->data;
-  http_response_t *response = &context->response;
-  strncat(response->headers[response->num_headers - 1][1], buf, len);
-  response->last_header_element = VALUE;
+  http_headers_value(&context->response.headers, buf, len);
   return 0;
 }
 
@@ -228,72 +325,370 @@ int response_headers_complete_cb(http_parser *p) {
   context->response.enable_compression = false;
   boolean already_compressed = false;
 
-  for (int i = 0; i < response->num_headers; i++) {
-    if (strcasecmp(response->headers[i][0], "Content-Type") == 0) {
+  http_headers_t *headers = &response->headers;
+  for (int i = 0; i < headers->num; i++) {
+    const char *name = http_str(headers, headers->list[i].name);
+    if (strcasecmp(name, "Content-Type") == 0) {
+      const char *value = http_str(headers, headers->list[i].value);
       for (int j = 0; j < context->server_config->num_gzip_mime_types; j++) {
-        if (strstr(response->headers[i][1],
-                   context->server_config->gzip_mime_types[j])) {
+        if (strstr(value, context->server_config->gzip_mime_types[j])) {
           response->enable_compression = true;
           continue;
         }
       }
-    } else if (strcasecmp(response->headers[i][0], "Content-Encoding") == 0) {
+    } else if (strcasecmp(name, "Content-Encoding") == 0) {
       already_compressed = true;
-    } else if (strcasecmp(response->headers[i][0], "Content-Length") == 0) {
-      response->expected_data_len = atoi(response->headers[i][1]);
     }
   }
 
-  if (already_compressed) {
+  // Only compress responses which carry a body the client asked to gzip
+  if (already_compressed || context->type != TYPE_REQUEST ||
+      !context->request.enable_compression ||
+      context->request.method == HTTP_HEAD || p->status_code < 200 ||
+      p->status_code == 204 || p->status_code == 304) {
     response->enable_compression = false;
   }
+  if (response->enable_compression) {
+    gzip_job_free(response->gzip_job);
+    response->gzip_job = NULL;
+    gzip_free_state(response->gzip_state);
+    free(response->gzip_state);
+    response->gzip_state = malloc(sizeof(gzip_state_t));
+    if (gzip_init_state(response->gzip_state) != Z_OK) {
+      log_error("could not initialize gzip stream");
+      free(response->gzip_state);
+      response->gzip_state = NULL;
+      response->enable_compression = false;
+    }
+  }
+  // Large bodies and bodies of unknown length are compressed off the loop
+  config_t *config = context->server_config;
+  if (response->enable_compression && config->gzip_offload &&
+      (p->content_length == ULLONG_MAX ||
+       p->content_length >= config->gzip_offload_min_size)) {
+    response->gzip_job = gzip_job_new(context->buffers, response->gzip_state,
+                                      http_gzip_job_cb, context);
+    response->gzip_state = NULL;
+  }
+  http_cache_response(context);
   response->headers_received = true;
-  return -1;
+  // Stop here so the caller knows where headers end, parsing is resumed to
+  // find the end of the body
+  http_parser_pause(p, 1);
+  return context->request.method == HTTP_HEAD ? 1 : 0;
 }
 
-void http_init_response_headers(http_response_t *response, bool compressed) {
-  response->http_header[0] = '\0';
-  char *c = response->http_header;
-  APPEND_STRING(c, response->status_line);
-  APPEND_STRING(c, "\r\n");
-  for (int i = 0; i < response->num_headers; ++i) {
-    // Skip responses of non compressed headers
-    if (compressed &&
-        (strcasecmp(response->headers[i][0], "Content-Length") == 0 ||
-         strcasecmp(response->headers[i][0], "Accept-Ranges") == 0)) {
+// Compresses data into frames of the client write queue, the stream is
+// flushed on every call so frames never wait for more upstream data.
+static void response_gzip(http_link_context_t *context, const char *data,
+                          size_t len, bool finish) {
+  http_response_t *response = &context->response;
+  if (response->gzip_job) {
+    gzip_job_push(response->gzip_job, data, len, finish);
+    return;
+  }
+  uint64_t start = uv_hrtime();
+  gzip_input(response->gzip_state, data, len);
+  do {
+    char *out = buf_pool_alloc(context->buffers, GZIP_FRAME_SIZE);
+    char *frame;
+    size_t frame_len = gzip_frame(response->gzip_state, out, finish, &frame);
+    if (frame_len == 0) {
+      buf_free(out);
       continue;
     }
+    http_response_add_frame(response, uv_buf_init(frame, frame_len));
+    METRICS_ADD(context->metrics->gzip_bytes_out, frame_len);
+  } while (response->gzip_state->pending);
+  METRICS_ADD(context->metrics->gzip_time, uv_hrtime() - start);
+}
 
-    APPEND_STRING(c, response->headers[i][0]);
+int response_body_cb(http_parser *p, const char *buf, size_t length) {
+  http_link_context_t *context = p->data;
+  if (context->response.enable_compression) {
+    METRICS_ADD(context->metrics->gzip_bytes_in, length);
+    response_gzip(context, buf, length, false);
+  }
+  return 0;
+}
+
+int response_message_complete_cb(http_parser *p) {
+  http_link_context_t *context = p->data;
+  http_response_t *response = &context->response;
+  // Informational responses are followed by the final one
+  if (p->status_code >= 100 && p->status_code < 200 && p->status_code != 101) {
+    return 0;
+  }
+  response->complete = true;
+  response->keepalive = http_should_keep_alive(p);
+  if (response->enable_compression) {
+    response_gzip(context, NULL, 0, true);
+  }
+  if (context->pending_responses > 0) {
+    context->pending_responses--;
+  }
+  return 0;
+}
+
+// Skips headers which don't apply to the compressed body
+static bool http_compressed_skip(const char *name) {
+  return strcasecmp(name, "Content-Length") == 0 ||
+         strcasecmp(name, "Transfer-Encoding") == 0 ||
+         strcasecmp(name, "Accept-Ranges") == 0;
+}
+
+// Serializes the status line and headers into the arena. Its size is known
+// before copying, so the strings being copied don't move.
+static http_slice_t http_serialize_headers(http_headers_t *headers,
+                                           http_slice_t status_line,
+                                           bool compressed) {
+  static const char *gzip_headers =
+      "Transfer-Encoding: chunked\r\nContent-Encoding: gzip\r\n";
+  char via[100];
+  snprintf(via, sizeof(via), "Via: bproxy %s\r\n\r\n", VERSION);
+
+  size_t len = status_line.len + 2 + strlen(via);
+  for (int i = 0; i < headers->num; i++) {
+    http_header_t *header = &headers->list[i];
+    if (!compressed || !http_compressed_skip(http_str(headers, header->name))) {
+      len += header->name.len + header->value.len + 4;
+    }
+  }
+  if (compressed) {
+    len += strlen(gzip_headers);
+  }
+
+  http_slice_t slice = {arena_alloc(&headers->arena, len + 1), len};
+  char *c = http_str(headers, slice);
+  APPEND_STRING(c, http_str(headers, status_line));
+  APPEND_STRING(c, "\r\n");
+  for (int i = 0; i < headers->num; i++) {
+    http_header_t *header = &headers->list[i];
+    const char *name = http_str(headers, header->name);
+    if (compressed && http_compressed_skip(name)) {
+      continue;
+    }
+    APPEND_STRING(c, name);
     APPEND_STRING(c, ": ");
-    APPEND_STRING(c, response->headers[i][1]);
+    APPEND_STRING(c, http_str(headers, header->value));
     APPEND_STRING(c, "\r\n");
   }
   if (compressed) {
-    // Add gzip headers
-    APPEND_STRING(c, "Transfer-Encoding: chunked\r\n");
-    APPEND_STRING(c, "Content-Encoding: gzip\r\n");
+    APPEND_STRING(c, gzip_headers);
   }
-  char name_and_version[100];
-  sprintf(name_and_version, "Via: bproxy %s\r\n\r\n", VERSION);
-  APPEND_STRING(c, name_and_version);
-  response->http_header_len = strlen(response->http_header);
+  APPEND_STRING(c, via);
+  return slice;
+}
+
+void http_init_response_headers(http_response_t *response, bool compressed) {
+  response->http_header = http_serialize_headers(
+      &response->headers, response->status_line, compressed);
+}
+
+void http_response_add_frame(http_response_t *response, uv_buf_t frame) {
+  if (response->num_gzip_frames == response->max_gzip_frames) {
+    response->max_gzip_frames =
+        response->max_gzip_frames ? response->max_gzip_frames * 2 : 4;
+    response->gzip_frames =
+        realloc(response->gzip_frames,
+                response->max_gzip_frames * sizeof(*response->gzip_frames));
+  }
+  response->gzip_frames[response->num_gzip_frames++] = frame;
 }
 
 void http_init_request_headers(http_link_context_t *context) {
   http_request_t *request = &context->request;
-  request->http_header[0] = '\0';
-  char *c = request->http_header;
+  request->http_header =
+      http_serialize_headers(&request->headers, request->status_line, false);
+}
 
-  APPEND_STRING(c, request->status_line);
-  APPEND_STRING(c, "\r\n");
-  for (int i = 0; i < request->num_headers; ++i) {
-    APPEND_STRING(c, request->headers[i][0]);
-    APPEND_STRING(c, ": ");
-    APPEND_STRING(c, request->headers[i][1]);
-    APPEND_STRING(c, "\r\n");
+// Drops cache state of the previous request
+void http_cache_reset(http_link_context_t *context) {
+  cache_release(context->cache_entry);
+  cache_release(context->cache_pending);
+  free(context->cache_key);
+  context->cache_entry = NULL;
+  context->cache_pending = NULL;
+  context->cache_key = NULL;
+  context->cache_hit = false;
+}
+
+// Looks up GET requests of gzip capable clients. A fresh entry is served by
+// the caller without contacting upstream, a stale one is revalidated by
+// turning the request into a conditional one.
+void http_cache_request(http_link_context_t *context) {
+  http_request_t *request = &context->request;
+  http_cache_reset(context);
+  if (!context->cache || request->method != HTTP_GET || request->upgrade ||
+      !request->enable_compression) {
+    return;
   }
 
-  APPEND_STRING(c, "\r\n");
-  request->http_header_len = strlen(request->http_header);
+  http_headers_t *headers = &request->headers;
+  bool lookup = true;
+  for (int i = 0; i < headers->num; i++) {
+    const char *name = http_str(headers, headers->list[i].name);
+    const char *value = http_str(headers, headers->list[i].value);
+    if (strcasecmp(name, "Authorization") == 0 ||
+        strcasecmp(name, "If-None-Match") == 0 ||
+        strcasecmp(name, "If-Modified-Since") == 0 ||
+        strcasecmp(name, "Range") == 0) {
+      // Only upstream knows how to answer these
+      return;
+    } else if ((strcasecmp(name, "Cache-Control") == 0 ||
+                strcasecmp(name, "Pragma") == 0) &&
+               strstr(value, "no-cache")) {
+      lookup = false;
+    }
+  }
+
+  const char *url = http_str(headers, request->url);
+  size_t len = strlen(request->host) + request->url.len + 16;
+  context->cache_key = malloc(len);
+  snprintf(context->cache_key, len, "%s://%s%s gzip",
+           context->https ? "https" : "http", request->host, url);
+  if (!lookup) {
+    cache_count(context->cache, CACHE_MISS);
+    return;
+  }
+
+  cache_entry_t *entry = cache_lookup(context->cache, context->cache_key);
+  if (entry && cache_fresh(entry)) {
+    context->cache_entry = entry;
+    context->cache_hit = true;
+  } else if (entry && (entry->etag || entry->last_modified)) {
+    if (entry->etag) {
+      http_headers_add(headers, "If-None-Match", entry->etag);
+    }
+    if (entry->last_modified) {
+      http_headers_add(headers, "If-Modified-Since", entry->last_modified);
+    }
+    context->cache_entry = entry;
+  } else {
+    cache_release(entry);
+    cache_count(context->cache, CACHE_MISS);
+  }
+}
+
+// Directives of all Cache-Control fields of a response
+typedef struct http_cache_control_s {
+  bool no_store;
+  bool no_cache;
+  int max_age;
+  int s_maxage;
+} http_cache_control_t;
+
+// Adds the directives of one Cache-Control field. Directives are compared
+// whole, so quoted arguments like no-cache="Set-Cookie" don't match others.
+static void http_cache_control(const char *value, http_cache_control_t *cc) {
+  const char *p = value;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    const char *name = p;
+    while (*p && *p != '=' && *p != ',' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    size_t name_len = p - name;
+    const char *arg = NULL;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '=') {
+      p++;
+      if (*p == '"') {
+        for (p++; *p && *p != '"'; p++) {
+          if (*p == '\\' && p[1]) {
+            p++;
+          }
+        }
+        if (*p == '"') {
+          p++;
+        }
+      } else {
+        arg = p;
+      }
+    }
+    while (*p && *p != ',') {
+      p++;
+    }
+    if (name_len == 0) {
+      continue;
+    }
+    if (name_len == 8 && strncasecmp(name, "no-store", 8) == 0) {
+      cc->no_store = true;
+    } else if (name_len == 7 && strncasecmp(name, "private", 7) == 0) {
+      cc->no_store = true;
+    } else if (name_len == 8 && strncasecmp(name, "no-cache", 8) == 0) {
+      cc->no_cache = true;
+    } else if (name_len == 7 && strncasecmp(name, "max-age", 7) == 0 &&
+               arg) {
+      cc->max_age = atoi(arg);
+    } else if (name_len == 8 && strncasecmp(name, "s-maxage", 8) == 0 &&
+               arg) {
+      cc->s_maxage = atoi(arg);
+    }
+  }
+}
+
+// Decides whether the response is stored, honouring Cache-Control and Vary.
+// A 304 answer to a revalidation keeps the stored entry.
+void http_cache_response(http_link_context_t *context) {
+  http_response_t *response = &context->response;
+  int status = response->parser.status_code;
+  if (!context->cache_key || status < 200) {
+    return;
+  }
+  cache_release(context->cache_pending);
+  context->cache_pending = NULL;
+
+  bool cacheable = status == 200 && response->enable_compression;
+  http_cache_control_t cc = {false, false, -1, -1};
+  const char *etag = NULL;
+  const char *last_modified = NULL;
+  http_headers_t *headers = &response->headers;
+  for (int i = 0; i < headers->num; i++) {
+    const char *name = http_str(headers, headers->list[i].name);
+    const char *value = http_str(headers, headers->list[i].value);
+    if (strcasecmp(name, "Cache-Control") == 0) {
+      http_cache_control(value, &cc);
+    } else if (strcasecmp(name, "Vary") == 0) {
+      // Bodies only vary by encoding, which is part of the key
+      if (value[0] && strcasecmp(value, "Accept-Encoding") != 0) {
+        cacheable = false;
+      }
+    } else if (strcasecmp(name, "Set-Cookie") == 0) {
+      cacheable = false;
+    } else if (strcasecmp(name, "ETag") == 0) {
+      etag = value;
+    } else if (strcasecmp(name, "Last-Modified") == 0) {
+      last_modified = value;
+    }
+  }
+  // Fields are combined first, no-store, private and no-cache win over any
+  // max-age
+  int max_age = cc.s_maxage >= 0 ? cc.s_maxage : cc.max_age;
+  if (cc.no_store) {
+    cacheable = false;
+  }
+  if (cc.no_cache || max_age < 0) {
+    max_age = 0;
+  }
+  uint64_t expires = cache_now() + (max_age > 0 ? max_age * 1000ull : 0);
+
+  if (context->cache_entry) {
+    if (status == 304) {
+      cache_refresh(context->cache_entry, expires);
+      cache_count(context->cache, CACHE_REVALIDATED);
+      return;
+    }
+    cache_release(context->cache_entry);
+    context->cache_entry = NULL;
+    cache_count(context->cache, CACHE_MISS);
+  }
+  if (cacheable && (max_age > 0 || etag || last_modified)) {
+    context->cache_pending = cache_entry_new(
+        context->cache, context->cache_key, etag, last_modified, expires);
+  }
 }
@@ -0,0 +1,1387 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "http2.h"
+
+#include "log.h"
+
+// Chunks of body take one 16 KB pool block each
+#define HTTP2_DATA_SIZE (HTTP2_MAX_FRAME_SIZE - sizeof(http2_data_t))
+
+#define HTTP2_SETTINGS_ENABLE_PUSH 0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Frames of one write to the connection. Stream writes complete the write
+// of the stream's chain once the frames were written.
+typedef struct http2_write_s {
+  QUEUE member;
+  // Write without frames, completed from the idle handle
+  QUEUE empty_member;
+  // NULL for frames of the session and once the stream was closed
+  http2_stream_t *stream;
+  uv_link_t *source;
+  uv_link_write_cb cb;
+  void *arg;
+  uv_link_t *shutdown_source;
+  uv_link_shutdown_cb shutdown_cb;
+  void *shutdown_arg;
+  // Frames end the response
+  bool ended;
+  // Body held back by flow control
+  bool flushed;
+  unsigned int nbufs;
+  uv_buf_t bufs[];
+} http2_write_t;
+
+static int http2_response_begin_cb(http_parser *p);
+static int http2_response_field_cb(http_parser *p, const char *buf,
+                                   size_t len);
+static int http2_response_value_cb(http_parser *p, const char *buf,
+                                   size_t len);
+static int http2_response_headers_cb(http_parser *p);
+static int http2_response_body_cb(http_parser *p, const char *buf, size_t len);
+static int http2_response_complete_cb(http_parser *p);
+
+// clang-format off
+static http_parser_settings http2_response_settings =
+{
+  .on_message_begin = http2_response_begin_cb,
+  .on_header_field = http2_response_field_cb,
+  .on_header_value = http2_response_value_cb,
+  .on_headers_complete = http2_response_headers_cb,
+  .on_body = http2_response_body_cb,
+  .on_message_complete = http2_response_complete_cb
+};
+// clang-format on
+
+uv_link_methods_t http2_stream_methods;
+uv_link_methods_t http2_session_methods;
+
+static uint32_t http2_get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void http2_put32(char *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static size_t http2_frame_length(const uint8_t *frame) {
+  return (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+}
+
+static void http2_frame_header(char *out, size_t len, uint8_t type,
+                               uint8_t flags, uint32_t id) {
+  out[0] = len >> 16;
+  out[1] = len >> 8;
+  out[2] = len;
+  out[3] = type;
+  out[4] = flags;
+  http2_put32(&out[5], id);
+}
+
+static bool http2_equals(const char *a, size_t len, const char *b) {
+  return strlen(b) == len && memcmp(a, b, len) == 0;
+}
+
+// Copies pieces to the tail of queue, filling up its last chunk first, and
+// returns the last chunk
+static http2_data_t *http2_data_push(buf_pool_t *buffers, QUEUE *queue,
+                                     const uv_buf_t *pieces,
+                                     unsigned int npieces) {
+  http2_data_t *data = NULL;
+  if (!QUEUE_EMPTY(queue)) {
+    data = QUEUE_DATA(QUEUE_PREV(queue), http2_data_t, member);
+  }
+  for (unsigned int i = 0; i < npieces; i++) {
+    const char *base = pieces[i].base;
+    size_t len = pieces[i].len;
+    while (len > 0) {
+      if (!data || data->len == HTTP2_DATA_SIZE) {
+        data = buf_pool_alloc(buffers, HTTP2_MAX_FRAME_SIZE);
+        data->len = 0;
+        data->offset = 0;
+        data->window = 0;
+        QUEUE_INSERT_TAIL(queue, &data->member);
+      }
+      size_t n = HTTP2_DATA_SIZE - data->len;
+      if (n > len) {
+        n = len;
+      }
+      memcpy(&data->data[data->len], base, n);
+      data->len += n;
+      base += n;
+      len -= n;
+    }
+  }
+  return data;
+}
+
+static void http2_data_free(QUEUE *queue) {
+  while (!QUEUE_EMPTY(queue)) {
+    QUEUE *q = QUEUE_HEAD(queue);
+    QUEUE_REMOVE(q);
+    buf_free(QUEUE_DATA(q, http2_data_t, member));
+  }
+}
+
+static http2_write_t *http2_write_new(buf_pool_t *buffers,
+                                      unsigned int nbufs) {
+  http2_write_t *req =
+      buf_pool_alloc(buffers, sizeof *req + nbufs * sizeof(uv_buf_t));
+  memset(req, 0, sizeof *req);
+  req->nbufs = nbufs;
+  return req;
+}
+
+static void http2_write_free(http2_write_t *req) {
+  for (unsigned int i = 0; i < req->nbufs; i++) {
+    buf_free(req->bufs[i].base);
+  }
+  buf_free(req);
+}
+
+static void http2_stream_release(http2_stream_t *stream) {
+  if (--stream->busy == 0 && stream->released) {
+    free(stream);
+  }
+}
+
+static void http2_write_cb(uv_link_t *source, int status, void *arg) {
+  http2_write_t *req = arg;
+  http2_stream_t *stream = req->stream;
+  if (!stream) {
+    http2_write_free(req);
+    return;
+  }
+
+  QUEUE_REMOVE(&req->member);
+  stream->busy++;
+  if (req->cb) {
+    req->cb(req->source, status, req->arg);
+  }
+  if (req->flushed && !stream->closed && stream->write_waiter) {
+    stream->write_waiter->cb(stream->write_waiter);
+  }
+  if (req->shutdown_cb) {
+    req->shutdown_cb(req->shutdown_source, status, req->shutdown_arg);
+  } else if (req->ended && !stream->closed && !stream->shutting_down &&
+             stream->session) {
+    stream->session->done_cb(stream);
+  }
+  http2_write_free(req);
+  http2_stream_release(stream);
+}
+
+static void http2_idle_cb(uv_idle_t *handle);
+
+static int http2_session_write(http2_session_t *session, http2_write_t *req) {
+  if (session->closing || !session->link.parent) {
+    return UV_ECANCELED;
+  }
+  if (req->nbufs == 0) {
+    // Not every parent completes writes of nothing, the socket doesn't
+    QUEUE_INSERT_TAIL(&session->empty_writes, &req->empty_member);
+    uv_idle_start(&session->idle, http2_idle_cb);
+    return 0;
+  }
+  return uv_link_propagate_write(session->link.parent, &session->link,
+                                 req->bufs, req->nbufs, NULL, http2_write_cb,
+                                 req);
+}
+
+// Writes a frame of the session, which is a pool buffer
+static void http2_session_control(http2_session_t *session, char *frame,
+                                  size_t len) {
+  http2_write_t *req = http2_write_new(session->buffers, 1);
+  req->bufs[0] = uv_buf_init(frame, len);
+  if (http2_session_write(session, req)) {
+    http2_write_free(req);
+  }
+}
+
+static void http2_send_rst(http2_session_t *session, uint32_t id,
+                           uint32_t code) {
+  char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + 4);
+  http2_frame_header(frame, 4, HTTP2_RST_STREAM, 0, id);
+  http2_put32(&frame[HTTP2_FRAME_HEADER_LEN], code);
+  http2_session_control(session, frame, HTTP2_FRAME_HEADER_LEN + 4);
+}
+
+static void http2_send_window_update(http2_session_t *session, uint32_t id,
+                                     uint32_t increment) {
+  char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + 4);
+  http2_frame_header(frame, 4, HTTP2_WINDOW_UPDATE, 0, id);
+  http2_put32(&frame[HTTP2_FRAME_HEADER_LEN], increment);
+  http2_session_control(session, frame, HTTP2_FRAME_HEADER_LEN + 4);
+}
+
+static void http2_session_goaway(http2_session_t *session, uint32_t code) {
+  if (session->goaway_sent) {
+    return;
+  }
+  session->goaway_sent = true;
+  char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + 8);
+  http2_frame_header(frame, 8, HTTP2_GOAWAY, 0, 0);
+  http2_put32(&frame[HTTP2_FRAME_HEADER_LEN], session->last_stream_id);
+  http2_put32(&frame[HTTP2_FRAME_HEADER_LEN + 4], code);
+  http2_session_control(session, frame, HTTP2_FRAME_HEADER_LEN + 8);
+}
+
+// Our settings go out with the first read, the connection window is raised
+// right away as the protocol has no setting for it
+static void http2_session_start(http2_session_t *session) {
+  size_t len = 2 * HTTP2_FRAME_HEADER_LEN + 12 + 4;
+  char *frame = buf_pool_alloc(session->buffers, len);
+  char *p = frame;
+  http2_frame_header(p, 12, HTTP2_SETTINGS, 0, 0);
+  p += HTTP2_FRAME_HEADER_LEN;
+  p[0] = 0;
+  p[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  http2_put32(&p[2], HTTP2_MAX_CONCURRENT_STREAMS);
+  p[6] = 0;
+  p[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  http2_put32(&p[8], HTTP2_STREAM_WINDOW);
+  p += 12;
+  http2_frame_header(p, 4, HTTP2_WINDOW_UPDATE, 0, 0);
+  http2_put32(&p[HTTP2_FRAME_HEADER_LEN],
+              HTTP2_CONNECTION_WINDOW - HTTP2_DEFAULT_WINDOW);
+  session->started = true;
+  session->recv_window = HTTP2_CONNECTION_WINDOW;
+  http2_session_control(session, frame, len);
+}
+
+static void http2_batch_add(http2_session_t *session, uv_buf_t buf) {
+  if (session->num_batch == session->max_batch) {
+    session->max_batch = session->max_batch ? session->max_batch * 2 : 8;
+    session->batch =
+        realloc(session->batch, session->max_batch * sizeof(uv_buf_t));
+  }
+  session->batch[session->num_batch++] = buf;
+}
+
+static void http2_batch_clear(http2_session_t *session) {
+  for (unsigned int i = 0; i < session->num_batch; i++) {
+    buf_free(session->batch[i].base);
+  }
+  session->num_batch = 0;
+  session->end_flags = NULL;
+  session->batch_ended = false;
+}
+
+static http2_stream_t *http2_session_find(http2_session_t *session,
+                                          uint32_t id) {
+  QUEUE *q;
+  QUEUE_FOREACH(q, &session->streams) {
+    http2_stream_t *stream = QUEUE_DATA(q, http2_stream_t, member);
+    if (stream->id == id) {
+      return stream;
+    }
+  }
+  return NULL;
+}
+
+static void http2_stream_detach(http2_stream_t *stream) {
+  http2_session_t *session = stream->session;
+  if (!session) {
+    return;
+  }
+  QUEUE_REMOVE(&stream->member);
+  session->num_streams--;
+  if (stream->ready) {
+    QUEUE_REMOVE(&stream->ready_member);
+    stream->ready = false;
+  }
+  stream->session = NULL;
+}
+
+// Nothing more is sent on the stream, queued body is dropped
+static void http2_stream_end(http2_stream_t *stream) {
+  stream->end_sent = true;
+  stream->reset = true;
+  http2_data_free(&stream->output);
+  stream->output_size = 0;
+}
+
+// Ends the stream with RST_STREAM as part of the write being assembled
+static void http2_stream_reset(http2_stream_t *stream, uint32_t code) {
+  http2_session_t *session = stream->session;
+  char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + 4);
+  http2_frame_header(frame, 4, HTTP2_RST_STREAM, 0, stream->id);
+  http2_put32(&frame[HTTP2_FRAME_HEADER_LEN], code);
+  http2_batch_add(session, uv_buf_init(frame, HTTP2_FRAME_HEADER_LEN + 4));
+  http2_stream_end(stream);
+}
+
+// Stream error, its chain is closed. The stream may be gone on return.
+static void http2_stream_error(http2_stream_t *stream, uint32_t code) {
+  log_debug("http2 stream %u error %u", stream->id, code);
+  http2_send_rst(stream->session, stream->id, code);
+  http2_stream_end(stream);
+  stream->session->reset_cb(stream);
+}
+
+static http2_stream_t *http2_stream_new(http2_session_t *session,
+                                        uint32_t id) {
+  http2_stream_t *stream = malloc(sizeof *stream);
+  memset(stream, 0, sizeof *stream);
+  uv_link_init(&stream->link, &http2_stream_methods);
+  stream->session = session;
+  stream->id = id;
+  QUEUE_INIT(&stream->input);
+  QUEUE_INIT(&stream->output);
+  QUEUE_INIT(&stream->writes);
+  QUEUE_INSERT_TAIL(&session->streams, &stream->member);
+  session->num_streams++;
+  stream->recv_window = HTTP2_STREAM_WINDOW;
+  stream->send_window = session->peer_initial_window;
+  http_parser_init(&stream->parser, HTTP_RESPONSE);
+  stream->parser.data = stream;
+  return stream;
+}
+
+// Input is delivered once the chain reads, from the session's idle handle
+static void http2_stream_ready(http2_stream_t *stream) {
+  http2_session_t *session = stream->session;
+  if (!session || stream->ready || !stream->reading ||
+      QUEUE_EMPTY(&stream->input)) {
+    return;
+  }
+  stream->ready = true;
+  QUEUE_INSERT_TAIL(&session->ready, &stream->ready_member);
+  uv_idle_start(&session->idle, http2_idle_cb);
+}
+
+// Gives flow control window back once half of it was read by the chain
+static void http2_stream_consumed(http2_stream_t *stream, uint32_t len) {
+  http2_session_t *session = stream->session;
+  if (!session || len == 0) {
+    return;
+  }
+  stream->recv_consumed += len;
+  if (stream->recv_consumed >= HTTP2_STREAM_WINDOW / 2 &&
+      !stream->end_received && !stream->reset) {
+    http2_send_window_update(session, stream->id, stream->recv_consumed);
+    stream->recv_window += stream->recv_consumed;
+    stream->recv_consumed = 0;
+  }
+}
+
+static void http2_stream_deliver(http2_stream_t *stream) {
+  stream->busy++;
+  while (stream->reading && !stream->closed && !QUEUE_EMPTY(&stream->input)) {
+    QUEUE *q = QUEUE_HEAD(&stream->input);
+    http2_data_t *data = QUEUE_DATA(q, http2_data_t, member);
+    QUEUE_REMOVE(q);
+    uint32_t window = data->window;
+    // The chain releases the chunk
+    uv_buf_t buf = uv_buf_init(data->data, data->len);
+    uv_link_propagate_read_cb(&stream->link, data->len, &buf);
+    http2_stream_consumed(stream, window);
+  }
+  http2_stream_release(stream);
+}
+
+static void http2_session_deliver(http2_session_t *session) {
+  while (!QUEUE_EMPTY(&session->ready) && !session->closing) {
+    QUEUE *q = QUEUE_HEAD(&session->ready);
+    http2_stream_t *stream = QUEUE_DATA(q, http2_stream_t, ready_member);
+    QUEUE_REMOVE(q);
+    stream->ready = false;
+    http2_stream_deliver(stream);
+  }
+  if (!session->closing && QUEUE_EMPTY(&session->empty_writes)) {
+    uv_idle_stop(&session->idle);
+  }
+}
+
+static void http2_idle_cb(uv_idle_t *handle) {
+  http2_session_t *session = handle->data;
+  while (!QUEUE_EMPTY(&session->empty_writes) && !session->closing) {
+    QUEUE *q = QUEUE_HEAD(&session->empty_writes);
+    QUEUE_REMOVE(q);
+    http2_write_cb(&session->link, 0,
+                   QUEUE_DATA(q, http2_write_t, empty_member));
+  }
+  http2_session_deliver(session);
+}
+
+static void http2_stream_end_request(http2_stream_t *stream) {
+  if (stream->chunked) {
+    uv_buf_t last = uv_buf_init("0\r\n\r\n", 5);
+    http2_data_push(stream->session->buffers, &stream->input, &last, 1);
+  }
+  stream->end_received = true;
+  http2_stream_ready(stream);
+}
+
+static bool http2_token_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+         (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+static bool http2_hop_header(const char *name, size_t len) {
+  return http2_equals(name, len, "connection") ||
+         http2_equals(name, len, "keep-alive") ||
+         http2_equals(name, len, "proxy-connection") ||
+         http2_equals(name, len, "transfer-encoding") ||
+         http2_equals(name, len, "upgrade");
+}
+
+// Collects the request of a header block. A malformed request is refused
+// once the block is decoded, as the decoder has to see all of it.
+static int http2_request_header_cb(void *data, const char *name,
+                                   size_t name_len, const char *value,
+                                   size_t value_len) {
+  http2_session_t *session = data;
+  http_headers_t *request = &session->request;
+  if (name_len == 0 || memchr(value, '\0', value_len) ||
+      memchr(value, '\r', value_len) || memchr(value, '\n', value_len)) {
+    session->malformed = true;
+    return 0;
+  }
+
+  if (name[0] == ':') {
+    if (session->regular_headers) {
+      session->malformed = true;
+    } else if (http2_equals(name, name_len, ":method")) {
+      session->malformed |= session->has_method;
+      session->has_method = true;
+      session->method = http_slice(request, value, value_len);
+    } else if (http2_equals(name, name_len, ":path")) {
+      session->malformed |= session->has_path || value_len == 0 ||
+                            (value[0] != '/' && strcmp(value, "*") != 0);
+      session->has_path = true;
+      session->path = http_slice(request, value, value_len);
+    } else if (http2_equals(name, name_len, ":authority")) {
+      session->malformed |= session->has_authority;
+      session->has_authority = true;
+      session->authority = http_slice(request, value, value_len);
+    } else if (!http2_equals(name, name_len, ":scheme")) {
+      session->malformed = true;
+    }
+    return 0;
+  }
+
+  session->regular_headers = true;
+  for (size_t i = 0; i < name_len; i++) {
+    if (!http2_token_char(name[i])) {
+      session->malformed = true;
+      return 0;
+    }
+  }
+  if (http2_hop_header(name, name_len)) {
+    session->malformed = true;
+  } else if (http2_equals(name, name_len, "te")) {
+    // Only allowed to announce trailers, which HTTP/1.1 upstreams get anyway
+    session->malformed |= strcmp(value, "trailers") != 0;
+  } else {
+    session->content_length |= http2_equals(name, name_len, "content-length");
+    http_headers_add(request, name, value);
+  }
+  return 0;
+}
+
+static void http2_request_reset(http2_session_t *session) {
+  http_headers_reset(&session->request);
+  session->has_method = false;
+  session->has_path = false;
+  session->has_authority = false;
+  session->regular_headers = false;
+  session->content_length = false;
+  session->malformed = false;
+}
+
+static void http2_append(arena_t *arena, const char *data) {
+  arena_strncat(arena, data, strlen(data));
+}
+
+// Queues the request as HTTP/1.1 for the stream's chain. Cookies split in
+// several fields are joined again, a body without Content-Length is sent
+// chunked.
+static void http2_stream_request(http2_stream_t *stream) {
+  http2_session_t *session = stream->session;
+  http_headers_t *request = &session->request;
+  arena_t *out = &session->scratch;
+  const char *method = http_str(request, session->method);
+
+  arena_reset(out);
+  arena_strndup(out, "", 0);
+  http2_append(out, method);
+  http2_append(out, " ");
+  http2_append(out, http_str(request, session->path));
+  http2_append(out, " HTTP/1.1\r\n");
+  if (session->has_authority) {
+    http2_append(out, "Host: ");
+    http2_append(out, http_str(request, session->authority));
+    http2_append(out, "\r\n");
+  }
+  int cookies = 0;
+  for (int i = 0; i < request->num; i++) {
+    const char *name = http_str(request, request->list[i].name);
+    if (strcmp(name, "cookie") == 0) {
+      cookies++;
+      continue;
+    } else if (session->has_authority && strcmp(name, "host") == 0) {
+      continue;
+    }
+    http2_append(out, name);
+    http2_append(out, ": ");
+    http2_append(out, http_str(request, request->list[i].value));
+    http2_append(out, "\r\n");
+  }
+  for (int i = 0, n = 0; i < request->num && n < cookies; i++) {
+    if (strcmp(http_str(request, request->list[i].name), "cookie") == 0) {
+      http2_append(out, n++ == 0 ? "cookie: " : "; ");
+      http2_append(out, http_str(request, request->list[i].value));
+    }
+  }
+  if (cookies > 0) {
+    http2_append(out, "\r\n");
+  }
+  if (!session->header_end_stream && !session->content_length) {
+    http2_append(out, "Transfer-Encoding: chunked\r\n");
+    stream->chunked = true;
+  }
+  http2_append(out, "\r\n");
+  stream->head = strcmp(method, "HEAD") == 0;
+
+  uv_buf_t buf = uv_buf_init(out->base, out->len - 1);
+  http2_data_push(session->buffers, &stream->input, &buf, 1);
+}
+
+// Header block of a new request or the trailers of one
+static int http2_header_block(http2_session_t *session, uint32_t id,
+                              const uint8_t *block, size_t len) {
+  http2_request_reset(session);
+  if (hpack_decode(&session->decoder, block, len, http2_request_header_cb,
+                   session)) {
+    return HTTP2_COMPRESSION_ERROR;
+  }
+
+  http2_stream_t *stream = http2_session_find(session, id);
+  if (stream) {
+    // Trailers end the request, their fields are not forwarded
+    if (!session->header_end_stream || stream->end_received) {
+      http2_stream_error(stream, HTTP2_PROTOCOL_ERROR);
+    } else if (!stream->reset) {
+      http2_stream_end_request(stream);
+    }
+    return 0;
+  }
+  if (id <= session->last_stream_id) {
+    // Stream was closed already
+    return 0;
+  }
+  session->last_stream_id = id;
+  if (session->goaway_sent) {
+    return 0;
+  }
+  if (session->malformed || !session->has_method || !session->has_path ||
+      strcmp(http_str(&session->request, session->method), "CONNECT") == 0) {
+    http2_send_rst(session, id, HTTP2_PROTOCOL_ERROR);
+    return 0;
+  }
+  if (session->num_streams >= HTTP2_MAX_CONCURRENT_STREAMS) {
+    http2_send_rst(session, id, HTTP2_REFUSED_STREAM);
+    return 0;
+  }
+
+  stream = http2_stream_new(session, id);
+  http2_stream_request(stream);
+  if (session->header_end_stream) {
+    stream->end_received = true;
+  }
+  session->stream_cb(stream);
+  return 0;
+}
+
+static int http2_on_headers(http2_session_t *session, const uint8_t *payload,
+                            size_t len, uint8_t flags, uint32_t id) {
+  if (id == 0 || id % 2 == 0) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  size_t pad = 0;
+  if (flags & HTTP2_FLAG_PADDED) {
+    if (len < 1) {
+      return HTTP2_PROTOCOL_ERROR;
+    }
+    pad = payload[0];
+    payload++;
+    len--;
+  }
+  if (flags & HTTP2_FLAG_PRIORITY) {
+    if (len < 5) {
+      return HTTP2_PROTOCOL_ERROR;
+    }
+    payload += 5;
+    len -= 5;
+  }
+  if (pad > len) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  len -= pad;
+
+  session->header_end_stream = flags & HTTP2_FLAG_END_STREAM;
+  if (flags & HTTP2_FLAG_END_HEADERS) {
+    return http2_header_block(session, id, payload, len);
+  }
+  arena_reset(&session->header_block);
+  uint32_t offset = arena_alloc(&session->header_block, len);
+  memcpy(&session->header_block.base[offset], payload, len);
+  session->header_stream = id;
+  return 0;
+}
+
+static int http2_on_continuation(http2_session_t *session,
+                                 const uint8_t *payload, size_t len,
+                                 uint8_t flags, uint32_t id) {
+  arena_t *block = &session->header_block;
+  // Only valid right after a HEADERS frame without END_HEADERS
+  if (session->header_stream == 0 || id != session->header_stream) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  if (block->len + len > HTTP2_MAX_HEADER_BLOCK) {
+    return HTTP2_ENHANCE_YOUR_CALM;
+  }
+  uint32_t offset = arena_alloc(block, len);
+  memcpy(&block->base[offset], payload, len);
+  if (!(flags & HTTP2_FLAG_END_HEADERS)) {
+    return 0;
+  }
+  session->header_stream = 0;
+  return http2_header_block(session, id, (const uint8_t *)block->base,
+                            block->len);
+}
+
+static int http2_on_data(http2_session_t *session, const uint8_t *payload,
+                         size_t len, uint8_t flags, uint32_t id) {
+  if (id == 0) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  // Connection window is given back as data arrives, streams hold back
+  // their own until the chain read it
+  size_t frame_len = len;
+  session->recv_window -= frame_len;
+  if (session->recv_window < 0) {
+    return HTTP2_FLOW_CONTROL_ERROR;
+  }
+  session->recv_consumed += frame_len;
+  if (session->recv_consumed >= HTTP2_CONNECTION_WINDOW / 2) {
+    http2_send_window_update(session, 0, session->recv_consumed);
+    session->recv_window += session->recv_consumed;
+    session->recv_consumed = 0;
+  }
+
+  if (flags & HTTP2_FLAG_PADDED) {
+    if (len < 1 || payload[0] >= len) {
+      return HTTP2_PROTOCOL_ERROR;
+    }
+    len -= 1 + payload[0];
+    payload++;
+  }
+  http2_stream_t *stream = http2_session_find(session, id);
+  if (!stream) {
+    return id > session->last_stream_id ? HTTP2_PROTOCOL_ERROR : 0;
+  }
+  if (stream->reset) {
+    // Response ended the stream before the request did
+    return 0;
+  } else if (stream->end_received) {
+    http2_stream_error(stream, HTTP2_STREAM_CLOSED);
+    return 0;
+  }
+  stream->recv_window -= frame_len;
+  if (stream->recv_window < 0) {
+    http2_stream_error(stream, HTTP2_FLOW_CONTROL_ERROR);
+    return 0;
+  }
+
+  // Padding is never read by the chain
+  http2_stream_consumed(stream, frame_len - len);
+  if (len > 0) {
+    char size[20];
+    uv_buf_t pieces[3] = {
+        uv_buf_init(size, snprintf(size, sizeof size, "%zx\r\n", len)),
+        uv_buf_init((char *)payload, len), uv_buf_init("\r\n", 2)};
+    http2_data_t *data =
+        stream->chunked
+            ? http2_data_push(session->buffers, &stream->input, pieces, 3)
+            : http2_data_push(session->buffers, &stream->input, &pieces[1],
+                              1);
+    data->window += len;
+  }
+  if (flags & HTTP2_FLAG_END_STREAM) {
+    http2_stream_end_request(stream);
+  } else {
+    http2_stream_ready(stream);
+  }
+  return 0;
+}
+
+// Frames body the flow control windows allow. The stream is ended once the
+// response is complete and all of it was framed.
+static void http2_stream_flush(http2_stream_t *stream) {
+  http2_session_t *session = stream->session;
+  if (stream->end_sent) {
+    return;
+  }
+  while (!QUEUE_EMPTY(&stream->output)) {
+    int64_t window = stream->send_window < session->send_window
+                         ? stream->send_window
+                         : session->send_window;
+    if (window <= 0) {
+      break;
+    }
+    QUEUE *q = QUEUE_HEAD(&stream->output);
+    http2_data_t *data = QUEUE_DATA(q, http2_data_t, member);
+    size_t len = data->len - data->offset;
+    if ((int64_t)len > window) {
+      len = window;
+    }
+    // Header and payload in one buffer, which becomes one TLS record
+    char *frame =
+        buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + len);
+    http2_frame_header(frame, len, HTTP2_DATA, 0, stream->id);
+    memcpy(&frame[HTTP2_FRAME_HEADER_LEN], &data->data[data->offset], len);
+    http2_batch_add(session, uv_buf_init(frame, HTTP2_FRAME_HEADER_LEN + len));
+    session->end_flags = &frame[4];
+    data->offset += len;
+    stream->output_size -= len;
+    stream->send_window -= len;
+    session->send_window -= len;
+    if (data->offset == data->len) {
+      QUEUE_REMOVE(q);
+      buf_free(data);
+    }
+  }
+
+  if (!stream->complete || !QUEUE_EMPTY(&stream->output)) {
+    return;
+  }
+  if (session->end_flags) {
+    *session->end_flags |= HTTP2_FLAG_END_STREAM;
+  } else {
+    char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN);
+    http2_frame_header(frame, 0, HTTP2_DATA, HTTP2_FLAG_END_STREAM,
+                       stream->id);
+    http2_batch_add(session, uv_buf_init(frame, HTTP2_FRAME_HEADER_LEN));
+  }
+  stream->end_sent = true;
+  session->batch_ended = true;
+  if (!stream->end_received) {
+    // Rest of the request is not needed anymore
+    http2_stream_reset(stream, HTTP2_NO_ERROR);
+  }
+}
+
+// Writes the frames assembled for the stream. A pending shutdown completes
+// with them once the stream was ended.
+static int http2_stream_send(http2_stream_t *stream, uv_link_t *source,
+                             uv_link_write_cb cb, void *arg, bool flushed) {
+  http2_session_t *session = stream->session;
+  http2_write_t *req = http2_write_new(session->buffers, session->num_batch);
+  memcpy(req->bufs, session->batch, session->num_batch * sizeof(uv_buf_t));
+  req->stream = stream;
+  req->source = source;
+  req->cb = cb;
+  req->arg = arg;
+  req->ended = session->batch_ended;
+  req->flushed = flushed;
+  session->num_batch = 0;
+  session->end_flags = NULL;
+  session->batch_ended = false;
+  if (stream->shutdown_cb && stream->end_sent &&
+      QUEUE_EMPTY(&stream->output)) {
+    req->shutdown_source = stream->shutdown_source;
+    req->shutdown_cb = stream->shutdown_cb;
+    req->shutdown_arg = stream->shutdown_arg;
+    stream->shutdown_cb = NULL;
+  }
+
+  QUEUE_INSERT_TAIL(&stream->writes, &req->member);
+  int err = http2_session_write(session, req);
+  if (err) {
+    QUEUE_REMOVE(&req->member);
+    http2_write_free(req);
+  }
+  return err;
+}
+
+// Sends body which waited for a window update
+static void http2_stream_resume(http2_stream_t *stream) {
+  http2_stream_flush(stream);
+  if (stream->session->num_batch > 0) {
+    http2_stream_send(stream, NULL, NULL, NULL, true);
+  }
+}
+
+static int http2_on_settings(http2_session_t *session, const uint8_t *payload,
+                             size_t len, uint8_t flags, uint32_t id) {
+  if (id != 0) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  if (flags & HTTP2_FLAG_ACK) {
+    return len == 0 ? 0 : HTTP2_FRAME_SIZE_ERROR;
+  }
+  if (len % 6 != 0) {
+    return HTTP2_FRAME_SIZE_ERROR;
+  }
+  for (size_t i = 0; i < len; i += 6) {
+    uint16_t setting = payload[i] << 8 | payload[i + 1];
+    uint32_t value = http2_get32(&payload[i + 2]);
+    if (setting == HTTP2_SETTINGS_ENABLE_PUSH && value > 1) {
+      return HTTP2_PROTOCOL_ERROR;
+    } else if (setting == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > HTTP2_MAX_WINDOW) {
+        return HTTP2_FLOW_CONTROL_ERROR;
+      }
+      int64_t delta = (int64_t)value - session->peer_initial_window;
+      QUEUE *q;
+      QUEUE_FOREACH(q, &session->streams) {
+        http2_stream_t *stream = QUEUE_DATA(q, http2_stream_t, member);
+        stream->send_window += delta;
+        if (stream->send_window > HTTP2_MAX_WINDOW) {
+          return HTTP2_FLOW_CONTROL_ERROR;
+        }
+      }
+      session->peer_initial_window = value;
+    } else if (setting == HTTP2_SETTINGS_MAX_FRAME_SIZE &&
+               (value < HTTP2_MAX_FRAME_SIZE || value > 0xffffff)) {
+      // Frames sent stay at the default size anyway
+      return HTTP2_PROTOCOL_ERROR;
+    }
+  }
+
+  char *frame = buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN);
+  http2_frame_header(frame, 0, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0);
+  http2_session_control(session, frame, HTTP2_FRAME_HEADER_LEN);
+
+  QUEUE *q;
+  QUEUE_FOREACH(q, &session->streams) {
+    http2_stream_resume(QUEUE_DATA(q, http2_stream_t, member));
+  }
+  return 0;
+}
+
+static int http2_on_window_update(http2_session_t *session,
+                                  const uint8_t *payload, size_t len,
+                                  uint32_t id) {
+  if (len != 4) {
+    return HTTP2_FRAME_SIZE_ERROR;
+  }
+  uint32_t increment = http2_get32(payload) & 0x7fffffff;
+  if (id == 0) {
+    if (increment == 0) {
+      return HTTP2_PROTOCOL_ERROR;
+    }
+    session->send_window += increment;
+    if (session->send_window > HTTP2_MAX_WINDOW) {
+      return HTTP2_FLOW_CONTROL_ERROR;
+    }
+    QUEUE *q;
+    QUEUE_FOREACH(q, &session->streams) {
+      if (session->send_window <= 0) {
+        break;
+      }
+      http2_stream_resume(QUEUE_DATA(q, http2_stream_t, member));
+    }
+    return 0;
+  }
+
+  http2_stream_t *stream = http2_session_find(session, id);
+  if (!stream || stream->end_sent) {
+    return 0;
+  }
+  stream->send_window += increment;
+  if (increment == 0) {
+    http2_stream_error(stream, HTTP2_PROTOCOL_ERROR);
+  } else if (stream->send_window > HTTP2_MAX_WINDOW) {
+    http2_stream_error(stream, HTTP2_FLOW_CONTROL_ERROR);
+  } else {
+    http2_stream_resume(stream);
+  }
+  return 0;
+}
+
+static int http2_on_rst_stream(http2_session_t *session, size_t len,
+                               uint32_t id) {
+  if (len != 4) {
+    return HTTP2_FRAME_SIZE_ERROR;
+  }
+  if (id == 0 || id > session->last_stream_id) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  http2_stream_t *stream = http2_session_find(session, id);
+  if (stream) {
+    http2_stream_end(stream);
+    session->reset_cb(stream);
+  }
+  return 0;
+}
+
+// Handles a complete frame, returns the error code of a connection error
+static int http2_session_frame(http2_session_t *session,
+                               const uint8_t *frame) {
+  size_t len = http2_frame_length(frame);
+  uint8_t type = frame[3];
+  uint8_t flags = frame[4];
+  uint32_t id = http2_get32(&frame[5]) & 0x7fffffff;
+  const uint8_t *payload = &frame[HTTP2_FRAME_HEADER_LEN];
+
+  if (session->header_stream && type != HTTP2_CONTINUATION) {
+    return HTTP2_PROTOCOL_ERROR;
+  }
+  switch (type) {
+    case HTTP2_DATA:
+      return http2_on_data(session, payload, len, flags, id);
+    case HTTP2_HEADERS:
+      return http2_on_headers(session, payload, len, flags, id);
+    case HTTP2_CONTINUATION:
+      return http2_on_continuation(session, payload, len, flags, id);
+    case HTTP2_SETTINGS:
+      return http2_on_settings(session, payload, len, flags, id);
+    case HTTP2_WINDOW_UPDATE:
+      return http2_on_window_update(session, payload, len, id);
+    case HTTP2_RST_STREAM:
+      return http2_on_rst_stream(session, len, id);
+    case HTTP2_PING:
+      if (len != 8) {
+        return HTTP2_FRAME_SIZE_ERROR;
+      } else if (id != 0) {
+        return HTTP2_PROTOCOL_ERROR;
+      } else if (!(flags & HTTP2_FLAG_ACK)) {
+        char *pong =
+            buf_pool_alloc(session->buffers, HTTP2_FRAME_HEADER_LEN + 8);
+        http2_frame_header(pong, 8, HTTP2_PING, HTTP2_FLAG_ACK, 0);
+        memcpy(&pong[HTTP2_FRAME_HEADER_LEN], payload, 8);
+        http2_session_control(session, pong, HTTP2_FRAME_HEADER_LEN + 8);
+      }
+      return 0;
+    case HTTP2_PUSH_PROMISE:
+      // Clients can't push
+      return HTTP2_PROTOCOL_ERROR;
+    case HTTP2_GOAWAY:
+      // Streams already open are answered, the client opens no new ones
+      return id == 0 ? 0 : HTTP2_PROTOCOL_ERROR;
+    default:
+      // PRIORITY is ignored, unknown types have to be
+      return 0;
+  }
+}
+
+// Processes frames as they are read, a frame split across reads is copied
+// until it is complete
+static int http2_session_input(http2_session_t *session, const char *data,
+                               size_t len) {
+  while (session->preface_len < HTTP2_PREFACE_LEN && len > 0) {
+    if (*data != HTTP2_PREFACE[session->preface_len]) {
+      return HTTP2_PROTOCOL_ERROR;
+    }
+    session->preface_len++;
+    data++;
+    len--;
+  }
+
+  while (session->partial_len > 0 && len > 0) {
+    size_t need = HTTP2_FRAME_HEADER_LEN;
+    if (session->partial_len >= HTTP2_FRAME_HEADER_LEN) {
+      need += http2_frame_length((uint8_t *)session->partial);
+    }
+    size_t n = need - session->partial_len < len ? need - session->partial_len
+                                                 : len;
+    memcpy(&session->partial[session->partial_len], data, n);
+    session->partial_len += n;
+    data += n;
+    len -= n;
+    if (session->partial_len < HTTP2_FRAME_HEADER_LEN) {
+      continue;
+    }
+    size_t frame_len = http2_frame_length((uint8_t *)session->partial);
+    if (frame_len > HTTP2_MAX_FRAME_SIZE) {
+      return HTTP2_FRAME_SIZE_ERROR;
+    }
+    if (session->partial_len == HTTP2_FRAME_HEADER_LEN + frame_len) {
+      session->partial_len = 0;
+      int err = http2_session_frame(session, (uint8_t *)session->partial);
+      if (err) {
+        return err;
+      }
+    }
+  }
+
+  while (len >= HTTP2_FRAME_HEADER_LEN && !session->closing) {
+    size_t frame_len = http2_frame_length((const uint8_t *)data);
+    if (frame_len > HTTP2_MAX_FRAME_SIZE) {
+      return HTTP2_FRAME_SIZE_ERROR;
+    }
+    if (len < HTTP2_FRAME_HEADER_LEN + frame_len) {
+      break;
+    }
+    int err = http2_session_frame(session, (const uint8_t *)data);
+    if (err) {
+      return err;
+    }
+    data += HTTP2_FRAME_HEADER_LEN + frame_len;
+    len -= HTTP2_FRAME_HEADER_LEN + frame_len;
+  }
+  if (len > 0) {
+    if (!session->partial) {
+      session->partial =
+          malloc(HTTP2_FRAME_HEADER_LEN + HTTP2_MAX_FRAME_SIZE);
+    }
+    memcpy(session->partial, data, len);
+    session->partial_len = len;
+  }
+  return 0;
+}
+
+static int http2_response_begin_cb(http_parser *p) {
+  http2_stream_t *stream = p->data;
+  http_headers_reset(&stream->headers);
+  return 0;
+}
+
+static int http2_response_field_cb(http_parser *p, const char *buf,
+                                   size_t len) {
+  http2_stream_t *stream = p->data;
+  http_headers_field(&stream->headers, buf, len);
+  return 0;
+}
+
+static int http2_response_value_cb(http_parser *p, const char *buf,
+                                   size_t len) {
+  http2_stream_t *stream = p->data;
+  http_headers_value(&stream->headers, buf, len);
+  return 0;
+}
+
+// Sends the response headers as HEADERS and CONTINUATION frames. Interim
+// responses don't end the stream.
+static int http2_response_headers_cb(http_parser *p) {
+  http2_stream_t *stream = p->data;
+  http2_session_t *session = stream->session;
+  http_headers_t *headers = &stream->headers;
+  int status = p->status_code;
+
+  size_t max_len = 16;
+  for (int i = 0; i < headers->num; i++) {
+    max_len += HPACK_ENCODED_MAX(headers->list[i].name.len,
+                                 headers->list[i].value.len);
+  }
+  arena_reset(&session->scratch);
+  char *block = &session->scratch.base[arena_alloc(&session->scratch, max_len)];
+  size_t len = hpack_encode_status(block, status);
+  for (int i = 0; i < headers->num; i++) {
+    const char *name = http_str(headers, headers->list[i].name);
+    size_t name_len = headers->list[i].name.len;
+    char lower[32];
+    if (name_len < sizeof lower) {
+      for (size_t j = 0; j < name_len; j++) {
+        lower[j] = tolower((unsigned char)name[j]);
+      }
+      if (http2_hop_header(lower, name_len)) {
+        continue;
+      }
+    }
+    len += hpack_encode_header(&block[len], name, name_len,
+                               http_str(headers, headers->list[i].value),
+                               headers->list[i].value.len);
+  }
+
+  size_t num_frames = len / HTTP2_MAX_FRAME_SIZE + 1;
+  char *frames = buf_pool_alloc(session->buffers,
+                                len + num_frames * HTTP2_FRAME_HEADER_LEN);
+  char *frame = frames;
+  for (size_t offset = 0, i = 0; i < num_frames; i++) {
+    size_t n = len - offset < HTTP2_MAX_FRAME_SIZE ? len - offset
+                                                   : HTTP2_MAX_FRAME_SIZE;
+    uint8_t flags = i == num_frames - 1 ? HTTP2_FLAG_END_HEADERS : 0;
+    http2_frame_header(frame, n, i == 0 ? HTTP2_HEADERS : HTTP2_CONTINUATION,
+                       flags, stream->id);
+    memcpy(&frame[HTTP2_FRAME_HEADER_LEN], &block[offset], n);
+    frame += HTTP2_FRAME_HEADER_LEN + n;
+    offset += n;
+  }
+  http2_batch_add(session, uv_buf_init(frames, frame - frames));
+  session->end_flags = status >= 200 ? &frames[4] : NULL;
+
+  // These have no body, whatever their headers say
+  return stream->head || status == 204 || status == 304;
+}
+
+static int http2_response_body_cb(http_parser *p, const char *buf,
+                                  size_t len) {
+  http2_stream_t *stream = p->data;
+  uv_buf_t piece = uv_buf_init((char *)buf, len);
+  http2_data_push(stream->session->buffers, &stream->output, &piece, 1);
+  stream->output_size += len;
+  return 0;
+}
+
+static int http2_response_complete_cb(http_parser *p) {
+  http2_stream_t *stream = p->data;
+  if (p->status_code >= 200) {
+    stream->complete = true;
+    // Anything after the response is ignored
+    http_parser_pause(p, 1);
+  }
+  return 0;
+}
+
+static int http2_stream_read_start(uv_link_t *link) {
+  http2_stream_t *stream = (http2_stream_t *)link;
+  stream->reading = true;
+  http2_stream_ready(stream);
+  return 0;
+}
+
+static int http2_stream_read_stop(uv_link_t *link) {
+  http2_stream_t *stream = (http2_stream_t *)link;
+  stream->reading = false;
+  return 0;
+}
+
+// Takes the HTTP/1.1 response the chain writes apart into frames. Data is
+// copied, the write completes once the frames were written.
+static int http2_stream_write(uv_link_t *link, uv_link_t *source,
+                              const uv_buf_t bufs[], unsigned int nbufs,
+                              uv_stream_t *send_handle, uv_link_write_cb cb,
+                              void *arg) {
+  http2_stream_t *stream = (http2_stream_t *)link;
+  http2_session_t *session = stream->session;
+  if (!session || stream->end_sent) {
+    return UV_ECANCELED;
+  }
+
+  for (unsigned int i = 0; i < nbufs && !stream->complete; i++) {
+    if (bufs[i].len == 0) {
+      continue;
+    }
+    http_parser_execute(&stream->parser, &http2_response_settings,
+                        bufs[i].base, bufs[i].len);
+    enum http_errno err = HTTP_PARSER_ERRNO(&stream->parser);
+    if (err != HPE_OK && err != HPE_PAUSED) {
+      log_debug("http2 stream %u: invalid response (%s)", stream->id,
+                http_errno_name(err));
+      http2_batch_clear(session);
+      http2_stream_reset(stream, HTTP2_INTERNAL_ERROR);
+      http2_stream_send(stream, NULL, NULL, NULL, false);
+      return UV_EPROTO;
+    }
+  }
+  http2_stream_flush(stream);
+  return http2_stream_send(stream, source, cb, arg, false);
+}
+
+static int http2_stream_try_write(uv_link_t *link, const uv_buf_t bufs[],
+                                  unsigned int nbufs) {
+  return UV_EAGAIN;
+}
+
+// Completes once the response was sent. A response the upstream didn't
+// finish resets the stream, so the client doesn't take it as complete.
+static int http2_stream_shutdown(uv_link_t *link, uv_link_t *source,
+                                 uv_link_shutdown_cb cb, void *arg) {
+  http2_stream_t *stream = (http2_stream_t *)link;
+  http2_session_t *session = stream->session;
+  if (!session || stream->shutting_down) {
+    return UV_ECANCELED;
+  }
+  stream->shutting_down = true;
+  stream->shutdown_source = source;
+  stream->shutdown_cb = cb;
+  stream->shutdown_arg = arg;
+
+  if (!stream->end_sent && !stream->complete) {
+    // Response without length ends with the connection
+    http_parser_execute(&stream->parser, &http2_response_settings, NULL, 0);
+    if (!stream->complete) {
+      http2_batch_clear(session);
+      http2_stream_reset(stream, HTTP2_INTERNAL_ERROR);
+    }
+  }
+  http2_stream_flush(stream);
+  if (!stream->end_sent && session->num_batch == 0) {
+    // Completed by a window update
+    return 0;
+  }
+  return http2_stream_send(stream, NULL, NULL, NULL, false);
+}
+
+static void http2_stream_close(uv_link_t *link, uv_link_t *source,
+                               uv_link_close_cb cb) {
+  http2_stream_t *stream = (http2_stream_t *)link;
+  stream->closed = true;
+  if (stream->session && !stream->end_sent) {
+    http2_send_rst(stream->session, stream->id, HTTP2_CANCEL);
+  }
+  http2_stream_detach(stream);
+  while (!QUEUE_EMPTY(&stream->writes)) {
+    QUEUE *q = QUEUE_HEAD(&stream->writes);
+    http2_write_t *req = QUEUE_DATA(q, http2_write_t, member);
+    QUEUE_REMOVE(q);
+    req->stream = NULL;
+    if (req->cb) {
+      req->cb(req->source, UV_ECANCELED, req->arg);
+    }
+  }
+  http2_data_free(&stream->input);
+  http2_data_free(&stream->output);
+  stream->output_size = 0;
+  http_headers_free(&stream->headers);
+  cb(source);
+}
+
+// Response data of the stream not written yet, held back by flow control or
+// queued on the connection
+size_t http2_stream_queue_size(http2_stream_t *stream) {
+  size_t size = stream->output_size;
+  QUEUE *q;
+  QUEUE_FOREACH(q, &stream->writes) {
+    http2_write_t *req = QUEUE_DATA(q, http2_write_t, member);
+    for (unsigned int i = 0; i < req->nbufs; i++) {
+      size += req->bufs[i].len;
+    }
+  }
+  return size;
+}
+
+// Called once the stream's chain was closed
+void http2_stream_free(http2_stream_t *stream) {
+  stream->released = true;
+  if (stream->busy == 0) {
+    free(stream);
+  }
+}
+
+http2_session_t *http2_session_new(uv_loop_t *loop, buf_pool_t *buffers) {
+  http2_session_t *session = malloc(sizeof *session);
+  memset(session, 0, sizeof *session);
+  uv_link_init(&session->link, &http2_session_methods);
+  session->loop = loop;
+  session->buffers = buffers;
+  hpack_decoder_init(&session->decoder);
+  QUEUE_INIT(&session->streams);
+  QUEUE_INIT(&session->ready);
+  QUEUE_INIT(&session->empty_writes);
+  uv_idle_init(loop, &session->idle);
+  session->idle.data = session;
+  session->send_window = HTTP2_DEFAULT_WINDOW;
+  session->recv_window = HTTP2_DEFAULT_WINDOW;
+  session->peer_initial_window = HTTP2_DEFAULT_WINDOW;
+  return session;
+}
+
+// Called once the session's chain was closed
+void http2_session_free(http2_session_t *session) { free(session); }
+
+static void http2_session_alloc_cb(uv_link_t *link, size_t suggested_size,
+                                   uv_buf_t *buf) {
+  http2_session_t *session = (http2_session_t *)link;
+  *buf = uv_buf_init(buf_pool_alloc(session->buffers, suggested_size),
+                     suggested_size);
+}
+
+static void http2_session_read_cb(uv_link_t *link, ssize_t nread,
+                                  const uv_buf_t *buf) {
+  http2_session_t *session = (http2_session_t *)link;
+  if (nread > 0 && !session->failed && !session->closing) {
+    if (!session->started) {
+      http2_session_start(session);
+    }
+    int err = http2_session_input(session, buf->base, nread);
+    if (err) {
+      log_debug("http2 connection error %d", err);
+      http2_session_goaway(session, err);
+      session->failed = true;
+      uv_link_read_stop(link);
+    } else {
+      http2_session_deliver(session);
+    }
+  }
+  if (buf) {
+    buf_free(buf->base);
+  }
+  if ((nread < 0 || session->failed) && !session->closing) {
+    session->error_cb(session);
+  }
+}
+
+// Tells the client no more streams are accepted
+static int http2_session_shutdown(uv_link_t *link, uv_link_t *source,
+                                  uv_link_shutdown_cb cb, void *arg) {
+  http2_session_goaway((http2_session_t *)link, HTTP2_NO_ERROR);
+  return uv_link_default_shutdown(link, source, cb, arg);
+}
+
+static void http2_session_idle_close_cb(uv_handle_t *handle) {
+  http2_session_t *session = handle->data;
+  session->close_cb(session->close_source);
+}
+
+// Streams left are lost with the connection
+static void http2_session_close(uv_link_t *link, uv_link_t *source,
+                                uv_link_close_cb cb) {
+  http2_session_t *session = (http2_session_t *)link;
+  session->closing = true;
+  while (!QUEUE_EMPTY(&session->streams)) {
+    QUEUE *q = QUEUE_HEAD(&session->streams);
+    http2_stream_t *stream = QUEUE_DATA(q, http2_stream_t, member);
+    http2_stream_detach(stream);
+    http2_stream_end(stream);
+    session->reset_cb(stream);
+  }
+  while (!QUEUE_EMPTY(&session->empty_writes)) {
+    QUEUE *q = QUEUE_HEAD(&session->empty_writes);
+    QUEUE_REMOVE(q);
+    http2_write_cb(&session->link, UV_ECANCELED,
+                   QUEUE_DATA(q, http2_write_t, empty_member));
+  }
+  hpack_decoder_free(&session->decoder);
+  http_headers_free(&session->request);
+  arena_free(&session->header_block);
+  arena_free(&session->scratch);
+  http2_batch_clear(session);
+  free(session->batch);
+  free(session->partial);
+  session->close_source = source;
+  session->close_cb = cb;
+  uv_close((uv_handle_t *)&session->idle, http2_session_idle_close_cb);
+}
+
+// clang-format off
+uv_link_methods_t http2_stream_methods =
+{
+  .read_start = http2_stream_read_start,
+  .read_stop = http2_stream_read_stop,
+  .write = http2_stream_write,
+  .try_write = http2_stream_try_write,
+  .shutdown = http2_stream_shutdown,
+  .close = http2_stream_close,
+  .strerror = uv_link_default_strerror
+};
+
+uv_link_methods_t http2_session_methods =
+{
+  .read_start = uv_link_default_read_start,
+  .read_stop = uv_link_default_read_stop,
+  .write = uv_link_default_write,
+  .try_write = uv_link_default_try_write,
+  .shutdown = http2_session_shutdown,
+  .close = http2_session_close,
+  .strerror = uv_link_default_strerror,
+
+  .alloc_cb_override = http2_session_alloc_cb,
+  .read_cb_override = http2_session_read_cb
+};
+// clang-format on
@@ -5,9 +5,11 @@
   if ((V) != 0) abort()
 
 void http_link_init(uv_link_t *link, http_link_context_t *context,
-                    config_t *config) {
+                    config_t *config, buf_pool_t *buffers) {
   memset(context, 0, sizeof *context);
   context->server_config = config;
+  context->link = link;
+  context->buffers = buffers;
   context->type = TYPE_REQUEST;
   link->data = context;
 
@@ -17,88 +19,139 @@ void http_link_init(uv_link_t *link, http_link_context_t *context,
   context->request.parser.data = context;
   context->response.parser.data = context;
   context->request.complete = true;
+  QUEUE_INIT(&context->held);
 }
 
 void alloc_cb_override(uv_link_t *link, size_t suggested_size, uv_buf_t *buf) {
-  buf->base = malloc(suggested_size);
-  assert(buf->base != NULL);
+  http_link_context_t *context = link->data;
+  buf->base = buf_pool_alloc(context->buffers, suggested_size);
   buf->len = suggested_size;
 }
 
-void http_read_cb_override(uv_link_t *link, ssize_t nread,
-                           const uv_buf_t *buf) {
+// Passes a slice of a read buffer on, sharing the buffer instead of copying
+static void http_link_forward(uv_link_t *link, char *data, size_t len) {
+  uv_buf_t tmp_buf = uv_buf_init(data, len);
+  buf_ref(data);
+  uv_link_propagate_read_cb(link, len, &tmp_buf);
+}
+
+// Keeps data for later. Data not framed yet goes in front of what was read
+// after it.
+static void http_link_hold(uv_link_t *link, char *data, size_t len,
+                           bool front) {
   http_link_context_t *context = link->data;
+  if (QUEUE_EMPTY(&context->held)) {
+    uv_link_read_stop(link->parent);
+  }
+  buf_queue_t *bq = buf_pool_alloc(context->buffers, sizeof *bq);
+  bq->buf = uv_buf_init(data, len);
+  buf_ref(data);
+  if (front) {
+    QUEUE_INSERT_HEAD(&context->held, &bq->member);
+  } else {
+    QUEUE_INSERT_TAIL(&context->held, &bq->member);
+  }
+}
 
-  if (nread > 0) {
-    size_t http_headers_len = 0;
-    if (context->type == TYPE_REQUEST) {
-      if (context->request.complete) {
-        context->request.complete = false;
-        context->initial_reply = true;
-        context->request_time = uv_hrtime();
-        time(&context->request_timestamp);
-
-        context->request.raw_len = nread;
-
-        // Parse status line
-        size_t status_line_len;
-        free(context->request.status_line);
-        char *status_line_end = strnstr_custom(buf->base, nread, "\r");
-        if (status_line_end) {
-          status_line_len = status_line_end - buf->base;
-        } else {
-          status_line_len = nread;
-        }
-
-        context->request.status_line = malloc(status_line_len + 1);
-        memcpy(context->request.status_line, buf->base, status_line_len);
-        context->request.status_line[status_line_len] = '\0';
-        http_parser_init(&context->request.parser, HTTP_REQUEST);
-
-        gzip_state_t *state = context->response.gzip_state;
-        if (state) {
-          gzip_free_state(state);
-          free(state);
-          context->response.gzip_state = NULL;
-        }
-        context->response.processed_data_len = 0;
-
-        char *header_end = strnstr_custom(buf->base, nread, "\r\n\r\n");
-        if (header_end) {
-          http_headers_len = header_end - buf->base + 4;
-        }
-      }
+static void http_request_begin(http_link_context_t *context) {
+  http_request_t *request = &context->request;
+  request->complete = false;
+  request->headers_received = false;
+  request->headers_sent = false;
+  context->initial_reply = true;
+  context->request_time = uv_hrtime();
+  time(&context->request_timestamp);
+  http_parser_init(&request->parser, HTTP_REQUEST);
+}
 
-      size_t np = http_parser_execute(&context->request.parser,
-                                      &parser_settings, buf->base, nread);
-      if (np != (size_t)nread) {
-        uv_shutdown_t *req;
-        req = (uv_shutdown_t *)malloc(sizeof *req);
-        log_error("Http parsing failed");
-        uv_link_propagate_read_cb(link, -400, buf);
-        return;
-      }
+static void http_request_send_headers(uv_link_t *link) {
+  http_link_context_t *context = link->data;
+  http_request_t *request = &context->request;
+  http_init_request_headers(context);
+  uv_buf_t tmp_buf =
+      uv_buf_init(buf_pool_alloc(context->buffers, request->http_header.len),
+                  request->http_header.len);
+  memcpy(tmp_buf.base, http_str(&request->headers, request->http_header),
+         request->http_header.len);
+  uv_link_propagate_read_cb(link, request->http_header.len, &tmp_buf);
+  request->headers_sent = true;
+}
 
-      if (context->request.upgrade) {
-        context->type = TYPE_WEBSOCKET;
+// Frames client data into requests, which may be split across reads or
+// several to a read. Headers are passed on rewritten once complete, bodies
+// as slices of the read buffer. A pipelined request is held until the
+// response to the previous one was sent, so each one is routed on its own.
+// Returns the length framed, the rest was held, or -400 when the request is
+// invalid.
+static ssize_t http_request_frame(uv_link_t *link, char *data, size_t len) {
+  http_link_context_t *context = link->data;
+  http_request_t *request = &context->request;
+  size_t offset = 0;
+  // LF ending the headers, consumed by the round after them
+  size_t skip = 0;
+
+  context->framing = true;
+  while (offset < len && !context->closing) {
+    if (context->type == TYPE_WEBSOCKET) {
+      http_link_forward(link, &data[offset], len - offset);
+      offset = len;
+      break;
+    }
+    if (request->complete) {
+      if (context->pending_responses > 0) {
+        http_link_hold(link, &data[offset], len - offset, true);
+        break;
       }
+      http_request_begin(context);
+    }
+
+    bool body = request->headers_received;
+    size_t np = http_parser_execute(&request->parser, &parser_settings,
+                                    &data[offset], len - offset);
+    if (HTTP_PARSER_ERRNO(&request->parser) == HPE_PAUSED) {
+      http_parser_pause(&request->parser, 0);
+    } else if (HTTP_PARSER_ERRNO(&request->parser) != HPE_OK) {
+      log_error("Http parsing failed");
+      context->framing = false;
+      return -400;
+    }
+    if (!body && request->headers_received) {
+      // Headers go out with the next round, when a request without body is
+      // known to be complete
+      offset += np;
+      skip = 1;
+      continue;
+    }
+    if (body && !request->headers_sent) {
+      http_request_send_headers(link);
+    }
+    if (body && np > skip && !context->closing) {
+      http_link_forward(link, &data[offset + skip], np - skip);
     }
-    // Insert head
-    if (http_headers_len) {
-      http_init_request_headers(context);
-      uv_buf_t tmp_buf = uv_buf_init(malloc(context->request.http_header_len),
-                                     context->request.http_header_len);
-      memcpy(tmp_buf.base, context->request.http_header,
-             context->request.http_header_len);
-      uv_link_propagate_read_cb(link, context->request.http_header_len,
-                                &tmp_buf);
+    skip = 0;
+    offset += np;
+    if (request->complete && request->upgrade) {
+      // Rest of the connection is in another protocol
+      context->type = TYPE_WEBSOCKET;
     }
-    // Insert body
-    size_t body_size = nread - http_headers_len;
-    if (body_size > 0) {
-      uv_buf_t tmp_buf = uv_buf_init(malloc(body_size), body_size);
-      memcpy(tmp_buf.base, &buf->base[http_headers_len], body_size);
-      uv_link_propagate_read_cb(link, body_size, &tmp_buf);
+  }
+  context->framing = false;
+  return offset;
+}
+
+void http_read_cb_override(uv_link_t *link, ssize_t nread,
+                           const uv_buf_t *buf) {
+  http_link_context_t *context = link->data;
+
+  if (nread > 0) {
+    if (!QUEUE_EMPTY(&context->held)) {
+      http_link_hold(link, buf->base, nread, false);
+    } else {
+      ssize_t framed = http_request_frame(link, buf->base, nread);
+      if (framed < 0) {
+        uv_link_propagate_read_cb(link, framed, buf);
+        return;
+      }
     }
     nread = 0;
   }
@@ -106,28 +159,185 @@ void http_read_cb_override(uv_link_t *link, ssize_t nread,
   uv_link_propagate_read_cb(link, nread, buf);
 }
 
-void compress_data(http_response_t *response, char *data, int len,
-                   char **compressed_resp, size_t *compressed_resp_size) {
-  response->gzip_state->raw_body = (unsigned char *)data;
-  response->gzip_state->current_size_in = len;
+// Frames held requests once the previous response was sent
+void http_link_resume(uv_link_t *link) {
+  http_link_context_t *context = link->data;
+  if (context->framing || context->pending_responses > 0) {
+    // Framer moves on to the next request by itself
+    return;
+  }
+  while (!QUEUE_EMPTY(&context->held) && !context->closing) {
+    QUEUE *q = QUEUE_HEAD(&context->held);
+    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
+    uv_buf_t buf = bq->buf;
+    QUEUE_REMOVE(q);
+    buf_free(bq);
+    ssize_t framed = http_request_frame(link, buf.base, buf.len);
+    buf_free(buf.base);
+    if (framed < 0) {
+      uv_link_propagate_read_cb(link, framed, NULL);
+      return;
+    } else if (framed < (ssize_t)buf.len) {
+      // Next request waits for this one's response
+      return;
+    }
+  }
+  if (QUEUE_EMPTY(&context->held) && context->reading && !context->closing) {
+    uv_link_read_start(link->parent);
+  }
+}
+
+static int http_link_read_start(uv_link_t *link) {
+  http_link_context_t *context = link->data;
+  context->reading = true;
+  if (!QUEUE_EMPTY(&context->held)) {
+    // Started by http_link_resume() once held requests are framed
+    return 0;
+  }
+  return uv_link_read_start(link->parent);
+}
+
+static int http_link_read_stop(uv_link_t *link) {
+  http_link_context_t *context = link->data;
+  context->reading = false;
+  return uv_link_read_stop(link->parent);
+}
+
+static int http_link_shutdown(uv_link_t *link, uv_link_t *source,
+                              uv_link_shutdown_cb cb, void *arg) {
+  http_link_context_t *context = link->data;
+  context->closing = true;
+  return uv_link_default_shutdown(link, source, cb, arg);
+}
+
+// Runs the response parser over data and returns the length of the headers
+// when they end inside data, 0 otherwise.
+static size_t http_response_parse(http_response_t *response, char *data,
+                                  size_t len) {
+  size_t header_len = 0;
+  size_t offset = 0;
+  while (offset < len) {
+    size_t np = http_parser_execute(&response->parser, &resp_parser_settings,
+                                    &data[offset], len - offset);
+    if (HTTP_PARSER_ERRNO(&response->parser) != HPE_PAUSED) {
+      break;
+    }
+    // Parser pauses on the last LF of the headers
+    if (!header_len) {
+      header_len = offset + np + 1;
+    }
+    http_parser_pause(&response->parser, 0);
+    offset += np;
+  }
+  return header_len;
+}
+
+// Copies body frames of a cacheable response into its cache entry, which is
+// inserted once the whole body was compressed
+static void http_cache_capture(http_link_context_t *context) {
+  http_response_t *response = &context->response;
+  for (unsigned int i = 0; i < response->num_gzip_frames; i++) {
+    if (!cache_entry_append(context->cache_pending,
+                            response->gzip_frames[i].base,
+                            response->gzip_frames[i].len)) {
+      // Too big to be cached
+      cache_release(context->cache_pending);
+      context->cache_pending = NULL;
+      return;
+    }
+  }
+  if (response->complete && http_gzip_idle(context)) {
+    cache_insert(context->cache_pending);
+    context->cache_pending = NULL;
+  }
+}
+
+// Writes compressed frames queued by the parser, preceded by headers if
+// they were not sent yet.
+static int http_gzip_write(uv_link_t *link, uv_link_t *source,
+                           uv_stream_t *send_handle, uv_link_write_cb cb) {
+  http_link_context_t *context = (http_link_context_t *)link->data;
+  http_response_t *response = &context->response;
+
+  if (response->gzip_job) {
+    gzip_job_submit(response->gzip_job);
+  }
+  if (context->cache_pending) {
+    http_cache_capture(context);
+  }
 
-  if (response->processed_data_len > 0) {
-    response->gzip_state->first_chunk = false;
+  if (!response->headers_send) {
+    response->headers_send = true;
+    const char *http_header =
+        http_str(&response->headers, response->http_header);
+    size_t header_len = response->http_header.len;
+    if (context->cache_pending) {
+      cache_entry_set_headers(context->cache_pending, http_header, header_len);
+    }
+    char *header = buf_pool_alloc(context->buffers, header_len);
+    memcpy(header, http_header, header_len);
+    // Make room for the headers in front of the queued frames
+    http_response_add_frame(response, uv_buf_init(NULL, 0));
+    memmove(&response->gzip_frames[1], &response->gzip_frames[0],
+            (response->num_gzip_frames - 1) * sizeof(uv_buf_t));
+    response->gzip_frames[0] = uv_buf_init(header, header_len);
+  }
+
+  unsigned int nbufs = response->num_gzip_frames;
+  if (nbufs == 0) {
+    return 0;
   }
+  response->num_gzip_frames = 0;
+  // All frames are released together with the first one
+  for (unsigned int i = 1; i < nbufs; i++) {
+    buf_attach(response->gzip_frames[0].base, response->gzip_frames[i].base);
+  }
+  return uv_link_propagate_write(link->parent, source, response->gzip_frames,
+                                 nbufs, send_handle, cb,
+                                 response->gzip_frames[0].base);
+}
 
-  response->processed_data_len += len;
-  if (response->processed_data_len == response->expected_data_len) {
-    response->gzip_state->last_chunk = true;
+static void http_cache_write_cb(uv_link_t *source, int status, void *arg) {
+  http_link_context_t *context = source->data;
+  cache_release(arg);
+  if (context->write_waiter) {
+    context->write_waiter->cb(context->write_waiter);
   }
+}
 
-  gzip_compress(response->gzip_state);
-  gzip_chunk_compress(response->gzip_state);
+// Writes a cached response to the client and releases the caller's reference
+// to entry once it is written
+int http_cache_write(http_link_context_t *context, cache_entry_t *entry) {
+  uv_buf_t bufs[2] = {uv_buf_init(entry->headers, entry->headers_len),
+                      uv_buf_init(entry->body, entry->body_len)};
+  int err = uv_link_propagate_write(context->link->parent, context->link, bufs,
+                                    2, NULL, http_cache_write_cb, entry);
+  if (err) {
+    cache_release(entry);
+  }
+  return err;
+}
+
+// Writes frames compressed on the thread pool
+void http_gzip_job_cb(gzip_job_t *job, uv_buf_t *frames, unsigned int nframes) {
+  http_link_context_t *context = job->data;
+  for (unsigned int i = 0; i < nframes; i++) {
+    http_response_add_frame(&context->response, frames[i]);
+    METRICS_ADD(context->metrics->gzip_bytes_out, frames[i].len);
+  }
+  METRICS_ADD(context->metrics->gzip_time, job->work_time);
+  if (http_gzip_write(context->link, context->link, NULL,
+                      http_write_link_cb) < 0) {
+    buf_free(context->response.gzip_frames[0].base);
+  }
+  if (gzip_job_idle(job) && context->gzip_waiter) {
+    context->gzip_waiter->cb(context->gzip_waiter);
+  }
+}
 
-  free(*compressed_resp);
-  (*compressed_resp_size) = response->gzip_state->current_size_out;
-  (*compressed_resp) = malloc(response->gzip_state->current_size_out);
-  memcpy(*compressed_resp, response->gzip_state->chunk_body,
-         response->gzip_state->current_size_out);
+bool http_gzip_idle(http_link_context_t *context) {
+  return !context->response.gzip_job ||
+         gzip_job_idle(context->response.gzip_job);
 }
 
 int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
@@ -140,6 +350,12 @@ int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
   size_t nread = bufs[0].len;
   size_t resp_size = nread;
 
+  if (nread == 0 && response->gzip_state && !response->complete) {
+    // Upstream closed the connection, which ends the body
+    http_parser_execute(&response->parser, &resp_parser_settings, NULL, 0);
+    return http_gzip_write(link, source, send_handle, cb);
+  }
+
   if (nread > 0) {
     int header_len = 0;
     int body_len = 0;
@@ -148,6 +364,9 @@ int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
       context->initial_reply = false;
       // Init parser and set status line len
       http_parser_init(&response->parser, HTTP_RESPONSE);
+      response->headers_received = false;
+      response->headers_send = false;
+      response->complete = false;
 
       // Parse status line
       size_t status_line_len;
@@ -160,8 +379,9 @@ int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
         status_line_len = nread;
       }
 
-      memcpy(response->status_line, resp, status_line_len);
-      response->status_line[status_line_len] = '\0';
+      http_headers_reset(&response->headers);
+      response->status_line =
+          http_slice(&response->headers, resp, status_line_len);
 
       // Log output
       double timeDiff = (uv_hrtime() - context->request_time) / 1000000.0;
@@ -171,66 +391,65 @@ int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
       strftime(timeString, sizeof(timeString), "%d/%b/%Y:%T %z", timeinfo);
       // IP - [response time] - [date time] "GET url http" HTTP_STATUS_NUM host
       log_debug("%s - [%.3fms] - [%s] \"%s\" %u %s", context->peer_ip, timeDiff,
-                timeString, context->request.status_line,
+                timeString,
+                http_str(&context->request.headers,
+                         context->request.status_line),
                 response->parser.status_code, context->request.host);
     }
     if (!context->response.headers_received) {
       // Keep parsing until all headers have arrived
-      // Because parser quits on headers received, parsed length means header
-      // length. Added +1, because parser doesn't count last LF after headers
-      header_len = http_parser_execute(&response->parser, &resp_parser_settings,
-                                       resp, nread) +
-                   1;
+      header_len = http_response_parse(response, resp, nread);
+      if (response->headers_received) {
+        metrics_response(context->metrics, response->parser.status_code,
+                         (uv_hrtime() - context->request_time) / 1000);
+      }
+    } else if (context->type == TYPE_REQUEST && !response->complete) {
+      // Track the body to find the end of the response
+      http_response_parse(response, resp, nread);
     }
     if (!context->response.headers_received) {
       // Headers not yet received, free response and nothing else
-      free(resp);
+      buf_free(resp);
       resp = NULL;
       return 0;
     }
+    if (context->response.headers_received && !context->response.headers_send &&
+        context->cache_entry && response->parser.status_code == 304) {
+      // Stored copy is still valid, answer with it instead
+      response->headers_send = true;
+      buf_free(resp);
+      cache_entry_t *entry = context->cache_entry;
+      context->cache_entry = NULL;
+      return http_cache_write(context, entry);
+    }
     if (context->response.headers_received && !context->response.headers_send) {
       // Headers have arrived , but are not yet processed
       // Init headers response and check if body follows headers
-      bool use_compression = context->type == TYPE_REQUEST &&
-                             context->request.enable_compression &&
-                             response->enable_compression;
-      http_init_response_headers(response, use_compression);
+      http_init_response_headers(response, response->enable_compression);
       // Get body start and body length
       body_len = nread - header_len;
-      response->body_size = body_len;
     }
-    if (context->type == TYPE_REQUEST && context->request.enable_compression &&
-        response->enable_compression) {
-      context->response.headers_send = true;
-      if (response->gzip_state == NULL) {
-        response->gzip_state = malloc(sizeof *response->gzip_state);
-        gzip_init_state(response->gzip_state, response->http_header);
-        if (body_len == 0) {
-          resp_size = 0;
-        }
-        if (body_len > 0) {
-          free(response->raw_body);
-          response->raw_body = malloc(body_len);
-          memcpy(response->raw_body, &resp[header_len], body_len);
-
-          compress_data(response, response->raw_body, response->body_size,
-                        &resp, &resp_size);
-        }
-      } else  // Gzip initialized
-      {
-        compress_data(response, resp, nread, &resp, &resp_size);
-      }
+    if (response->enable_compression) {
+      // Body was compressed by the parser, raw data is not needed anymore
+      buf_free(resp);
+      return http_gzip_write(link, source, send_handle, cb);
     } else {
       // Add Via header
       if (!context->response.headers_send) {
         context->response.headers_send = true;
-        char *tmp_resp = malloc(response->http_header_len + body_len);
-        memcpy(tmp_resp, response->http_header, response->http_header_len);
-        memcpy(&tmp_resp[response->http_header_len], &resp[header_len],
-               body_len);
-        free(resp);
-        resp = tmp_resp;
-        resp_size = response->http_header_len + body_len;
+        // Rewritten headers go out in their own buffer, the body is written
+        // straight from the read buffer
+        char *header =
+            buf_pool_alloc(context->buffers, response->http_header.len);
+        memcpy(header, http_str(&response->headers, response->http_header),
+               response->http_header.len);
+        buf_attach(header, resp);
+        uv_buf_t tmp_bufs[2] = {
+            uv_buf_init(header, response->http_header.len),
+            uv_buf_init(&resp[header_len], body_len)};
+        return uv_link_propagate_write(link->parent, source, tmp_bufs,
+                                       body_len > 0 ? 2 : 1, send_handle, cb,
+                                       header);
       }
     }
   }
@@ -239,26 +458,44 @@ int http_link_write(uv_link_t *link, uv_link_t *source, const uv_buf_t bufs[],
                                  cb, resp);
 }
 
-void http_write_link_cb(uv_link_t *source, int status, void *arg) { free(arg); }
+void http_write_link_cb(uv_link_t *source, int status, void *arg) {
+  http_link_context_t *context = source->data;
+  buf_free(arg);
+  if (context->write_waiter) {
+    context->write_waiter->cb(context->write_waiter);
+  }
+}
 
 void http_link_close(uv_link_t *link, uv_link_t *source, uv_link_close_cb cb) {
   http_link_context_t *context = (http_link_context_t *)link->data;
   http_response_t *response = &context->response;
 
+  context->closing = true;
+  while (!QUEUE_EMPTY(&context->held)) {
+    QUEUE *q = QUEUE_HEAD(&context->held);
+    buf_queue_t *bq = QUEUE_DATA(q, buf_queue_t, member);
+    QUEUE_REMOVE(q);
+    buf_free(bq->buf.base);
+    buf_free(bq);
+  }
   gzip_free_state(response->gzip_state);
   free(response->gzip_state);
+  gzip_job_free(response->gzip_job);
+  http_cache_reset(context);
+  for (unsigned int i = 0; i < response->num_gzip_frames; i++) {
+    buf_free(response->gzip_frames[i].base);
+  }
+  free(response->gzip_frames);
   context->request.raw_len = 0;
-  free(context->response.raw_body);
-  free(context->request.status_line);
-  free(context->request.body);
-  free(context->request.url);
+  http_headers_free(&context->request.headers);
+  http_headers_free(&response->headers);
   cb(source);
 }
 
 uv_link_methods_t http_link_methods = {
-    .read_start = uv_link_default_read_start,
-    .read_stop = uv_link_default_read_stop,
-    .shutdown = uv_link_default_shutdown,
+    .read_start = http_link_read_start,
+    .read_stop = http_link_read_stop,
+    .shutdown = http_link_shutdown,
     .close = http_link_close,
     .write = http_link_write,
 
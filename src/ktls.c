@@ -0,0 +1,188 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "ktls.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+// Implicit part of the GCM nonce, the rest is sent with every record
+#define KTLS_SALT_SIZE 4
+#define KTLS_MAX_KEY_SIZE 32
+
+// Fills the crypto info of one direction, the explicit nonce of records
+// sent starts at the sequence number like OpenSSL's
+#define KTLS_CRYPTO_INFO(ci, cipher, key, salt, seq)  \
+  do {                                                \
+    (ci).info.version = TLS_1_2_VERSION;              \
+    (ci).info.cipher_type = (cipher);                 \
+    memcpy((ci).key, (key), sizeof (ci).key);         \
+    memcpy((ci).salt, (salt), sizeof (ci).salt);      \
+    memcpy((ci).rec_seq, (seq), sizeof (ci).rec_seq); \
+    memcpy((ci).iv, (seq), sizeof (ci).iv);           \
+  } while (0)
+
+// TLS 1.2 PRF (RFC 5246 section 5)
+static void ktls_prf(const EVP_MD *md, const unsigned char *secret,
+                     int secret_len, const char *label,
+                     const unsigned char *seed, size_t seed_len,
+                     unsigned char *out, size_t len) {
+  // A(i) followed by label and seed
+  unsigned char msg[EVP_MAX_MD_SIZE + 32 + 2 * SSL3_RANDOM_SIZE];
+  unsigned char block[EVP_MAX_MD_SIZE];
+  unsigned int md_size = EVP_MD_size(md);
+  unsigned int block_len;
+  size_t label_len = strlen(label);
+
+  memcpy(msg + md_size, label, label_len);
+  memcpy(msg + md_size + label_len, seed, seed_len);
+  HMAC(md, secret, secret_len, msg + md_size, label_len + seed_len, block,
+       &block_len);
+  memcpy(msg, block, md_size);
+  while (len > 0) {
+    HMAC(md, secret, secret_len, msg, md_size + label_len + seed_len, block,
+         &block_len);
+    size_t n = len < block_len ? len : block_len;
+    memcpy(out, block, n);
+    out += n;
+    len -= n;
+    HMAC(md, secret, secret_len, msg, md_size, block, &block_len);
+    memcpy(msg, block, md_size);
+  }
+  OPENSSL_cleanse(msg, sizeof msg);
+  OPENSSL_cleanse(block, sizeof block);
+}
+
+static int ktls_set_keys(int fd, int direction, int nid,
+                         const unsigned char *key, const unsigned char *salt,
+                         const unsigned char *seq) {
+  int err;
+  if (nid == NID_aes_128_gcm) {
+    struct tls12_crypto_info_aes_gcm_128 ci = {0};
+    KTLS_CRYPTO_INFO(ci, TLS_CIPHER_AES_GCM_128, key, salt, seq);
+    err = setsockopt(fd, SOL_TLS, direction, &ci, sizeof ci);
+    OPENSSL_cleanse(&ci, sizeof ci);
+  } else {
+    struct tls12_crypto_info_aes_gcm_256 ci = {0};
+    KTLS_CRYPTO_INFO(ci, TLS_CIPHER_AES_GCM_256, key, salt, seq);
+    err = setsockopt(fd, SOL_TLS, direction, &ci, sizeof ci);
+    OPENSSL_cleanse(&ci, sizeof ci);
+  }
+  return err ? -errno : 0;
+}
+
+bool ktls_supported(void) {
+  struct sockaddr_in addr = {0};
+  socklen_t len = sizeof addr;
+  unsigned char zero[KTLS_MAX_KEY_SIZE] = {0};
+  bool supported = false;
+  int client = -1;
+  int server = -1;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    return false;
+  }
+  if (!bind(listener, (struct sockaddr *)&addr, sizeof addr) &&
+      !listen(listener, 1) &&
+      !getsockname(listener, (struct sockaddr *)&addr, &len)) {
+    client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client >= 0 &&
+        !connect(client, (struct sockaddr *)&addr, sizeof addr)) {
+      server = accept(listener, NULL, NULL);
+    }
+  }
+  if (server >= 0 && !setsockopt(server, SOL_TCP, TCP_ULP, "tls", 4)) {
+    supported =
+        !ktls_set_keys(server, TLS_TX, NID_aes_128_gcm, zero, zero, zero) &&
+        !ktls_set_keys(server, TLS_RX, NID_aes_128_gcm, zero, zero, zero);
+  }
+
+  if (server >= 0) {
+    close(server);
+  }
+  if (client >= 0) {
+    close(client);
+  }
+  close(listener);
+  return supported;
+}
+
+int ktls_start(SSL *ssl, uv_os_fd_t fd) {
+  if (SSL_version(ssl) != TLS1_2_VERSION || !ssl->enc_write_ctx ||
+      !SSL_get_session(ssl)) {
+    return UV_ENOTSUP;
+  }
+  // TLS 1.2 GCM suites use SHA-256 for the PRF, except the AES-256 ones
+  // which use SHA-384
+  int nid = EVP_CIPHER_CTX_nid(ssl->enc_write_ctx);
+  const EVP_MD *md;
+  size_t key_len;
+  if (nid == NID_aes_128_gcm) {
+    md = EVP_sha256();
+    key_len = 16;
+  } else if (nid == NID_aes_256_gcm) {
+    md = EVP_sha384();
+    key_len = 32;
+  } else {
+    return UV_ENOTSUP;
+  }
+
+  // AEAD key block has no MAC keys: client key, server key, client salt,
+  // server salt
+  SSL_SESSION *session = SSL_get_session(ssl);
+  unsigned char seed[2 * SSL3_RANDOM_SIZE];
+  unsigned char key_block[2 * (KTLS_MAX_KEY_SIZE + KTLS_SALT_SIZE)];
+  memcpy(seed, ssl->s3->server_random, SSL3_RANDOM_SIZE);
+  memcpy(seed + SSL3_RANDOM_SIZE, ssl->s3->client_random, SSL3_RANDOM_SIZE);
+  ktls_prf(md, session->master_key, session->master_key_length,
+           "key expansion", seed, sizeof seed, key_block,
+           2 * (key_len + KTLS_SALT_SIZE));
+  const unsigned char *client_key = key_block;
+  const unsigned char *server_key = key_block + key_len;
+  const unsigned char *client_salt = key_block + 2 * key_len;
+  const unsigned char *server_salt = client_salt + KTLS_SALT_SIZE;
+
+  int err = UV_ENOTSUP;
+  if (!setsockopt(fd, SOL_TCP, TCP_ULP, "tls", 4) &&
+      !ktls_set_keys(fd, TLS_TX, nid, server_key, server_salt,
+                     ssl->s3->write_sequence)) {
+    // Records are sent by the kernel now
+    err = ktls_set_keys(fd, TLS_RX, nid, client_key, client_salt,
+                        ssl->s3->read_sequence);
+  }
+  OPENSSL_cleanse(key_block, sizeof key_block);
+  return err;
+}
+
+#else
+
+bool ktls_supported(void) { return false; }
+
+int ktls_start(SSL *ssl, uv_os_fd_t fd) { return UV_ENOTSUP; }
+
+#endif
@@ -7,6 +7,8 @@
  */
 #include "log.h"
 
+#include "uv.h"
+
 // clang-format off
 static const char *level_names[] =
 {
@@ -19,43 +21,282 @@ static const char *level_colors[] =
 };
 // clang-format on
 
+// Slot of the ring. seq is the position it can be written at next, and that
+// position + 1 once the record is ready to be read.
+typedef struct log_record_s {
+  uint64_t seq;
+  time_t time;
+  int level;
+  int len;
+  char message[LOG_MAX_MESSAGE];
+} log_record_t;
+
+// Output buffer of the log thread
+typedef struct log_batch_s {
+  char data[LOG_BATCH_SIZE];
+  size_t len;
+} log_batch_t;
+
+// Workers format records into a bounded lock-free ring (multiple producers,
+// one consumer) and a thread writes them out in batches. When the ring is
+// full records are dropped and counted instead of blocking the loop.
+static struct {
+  FILE *fp;
+  char *path;
+  int level;
+  int quiet;
+
+  log_record_t *ring;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  uint64_t dropped_reported;
+  bool started;
+  bool stopping;
+  bool reopen;
+  bool sleeping;
+  uv_thread_t thread;
+  uv_mutex_t lock;
+  uv_cond_t wakeup;
+
+  // Formatted timestamps, updated once a second
+  time_t cached_time;
+  char stderr_time[16];
+  char file_time[32];
+  log_batch_t stderr_batch;
+  log_batch_t file_batch;
+} L;
+
 void log_set_fp(FILE *fp) { L.fp = fp; }
 
 void log_set_level(int level) { L.level = level; }
 
 void log_set_quiet(int enable) { L.quiet = enable ? 1 : 0; }
 
-void log_log(int level, const char *fmt, ...) {
-  if (level < L.level) {
+// Appends to the file at path, which is opened again by log_reopen()
+int log_open(const char *path) {
+  FILE *fp = fopen(path, "a");
+  if (!fp) {
+    return 1;
+  }
+  free(L.path);
+  L.path = malloc(strlen(path) + 1);
+  strcpy(L.path, path);
+  L.fp = fp;
+  return 0;
+}
+
+// Picks up a new file after rotation
+void log_reopen(void) {
+  if (!L.path) {
     return;
   }
+  __atomic_store_n(&L.reopen, true, __ATOMIC_RELAXED);
+  uv_mutex_lock(&L.lock);
+  uv_cond_signal(&L.wakeup);
+  uv_mutex_unlock(&L.lock);
+}
 
-  time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
+static void log_update_time(time_t t) {
+  if (t == L.cached_time) {
+    return;
+  }
+  struct tm lt;
+  localtime_r(&t, &lt);
+  strftime(L.stderr_time, sizeof(L.stderr_time), "%H:%M:%S", &lt);
+  strftime(L.file_time, sizeof(L.file_time), "%Y-%m-%d %H:%M:%S", &lt);
+  L.cached_time = t;
+}
 
-  // log to stderr
-  if (!L.quiet) {
-    va_list args;
-    char buf[16];
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-    fprintf(stderr, "%s %s%-5s\x1b[0m \x1b[90m \x1b[0m ", buf,
-            level_colors[level], level_names[level]);
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
+static void log_flush_batch(log_batch_t *batch, FILE *fp) {
+  if (batch->len > 0 && fp) {
+    fwrite(batch->data, 1, batch->len, fp);
+    fflush(fp);
   }
+  batch->len = 0;
+}
 
-  // log to file
+static void log_format(const log_record_t *record) {
+  log_update_time(record->time);
+  // A formatted record is at most a few dozen bytes over its message
+  if (L.stderr_batch.len + LOG_MAX_MESSAGE + 64 > LOG_BATCH_SIZE) {
+    log_flush_batch(&L.stderr_batch, stderr);
+  }
+  if (L.file_batch.len + LOG_MAX_MESSAGE + 64 > LOG_BATCH_SIZE) {
+    log_flush_batch(&L.file_batch, L.fp);
+  }
+  if (!L.quiet) {
+    log_batch_t *batch = &L.stderr_batch;
+    batch->len += snprintf(&batch->data[batch->len],
+                           LOG_BATCH_SIZE - batch->len,
+                           "%s %s%-5s\x1b[0m \x1b[90m \x1b[0m %.*s\n",
+                           L.stderr_time, level_colors[record->level],
+                           level_names[record->level], record->len,
+                           record->message);
+  }
   if (L.fp) {
-    va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s ", buf, level_names[level]);
+    log_batch_t *batch = &L.file_batch;
+    batch->len += snprintf(&batch->data[batch->len],
+                           LOG_BATCH_SIZE - batch->len, "%s %-5s %.*s\n",
+                           L.file_time, level_names[record->level],
+                           record->len, record->message);
+  }
+}
+
+static void log_flush(void) {
+  log_flush_batch(&L.stderr_batch, stderr);
+  log_flush_batch(&L.file_batch, L.fp);
+}
+
+static void log_record_init(log_record_t *record, int level, const char *fmt,
+                            va_list args) {
+  record->time = time(NULL);
+  record->level = level;
+  int len = vsnprintf(record->message, LOG_MAX_MESSAGE, fmt, args);
+  record->len = len < 0 ? 0 : len < LOG_MAX_MESSAGE ? len : LOG_MAX_MESSAGE - 1;
+}
+
+// Returns false when the ring is empty
+static bool log_drain_one(void) {
+  log_record_t *record = &L.ring[L.tail % LOG_RING_SIZE];
+  if (__atomic_load_n(&record->seq, __ATOMIC_SEQ_CST) != L.tail + 1) {
+    return false;
+  }
+  log_format(record);
+  __atomic_store_n(&record->seq, L.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+  L.tail++;
+  return true;
+}
+
+static void log_report_dropped(void) {
+  uint64_t dropped = __atomic_load_n(&L.dropped, __ATOMIC_RELAXED);
+  if (dropped == L.dropped_reported) {
+    return;
+  }
+  log_record_t record;
+  record.time = time(NULL);
+  record.level = LOG_WARN;
+  record.len = snprintf(record.message, LOG_MAX_MESSAGE,
+                        "log buffer full, %llu messages dropped",
+                        (unsigned long long)(dropped - L.dropped_reported));
+  L.dropped_reported = dropped;
+  log_format(&record);
+}
+
+static void log_thread(void *arg) {
+  for (;;) {
+    while (log_drain_one()) {
+    }
+    log_report_dropped();
+    log_flush();
+
+    if (__atomic_exchange_n(&L.reopen, false, __ATOMIC_RELAXED)) {
+      FILE *fp = fopen(L.path, "a");
+      if (fp) {
+        if (L.fp) {
+          fclose(L.fp);
+        }
+        L.fp = fp;
+      }
+    }
+
+    uv_mutex_lock(&L.lock);
+    if (L.stopping) {
+      uv_mutex_unlock(&L.lock);
+      // Producers may still have published records after the last drain
+      while (log_drain_one()) {
+      }
+      log_flush();
+      return;
+    }
+    // Producers check the flag after publishing, so a record published
+    // before it was set is seen here and one published after signals
+    __atomic_store_n(&L.sleeping, true, __ATOMIC_SEQ_CST);
+    log_record_t *next = &L.ring[L.tail % LOG_RING_SIZE];
+    if (__atomic_load_n(&next->seq, __ATOMIC_SEQ_CST) != L.tail + 1 &&
+        !__atomic_load_n(&L.reopen, __ATOMIC_RELAXED)) {
+      uv_cond_timedwait(&L.wakeup, &L.lock, 1000000000ull);
+    }
+    __atomic_store_n(&L.sleeping, false, __ATOMIC_SEQ_CST);
+    uv_mutex_unlock(&L.lock);
+  }
+}
+
+// Moves writing to the log thread, logging is synchronous until then
+void log_start(void) {
+  if (L.started) {
+    return;
+  }
+  L.ring = calloc(LOG_RING_SIZE, sizeof(log_record_t));
+  for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+    L.ring[i].seq = i;
+  }
+  if (uv_mutex_init(&L.lock) != 0 || uv_cond_init(&L.wakeup) != 0 ||
+      uv_thread_create(&L.thread, log_thread, NULL) != 0) {
+    abort();
+  }
+  L.started = true;
+  atexit(log_stop);
+}
+
+// Writes out what is left, e.g. a fatal error before exit()
+void log_stop(void) {
+  if (!L.started) {
+    return;
+  }
+  uv_mutex_lock(&L.lock);
+  L.stopping = true;
+  uv_cond_signal(&L.wakeup);
+  uv_mutex_unlock(&L.lock);
+  uv_thread_join(&L.thread);
+  L.started = false;
+}
+
+void log_log(int level, const char *fmt, ...) {
+  if (level < L.level) {
+    return;
+  }
+
+  va_list args;
+  if (!L.started) {
+    log_record_t record;
     va_start(args, fmt);
-    vfprintf(L.fp, fmt, args);
+    log_record_init(&record, level, fmt, args);
     va_end(args);
-    fprintf(L.fp, "\n");
-    fflush(L.fp);
+    log_format(&record);
+    log_flush();
+    return;
+  }
+
+  // Claim a slot, the ring is full when the slot still holds a record
+  // LOG_RING_SIZE positions older
+  uint64_t pos = __atomic_load_n(&L.head, __ATOMIC_RELAXED);
+  log_record_t *record;
+  for (;;) {
+    record = &L.ring[pos % LOG_RING_SIZE];
+    int64_t diff =
+        (int64_t)__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&L.head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_fetch_add(&L.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&L.head, __ATOMIC_RELAXED);
+    }
+  }
+
+  va_start(args, fmt);
+  log_record_init(record, level, fmt, args);
+  va_end(args);
+  __atomic_store_n(&record->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&L.sleeping, __ATOMIC_SEQ_CST)) {
+    uv_mutex_lock(&L.lock);
+    uv_cond_signal(&L.wakeup);
+    uv_mutex_unlock(&L.lock);
   }
 }
@@ -0,0 +1,312 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "metrics.h"
+
+#include "log.h"
+
+#define METRICS_MAX_REQUEST 4096
+
+typedef struct metrics_counter_s {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+} metrics_counter_t;
+
+// clang-format off
+static const metrics_counter_t counters[] =
+{
+  {"bproxy_request_bytes_total", "counter",
+   "Bytes read from clients.", offsetof(metrics_t, bytes_in)},
+  {"bproxy_response_bytes_total", "counter",
+   "Bytes read from upstreams, before compression.",
+   offsetof(metrics_t, bytes_out)},
+  {"bproxy_gzip_input_bytes_total", "counter",
+   "Response bytes compressed.", offsetof(metrics_t, gzip_bytes_in)},
+  {"bproxy_gzip_output_bytes_total", "counter",
+   "Compressed bytes produced.", offsetof(metrics_t, gzip_bytes_out)},
+  {"bproxy_connections", "gauge",
+   "Open client connections.", offsetof(metrics_t, connections)}
+};
+
+static const metrics_counter_t histograms[] =
+{
+  {"bproxy_request_duration_seconds", "histogram",
+   "Time from request start to response headers.",
+   offsetof(metrics_t, request_latency)},
+  {"bproxy_upstream_connect_seconds", "histogram",
+   "Time to connect to upstreams.", offsetof(metrics_t, upstream_connect)},
+  {"bproxy_ssl_handshake_seconds", "histogram",
+   "Duration of TLS handshakes.", offsetof(metrics_t, ssl_handshake)}
+};
+// clang-format on
+
+typedef struct metrics_conn_s {
+  uv_tcp_t tcp;
+  uv_write_t req;
+  metrics_server_t *server;
+  char request[METRICS_MAX_REQUEST];
+  size_t len;
+  char head[256];
+  arena_t out;
+} metrics_conn_t;
+
+static uint64_t metrics_counter(const metrics_t *metrics, size_t offset) {
+  uint64_t *counter = (uint64_t *)((char *)metrics + offset);
+  return METRICS_READ(*counter);
+}
+
+void metrics_observe(metrics_histogram_t *histogram, uint64_t usec) {
+  int bucket = 0;
+  while (bucket < METRICS_BUCKETS - 1 && usec > (1ull << bucket)) {
+    bucket++;
+  }
+  METRICS_ADD(histogram->buckets[bucket], 1);
+  METRICS_ADD(histogram->count, 1);
+  METRICS_ADD(histogram->sum, usec);
+}
+
+void metrics_response(metrics_t *metrics, int status, uint64_t usec) {
+  if (status >= 100 && status < 600) {
+    METRICS_ADD(metrics->responses[status / 100 - 1], 1);
+  }
+  metrics_observe(&metrics->request_latency, usec);
+}
+
+// metrics_t holds nothing but uint64_t fields, which add up one by one
+void metrics_merge(metrics_t *dst, const metrics_t *src) {
+  uint64_t *d = (uint64_t *)dst;
+  const uint64_t *s = (const uint64_t *)src;
+  for (size_t i = 0; i < sizeof(metrics_t) / sizeof(uint64_t); i++) {
+    d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Called by the worker owning the list only
+metrics_t *metrics_get(metrics_host_t **list, const char *host) {
+  for (metrics_host_t *node = *list; node; node = node->next) {
+    if (strcmp(node->host, host) == 0) {
+      return &node->metrics;
+    }
+  }
+  metrics_host_t *node = calloc(1, sizeof(metrics_host_t));
+  node->host = malloc(strlen(host) + 1);
+  strcpy(node->host, host);
+  node->next = *list;
+  __atomic_store_n(list, node, __ATOMIC_RELEASE);
+  return &node->metrics;
+}
+
+static void metrics_printf(arena_t *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  uint32_t offset = arena_alloc(out, len + 1);
+  va_start(args, fmt);
+  vsnprintf(&out->base[offset], len + 1, fmt, args);
+  va_end(args);
+  // Drop the terminator, the next line continues here
+  out->len--;
+}
+
+static void metrics_print_head(arena_t *out, const metrics_counter_t *metric) {
+  metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name,
+                 metric->help, metric->name, metric->type);
+}
+
+// Writes the text exposition format, families grouped over all hosts
+void metrics_print(arena_t *out, const char **hosts, const metrics_t *metrics,
+                   int num_hosts) {
+  static const metrics_counter_t responses = {
+      "bproxy_responses_total", "counter",
+      "Responses sent to clients by status class.", 0};
+  metrics_print_head(out, &responses);
+  for (int i = 0; i < num_hosts; i++) {
+    for (int j = 0; j < 5; j++) {
+      metrics_printf(out, "%s{host=\"%s\",code=\"%dxx\"} %llu\n",
+                     responses.name, hosts[i], j + 1,
+                     (unsigned long long)metrics[i].responses[j]);
+    }
+  }
+
+  for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+    metrics_print_head(out, &counters[c]);
+    // The gauge is opens minus closes, which may wrap per worker
+    for (int i = 0; i < num_hosts; i++) {
+      metrics_printf(
+          out, "%s{host=\"%s\"} %lld\n", counters[c].name, hosts[i],
+          (long long)metrics_counter(&metrics[i], counters[c].offset));
+    }
+  }
+
+  static const metrics_counter_t gzip_time = {
+      "bproxy_gzip_seconds_total", "counter", "Time spent compressing.", 0};
+  static const metrics_counter_t handshakes = {
+      "bproxy_ssl_handshakes_total", "counter",
+      "Completed TLS handshakes by type.", 0};
+  metrics_print_head(out, &gzip_time);
+  for (int i = 0; i < num_hosts; i++) {
+    metrics_printf(out, "%s{host=\"%s\"} %.6f\n", gzip_time.name, hosts[i],
+                   metrics[i].gzip_time / 1e9);
+  }
+  metrics_print_head(out, &handshakes);
+  for (int i = 0; i < num_hosts; i++) {
+    metrics_printf(out, "%s{host=\"%s\",type=\"full\"} %llu\n",
+                   handshakes.name, hosts[i],
+                   (unsigned long long)metrics[i].ssl_full_handshakes);
+    metrics_printf(out, "%s{host=\"%s\",type=\"resumed\"} %llu\n",
+                   handshakes.name, hosts[i],
+                   (unsigned long long)metrics[i].ssl_resumed_handshakes);
+  }
+
+  for (size_t h = 0; h < sizeof(histograms) / sizeof(histograms[0]); h++) {
+    const char *name = histograms[h].name;
+    metrics_print_head(out, &histograms[h]);
+    for (int i = 0; i < num_hosts; i++) {
+      const metrics_histogram_t *histogram =
+          (const metrics_histogram_t *)((const char *)&metrics[i] +
+                                        histograms[h].offset);
+      uint64_t cumulative = 0;
+      for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        cumulative += histogram->buckets[b];
+        metrics_printf(out, "%s_bucket{host=\"%s\",le=\"%.6f\"} %llu\n", name,
+                       hosts[i], (1ull << b) / 1e6,
+                       (unsigned long long)cumulative);
+      }
+      metrics_printf(out, "%s_bucket{host=\"%s\",le=\"+Inf\"} %llu\n", name,
+                     hosts[i], (unsigned long long)histogram->count);
+      metrics_printf(out, "%s_sum{host=\"%s\"} %.6f\n", name, hosts[i],
+                     histogram->sum / 1e6);
+      metrics_printf(out, "%s_count{host=\"%s\"} %llu\n", name, hosts[i],
+                     (unsigned long long)histogram->count);
+    }
+  }
+}
+
+// Counters of the response cache shared by all workers
+void metrics_print_cache(arena_t *out, const cache_stats_t *stats) {
+  static const metrics_counter_t requests = {
+      "bproxy_cache_requests_total", "counter",
+      "Cache lookups by result.", 0};
+  static const metrics_counter_t evictions = {
+      "bproxy_cache_evictions_total", "counter",
+      "Entries evicted to stay within the memory limit.", 0};
+  static const metrics_counter_t entries = {
+      "bproxy_cache_entries", "gauge", "Stored responses.", 0};
+  static const metrics_counter_t memory = {
+      "bproxy_cache_bytes", "gauge", "Memory held by stored responses.", 0};
+  metrics_print_head(out, &requests);
+  metrics_printf(out, "%s{result=\"hit\"} %llu\n", requests.name,
+                 (unsigned long long)stats->hits);
+  metrics_printf(out, "%s{result=\"revalidated\"} %llu\n", requests.name,
+                 (unsigned long long)stats->revalidated);
+  metrics_printf(out, "%s{result=\"miss\"} %llu\n", requests.name,
+                 (unsigned long long)stats->misses);
+  metrics_print_head(out, &evictions);
+  metrics_printf(out, "%s %llu\n", evictions.name,
+                 (unsigned long long)stats->evictions);
+  metrics_print_head(out, &entries);
+  metrics_printf(out, "%s %zu\n", entries.name, stats->entries);
+  metrics_print_head(out, &memory);
+  metrics_printf(out, "%s %zu\n", memory.name, stats->memory);
+}
+
+static void metrics_close_cb(uv_handle_t *handle) {
+  metrics_conn_t *conn = handle->data;
+  arena_free(&conn->out);
+  free(conn);
+}
+
+static void metrics_write_cb(uv_write_t *req, int status) {
+  metrics_conn_t *conn = req->data;
+  uv_close((uv_handle_t *)&conn->tcp, metrics_close_cb);
+}
+
+static void metrics_alloc_cb(uv_handle_t *handle, size_t suggested_size,
+                             uv_buf_t *buf) {
+  metrics_conn_t *conn = handle->data;
+  *buf = uv_buf_init(&conn->request[conn->len],
+                     METRICS_MAX_REQUEST - 1 - conn->len);
+}
+
+static void metrics_read_cb(uv_stream_t *stream, ssize_t nread,
+                            const uv_buf_t *buf) {
+  metrics_conn_t *conn = stream->data;
+  // Requests which don't fit end with UV_ENOBUFS
+  if (nread < 0) {
+    uv_close((uv_handle_t *)stream, metrics_close_cb);
+    return;
+  }
+  conn->len += nread;
+  conn->request[conn->len] = '\0';
+  if (!strstr(conn->request, "\r\n\r\n")) {
+    return;
+  }
+  uv_read_stop(stream);
+
+  const char *status = "404 Not Found";
+  if (strncmp(conn->request, "GET /metrics ", 13) == 0) {
+    status = "200 OK";
+    conn->server->scrape(&conn->out);
+  }
+  int head_len =
+      snprintf(conn->head, sizeof(conn->head),
+               "HTTP/1.1 %s\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               status, conn->out.len);
+  uv_buf_t bufs[2] = {uv_buf_init(conn->head, head_len),
+                      uv_buf_init(conn->out.base, conn->out.len)};
+  conn->req.data = conn;
+  if (uv_write(&conn->req, stream, bufs, conn->out.len > 0 ? 2 : 1,
+               metrics_write_cb)) {
+    uv_close((uv_handle_t *)stream, metrics_close_cb);
+  }
+}
+
+static void metrics_connection_cb(uv_stream_t *listener, int status) {
+  metrics_server_t *server = listener->data;
+  if (status < 0) {
+    return;
+  }
+  metrics_conn_t *conn = calloc(1, sizeof(metrics_conn_t));
+  conn->server = server;
+  uv_tcp_init(listener->loop, &conn->tcp);
+  conn->tcp.data = conn;
+  if (uv_accept(listener, (uv_stream_t *)&conn->tcp) ||
+      uv_read_start((uv_stream_t *)&conn->tcp, metrics_alloc_cb,
+                    metrics_read_cb)) {
+    uv_close((uv_handle_t *)&conn->tcp, metrics_close_cb);
+  }
+}
+
+// inherited is the listening socket of the previous process, -1 to bind a
+// new one
+int metrics_listen(metrics_server_t *server, uv_loop_t *loop,
+                   const char *address, unsigned short port,
+                   uv_os_sock_t inherited, metrics_scrape_cb scrape) {
+  struct sockaddr_in addr;
+  server->scrape = scrape;
+  if (uv_ip4_addr(address, port, &addr) || uv_tcp_init(loop, &server->tcp)) {
+    log_error("invalid metrics address: %s", address);
+    return 1;
+  }
+  server->tcp.data = server;
+  if ((inherited >= 0 ? uv_tcp_open(&server->tcp, inherited)
+                      : uv_tcp_bind(&server->tcp,
+                                    (const struct sockaddr *)&addr, 0)) ||
+      uv_listen((uv_stream_t *)&server->tcp, 128, metrics_connection_cb)) {
+    log_error("cannot listen for metrics on %s:%d", address, port);
+    return 1;
+  }
+  log_info("serving metrics on %s:%d", address, port);
+  return 0;
+}
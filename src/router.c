@@ -0,0 +1,164 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "router.h"
+
+#define ROUTER_INITIAL_SIZE 16
+
+// FNV-1a
+static uint32_t router_hash(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static router_entry_t *router_table_find(const router_table_t *table,
+                                         const char *key, size_t len,
+                                         uint32_t hash) {
+  size_t mask = table->size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    router_entry_t *entry = &table->entries[i];
+    if (!entry->key) {
+      return entry;
+    }
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->key, key, len) == 0) {
+      return entry;
+    }
+  }
+}
+
+static void router_table_init(router_table_t *table) {
+  table->size = ROUTER_INITIAL_SIZE;
+  table->count = 0;
+  table->entries = calloc(table->size, sizeof(router_entry_t));
+}
+
+static void router_table_grow(router_table_t *table) {
+  router_entry_t *entries = table->entries;
+  size_t size = table->size;
+
+  table->size *= 2;
+  table->entries = calloc(table->size, sizeof(router_entry_t));
+  for (size_t i = 0; i < size; i++) {
+    if (entries[i].key) {
+      *router_table_find(table, entries[i].key, entries[i].len,
+                         entries[i].hash) = entries[i];
+    }
+  }
+  free(entries);
+}
+
+// Index -1 adds a node without a host of its own.
+static void router_table_add(router_table_t *table, const char *key,
+                             size_t len, int index) {
+  // Keep load factor under 1/2 so probe sequences stay short
+  if ((table->count + 1) * 2 > table->size) {
+    router_table_grow(table);
+  }
+  uint32_t hash = router_hash(key, len);
+  router_entry_t *entry = router_table_find(table, key, len, hash);
+  if (!entry->key) {
+    entry->key = key;
+    entry->len = len;
+    entry->hash = hash;
+    entry->index = index;
+    table->count++;
+  } else if (index >= 0 && (entry->index < 0 || index < entry->index)) {
+    entry->index = index;
+  }
+}
+
+static router_entry_t *router_table_get(const router_table_t *table,
+                                        const char *key, size_t len) {
+  router_entry_t *entry =
+      router_table_find(table, key, len, router_hash(key, len));
+  return entry->key ? entry : NULL;
+}
+
+router_t *router_new() {
+  router_t *router = calloc(1, sizeof(router_t));
+  router_table_init(&router->exact);
+  router_table_init(&router->wildcards);
+  return router;
+}
+
+void router_free(router_t *router) {
+  if (!router) {
+    return;
+  }
+  free(router->exact.entries);
+  free(router->wildcards.entries);
+  free(router->suffixes);
+  free(router->suffix_indexes);
+  free(router);
+}
+
+// Host strings are referenced, not copied, and must outlive the router.
+void router_add(router_t *router, const char *host, int index) {
+  size_t len = strlen(host);
+  if (host[0] != '*') {
+    router_table_add(&router->exact, host, len, index);
+  } else if (host[1] == '.') {
+    // Add every parent label so lookups can stop at the first missing one
+    for (size_t i = len; i-- > 2;) {
+      if (host[i] == '.') {
+        router_table_add(&router->wildcards, &host[i], len - i, -1);
+      }
+    }
+    router_table_add(&router->wildcards, &host[1], len - 1, index);
+  } else {
+    int n = router->num_suffixes++;
+    router->suffixes =
+        realloc(router->suffixes, router->num_suffixes * sizeof(char *));
+    router->suffix_indexes =
+        realloc(router->suffix_indexes, router->num_suffixes * sizeof(int));
+    router->suffixes[n] = &host[1];
+    router->suffix_indexes[n] = index;
+  }
+}
+
+static int router_min(int a, int b) {
+  if (a < 0) {
+    return b;
+  }
+  return (b < 0 || a < b) ? a : b;
+}
+
+int router_lookup(const router_t *router, const char *hostname) {
+  size_t len = strlen(hostname);
+  router_entry_t *entry = router_table_get(&router->exact, hostname, len);
+  int index = entry ? entry->index : -1;
+
+  // Walk the trie from the top level label down: ".com", ".example.com", ...
+  if (router->wildcards.count > 0) {
+    for (size_t i = len; i-- > 0;) {
+      if (hostname[i] != '.') {
+        continue;
+      }
+      entry = router_table_get(&router->wildcards, &hostname[i], len - i);
+      if (!entry) {
+        break;
+      }
+      index = router_min(index, entry->index);
+    }
+  }
+
+  for (int i = 0; i < router->num_suffixes; i++) {
+    const char *suffix = router->suffixes[i];
+    size_t suffix_len = strlen(suffix);
+    if (suffix_len <= len &&
+        memcmp(&hostname[len - suffix_len], suffix, suffix_len) == 0) {
+      index = router_min(index, router->suffix_indexes[i]);
+    }
+  }
+
+  return index;
+}
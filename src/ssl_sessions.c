@@ -0,0 +1,372 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "ssl_sessions.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+#include "openssl/rand.h"
+#include "openssl/sha.h"
+
+#define SSL_SESSIONS_INITIAL_BUCKETS 1024
+
+static int sessions_index = -1;
+
+static ssl_sessions_t *ssl_sessions_of(SSL *ssl) {
+  return SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sessions_index);
+}
+
+// FNV-1a
+static uint32_t ssl_sessions_hash(const unsigned char *id, unsigned int len) {
+  uint32_t hash = 2166136261u;
+  for (unsigned int i = 0; i < len; i++) {
+    hash ^= id[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Caller holds the lock
+static ssl_session_entry_t **ssl_sessions_find(ssl_sessions_t *sessions,
+                                               const unsigned char *id,
+                                               unsigned int len,
+                                               uint32_t hash) {
+  ssl_session_entry_t **link = &sessions->buckets[hash % sessions->num_buckets];
+  while (*link && ((*link)->hash != hash || (*link)->id_len != len ||
+                   memcmp((*link)->id, id, len) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static void ssl_sessions_unlink(ssl_sessions_t *sessions,
+                                ssl_session_entry_t **link) {
+  ssl_session_entry_t *entry = *link;
+  *link = entry->next;
+  QUEUE_REMOVE(&entry->lru);
+  sessions->num_entries--;
+  free(entry->der);
+  free(entry);
+}
+
+static void ssl_sessions_remove(ssl_sessions_t *sessions,
+                                const unsigned char *id, unsigned int len) {
+  ssl_session_entry_t **link =
+      ssl_sessions_find(sessions, id, len, ssl_sessions_hash(id, len));
+  if (*link) {
+    ssl_sessions_unlink(sessions, link);
+  }
+}
+
+static int ssl_sessions_new_cb(SSL *ssl, SSL_SESSION *session) {
+  ssl_sessions_t *sessions = ssl_sessions_of(ssl);
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+  int der_len = i2d_SSL_SESSION(session, NULL);
+  if (!sessions || id_len == 0 || der_len <= 0) {
+    return 0;
+  }
+
+  ssl_session_entry_t *entry = malloc(sizeof(ssl_session_entry_t));
+  entry->der = malloc(der_len);
+  unsigned char *p = entry->der;
+  entry->der_len = i2d_SSL_SESSION(session, &p);
+  memcpy(entry->id, id, id_len);
+  entry->id_len = id_len;
+  entry->hash = ssl_sessions_hash(id, id_len);
+  entry->expires = time(NULL) + sessions->timeout;
+
+  uv_mutex_lock(&sessions->lock);
+  ssl_sessions_remove(sessions, id, id_len);
+  if (sessions->num_entries >= sessions->max_entries) {
+    ssl_session_entry_t *last =
+        QUEUE_DATA(QUEUE_PREV(&sessions->lru), ssl_session_entry_t, lru);
+    ssl_sessions_remove(sessions, last->id, last->id_len);
+  }
+  ssl_session_entry_t **bucket =
+      &sessions->buckets[entry->hash % sessions->num_buckets];
+  entry->next = *bucket;
+  *bucket = entry;
+  QUEUE_INSERT_HEAD(&sessions->lru, &entry->lru);
+  sessions->num_entries++;
+  uv_mutex_unlock(&sessions->lock);
+  // Serialized copy is kept, OpenSSL keeps ownership of session
+  return 0;
+}
+
+static SSL_SESSION *ssl_sessions_get_cb(SSL *ssl, unsigned char *id, int len,
+                                        int *copy) {
+  ssl_sessions_t *sessions = ssl_sessions_of(ssl);
+  SSL_SESSION *session = NULL;
+  *copy = 0;
+  if (!sessions) {
+    return NULL;
+  }
+
+  uv_mutex_lock(&sessions->lock);
+  ssl_session_entry_t **link =
+      ssl_sessions_find(sessions, id, len, ssl_sessions_hash(id, len));
+  if (*link && (*link)->expires <= time(NULL)) {
+    ssl_sessions_unlink(sessions, link);
+  } else if (*link) {
+    const unsigned char *p = (*link)->der;
+    session = d2i_SSL_SESSION(NULL, &p, (*link)->der_len);
+    QUEUE_REMOVE(&(*link)->lru);
+    QUEUE_INSERT_HEAD(&sessions->lru, &(*link)->lru);
+  }
+  uv_mutex_unlock(&sessions->lock);
+  return session;
+}
+
+static void ssl_sessions_remove_cb(SSL_CTX *ctx, SSL_SESSION *session) {
+  ssl_sessions_t *sessions = SSL_CTX_get_ex_data(ctx, sessions_index);
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+  if (!sessions) {
+    return;
+  }
+  uv_mutex_lock(&sessions->lock);
+  ssl_sessions_remove(sessions, id, id_len);
+  uv_mutex_unlock(&sessions->lock);
+}
+
+// Encrypts new tickets with the first key. Tickets of older keys are
+// accepted and renewed (return 2).
+static int ssl_sessions_ticket_cb(SSL *ssl, unsigned char name[16],
+                                  unsigned char iv[EVP_MAX_IV_LENGTH],
+                                  EVP_CIPHER_CTX *cipher, HMAC_CTX *hmac,
+                                  int enc) {
+  ssl_sessions_t *sessions = ssl_sessions_of(ssl);
+  if (!sessions) {
+    return -1;
+  }
+
+  uv_mutex_lock(&sessions->lock);
+  int ret = 0;
+  if (enc) {
+    ssl_ticket_key_t *key = &sessions->keys[0];
+    if (RAND_bytes(iv, 16) == 1) {
+      memcpy(name, key->name, 16);
+      EVP_EncryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key->aes_key, iv);
+      HMAC_Init_ex(hmac, key->hmac_key, 16, EVP_sha256(), NULL);
+      ret = 1;
+    } else {
+      ret = -1;
+    }
+  } else {
+    for (int i = 0; i < sessions->num_keys; i++) {
+      ssl_ticket_key_t *key = &sessions->keys[i];
+      if (memcmp(name, key->name, 16) == 0) {
+        HMAC_Init_ex(hmac, key->hmac_key, 16, EVP_sha256(), NULL);
+        EVP_DecryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key->aes_key, iv);
+        ret = i == 0 ? 1 : 2;
+        break;
+      }
+    }
+  }
+  uv_mutex_unlock(&sessions->lock);
+  return ret;
+}
+
+// Returns number of keys read, 0 when file can't be used
+static int ssl_sessions_read_keys(const char *path, ssl_ticket_key_t *keys) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    log_error("could not open ticket key file: %s", path);
+    return 0;
+  }
+  unsigned char buf[SSL_TICKET_KEY_SIZE * SSL_MAX_TICKET_KEYS + 1];
+  size_t len = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+  if (len == 0 || len % SSL_TICKET_KEY_SIZE != 0 ||
+      len > SSL_TICKET_KEY_SIZE * SSL_MAX_TICKET_KEYS) {
+    log_error("ticket key file %s must hold 1 to %d keys of %d bytes", path,
+              SSL_MAX_TICKET_KEYS, SSL_TICKET_KEY_SIZE);
+    return 0;
+  }
+  int num_keys = len / SSL_TICKET_KEY_SIZE;
+  for (int i = 0; i < num_keys; i++) {
+    unsigned char *p = &buf[i * SSL_TICKET_KEY_SIZE];
+    memcpy(keys[i].name, p, 16);
+    memcpy(keys[i].aes_key, p + 16, 16);
+    memcpy(keys[i].hmac_key, p + 32, 16);
+  }
+  return num_keys;
+}
+
+// Reloads the key file when it changed. Without a file a new key is
+// generated every session timeout, the previous one still decrypts.
+void ssl_sessions_rotate(ssl_sessions_t *sessions) {
+  if (!sessions->tickets) {
+    return;
+  }
+  ssl_ticket_key_t keys[SSL_MAX_TICKET_KEYS];
+  int num_keys = 0;
+  time_t now = time(NULL);
+
+  if (sessions->key_file) {
+    struct stat st;
+    if (stat(sessions->key_file, &st) != 0 ||
+        st.st_mtime == sessions->key_file_mtime) {
+      return;
+    }
+    num_keys = ssl_sessions_read_keys(sessions->key_file, keys);
+    if (num_keys == 0) {
+      return;
+    }
+    sessions->key_file_mtime = st.st_mtime;
+    log_info("loaded %d ticket keys from %s", num_keys, sessions->key_file);
+  } else {
+    if (sessions->num_keys > 0 &&
+        now - sessions->keys_rotated < sessions->timeout) {
+      return;
+    }
+    if (RAND_bytes((unsigned char *)&keys[0], sizeof(keys[0])) != 1) {
+      return;
+    }
+    num_keys = 1;
+    if (sessions->num_keys > 0) {
+      keys[num_keys++] = sessions->keys[0];
+    }
+  }
+
+  uv_mutex_lock(&sessions->lock);
+  memcpy(sessions->keys, keys, num_keys * sizeof(ssl_ticket_key_t));
+  sessions->num_keys = num_keys;
+  sessions->keys_rotated = now;
+  uv_mutex_unlock(&sessions->lock);
+}
+
+ssl_sessions_t *ssl_sessions_new(size_t max_entries, long timeout,
+                                 bool tickets, const char *key_file) {
+  if (sessions_index < 0) {
+    sessions_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  }
+  ssl_sessions_t *sessions = calloc(1, sizeof(ssl_sessions_t));
+  if (uv_mutex_init(&sessions->lock) != 0) {
+    abort();
+  }
+  sessions->max_entries = max_entries;
+  sessions->num_buckets = SSL_SESSIONS_INITIAL_BUCKETS;
+  while (sessions->num_buckets < max_entries) {
+    sessions->num_buckets *= 2;
+  }
+  sessions->buckets =
+      calloc(sessions->num_buckets, sizeof(ssl_session_entry_t *));
+  QUEUE_INIT(&sessions->lru);
+  sessions->timeout = timeout;
+  sessions->tickets = tickets;
+  if (key_file) {
+    sessions->key_file = malloc(strlen(key_file) + 1);
+    strcpy(sessions->key_file, key_file);
+  }
+  ssl_sessions_rotate(sessions);
+  if (tickets && sessions->num_keys == 0) {
+    log_error("session tickets disabled, no usable ticket key");
+    sessions->tickets = false;
+  }
+  return sessions;
+}
+
+// Returns true when the ClientHello message (with its 4 byte header) asks
+// for a server name, which is copied to name.
+bool ssl_sessions_client_hello_name(const unsigned char *msg, size_t len,
+                                    char *name, size_t size) {
+  if (len < 4 || msg[0] != SSL3_MT_CLIENT_HELLO) {
+    return false;
+  }
+  size_t end = 4 + ((size_t)msg[1] << 16 | msg[2] << 8 | msg[3]);
+  if (end > len) {
+    return false;
+  }
+  // Version and random, then session id, cipher suites and compression
+  size_t p = 4 + 2 + SSL3_RANDOM_SIZE;
+  if (p + 1 > end) {
+    return false;
+  }
+  p += 1 + msg[p];
+  if (p + 2 > end) {
+    return false;
+  }
+  p += 2 + (msg[p] << 8 | msg[p + 1]);
+  if (p + 1 > end) {
+    return false;
+  }
+  p += 1 + msg[p];
+  if (p + 2 > end) {
+    return false;
+  }
+  p += 2;
+
+  while (p + 4 <= end) {
+    unsigned int type = msg[p] << 8 | msg[p + 1];
+    size_t ext_end = p + 4 + (msg[p + 2] << 8 | msg[p + 3]);
+    p += 4;
+    if (ext_end > end) {
+      return false;
+    }
+    if (type != TLSEXT_TYPE_server_name) {
+      p = ext_end;
+      continue;
+    }
+    // List length, then entries of a type and a 2 byte length
+    for (p += 2; p + 3 <= ext_end;) {
+      size_t name_len = msg[p + 1] << 8 | msg[p + 2];
+      if (p + 3 + name_len > ext_end) {
+        return false;
+      }
+      if (msg[p] == TLSEXT_NAMETYPE_host_name && name_len < size &&
+          memchr(&msg[p + 3], '\0', name_len) == NULL) {
+        memcpy(name, &msg[p + 3], name_len);
+        name[name_len] = '\0';
+        return true;
+      }
+      p += 3 + name_len;
+    }
+    return false;
+  }
+  return false;
+}
+
+void ssl_sessions_proxy_sid_ctx(char **hosts, int num_hosts,
+                                unsigned char sid_ctx[SSL_MAX_SID_CTX_LENGTH]) {
+  SHA256_CTX sha;
+  SHA256_Init(&sha);
+  for (int i = 0; i < num_hosts; i++) {
+    SHA256_Update(&sha, hosts[i], strlen(hosts[i]) + 1);
+  }
+  SHA256_Final(sid_ctx, &sha);
+}
+
+// Every context shares the session state, the callbacks and a fixed session
+// id context, so sessions stay valid across restarts and hosts sharing a
+// ticket key file. The proxy binding is set per connection before OpenSSL
+// looks the session up.
+void ssl_sessions_setup(ssl_sessions_t *sessions, SSL_CTX *ctx) {
+  static const unsigned char sid_ctx[] = "bproxy";
+  SSL_CTX_set_ex_data(ctx, sessions_index, sessions);
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_timeout(ctx, sessions->timeout);
+  if (sessions->max_entries > 0) {
+    SSL_CTX_set_session_cache_mode(
+        ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, ssl_sessions_new_cb);
+    SSL_CTX_sess_set_get_cb(ctx, ssl_sessions_get_cb);
+    SSL_CTX_sess_set_remove_cb(ctx, ssl_sessions_remove_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  if (sessions->tickets) {
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_sessions_ticket_cb);
+  } else {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+}
@@ -0,0 +1,138 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static uint64_t timer_wheel_ticks(timer_wheel_t *wheel) {
+  return uv_now(wheel->timer.loop) / TIMER_WHEEL_TICK;
+}
+
+// Level of an entry depends on how far its expiry is from the next tick
+static void timer_wheel_insert(timer_wheel_t *wheel,
+                               timer_wheel_entry_t *entry) {
+  uint64_t expires = entry->expires;
+  if (expires < wheel->now) {
+    expires = wheel->now;
+  }
+  uint64_t delta = expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << ((level + 1) * TIMER_WHEEL_BITS)) {
+    level++;
+  }
+  if (level == TIMER_WHEEL_LEVELS - 1 &&
+      delta >= (uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) {
+    // Beyond the wheel, expires when the top level comes around
+    expires = wheel->now +
+              ((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+  }
+  int slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  QUEUE_INSERT_TAIL(&wheel->slots[level][slot], &entry->member);
+}
+
+// Moves the entries of one slot to lower levels, returns the slot index so
+// the caller knows when this level wrapped around too
+static int timer_wheel_cascade(timer_wheel_t *wheel, int level) {
+  int slot = (wheel->now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  QUEUE entries;
+  QUEUE_MOVE(&wheel->slots[level][slot], &entries);
+  while (!QUEUE_EMPTY(&entries)) {
+    QUEUE *q = QUEUE_HEAD(&entries);
+    QUEUE_REMOVE(q);
+    timer_wheel_insert(wheel, QUEUE_DATA(q, timer_wheel_entry_t, member));
+  }
+  return slot;
+}
+
+static void timer_wheel_tick(timer_wheel_t *wheel) {
+  int slot = wheel->now & TIMER_WHEEL_MASK;
+  for (int level = 1; slot == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+    if (timer_wheel_cascade(wheel, level) != 0) {
+      break;
+    }
+  }
+  wheel->now++;
+
+  // Callbacks may start and stop entries, also ones of this slot
+  QUEUE expired;
+  QUEUE_MOVE(&wheel->slots[0][slot], &expired);
+  while (!QUEUE_EMPTY(&expired)) {
+    QUEUE *q = QUEUE_HEAD(&expired);
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    wheel->count--;
+    timer_wheel_entry_t *entry = QUEUE_DATA(q, timer_wheel_entry_t, member);
+    entry->cb(entry);
+  }
+}
+
+static void timer_wheel_timer_cb(uv_timer_t *timer) {
+  timer_wheel_t *wheel = timer->data;
+  uint64_t ticks = timer_wheel_ticks(wheel);
+  // Catches up when the loop was blocked for longer than a tick
+  while (wheel->now <= ticks && wheel->count > 0) {
+    timer_wheel_tick(wheel);
+  }
+  if (wheel->count == 0) {
+    uv_timer_stop(timer);
+  }
+}
+
+// The wheel's timer doesn't keep the loop alive
+void timer_wheel_init(timer_wheel_t *wheel, uv_loop_t *loop) {
+  uv_timer_init(loop, &wheel->timer);
+  uv_unref((uv_handle_t *)&wheel->timer);
+  wheel->timer.data = wheel;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      QUEUE_INIT(&wheel->slots[level][slot]);
+    }
+  }
+}
+
+void timer_wheel_entry_init(timer_wheel_entry_t *entry, timer_wheel_cb cb,
+                            void *data) {
+  QUEUE_INIT(&entry->member);
+  entry->cb = cb;
+  entry->data = data;
+}
+
+// (Re)starts entry to expire in timeout milliseconds
+void timer_wheel_start(timer_wheel_t *wheel, timer_wheel_entry_t *entry,
+                       uint64_t timeout) {
+  if (wheel->count == 0) {
+    // Idle wheel isn't ticking, nothing is left behind in its slots
+    wheel->now = timer_wheel_ticks(wheel) + 1;
+    uv_timer_start(&wheel->timer, timer_wheel_timer_cb, TIMER_WHEEL_TICK,
+                   TIMER_WHEEL_TICK);
+  }
+  if (timer_wheel_active(entry)) {
+    QUEUE_REMOVE(&entry->member);
+  } else {
+    wheel->count++;
+  }
+  // Rounded up, so an entry never fires early
+  entry->expires =
+      (uv_now(wheel->timer.loop) + timeout + TIMER_WHEEL_TICK - 1) /
+      TIMER_WHEEL_TICK;
+  timer_wheel_insert(wheel, entry);
+}
+
+void timer_wheel_stop(timer_wheel_t *wheel, timer_wheel_entry_t *entry) {
+  if (timer_wheel_active(entry)) {
+    QUEUE_REMOVE(&entry->member);
+    QUEUE_INIT(&entry->member);
+    wheel->count--;
+  }
+}
+
+bool timer_wheel_active(const timer_wheel_entry_t *entry) {
+  return !QUEUE_EMPTY(&entry->member);
+}
@@ -0,0 +1,171 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#define _GNU_SOURCE  // splice(), pipe2(), F_SETPIPE_SZ
+
+#include "tunnel.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CHECK(V) \
+  if ((V) != 0) abort()
+
+static void tunnel_poll_cb(uv_poll_t *handle, int status, int events);
+
+static void tunnel_close_cb(uv_handle_t *handle) {
+  tunnel_t *tunnel = handle->data;
+  if (++tunnel->num_closed < 2) {
+    return;
+  }
+  tunnel_side_t *sides[2] = {&tunnel->client, &tunnel->upstream};
+  for (int i = 0; i < 2; i++) {
+    close(sides[i]->fd);
+    close(sides[i]->flow.pipe[0]);
+    close(sides[i]->flow.pipe[1]);
+  }
+  free(tunnel);
+}
+
+static void tunnel_close(tunnel_t *tunnel) {
+  if (!uv_is_closing((uv_handle_t *)&tunnel->client.poll)) {
+    uv_close((uv_handle_t *)&tunnel->client.poll, tunnel_close_cb);
+    uv_close((uv_handle_t *)&tunnel->upstream.poll, tunnel_close_cb);
+  }
+}
+
+// Moves what is readable from one side to the other, returns -1 on error
+static int tunnel_pump(tunnel_side_t *from, tunnel_side_t *to) {
+  tunnel_flow_t *flow = &from->flow;
+  ssize_t n;
+
+  if (!flow->eof && !flow->blocked && flow->pending < TUNNEL_MAX_PENDING) {
+    n = splice(from->fd, NULL, flow->pipe[1], NULL,
+               TUNNEL_MAX_PENDING - flow->pending,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      flow->pending += n;
+    } else if (n == 0) {
+      flow->eof = true;
+    } else if (errno == EAGAIN) {
+      // Either socket is drained or pipe is full
+      flow->blocked = flow->pending > 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  while (flow->pending > 0) {
+    n = splice(flow->pipe[0], NULL, to->fd, NULL, flow->pending,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      flow->pending -= n;
+      flow->blocked = false;
+    } else if (n < 0 && errno == EAGAIN) {
+      break;
+    } else if (n < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+
+  // Forward half-close once everything read was written
+  if (flow->eof && flow->pending == 0 && !flow->shutdown) {
+    flow->shutdown = true;
+    shutdown(to->fd, SHUT_WR);
+  }
+  return 0;
+}
+
+static int tunnel_update(tunnel_side_t *side, tunnel_side_t *other) {
+  int events = 0;
+  if (!side->flow.eof && !side->flow.blocked &&
+      side->flow.pending < TUNNEL_MAX_PENDING) {
+    events |= UV_READABLE;
+  }
+  if (other->flow.pending > 0) {
+    events |= UV_WRITABLE;
+  }
+  if (events == side->events) {
+    return 0;
+  }
+  side->events = events;
+  if (events == 0) {
+    return uv_poll_stop(&side->poll);
+  }
+  return uv_poll_start(&side->poll, events, tunnel_poll_cb);
+}
+
+static void tunnel_poll_cb(uv_poll_t *handle, int status, int events) {
+  tunnel_t *tunnel = handle->data;
+  if (status < 0 || tunnel_pump(&tunnel->client, &tunnel->upstream) ||
+      tunnel_pump(&tunnel->upstream, &tunnel->client)) {
+    tunnel_close(tunnel);
+    return;
+  }
+  if (tunnel->client.flow.shutdown && tunnel->upstream.flow.shutdown) {
+    tunnel_close(tunnel);
+    return;
+  }
+  if (tunnel_update(&tunnel->client, &tunnel->upstream) ||
+      tunnel_update(&tunnel->upstream, &tunnel->client)) {
+    tunnel_close(tunnel);
+  }
+}
+
+static int tunnel_flow_init(tunnel_flow_t *flow) {
+  if (pipe2(flow->pipe, O_NONBLOCK | O_CLOEXEC)) {
+    flow->pipe[0] = flow->pipe[1] = -1;
+    return -errno;
+  }
+  // Bigger pipe holds more socket buffers, failure just means less batching
+  fcntl(flow->pipe[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+  return 0;
+}
+
+static void tunnel_side_init(uv_loop_t *loop, tunnel_t *tunnel,
+                             tunnel_side_t *side, int fd) {
+  side->fd = fd;
+  CHECK(uv_poll_init(loop, &side->poll, fd));
+  side->poll.data = tunnel;
+}
+
+// Takes ownership of both sockets when it succeeds, they are closed when the
+// tunnel ends.
+int tunnel_start(uv_loop_t *loop, int client_fd, int upstream_fd) {
+  tunnel_t *tunnel = calloc(1, sizeof *tunnel);
+  int err = tunnel_flow_init(&tunnel->client.flow);
+  if (!err) {
+    err = tunnel_flow_init(&tunnel->upstream.flow);
+    if (err) {
+      close(tunnel->client.flow.pipe[0]);
+      close(tunnel->client.flow.pipe[1]);
+    }
+  }
+  if (err) {
+    log_error("could not set up splice tunnel: %s", uv_strerror(err));
+    free(tunnel);
+    return err;
+  }
+
+  tunnel_side_init(loop, tunnel, &tunnel->client, client_fd);
+  tunnel_side_init(loop, tunnel, &tunnel->upstream, upstream_fd);
+  tunnel_update(&tunnel->client, &tunnel->upstream);
+  tunnel_update(&tunnel->upstream, &tunnel->client);
+  return 0;
+}
+
+#else
+
+int tunnel_start(uv_loop_t *loop, int client_fd, int upstream_fd) {
+  return UV_ENOSYS;
+}
+
+#endif
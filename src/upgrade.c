@@ -0,0 +1,241 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "upgrade.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Listening sockets passed by the previous process, -1 once taken
+static struct {
+  int fd;
+  uv_os_sock_t fds[UPGRADE_MAX_LISTENERS];
+  unsigned short ports[UPGRADE_MAX_LISTENERS];
+  int num;
+} inherited = {.fd = -1};
+
+static void upgrade_close_cb(uv_handle_t *handle) {
+  upgrade_t *upgrade = handle->data;
+  upgrade->handles--;
+}
+
+static void upgrade_finish(upgrade_t *upgrade, int status) {
+  if (upgrade->done) {
+    return;
+  }
+  upgrade->done = true;
+  if (!uv_is_closing((uv_handle_t *)&upgrade->pipe)) {
+    uv_close((uv_handle_t *)&upgrade->pipe, upgrade_close_cb);
+  }
+  upgrade->cb(upgrade, status);
+}
+
+static void upgrade_exit_cb(uv_process_t *process, int64_t exit_status,
+                            int term_signal) {
+  upgrade_t *upgrade = process->data;
+  log_warn("new process %d exited (status %d, signal %d)", process->pid,
+           (int)exit_status, term_signal);
+  uv_close((uv_handle_t *)process, upgrade_close_cb);
+  upgrade_finish(upgrade, UV_ECANCELED);
+}
+
+static void upgrade_alloc_cb(uv_handle_t *handle, size_t suggested_size,
+                             uv_buf_t *buf) {
+  static char slab[16];
+  *buf = uv_buf_init(slab, sizeof slab);
+}
+
+// Any byte means the new process listens, EOF that it gave up
+static void upgrade_read_cb(uv_stream_t *stream, ssize_t nread,
+                            const uv_buf_t *buf) {
+  upgrade_t *upgrade = stream->data;
+  if (nread > 0) {
+    upgrade_finish(upgrade, 0);
+  } else if (nread < 0) {
+    upgrade_finish(upgrade, nread);
+  }
+}
+
+static int upgrade_send(int sock, const uv_os_sock_t *fds,
+                        const unsigned short *ports, int num) {
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  struct iovec iov = {(void *)ports, num * sizeof(unsigned short)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  memset(control, 0, sizeof control);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * num);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+
+  ssize_t len;
+  do {
+    len = sendmsg(sock, &msg, 0);
+  } while (len < 0 && errno == EINTR);
+  return len == (ssize_t)iov.iov_len ? 0 : 1;
+}
+
+// Starts argv again as a new process and passes it the listening sockets.
+// The new process keeps the environment, with UPGRADE_ENV added.
+int upgrade_start(upgrade_t *upgrade, uv_loop_t *loop, char **argv,
+                  const uv_os_sock_t *fds, const unsigned short *ports,
+                  int num, upgrade_cb cb) {
+  int sv[2];
+  if (num < 1 || num > UPGRADE_MAX_LISTENERS ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    log_error("cannot create upgrade socket pair!");
+    return 1;
+  }
+
+  int num_env = 0;
+  while (environ[num_env]) {
+    num_env++;
+  }
+  char **env = malloc((num_env + 2) * sizeof(char *));
+  int n = 0;
+  for (int i = 0; i < num_env; i++) {
+    if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0) {
+      env[n++] = environ[i];
+    }
+  }
+  // The socket is the first descriptor after stdio in the new process
+  env[n++] = UPGRADE_ENV "=3";
+  env[n] = NULL;
+
+  uv_stdio_container_t stdio[4];
+  for (int i = 0; i < 3; i++) {
+    stdio[i].flags = UV_INHERIT_FD;
+    stdio[i].data.fd = i;
+  }
+  stdio[3].flags = UV_INHERIT_FD;
+  stdio[3].data.fd = sv[1];
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof options);
+  options.file = argv[0];
+  options.args = argv;
+  options.env = env;
+  options.stdio = stdio;
+  options.stdio_count = 4;
+  // Outlives this process
+  options.flags = UV_PROCESS_DETACHED;
+  options.exit_cb = upgrade_exit_cb;
+
+  memset(upgrade, 0, sizeof *upgrade);
+  upgrade->cb = cb;
+  upgrade->process.data = upgrade;
+  upgrade->pipe.data = upgrade;
+  upgrade->handles = 1;
+  int err = uv_spawn(loop, &upgrade->process, &options);
+  free(env);
+  close(sv[1]);
+  if (err) {
+    log_error("cannot start %s: %s", argv[0], uv_strerror(err));
+    close(sv[0]);
+    uv_close((uv_handle_t *)&upgrade->process, upgrade_close_cb);
+    return 1;
+  }
+  uv_unref((uv_handle_t *)&upgrade->process);
+
+  if (upgrade_send(sv[0], fds, ports, num)) {
+    log_error("cannot pass listening sockets to new process!");
+    close(sv[0]);
+    // Exit callback only closes the process handle
+    upgrade->done = true;
+    uv_process_kill(&upgrade->process, SIGTERM);
+    return 1;
+  }
+
+  upgrade->handles++;
+  uv_pipe_init(loop, &upgrade->pipe, 0);
+  uv_pipe_open(&upgrade->pipe, sv[0]);
+  uv_read_start((uv_stream_t *)&upgrade->pipe, upgrade_alloc_cb,
+                upgrade_read_cb);
+  log_info("started new process %d with %d listening sockets",
+           upgrade->process.pid, num);
+  return 0;
+}
+
+bool upgrade_busy(upgrade_t *upgrade) { return upgrade->handles > 0; }
+
+// Reads the listening sockets passed by the previous process, if this one
+// was started by an upgrade
+int upgrade_receive() {
+  const char *env = getenv(UPGRADE_ENV);
+  if (!env) {
+    return 0;
+  }
+  inherited.fd = atoi(env);
+  unsetenv(UPGRADE_ENV);
+
+  char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  struct iovec iov = {inherited.ports, sizeof inherited.ports};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  ssize_t len;
+  do {
+    len = recvmsg(inherited.fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (len < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = len > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    log_error("no listening sockets received from previous process!");
+    return 1;
+  }
+  inherited.num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(inherited.fds, CMSG_DATA(cmsg), inherited.num * sizeof(int));
+  if (inherited.num > len / (ssize_t)sizeof(unsigned short)) {
+    inherited.num = len / sizeof(unsigned short);
+  }
+  log_info("took over %d listening sockets", inherited.num);
+  return 0;
+}
+
+// Returns an inherited socket listening on port, -1 when there is none
+uv_os_sock_t upgrade_take_listener(unsigned short port) {
+  for (int i = 0; i < inherited.num; i++) {
+    if (inherited.ports[i] == port && inherited.fds[i] >= 0) {
+      uv_os_sock_t fd = inherited.fds[i];
+      inherited.fds[i] = -1;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+// Tells the previous process to stop accepting. Sockets nobody took are
+// closed, connections waiting on them are lost.
+void upgrade_ready() {
+  if (inherited.fd < 0) {
+    return;
+  }
+  for (int i = 0; i < inherited.num; i++) {
+    if (inherited.fds[i] >= 0) {
+      log_warn("listening socket for port %d not used", inherited.ports[i]);
+      close(inherited.fds[i]);
+    }
+  }
+  ssize_t len;
+  do {
+    len = write(inherited.fd, "1", 1);
+  } while (len < 0 && errno == EINTR);
+  close(inherited.fd);
+  inherited.fd = -1;
+}
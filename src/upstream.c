@@ -0,0 +1,112 @@
+/**
+ * @license
+ * Copyright Bleenco GmbH. All Rights Reserved.
+ *
+ * Use of this source code is governed by an MIT-style license that can be
+ * found in the LICENSE file at https://github.com/bleenco/bproxy
+ */
+#include "upstream.h"
+
+static void upstream_close_cb(uv_handle_t *handle) { free(handle); }
+
+void upstream_close(upstream_t *upstream) {
+  if (!uv_is_closing((uv_handle_t *)&upstream->handle)) {
+    uv_close((uv_handle_t *)&upstream->handle, upstream_close_cb);
+  }
+}
+
+static void upstream_idle_alloc_cb(uv_handle_t *handle, size_t suggested_size,
+                                   uv_buf_t *buf) {
+  static char slab[64];
+  *buf = uv_buf_init(slab, sizeof slab);
+}
+
+// Idle connections must stay silent, anything read here (usually EOF when
+// the server closes the connection) makes it unusable.
+static void upstream_idle_read_cb(uv_stream_t *handle, ssize_t nread,
+                                  const uv_buf_t *buf) {
+  upstream_t *upstream = (upstream_t *)handle;
+  if (nread == 0) {
+    return;
+  }
+  QUEUE_REMOVE(&upstream->member);
+  upstream->target->num_idle_upstreams--;
+  upstream_close(upstream);
+}
+
+upstream_t *upstream_new(uv_loop_t *loop, proxy_config_t *config,
+                         upstream_target_t *target) {
+  upstream_t *upstream = malloc(sizeof *upstream);
+  memset(upstream, 0, sizeof *upstream);
+  upstream->config = config;
+  upstream->target = target;
+  QUEUE_INIT(&upstream->member);
+  uv_tcp_init(loop, &upstream->handle);
+  return upstream;
+}
+
+upstream_t *upstream_pool_get(upstream_target_t *target) {
+  if (QUEUE_EMPTY(&target->idle_upstreams)) {
+    return NULL;
+  }
+  // Most recently used connection first, it is the least likely to be
+  // timed out by the server
+  QUEUE *q = QUEUE_HEAD(&target->idle_upstreams);
+  upstream_t *upstream = QUEUE_DATA(q, upstream_t, member);
+  QUEUE_REMOVE(q);
+  QUEUE_INIT(q);
+  target->num_idle_upstreams--;
+  uv_read_stop((uv_stream_t *)&upstream->handle);
+  return upstream;
+}
+
+void upstream_pool_put(upstream_t *upstream) {
+  proxy_config_t *config = upstream->config;
+  upstream_target_t *target = upstream->target;
+
+  upstream->handle.data = NULL;
+  uv_read_stop((uv_stream_t *)&upstream->handle);
+  if (target->num_idle_upstreams >= config->keepalive_max_idle ||
+      (config->keepalive_max_requests > 0 &&
+       upstream->num_requests >= config->keepalive_max_requests) ||
+      uv_is_closing((uv_handle_t *)&upstream->handle)) {
+    upstream_close(upstream);
+    return;
+  }
+
+  upstream->idle_since = uv_now(upstream->handle.loop);
+  QUEUE_INSERT_HEAD(&target->idle_upstreams, &upstream->member);
+  target->num_idle_upstreams++;
+  uv_read_start((uv_stream_t *)&upstream->handle, upstream_idle_alloc_cb,
+                upstream_idle_read_cb);
+}
+
+void upstream_pool_sweep(proxy_config_t *config, uint64_t now) {
+  for (int i = 0; i < config->balancer.num_targets; i++) {
+    upstream_target_t *target = &config->balancer.targets[i];
+    // Oldest connections are at the tail
+    while (!QUEUE_EMPTY(&target->idle_upstreams)) {
+      QUEUE *q = QUEUE_PREV(&target->idle_upstreams);
+      upstream_t *upstream = QUEUE_DATA(q, upstream_t, member);
+      if (now - upstream->idle_since < config->keepalive_idle_timeout) {
+        break;
+      }
+      QUEUE_REMOVE(q);
+      target->num_idle_upstreams--;
+      upstream_close(upstream);
+    }
+  }
+}
+
+// Pool of a replaced configuration, nothing takes connections from it again
+void upstream_pool_close(proxy_config_t *config) {
+  for (int i = 0; i < config->balancer.num_targets; i++) {
+    upstream_target_t *target = &config->balancer.targets[i];
+    while (!QUEUE_EMPTY(&target->idle_upstreams)) {
+      QUEUE *q = QUEUE_HEAD(&target->idle_upstreams);
+      QUEUE_REMOVE(q);
+      target->num_idle_upstreams--;
+      upstream_close(QUEUE_DATA(q, upstream_t, member));
+    }
+  }
+}
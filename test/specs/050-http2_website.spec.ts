@@ -0,0 +1,138 @@
+import * as chai from 'chai';
+import * as chaiAsPromised from 'chai-as-promised';
+import { bproxy, runNode, killAll } from '../utils/process';
+import { writeConfig, tempDir, delay } from '../utils/helpers';
+import * as path from 'path';
+import * as http2 from 'http2';
+import * as tls from 'tls';
+import { exec } from 'child_process';
+
+chai.use(chaiAsPromised);
+
+const expect = chai.expect;
+const cwd = process.cwd();
+let configPath = null;
+let config = {
+  "port": 8080,
+  "secure_port": 8081,
+  "gzip_mime_types": ["text/css", "application/javascript", "application/x-javascript"],
+  "proxies": [
+    {
+      "hosts": ["localhost"],
+      "ip": "127.0.0.1",
+      "certificate_path": "test/certs/localhost.crt",
+      "key_path": "test/certs/localhost.key",
+      "port": 4000,
+      "http2": true
+    }
+  ]
+};
+
+function http2Get(session: http2.ClientHttp2Session, urlPath: string): Promise<{ status: number, headers: any, body: string }> {
+  return new Promise((resolve, reject) => {
+    const req = session.request({ ':path': urlPath });
+    let headers: any = {};
+    let body = '';
+    req.setEncoding('utf8');
+    req.on('response', h => headers = h);
+    req.on('data', data => body += data);
+    req.on('end', () => resolve({ status: headers[':status'], headers, body }));
+    req.on('error', reject);
+  });
+}
+
+function alpnProtocol(): Promise<string> {
+  return new Promise((resolve, reject) => {
+    const socket = tls.connect({
+      host: 'localhost', port: 8081, servername: 'localhost',
+      ALPNProtocols: ['h2', 'http/1.1'], rejectUnauthorized: false
+    }, () => {
+      const protocol = (socket as any).alpnProtocol;
+      socket.destroy();
+      resolve(protocol);
+    });
+    socket.on('error', reject);
+  });
+}
+
+describe('HTTP/2 Website', () => {
+  before(() => {
+    return Promise.resolve()
+      .then(() => {
+        return new Promise((resolve, reject) => {
+          const command = `/bin/bash ${path.resolve(__dirname, '../certs/make_certs.sh')}`;
+          exec(command, (error, stdout, stderr) => {
+            if (error) {
+              reject(error);
+            } else {
+              resolve();
+            }
+          });
+        });
+      });
+  })
+  beforeEach(() => {
+    return Promise.resolve()
+      .then(() => process.chdir(path.resolve(cwd, 'test/files')))
+      .then(() => runNode(false, ['./dist/server.js']))
+      .then(() => process.chdir(cwd))
+      .catch(err => console.error(err));;
+  })
+  afterEach(() => killAll());
+
+  it(`should return 200 response over h2 based on https://localhost:8081 request`, () => {
+    let session: http2.ClientHttp2Session;
+    return tempDir()
+      .then(dir => configPath = path.join(dir, 'bproxy.json'))
+      .then(() => writeConfig(configPath, config))
+      .then(() => bproxy(false, ['-c', configPath]))
+      .then(() => delay(500))
+      .then(() => session = http2.connect('https://localhost:8081', { rejectUnauthorized: false }))
+      .then(() => http2Get(session, '/'))
+      .then(resp => {
+        expect(session.alpnProtocol).to.equal('h2');
+        expect(resp.status).to.equal(200);
+        expect(resp.headers['content-type']).to.includes('text/html');
+        expect(resp.body).to.contains('App Works!');
+      })
+      .then(() => session.close())
+      .catch(err => console.error(err));;
+  });
+
+  it(`should serve concurrent streams on one connection (https://localhost:8081/css/app.css, /js/app.bundle.js)`, () => {
+    let session: http2.ClientHttp2Session;
+    return tempDir()
+      .then(dir => configPath = path.join(dir, 'bproxy.json'))
+      .then(() => writeConfig(configPath, config))
+      .then(() => bproxy(false, ['-c', configPath]))
+      .then(() => delay(500))
+      .then(() => session = http2.connect('https://localhost:8081', { rejectUnauthorized: false }))
+      .then(() => Promise.all([
+        http2Get(session, '/css/app.css'),
+        http2Get(session, '/js/app.bundle.js')
+      ]))
+      .then(([css, js]) => {
+        expect(css.status).to.equal(200);
+        expect(css.headers['content-type']).to.includes('text/css');
+        expect(js.status).to.equal(200);
+        expect(js.headers['content-type']).to.includes('application/javascript');
+        expect(js.body.length).to.be.greaterThan(100000);
+      })
+      .then(() => session.close())
+      .catch(err => console.error(err));;
+  });
+
+  it(`should not offer h2 when "http2" is not enabled for the proxy (https://localhost:8081)`, () => {
+    const http1Config = JSON.parse(JSON.stringify(config));
+    delete http1Config.proxies[0].http2;
+    return tempDir()
+      .then(dir => configPath = path.join(dir, 'bproxy.json'))
+      .then(() => writeConfig(configPath, http1Config))
+      .then(() => bproxy(false, ['-c', configPath]))
+      .then(() => delay(500))
+      .then(() => alpnProtocol())
+      .then(protocol => expect(protocol).to.equal('http/1.1'))
+      .catch(err => console.error(err));;
+  });
+
+});
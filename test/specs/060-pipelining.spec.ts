@@ -0,0 +1,134 @@
+import * as chai from 'chai';
+import * as chaiAsPromised from 'chai-as-promised';
+import { bproxy, killAll } from '../utils/process';
+import { writeConfig, tempDir, delay } from '../utils/helpers';
+import * as path from 'path';
+import * as http from 'http';
+import * as net from 'net';
+
+chai.use(chaiAsPromised);
+
+const expect = chai.expect;
+let configPath = null;
+let config = {
+  "port": 8080,
+  "proxies": [
+    {
+      "hosts": ["one.test"],
+      "ip": "127.0.0.1",
+      "port": 4001
+    },
+    {
+      "hosts": ["two.test"],
+      "ip": "127.0.0.1",
+      "port": 4002
+    }
+  ]
+};
+
+// Upstream answering with its own name and the path it was asked for
+function upstream(name: string, port: number): Promise<http.Server> {
+  return new Promise(resolve => {
+    const server = http.createServer((req, res) => {
+      const body = `${name} ${req.url}`;
+      res.writeHead(200, { 'Content-Type': 'text/plain', 'Content-Length': body.length });
+      res.end(body);
+    });
+    server.listen(port, '127.0.0.1', () => resolve(server));
+  });
+}
+
+function request(urlPath: string, host: string): string {
+  return `GET ${urlPath} HTTP/1.1\r\nHost: ${host}\r\n\r\n`;
+}
+
+// Reads count responses from one connection, each one has a Content-Length
+function readResponses(socket: net.Socket, count: number): Promise<{ status: number, body: string }[]> {
+  return new Promise((resolve, reject) => {
+    let data = Buffer.alloc(0);
+    const responses: { status: number, body: string }[] = [];
+    socket.on('data', chunk => {
+      data = Buffer.concat([data, chunk]);
+      while (responses.length < count) {
+        const end = data.indexOf('\r\n\r\n');
+        if (end < 0) {
+          return;
+        }
+        const head = data.slice(0, end).toString();
+        const length = parseInt((head.match(/content-length: *(\d+)/i) || [])[1] || '0', 10);
+        if (data.length < end + 4 + length) {
+          return;
+        }
+        responses.push({
+          status: parseInt(head.split(' ')[1], 10),
+          body: data.slice(end + 4, end + 4 + length).toString()
+        });
+        data = data.slice(end + 4 + length);
+      }
+      resolve(responses);
+    });
+    socket.on('error', reject);
+    socket.on('end', () => reject(new Error(`connection closed after ${responses.length} responses`)));
+  });
+}
+
+describe('Pipelining', () => {
+  let servers: http.Server[] = [];
+
+  beforeEach(() => {
+    return Promise.all([upstream('one', 4001), upstream('two', 4002)])
+      .then(s => servers = s);
+  })
+  afterEach(() => {
+    servers.forEach(server => server.close());
+    return killAll();
+  });
+
+  it(`should route a split request and a pipelined pair by their own Host headers (http://localhost:8080)`, () => {
+    let socket: net.Socket;
+    let responses: Promise<{ status: number, body: string }[]>;
+    const split = request('/split', 'one.test');
+    const cut = split.indexOf('Host') + 2;
+    return tempDir()
+      .then(dir => configPath = path.join(dir, 'bproxy.json'))
+      .then(() => writeConfig(configPath, config))
+      .then(() => bproxy(false, ['-c', configPath]))
+      .then(() => delay(500))
+      .then(() => socket = net.connect(8080, '127.0.0.1'))
+      .then(() => responses = readResponses(socket, 3))
+      .then(() => socket.write(split.slice(0, cut)))
+      .then(() => delay(100))
+      .then(() => socket.write(split.slice(cut)))
+      .then(() => delay(100))
+      .then(() => socket.write(request('/a', 'one.test') + request('/b', 'two.test')))
+      .then(() => responses)
+      .then(resps => {
+        expect(resps.map(resp => resp.status)).to.deep.equal([200, 200, 200]);
+        expect(resps.map(resp => resp.body)).to.deep.equal(['one /split', 'one /a', 'two /b']);
+      })
+      .then(() => socket.destroy());
+  });
+
+  it(`should answer pipelined requests in order when the last one is split (http://localhost:8080)`, () => {
+    let socket: net.Socket;
+    let responses: Promise<{ status: number, body: string }[]>;
+    const pipelined = request('/1', 'two.test') + request('/2', 'one.test') + request('/3', 'two.test');
+    const cut = pipelined.length - 10;
+    return tempDir()
+      .then(dir => configPath = path.join(dir, 'bproxy.json'))
+      .then(() => writeConfig(configPath, config))
+      .then(() => bproxy(false, ['-c', configPath]))
+      .then(() => delay(500))
+      .then(() => socket = net.connect(8080, '127.0.0.1'))
+      .then(() => responses = readResponses(socket, 3))
+      .then(() => socket.write(pipelined.slice(0, cut)))
+      .then(() => delay(100))
+      .then(() => socket.write(pipelined.slice(cut)))
+      .then(() => responses)
+      .then(resps => {
+        expect(resps.map(resp => resp.body)).to.deep.equal(['two /1', 'one /2', 'two /3']);
+      })
+      .then(() => socket.destroy());
+  });
+
+});